@@ -0,0 +1,345 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "tm.h"
+#include "adm.h"
+
+// Queue-delay based load shedding, modelled after CoDel
+// (https://datatracker.ietf.org/doc/html/rfc8289). The "queue" is the time
+// between a connection being accepted and its handler starting to process it.
+typedef struct {
+	uint64_t first_above_ns; // when delay will have been above target for a full interval
+	uint64_t drop_next_ns;   // when to shed next, while in the dropping state
+	uint32_t count;          // number of requests shed since entering the dropping state
+	uint32_t last_count;
+	bool     dropping;
+} Adm_Codel;
+
+typedef struct {
+	Adm_Config cfg;
+	Adm_Stats stats;
+	pthread_mutex_t codel_lock;
+	Adm_Codel codel;
+	size_t rsp_503_len;
+	char rsp_503[128];
+} Adm_State;
+
+static Adm_State _adm_local = {
+	.codel_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static Adm_State * _adm = &_adm_local;
+
+// Accept time of the connection handled by this process (or thread)
+static __thread uint64_t _t_accept_ns = 0;
+
+#define ATOMIC_INC(V) __atomic_add_fetch(&(V),1,__ATOMIC_RELAXED)
+#define ATOMIC_DEC(V) __atomic_sub_fetch(&(V),1,__ATOMIC_RELAXED)
+#define ATOMIC_GET(V) __atomic_load_n(&(V),__ATOMIC_RELAXED)
+
+static void build_503(Adm_State * adm, unsigned int retry_after_s) {
+	int n = snprintf(adm->rsp_503,sizeof(adm->rsp_503),
+		"HTTP/1.1 503 Service Unavailable\r\n"
+		"Retry-After: %u\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		retry_after_s);
+	adm->rsp_503_len = n;
+}
+
+static uint64_t isqrt(uint64_t n) {
+	uint64_t r = 0;
+	for(uint64_t bit = 1ULL<<62; bit; bit>>=2) {
+		if(n >= r + bit) {
+			n -= r + bit;
+			r = (r>>1) + bit;
+		} else {
+			r >>= 1;
+		}
+	}
+	return r;
+}
+
+// t + interval/sqrt(count), with sqrt scaled by 1024 for precision
+static uint64_t codel_control_law(uint64_t t, uint64_t interval, uint32_t count) {
+	return t + (interval << 10) / isqrt((uint64_t)(count ? count : 1) << 20);
+}
+
+/*! \brief Determine whether the current request should be shed, given the
+ *         queue delay it experienced. See RFC 8289, section 5.
+ */
+static bool codel_should_shed(Adm_Codel * c, uint64_t now, uint64_t sojourn, uint64_t target, uint64_t interval) {
+	bool ok_to_shed = false;
+	if(sojourn < target) {
+		c->first_above_ns = 0;
+	} else if(c->first_above_ns == 0) {
+		c->first_above_ns = now + interval;
+	} else if(now >= c->first_above_ns) {
+		ok_to_shed = true;
+	}
+
+	if(c->dropping) {
+		if(!ok_to_shed) {
+			c->dropping = false;
+			return false;
+		}
+		if(now >= c->drop_next_ns) {
+			c->count++;
+			c->drop_next_ns = codel_control_law(c->drop_next_ns, interval, c->count);
+			return true;
+		}
+		return false;
+	}
+	if(ok_to_shed) {
+		c->dropping = true;
+		uint32_t delta = c->count - c->last_count;
+		if(delta > 1 && now - c->drop_next_ns < 16 * interval) {
+			// we were recently dropping, so resume at about the same rate
+			c->count = delta;
+		} else {
+			c->count = 1;
+		}
+		c->last_count = c->count;
+		c->drop_next_ns = codel_control_law(now, interval, c->count);
+		return true;
+	}
+	return false;
+}
+
+int adm_init(const Adm_Config * cfg) {
+	ilogf("Initializing admission control: max_conns=%u, max_inflight=%u, codel_target_ms=%u, codel_interval_ms=%u",
+		cfg->max_conns, cfg->max_inflight, cfg->codel_target_ms, cfg->codel_interval_ms);
+	Adm_State * adm = mmap(NULL,sizeof(Adm_State),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if(adm==MAP_FAILED) {
+		elogf("mmap failed: %s",strerror(errno));
+		return -1;
+	}
+	memset(adm,0,sizeof(Adm_State));
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr,PTHREAD_PROCESS_SHARED);
+	int rc = pthread_mutex_init(&adm->codel_lock,&attr);
+	pthread_mutexattr_destroy(&attr);
+	if(rc!=0) {
+		elogf("pthread_mutex_init failed: %s",strerror(rc));
+		munmap(adm,sizeof(Adm_State));
+		return -1;
+	}
+	adm->cfg = *cfg;
+	if(adm->cfg.codel_interval_ms==0) {
+		adm->cfg.codel_interval_ms = 100;
+	}
+	if(adm->cfg.retry_after_s==0) {
+		adm->cfg.retry_after_s = 1;
+	}
+	build_503(adm,adm->cfg.retry_after_s);
+	if(_adm != &_adm_local) {
+		munmap(_adm,sizeof(Adm_State));
+	}
+	_adm = adm;
+	return 0;
+}
+
+Adm_Verdict adm_conn_open(uint64_t t_accept_ns) {
+	_t_accept_ns = t_accept_ns;
+	ATOMIC_INC(_adm->stats.conns_accepted);
+	uint64_t active = ATOMIC_INC(_adm->stats.conns_active);
+	if(_adm->cfg.max_conns && active > _adm->cfg.max_conns) {
+		ATOMIC_DEC(_adm->stats.conns_active);
+		ATOMIC_INC(_adm->stats.conns_shed);
+		return ADM_SHED_CONNS;
+	}
+	return ADM_ADMIT;
+}
+
+void adm_conn_close(void) {
+	ATOMIC_DEC(_adm->stats.conns_active);
+}
+
+void adm_conn_set_accept_ns(uint64_t t_accept_ns) {
+	_t_accept_ns = t_accept_ns;
+}
+
+uint64_t adm_sojourn_ns(void) {
+	if(_t_accept_ns==0) {
+		return 0;
+	}
+	return tm_now_ns() - _t_accept_ns;
+}
+
+Adm_Verdict adm_req_begin(uint64_t sojourn_ns, bool upgrade) {
+	Adm_Verdict verdict = ADM_ADMIT;
+	uint64_t inflight = ATOMIC_INC(_adm->stats.reqs_inflight);
+	if(_adm->cfg.max_inflight && inflight > _adm->cfg.max_inflight) {
+		ATOMIC_INC(_adm->stats.reqs_shed_inflight);
+		verdict = ADM_SHED_INFLIGHT;
+	} else if(_adm->cfg.codel_target_ms) {
+		pthread_mutex_lock(&_adm->codel_lock);
+		bool shed = codel_should_shed(&_adm->codel, tm_now_ns(), sojourn_ns,
+			_adm->cfg.codel_target_ms * TM_NS_PER_MS, _adm->cfg.codel_interval_ms * TM_NS_PER_MS);
+		pthread_mutex_unlock(&_adm->codel_lock);
+		if(shed) {
+			ATOMIC_INC(_adm->stats.reqs_shed_codel);
+			verdict = ADM_SHED_CODEL;
+		}
+	}
+	if(verdict!=ADM_ADMIT) {
+		ATOMIC_DEC(_adm->stats.reqs_inflight);
+		if(upgrade) {
+			ATOMIC_INC(_adm->stats.upgrades_refused);
+		}
+		dlogf("Shedding request: verdict=%d, sojourn_ns=%llu",verdict,sojourn_ns);
+	} else {
+		ATOMIC_INC(_adm->stats.reqs_admitted);
+	}
+	return verdict;
+}
+
+void adm_req_end(void) {
+	ATOMIC_DEC(_adm->stats.reqs_inflight);
+}
+
+int adm_send_503(int fd) {
+	if(_adm->rsp_503_len==0) {
+		build_503(_adm,1);
+	}
+	return write(fd,_adm->rsp_503,_adm->rsp_503_len);
+}
+
+void adm_get_stats(Adm_Stats * stats) {
+	stats->conns_active       = ATOMIC_GET(_adm->stats.conns_active);
+	stats->conns_accepted     = ATOMIC_GET(_adm->stats.conns_accepted);
+	stats->conns_shed         = ATOMIC_GET(_adm->stats.conns_shed);
+	stats->reqs_inflight      = ATOMIC_GET(_adm->stats.reqs_inflight);
+	stats->reqs_admitted      = ATOMIC_GET(_adm->stats.reqs_admitted);
+	stats->reqs_shed_inflight = ATOMIC_GET(_adm->stats.reqs_shed_inflight);
+	stats->reqs_shed_codel    = ATOMIC_GET(_adm->stats.reqs_shed_codel);
+	stats->upgrades_refused   = ATOMIC_GET(_adm->stats.upgrades_refused);
+}
+
+void adm_dump_stats(FILE * fp) {
+	Adm_Stats s;
+	adm_get_stats(&s);
+	fprintf(fp, "conns_active %llu\n",      (unsigned long long)s.conns_active);
+	fprintf(fp, "conns_accepted %llu\n",    (unsigned long long)s.conns_accepted);
+	fprintf(fp, "conns_shed %llu\n",        (unsigned long long)s.conns_shed);
+	fprintf(fp, "reqs_inflight %llu\n",     (unsigned long long)s.reqs_inflight);
+	fprintf(fp, "reqs_admitted %llu\n",     (unsigned long long)s.reqs_admitted);
+	fprintf(fp, "reqs_shed_inflight %llu\n",(unsigned long long)s.reqs_shed_inflight);
+	fprintf(fp, "reqs_shed_codel %llu\n",   (unsigned long long)s.reqs_shed_codel);
+	fprintf(fp, "upgrades_refused %llu\n",  (unsigned long long)s.upgrades_refused);
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include <fcntl.h>
+#include "ut.h"
+
+UT_TEST_CASE(adm_isqrt) {
+	ut_assert(isqrt(0)==0);
+	ut_assert(isqrt(1)==1);
+	ut_assert(isqrt(15)==3);
+	ut_assert(isqrt(16)==4);
+	ut_assert(isqrt(1000000)==1000);
+}
+
+UT_TEST_CASE(adm_codel) {
+	const uint64_t target = 5 * TM_NS_PER_MS;
+	const uint64_t interval = 100 * TM_NS_PER_MS;
+	Adm_Codel c;
+	memset(&c,0,sizeof(c));
+	uint64_t now = TM_NS_PER_S;
+
+	// below target: never shed
+	for(int i=0; i<100; i++, now += TM_NS_PER_MS) {
+		ut_assert(!codel_should_shed(&c,now,target-1,target,interval));
+	}
+	// above target, but not for a full interval
+	for(int i=0; i<99; i++, now += TM_NS_PER_MS) {
+		ut_assert(!codel_should_shed(&c,now,target*2,target,interval));
+	}
+	// dip below target resets the interval
+	ut_assert(!codel_should_shed(&c,now,0,target,interval));
+	ut_assert(c.first_above_ns==0);
+
+	// above target for a full interval: start shedding
+	uint64_t start = now;
+	while(!codel_should_shed(&c,now,target*2,target,interval)) {
+		now += TM_NS_PER_MS;
+	}
+	ut_assert(now - start >= interval);
+	ut_assert(c.dropping);
+	ut_assert(c.count==1);
+
+	// next shed is one interval later, then progressively sooner
+	uint64_t t_shed_1 = now;
+	do {
+		now += TM_NS_PER_MS;
+	} while(!codel_should_shed(&c,now,target*2,target,interval));
+	ut_assert(now - t_shed_1 >= interval);
+	uint64_t t_shed_2 = now;
+	do {
+		now += TM_NS_PER_MS;
+	} while(!codel_should_shed(&c,now,target*2,target,interval));
+	ut_assert(now - t_shed_2 < interval);
+	ut_assert(c.count==3);
+
+	// back below target: leave dropping state
+	ut_assert(!codel_should_shed(&c,now,0,target,interval));
+	ut_assert(!c.dropping);
+}
+
+UT_TEST_CASE(adm_limits) {
+	Adm_Config cfg = { .max_conns = 2, .max_inflight = 1 };
+	ut_assert(adm_init(&cfg)==0);
+	Adm_Stats s;
+
+	uint64_t now = tm_now_ns();
+	ut_assert(adm_conn_open(now)==ADM_ADMIT);
+	ut_assert(adm_conn_open(now)==ADM_ADMIT);
+	ut_assert(adm_conn_open(now)==ADM_SHED_CONNS);
+	ut_assert(adm_sojourn_ns()>0);
+
+	ut_assert(adm_req_begin(0,false)==ADM_ADMIT);
+	ut_assert(adm_req_begin(0,true)==ADM_SHED_INFLIGHT);
+	ut_assert(adm_req_begin(0,false)==ADM_SHED_INFLIGHT);
+	adm_req_end();
+	ut_assert(adm_req_begin(0,false)==ADM_ADMIT);
+	adm_req_end();
+
+	adm_get_stats(&s);
+	ut_assert(s.conns_active==2);
+	ut_assert(s.conns_accepted==3);
+	ut_assert(s.conns_shed==1);
+	ut_assert(s.reqs_inflight==0);
+	ut_assert(s.reqs_admitted==2);
+	ut_assert(s.reqs_shed_inflight==2);
+	ut_assert(s.upgrades_refused==1);
+
+	adm_conn_close();
+	adm_conn_close();
+	adm_get_stats(&s);
+	ut_assert(s.conns_active==0);
+	adm_dump_stats(stdlog);
+
+	int fd = open("/dev/null", O_WRONLY);
+	ut_assert(fd>=0);
+	ut_assert(adm_send_503(fd)>0);
+	close(fd);
+
+	// back to unlimited
+	Adm_Config unlimited = {0};
+	ut_assert(adm_init(&unlimited)==0);
+	for(int i=0; i<10; i++) {
+		ut_assert(adm_conn_open(now)==ADM_ADMIT);
+		ut_assert(adm_req_begin(TM_NS_PER_S,false)==ADM_ADMIT);
+	}
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
@@ -0,0 +1,91 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __ADM_H__
+#define __ADM_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*! \brief Admission control configuration. A value of zero disables the
+ *         corresponding limit.
+ */
+typedef struct {
+	unsigned int max_conns;         // max concurrent client connections
+	unsigned int max_inflight;      // max concurrent (non-websocket) requests
+	unsigned int codel_target_ms;   // acceptable queue delay; 0 disables the shedder
+	unsigned int codel_interval_ms; // window in which delay must exceed target before shedding
+	unsigned int retry_after_s;     // value of the Retry-After header on 503 responses
+} Adm_Config;
+
+typedef enum {
+	ADM_ADMIT = 0,     // go ahead
+	ADM_SHED_CONNS,    // too many concurrent connections
+	ADM_SHED_INFLIGHT, // too many requests in flight
+	ADM_SHED_CODEL,    // queue delay has been above target for too long
+} Adm_Verdict;
+
+/*! \brief Admission control counters. These are shared by the server
+ *         process and all of its child processes.
+ */
+typedef struct {
+	uint64_t conns_active;
+	uint64_t conns_accepted;
+	uint64_t conns_shed;
+	uint64_t reqs_inflight;
+	uint64_t reqs_admitted;
+	uint64_t reqs_shed_inflight;
+	uint64_t reqs_shed_codel;
+	uint64_t upgrades_refused;
+} Adm_Stats;
+
+// URI at which the admission control counters are exported
+#define ADM_STATS_URI "/_nuthatch/stats"
+
+/*! \brief Initialize the admission control subsystem. Must be called before
+ *         forking any child processes, since state is placed in memory that
+ *         is shared with children.
+ *
+ * \return Returns 0 if initialized successfully, non-zero if something went wrong.
+ */
+int adm_init(const Adm_Config * cfg);
+
+/*! \brief Called by the server when a client connection has been accepted.
+ *  \return ADM_ADMIT if the connection may be handled, otherwise the reason
+ *          it must be shed (e.g., by sending adm_send_503).
+ */
+Adm_Verdict adm_conn_open(uint64_t t_accept_ns);
+
+/*! \brief Called by the server once an admitted connection has terminated.
+ */
+void adm_conn_close(void);
+
+/*! \brief Set the accept time of the connection handled by the calling thread,
+ *         when the connection was accepted (and admitted) by another process.
+ */
+void adm_conn_set_accept_ns(uint64_t t_accept_ns);
+
+/*! \brief Time elapsed since the current connection was accepted. This is the
+ *         queue delay (sojourn time) seen by the connection's handler.
+ */
+uint64_t adm_sojourn_ns(void);
+
+/*! \brief Called when a request is about to be dispatched.
+ *  \param sojourn_ns The queue delay experienced by the request.
+ *  \param upgrade True if the request asks to be upgraded to a websocket.
+ *  \return ADM_ADMIT if the request may be dispatched, in which case the
+ *          caller must call adm_req_end once the request is complete.
+ */
+Adm_Verdict adm_req_begin(uint64_t sojourn_ns, bool upgrade);
+
+/*! \brief Called when an admitted request is complete.
+ */
+void adm_req_end(void);
+
+/*! \brief Write the prebuilt "503 Service Unavailable" response.
+ */
+int adm_send_503(int fd);
+
+void adm_get_stats(Adm_Stats * stats);
+void adm_dump_stats(FILE * fp);
+
+#endif // __ADM_H__
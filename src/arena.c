@@ -0,0 +1,284 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "arena.h"
+
+typedef struct Arena_Block_S {
+	struct Arena_Block_S * next;
+	size_t size;   // usable bytes
+	size_t used;
+	unsigned char data[] __attribute__((aligned(ARENA_ALIGN)));
+} Arena_Block;
+
+struct Arena_S {
+	Arena_Kind kind;
+	size_t block_size;
+	Arena_Block * blocks;  // in allocation order; blocks after cur are unused
+	Arena_Block * cur;     // the block being allocated from
+	size_t used;           // bytes allocated since the last reset
+	size_t high_water;
+};
+
+static Arena_Stats _arena_stats_local[ARENA_NUM_KINDS];
+static Arena_Stats * _arena_stats = _arena_stats_local;
+
+#define ATOMIC_INC(V) __atomic_add_fetch(&(V),1,__ATOMIC_RELAXED)
+#define ATOMIC_GET(V) __atomic_load_n(&(V),__ATOMIC_RELAXED)
+
+static const char * ARENA_KIND_NAMES[ARENA_NUM_KINDS] = { "req", "conn" };
+
+int arena_init(void) {
+	Arena_Stats * stats = mmap(NULL,sizeof(_arena_stats_local),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if(stats==MAP_FAILED) {
+		elogf("mmap failed: %s",strerror(errno));
+		return -1;
+	}
+	memset(stats,0,sizeof(_arena_stats_local));
+	if(_arena_stats != _arena_stats_local) {
+		munmap(_arena_stats,sizeof(_arena_stats_local));
+	}
+	_arena_stats = stats;
+	return 0;
+}
+
+static void arena_stat_high_water(Arena * arena) {
+	if(arena->used <= arena->high_water) {
+		return;
+	}
+	arena->high_water = arena->used;
+	uint64_t * hw = &_arena_stats[arena->kind].high_water;
+	uint64_t cur = ATOMIC_GET(*hw);
+	while(cur < arena->used && !__atomic_compare_exchange_n(hw,&cur,arena->used,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+Arena * arena_create(Arena_Kind kind, size_t block_size) {
+	Arena * arena = calloc(1,sizeof(Arena));
+	if(!arena) {
+		elogf("calloc failed: %s",strerror(errno));
+		return NULL;
+	}
+	arena->kind = kind;
+	arena->block_size = block_size;
+	ATOMIC_INC(_arena_stats[kind].arenas);
+	return arena;
+}
+
+void arena_free(Arena * arena) {
+	if(!arena) {
+		return;
+	}
+	arena_stat_high_water(arena);
+	for(Arena_Block * b = arena->blocks; b; ) {
+		Arena_Block * next = b->next;
+		free(b);
+		ATOMIC_INC(_arena_stats[arena->kind].block_frees);
+		b = next;
+	}
+	free(arena);
+}
+
+void arena_reset(Arena * arena) {
+	arena_stat_high_water(arena);
+	ATOMIC_INC(_arena_stats[arena->kind].resets);
+	// Keep blocks up to the retention limit
+	size_t retained = 0;
+	Arena_Block ** pb = &arena->blocks;
+	while(*pb) {
+		Arena_Block * b = *pb;
+		if(retained + b->size > ARENA_RETAIN_MAX && retained>0) {
+			*pb = b->next;
+			free(b);
+			ATOMIC_INC(_arena_stats[arena->kind].block_frees);
+			continue;
+		}
+		retained += b->size;
+		b->used = 0;
+		pb = &b->next;
+	}
+	arena->cur = arena->blocks;
+	arena->used = 0;
+}
+
+void * arena_alloc(Arena * arena, size_t len) {
+	len = (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	Arena_Block * b;
+	for(b = arena->cur; b; b = b->next) {
+		if(b->size - b->used >= len) {
+			break;
+		}
+	}
+	if(!b) {
+		size_t size = len > arena->block_size ? len : arena->block_size;
+		if(!(b = malloc(sizeof(Arena_Block) + size))) {
+			elogf("malloc failed: %s",strerror(errno));
+			return NULL;
+		}
+		ATOMIC_INC(_arena_stats[arena->kind].block_allocs);
+		b->size = size;
+		b->used = 0;
+		b->next = NULL;
+		// Append, so that blocks after cur remain unused
+		Arena_Block ** pb = &arena->blocks;
+		while(*pb) {
+			pb = &(*pb)->next;
+		}
+		*pb = b;
+	}
+	arena->cur = b;
+	void * p = b->data + b->used;
+	b->used += len;
+	arena->used += len;
+	return p;
+}
+
+void * arena_calloc(Arena * arena, size_t len) {
+	void * p = arena_alloc(arena,len);
+	if(p) {
+		memset(p,0,len);
+	}
+	return p;
+}
+
+char * arena_strndup(Arena * arena, const char * sz, size_t len) {
+	size_t sz_len = strnlen(sz,len);
+	char * p = arena_alloc(arena,sz_len+1);
+	if(p) {
+		memcpy(p,sz,sz_len);
+		p[sz_len] = '\0';
+	}
+	return p;
+}
+
+Arena_Mark arena_mark(const Arena * arena) {
+	Arena_Mark mark = {
+		.block = arena->cur,
+		.block_used = arena->cur ? arena->cur->used : 0,
+		.used = arena->used,
+	};
+	return mark;
+}
+
+void arena_release(Arena * arena, Arena_Mark mark) {
+	arena_stat_high_water(arena);
+	Arena_Block * b = mark.block ? mark.block : arena->blocks;
+	if(b) {
+		b->used = mark.block ? mark.block_used : 0;
+		for(Arena_Block * next = b->next; next; next = next->next) {
+			next->used = 0;
+		}
+	}
+	arena->cur = b;
+	arena->used = mark.used;
+}
+
+size_t arena_used(const Arena * arena) {
+	return arena->used;
+}
+
+size_t arena_high_water(const Arena * arena) {
+	return arena->used > arena->high_water ? arena->used : arena->high_water;
+}
+
+void arena_get_stats(Arena_Kind kind, Arena_Stats * stats) {
+	memset(stats,0,sizeof(Arena_Stats));
+	if(kind>=0 && kind<ARENA_NUM_KINDS) {
+		Arena_Stats * s = &_arena_stats[kind];
+		stats->arenas = ATOMIC_GET(s->arenas);
+		stats->resets = ATOMIC_GET(s->resets);
+		stats->block_allocs = ATOMIC_GET(s->block_allocs);
+		stats->block_frees = ATOMIC_GET(s->block_frees);
+		stats->high_water = ATOMIC_GET(s->high_water);
+	}
+}
+
+void arena_dump_stats(FILE * fp) {
+	for(int kind=0; kind<ARENA_NUM_KINDS; kind++) {
+		Arena_Stats s;
+		arena_get_stats(kind,&s);
+		const char * name = ARENA_KIND_NAMES[kind];
+		fprintf(fp,"arena_%s_arenas %llu\n",name,(unsigned long long)s.arenas);
+		fprintf(fp,"arena_%s_resets %llu\n",name,(unsigned long long)s.resets);
+		fprintf(fp,"arena_%s_block_allocs %llu\n",name,(unsigned long long)s.block_allocs);
+		fprintf(fp,"arena_%s_block_frees %llu\n",name,(unsigned long long)s.block_frees);
+		fprintf(fp,"arena_%s_high_water %llu\n",name,(unsigned long long)s.high_water);
+	}
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+
+UT_TEST_CASE(arena_alloc) {
+	ut_assert(arena_init()==0);
+	Arena * a = arena_create(ARENA_REQ,256);
+	ut_assert(a);
+	char * p1 = arena_alloc(a,10);
+	char * p2 = arena_alloc(a,1);
+	ut_assert(p1 && p2);
+	ut_assert(((uintptr_t)p1 % ARENA_ALIGN)==0 && ((uintptr_t)p2 % ARENA_ALIGN)==0);
+	ut_assert(p2==p1+16);
+	ut_assert(arena_used(a)==32);
+	char * s = arena_strndup(a,"hello, world",5);
+	ut_assert(strcmp(s,"hello")==0);
+	unsigned char * z = arena_calloc(a,100);
+	for(int i=0; i<100; i++) {
+		ut_assert(z[i]==0);
+	}
+	// Larger than a block
+	unsigned char * big = arena_alloc(a,1000);
+	ut_assert(big);
+	memset(big,0xff,1000);
+	Arena_Stats stats;
+	arena_get_stats(ARENA_REQ,&stats);
+	ut_assert(stats.arenas==1 && stats.block_allocs==2);
+
+	// Steady state: no more blocks after a reset
+	arena_reset(a);
+	ut_assert(arena_used(a)==0);
+	ut_assert(arena_alloc(a,10)==p1);
+	ut_assert(arena_alloc(a,100));
+	ut_assert(arena_alloc(a,1000));
+	arena_get_stats(ARENA_REQ,&stats);
+	ut_assert(stats.block_allocs==2 && stats.resets==1);
+	ut_assert(stats.high_water>=1000+16+16+16+112);
+	ut_assert(arena_high_water(a)==stats.high_water);
+	arena_free(a);
+	arena_get_stats(ARENA_REQ,&stats);
+	ut_assert(stats.block_frees==2);
+}
+
+UT_TEST_CASE(arena_mark_release) {
+	Arena * a = arena_create(ARENA_CONN,128);
+	Arena_Mark empty = arena_mark(a);
+	char * keep = arena_alloc(a,64);
+	Arena_Mark mark = arena_mark(a);
+	char * scratch1 = arena_alloc(a,32);
+	ut_assert(arena_alloc(a,500));
+	arena_release(a,mark);
+	ut_assert(arena_used(a)==64);
+	ut_assert(arena_alloc(a,32)==scratch1);
+	arena_release(a,empty);
+	ut_assert(arena_used(a)==0);
+	ut_assert(arena_alloc(a,16)==keep);
+	arena_free(a);
+}
+
+UT_TEST_CASE(arena_retain_max) {
+	ut_assert(arena_init()==0);
+	Arena * a = arena_create(ARENA_REQ,1024);
+	for(int i=0; i<3; i++) {
+		ut_assert(arena_alloc(a,ARENA_RETAIN_MAX/2));
+	}
+	arena_reset(a);
+	Arena_Stats stats;
+	arena_get_stats(ARENA_REQ,&stats);
+	ut_assert(stats.block_allocs==3 && stats.block_frees==1);
+	arena_free(a);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
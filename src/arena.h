@@ -0,0 +1,77 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Region allocator: allocations are bumped from large blocks and released
+// all at once by arena_reset, which keeps the blocks for reuse. An arena
+// that is reset after each request (or connection) stops calling malloc once
+// it has grown to its high-water mark.
+
+#define ARENA_ALIGN 16
+#define ARENA_RETAIN_MAX (1024*1024) // blocks kept by arena_reset, at most
+
+typedef enum {
+	ARENA_REQ = 0,   // per-request lifetime
+	ARENA_CONN,      // per-connection lifetime
+	ARENA_NUM_KINDS
+} Arena_Kind;
+
+typedef struct {
+	uint64_t arenas;        // arenas created
+	uint64_t resets;
+	uint64_t block_allocs;  // blocks malloc'd
+	uint64_t block_frees;
+	uint64_t high_water;    // most bytes allocated from an arena between resets
+} Arena_Stats;
+
+typedef struct Arena_S Arena;
+
+/*! \brief Position in an arena, for releasing scratch allocations. */
+typedef struct {
+	void * block;
+	size_t block_used;
+	size_t used;
+} Arena_Mark;
+
+/*! \brief Place the stats in shared memory, so that they are shared with
+ *         forked children.
+ *  \return 0 if successful, or -1 if something went wrong.
+ */
+int arena_init(void);
+
+/*! \brief Create an arena.
+ *  \param block_size Size of the blocks allocations are made from; larger
+ *                    allocations get a block of their own.
+ */
+Arena * arena_create(Arena_Kind kind, size_t block_size);
+void arena_free(Arena * arena);
+
+/*! \brief Release everything allocated from the arena. */
+void arena_reset(Arena * arena);
+
+/*! \brief Allocate len bytes, aligned to ARENA_ALIGN.
+ *  \return The memory, or NULL if out of memory.
+ */
+void * arena_alloc(Arena * arena, size_t len);
+void * arena_calloc(Arena * arena, size_t len);
+char * arena_strndup(Arena * arena, const char * sz, size_t len);
+
+/*! \brief Mark the current position, so that the allocations made after it
+ *         can be released with arena_release (last in, first out).
+ */
+Arena_Mark arena_mark(const Arena * arena);
+void arena_release(Arena * arena, Arena_Mark mark);
+
+/*! \brief Bytes allocated since the last reset. */
+size_t arena_used(const Arena * arena);
+/*! \brief Most bytes allocated between resets. */
+size_t arena_high_water(const Arena * arena);
+
+void arena_get_stats(Arena_Kind kind, Arena_Stats * stats);
+void arena_dump_stats(FILE * fp);
+
+#endif // __ARENA_H__
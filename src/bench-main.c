@@ -0,0 +1,14 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef EXCLUDE_BENCHMARKS
+
+#include "bench.h"
+
+#include <openssl/crypto.h>
+
+int main(int argc, char ** argv) {
+  int ec = bench_driver(argc, argv);
+  CRYPTO_cleanup_all_ex_data();
+  return ec;
+}
+
+#endif // !EXCLUDE_BENCHMARKS
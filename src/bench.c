@@ -0,0 +1,119 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef EXCLUDE_BENCHMARKS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "sz.h"
+#include "bench.h"
+
+struct BenchCase_S {
+	const char * name;
+	BenchFn fn;
+};
+
+static struct BenchCase_S * reg_bench_cases = NULL;
+static int num_reg_bench_cases = 0;
+static double bench_scale = 1.0;
+static FILE * fp_bench_out = NULL;
+
+static void bench_cleanup(void) {
+	if(reg_bench_cases) {
+		free(reg_bench_cases);
+		reg_bench_cases = NULL;
+	}
+}
+
+int bench_register(const char * name, BenchFn fn) {
+	if(!reg_bench_cases) {
+		atexit(bench_cleanup);
+	}
+	reg_bench_cases = realloc(reg_bench_cases,sizeof(struct BenchCase_S) * (num_reg_bench_cases+1));
+	struct BenchCase_S * bc = &reg_bench_cases[num_reg_bench_cases++];
+	bc->name = name;
+	bc->fn = fn;
+	return num_reg_bench_cases;
+}
+
+uint64_t bench_iterations(uint64_t n) {
+	uint64_t scaled = (uint64_t)(n * bench_scale);
+	return scaled > 0 ? scaled : 1;
+}
+
+void bench_report(const char * label, uint64_t ops, uint64_t bytes, uint64_t elapsed_ns) {
+	if(elapsed_ns==0) {
+		elapsed_ns = 1;
+	}
+	double secs = (double)elapsed_ns / TM_NS_PER_S;
+	fprintf(fp_bench_out,"  %-44s %12.0f ops/s %12.1f ns/op",label,ops/secs,(double)elapsed_ns/(ops?ops:1));
+	if(bytes>0) {
+		fprintf(fp_bench_out," %10.2f MB/s %8.3f ns/byte",bytes/secs/1e6,(double)elapsed_ns/bytes);
+	}
+	fprintf(fp_bench_out,"\n");
+	fflush(fp_bench_out);
+}
+
+static void usage(FILE * out, const char * prog) {
+	fprintf(out,"Usage: %s [options] [bench-pattern ...]\n",prog);
+	fprintf(out,"Options:\n");
+	fprintf(out,"  --help         Display this message\n");
+	fprintf(out,"  --debug        Enable debug output\n");
+	fprintf(out,"  --scale <f>    Scale iteration counts by the given factor (default: 1.0)\n");
+	fprintf(out,"  -l, --list     List benchmarks\n");
+}
+
+int bench_driver(int argc, char ** argv) {
+	fp_bench_out = stdout;
+	bool list = false;
+	char ** patterns = NULL;
+	int num_patterns = 0;
+	// Benchmarks are noisy enough without logging
+	log_set_level(LEVEL_WARNING);
+	for(int iarg=1; iarg<argc; iarg++) {
+		const char * arg = argv[iarg];
+		if(sz_starts_with(arg,"-")) {
+			if(0==strcmp("--help",arg)) {
+				usage(stdout,argv[0]);
+				return 0;
+			} else if(0==strcmp("--debug",arg)) {
+				log_set_level(LEVEL_DEBUG);
+			} else if(0==strcmp("--scale",arg) && iarg+1<argc) {
+				bench_scale = atof(argv[++iarg]);
+			} else if(0==strcmp("-l",arg) || 0==strcmp("--list",arg)) {
+				list = true;
+			} else {
+				fprintf(stderr,"Unrecognized option: %s\n",arg);
+				usage(stderr,argv[0]);
+				return 1;
+			}
+		} else {
+			patterns = argv + iarg;
+			num_patterns = argc - iarg;
+			break;
+		}
+	}
+	for(int i=0; i<num_reg_bench_cases; i++) {
+		struct BenchCase_S * bc = &reg_bench_cases[i];
+		bool run = num_patterns==0;
+		for(int p=0; p<num_patterns && !run; p++) {
+			run = sz_contains_case(bc->name,patterns[p],true);
+		}
+		if(!run) {
+			continue;
+		}
+		if(list) {
+			printf("%s\n",bc->name);
+			continue;
+		}
+		fprintf(fp_bench_out,"%s\n",bc->name);
+		uint64_t start = tm_now_ns();
+		bc->fn();
+		fprintf(fp_bench_out,"  (%llu ms)\n",(unsigned long long)((tm_now_ns()-start)/TM_NS_PER_MS));
+	}
+	fflush(fp_bench_out);
+	return 0;
+}
+
+#endif // !EXCLUDE_BENCHMARKS
@@ -0,0 +1,39 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#ifndef EXCLUDE_BENCHMARKS
+
+#include <stdint.h>
+
+#include "log.h"
+#include "tm.h"
+
+typedef void (*BenchFn)(void);
+
+extern int bench_register(const char * bench_name, BenchFn bench_fn);
+extern int bench_driver(int, char**);
+
+/*! \brief Define a benchmark. Benchmarks are run by the benchmark driver
+ *         (`make bench`), and report their results using bench_report.
+ */
+#define BENCH_CASE(B) \
+    static void _bench_##B(void);\
+    __attribute__ ((__constructor__)) void register_bench_##B() {bench_register(#B, _bench_##B); } \
+    static void _bench_##B(void)
+
+/*! \brief Scale an iteration count by the driver's --scale option, so that
+ *         benchmarks can be run quickly (e.g., as a smoke test) or for longer.
+ */
+extern uint64_t bench_iterations(uint64_t n);
+
+/*! \brief Report the result of a measurement.
+ *  \param label What was measured
+ *  \param ops Number of operations performed
+ *  \param bytes Number of bytes processed (0 if not meaningful)
+ *  \param elapsed_ns Time taken to perform the operations
+ */
+extern void bench_report(const char * label, uint64_t ops, uint64_t bytes, uint64_t elapsed_ns);
+
+#endif // EXCLUDE_BENCHMARKS
+#endif // __BENCH_H__
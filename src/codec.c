@@ -0,0 +1,414 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "codec.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CODEC_SSSE3
+#include <tmmintrin.h>
+#endif
+
+static const char B64_CHARS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char HEX_CHARS[] = "0123456789abcdef";
+
+// -1 until the CPU has been checked; tests and benchmarks set it to compare paths
+static int _codec_simd = -1;
+
+static inline bool codec_simd(void) {
+	if(_codec_simd<0) {
+	#ifdef CODEC_SSSE3
+		_codec_simd = __builtin_cpu_supports("ssse3") ? 1 : 0;
+	#else
+		_codec_simd = 0;
+	#endif
+	}
+	return _codec_simd;
+}
+
+// Value of each base64 character; -1 if not in the alphabet
+static const signed char B64_VALUES[256] = {
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,62,-1,-1,-1,63,
+	52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-1,-1,-1,
+	-1,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,
+	15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,
+	-1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
+	41,42,43,44,45,46,47,48,49,50,51,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+	-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+};
+
+static inline int b64_value(unsigned char c) {
+	return B64_VALUES[c];
+}
+
+static inline int hex_value(unsigned char c) {
+	if(c>='0' && c<='9') return c - '0';
+	c |= 0x20; // lower case
+	if(c>='a' && c<='f') return c - 'a' + 10;
+	return -1;
+}
+
+#ifdef CODEC_SSSE3
+
+// Base64 with pshufb, after Wojciech Muła and Daniel Lemire,
+// "Faster Base64 Encoding and Decoding Using AVX2 Instructions" (2018),
+// with 128-bit vectors.
+
+// 12 bytes (of 16 read) to 16 characters
+__attribute__((target("ssse3")))
+static size_t b64_encode_ssse3(char * dst, const unsigned char * src, size_t len) {
+	size_t i = 0;
+	char * d = dst;
+	for(; len - i >= 16; i += 12, d += 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+		// Each 32-bit lane gets 3 input bytes, as b1 b0 b2 b1
+		in = _mm_shuffle_epi8(in,_mm_set_epi8(10,11,9,10,7,8,6,7,4,5,3,4,1,2,0,1));
+		// Move the four 6-bit fields of each lane to their own bytes
+		__m128i t0 = _mm_and_si128(in,_mm_set1_epi32(0x0fc0fc00));
+		__m128i t1 = _mm_mulhi_epu16(t0,_mm_set1_epi32(0x04000040));
+		__m128i t2 = _mm_and_si128(in,_mm_set1_epi32(0x003f03f0));
+		__m128i t3 = _mm_mullo_epi16(t2,_mm_set1_epi32(0x01000010));
+		__m128i indices = _mm_or_si128(t1,t3);
+		// Map 0..63 to the alphabet by adding a per-range offset
+		__m128i range = _mm_subs_epu8(indices,_mm_set1_epi8(51));
+		__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26),indices);
+		range = _mm_or_si128(range,_mm_and_si128(less,_mm_set1_epi8(13)));
+		const __m128i offsets = _mm_setr_epi8('a'-26,'0'-52,'0'-52,'0'-52,'0'-52,'0'-52,
+			'0'-52,'0'-52,'0'-52,'0'-52,'0'-52,'+'-62,'/'-63,'A',0,0);
+		__m128i out = _mm_add_epi8(_mm_shuffle_epi8(offsets,range),indices);
+		_mm_storeu_si128((__m128i *)d,out);
+	}
+	return i;
+}
+
+// 16 characters to 12 bytes (of 16 written); stops at the first block with
+// a character outside the alphabet (including padding)
+__attribute__((target("ssse3")))
+static size_t b64_decode_ssse3(unsigned char * dst, const char * src, size_t len, size_t * written) {
+	size_t i = 0;
+	unsigned char * d = dst;
+	const __m128i lut_lo = _mm_setr_epi8(0x15,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x13,0x1a,0x1b,0x1b,0x1b,0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(0x10,0x10,0x01,0x02,0x04,0x08,0x04,0x08,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0,16,19,4,-65,-65,-71,-71,0,0,0,0,0,0,0,0);
+	// Leave the last block(s), which may be padded, to the scalar code; and
+	// room for the 4 extra bytes each store writes
+	for(; len - i >= 32; i += 16, d += 12) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in,4),_mm_set1_epi8(0x0f));
+		__m128i lo_nibbles = _mm_and_si128(in,_mm_set1_epi8(0x0f));
+		__m128i lo = _mm_shuffle_epi8(lut_lo,lo_nibbles);
+		__m128i hi = _mm_shuffle_epi8(lut_hi,hi_nibbles);
+		if(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo,hi),_mm_setzero_si128()))) {
+			break;
+		}
+		__m128i eq_2f = _mm_cmpeq_epi8(in,_mm_set1_epi8(0x2f));
+		__m128i roll = _mm_shuffle_epi8(lut_roll,_mm_add_epi8(eq_2f,hi_nibbles));
+		__m128i values = _mm_add_epi8(in,roll);
+		// Pack 4 x 6 bits into 3 bytes per lane
+		__m128i merged = _mm_maddubs_epi16(values,_mm_set1_epi32(0x01400140));
+		__m128i packed = _mm_madd_epi16(merged,_mm_set1_epi32(0x00011000));
+		packed = _mm_shuffle_epi8(packed,_mm_setr_epi8(2,1,0,6,5,4,10,9,8,14,13,12,-1,-1,-1,-1));
+		_mm_storeu_si128((__m128i *)d,packed);
+	}
+	*written = d - dst;
+	return i;
+}
+
+// 16 bytes to 32 characters
+__attribute__((target("ssse3")))
+static size_t hex_encode_ssse3(char * dst, const unsigned char * src, size_t len) {
+	size_t i = 0;
+	const __m128i lut = _mm_loadu_si128((const __m128i *)HEX_CHARS);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	for(; len - i >= 16; i += 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi = _mm_shuffle_epi8(lut,_mm_and_si128(_mm_srli_epi16(in,4),mask));
+		__m128i lo = _mm_shuffle_epi8(lut,_mm_and_si128(in,mask));
+		_mm_storeu_si128((__m128i *)(dst + 2*i),_mm_unpacklo_epi8(hi,lo));
+		_mm_storeu_si128((__m128i *)(dst + 2*i + 16),_mm_unpackhi_epi8(hi,lo));
+	}
+	return i;
+}
+
+#endif // CODEC_SSSE3
+
+size_t codec_b64_encode(char * dst, const void * src, size_t len) {
+	const unsigned char * s = src;
+	size_t i = 0;
+	char * d = dst;
+	#ifdef CODEC_SSSE3
+	if(len>=16 && codec_simd()) {
+		i = b64_encode_ssse3(d,s,len);
+		d += (i/3)*4;
+	}
+	#endif
+	for(; len - i >= 3; i += 3, d += 4) {
+		uint32_t v = (uint32_t)s[i]<<16 | (uint32_t)s[i+1]<<8 | s[i+2];
+		d[0] = B64_CHARS[v>>18];
+		d[1] = B64_CHARS[(v>>12)&0x3f];
+		d[2] = B64_CHARS[(v>>6)&0x3f];
+		d[3] = B64_CHARS[v&0x3f];
+	}
+	if(len - i == 1) {
+		d[0] = B64_CHARS[s[i]>>2];
+		d[1] = B64_CHARS[(s[i]&0x03)<<4];
+		d[2] = d[3] = '=';
+		d += 4;
+	} else if(len - i == 2) {
+		d[0] = B64_CHARS[s[i]>>2];
+		d[1] = B64_CHARS[((s[i]&0x03)<<4) | (s[i+1]>>4)];
+		d[2] = B64_CHARS[(s[i+1]&0x0f)<<2];
+		d[3] = '=';
+		d += 4;
+	}
+	return d - dst;
+}
+
+ssize_t codec_b64_decode(void * dst, const char * src, size_t len) {
+	if(len%4) {
+		errno = EINVAL;
+		return -1;
+	}
+	unsigned char * d = dst;
+	size_t i = 0;
+	#ifdef CODEC_SSSE3
+	if(len>=32 && codec_simd()) {
+		size_t written;
+		i = b64_decode_ssse3(d,src,len,&written);
+		d += written;
+	}
+	#endif
+	for(; i<len; i += 4) {
+		int v0 = b64_value(src[i]);
+		int v1 = b64_value(src[i+1]);
+		int v2 = b64_value(src[i+2]);
+		int v3 = b64_value(src[i+3]);
+		if(v0<0 || v1<0) {
+			errno = EINVAL;
+			return -1;
+		}
+		*d++ = (v0<<2) | (v1>>4);
+		if(v2<0 || v3<0) {
+			// Padding, which is only allowed at the end
+			bool last = i+4==len;
+			if(last && v2<0 && src[i+2]=='=' && src[i+3]=='=' && (v1&0x0f)==0) {
+				break;
+			}
+			if(last && v2>=0 && src[i+3]=='=' && (v2&0x03)==0) {
+				*d++ = ((v1&0x0f)<<4) | (v2>>2);
+				break;
+			}
+			errno = EINVAL;
+			return -1;
+		}
+		*d++ = ((v1&0x0f)<<4) | (v2>>2);
+		*d++ = ((v2&0x03)<<6) | v3;
+	}
+	return d - (unsigned char *)dst;
+}
+
+size_t codec_hex_encode(char * dst, const void * src, size_t len) {
+	const unsigned char * s = src;
+	size_t i = 0;
+	#ifdef CODEC_SSSE3
+	if(len>=16 && codec_simd()) {
+		i = hex_encode_ssse3(dst,s,len);
+	}
+	#endif
+	for(; i<len; i++) {
+		dst[2*i] = HEX_CHARS[s[i]>>4];
+		dst[2*i+1] = HEX_CHARS[s[i]&0x0f];
+	}
+	return 2*len;
+}
+
+ssize_t codec_hex_decode(void * dst, const char * src, size_t len) {
+	if(len%2) {
+		errno = EINVAL;
+		return -1;
+	}
+	unsigned char * d = dst;
+	for(size_t i=0; i<len; i += 2) {
+		int hi = hex_value(src[i]);
+		int lo = hex_value(src[i+1]);
+		if(hi<0 || lo<0) {
+			errno = EINVAL;
+			return -1;
+		}
+		*d++ = (hi<<4) | lo;
+	}
+	return len/2;
+}
+
+size_t codec_varint_put(unsigned char * dst, uint64_t v) {
+	size_t n = 0;
+	while(v>=0x80) {
+		dst[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	dst[n++] = v;
+	return n;
+}
+
+int codec_varint_get(const unsigned char * src, size_t len, uint64_t * v) {
+	*v = 0;
+	for(int i=0; i<CODEC_VARINT_MAX; i++) {
+		if((size_t)i>=len) {
+			return 0;
+		}
+		*v |= (uint64_t)(src[i] & 0x7f) << (7*i);
+		if(!(src[i] & 0x80)) {
+			return i+1;
+		}
+	}
+	return -1;
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+#include "rnd.h"
+
+UT_TEST_CASE(codec_b64) {
+	// RFC 4648 test vectors
+	const char * vectors[][2] = {
+		{"",""}, {"f","Zg=="}, {"fo","Zm8="}, {"foo","Zm9v"},
+		{"foob","Zm9vYg=="}, {"fooba","Zm9vYmE="}, {"foobar","Zm9vYmFy"},
+	};
+	char enc[16];
+	unsigned char dec[16];
+	for(int i=0; i<sizeof(vectors)/sizeof(vectors[0]); i++) {
+		size_t len = strlen(vectors[i][0]);
+		ut_assert(codec_b64_encode(enc,vectors[i][0],len)==strlen(vectors[i][1]));
+		ut_assert(memcmp(enc,vectors[i][1],strlen(vectors[i][1]))==0);
+		ut_assert(codec_b64_decode(dec,vectors[i][1],strlen(vectors[i][1]))==len);
+		ut_assert(memcmp(dec,vectors[i][0],len)==0);
+	}
+	ut_assert(codec_b64_decode(dec,"Zm9",3)<0 && errno==EINVAL);
+	ut_assert(codec_b64_decode(dec,"Zm=v",4)<0);
+	ut_assert(codec_b64_decode(dec,"Zg==Zg==",8)<0);
+	ut_assert(codec_b64_decode(dec,"Zm9*",4)<0);
+	ut_assert(codec_b64_decode(dec,"Zh==",4)<0); // non-zero trailing bits
+
+	// The websocket handshake example from RFC 6455
+	const unsigned char hash[20] = {0xb3,0x7a,0x4f,0x2c,0xc0,0x62,0x4f,0x16,0x90,0xf6,
+		0x46,0x06,0xcf,0x38,0x59,0x45,0xb2,0xbe,0xc4,0xea};
+	char accept[CODEC_B64_LEN(20)];
+	ut_assert(codec_b64_encode(accept,hash,20)==28);
+	ut_assert(memcmp(accept,"s3pPLMBiTxaQ9kYGzzhZRbK+xOo=",28)==0);
+}
+
+UT_TEST_CASE(codec_hex) {
+	char enc[8];
+	unsigned char dec[4];
+	const unsigned char bytes[3] = {0x00,0xaf,0x19};
+	ut_assert(codec_hex_encode(enc,bytes,3)==6 && memcmp(enc,"00af19",6)==0);
+	ut_assert(codec_hex_decode(dec,"00AF19",6)==3 && memcmp(dec,bytes,3)==0);
+	ut_assert(codec_hex_decode(dec,"00a",3)<0 && errno==EINVAL);
+	ut_assert(codec_hex_decode(dec,"0g",2)<0);
+}
+
+UT_TEST_CASE(codec_varint) {
+	unsigned char buff[CODEC_VARINT_MAX+1];
+	const uint64_t values[] = { 0, 1, 127, 128, 300, 16383, 16384, (uint64_t)1<<32, UINT64_MAX };
+	for(int i=0; i<sizeof(values)/sizeof(values[0]); i++) {
+		size_t n = codec_varint_put(buff,values[i]);
+		uint64_t v;
+		ut_assert(n>=1 && n<=CODEC_VARINT_MAX);
+		ut_assert(codec_varint_get(buff,n,&v)==n && v==values[i]);
+		ut_assert(codec_varint_get(buff,n-1,&v)==0);
+	}
+	ut_assert(codec_varint_put(buff,300)==2 && buff[0]==0xac && buff[1]==0x02);
+	memset(buff,0x80,sizeof(buff));
+	uint64_t v;
+	ut_assert(codec_varint_get(buff,sizeof(buff),&v)<0);
+}
+
+UT_TEST_CASE(codec_simd_vs_scalar) {
+	// Every length up to a few blocks, and both paths, must agree
+	enum { MAX = 200 };
+	unsigned char bytes[MAX];
+	rnd_fill(bytes,sizeof(bytes));
+	char enc[2][CODEC_HEX_LEN(MAX)];
+	unsigned char dec[CODEC_HEX_LEN(MAX)];
+	int simd = codec_simd();
+	for(size_t len=0; len<=MAX; len++) {
+		size_t n[2];
+		for(int path=0; path<2; path++) {
+			_codec_simd = path ? simd : 0;
+			n[path] = codec_b64_encode(enc[path],bytes,len);
+			ut_assert(n[path]==CODEC_B64_LEN(len));
+			ut_assert(codec_b64_decode(dec,enc[path],n[path])==len);
+			ut_assert(memcmp(dec,bytes,len)==0);
+		}
+		ut_assert(memcmp(enc[0],enc[1],n[0])==0);
+		for(int path=0; path<2; path++) {
+			_codec_simd = path ? simd : 0;
+			ut_assert(codec_hex_encode(enc[path],bytes,len)==2*len);
+			ut_assert(codec_hex_decode(dec,enc[path],2*len)==len);
+			ut_assert(memcmp(dec,bytes,len)==0);
+		}
+		ut_assert(memcmp(enc[0],enc[1],2*len)==0);
+	}
+	// An invalid character in a vectorized block
+	_codec_simd = simd;
+	size_t n = codec_b64_encode(enc[0],bytes,MAX);
+	enc[0][5] = '.';
+	ut_assert(codec_b64_decode(dec,enc[0],n)<0 && errno==EINVAL);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
+
+#ifndef EXCLUDE_BENCHMARKS
+
+#include "bench.h"
+#include "rnd.h"
+
+BENCH_CASE(codec_b64_hex) {
+	enum { LEN = 16*1024 };
+	static unsigned char bytes[LEN];
+	static char enc[CODEC_HEX_LEN(LEN)];
+	rnd_fill(bytes,sizeof(bytes));
+	const uint64_t n = bench_iterations(20000);
+	int simd = codec_simd();
+	for(int path=0; path<2; path++) {
+		_codec_simd = path ? simd : 0;
+		const char * name = path ? (simd ? "ssse3" : "scalar (no ssse3)") : "scalar";
+		char label[64];
+		uint64_t start = tm_now_ns();
+		for(uint64_t i=0; i<n; i++) {
+			codec_b64_encode(enc,bytes,LEN);
+		}
+		snprintf(label,sizeof(label),"b64 encode, %s (16KB)",name);
+		bench_report(label,n,n*LEN,tm_now_ns()-start);
+
+		size_t enc_len = CODEC_B64_LEN(LEN);
+		start = tm_now_ns();
+		for(uint64_t i=0; i<n; i++) {
+			codec_b64_decode(bytes,enc,enc_len);
+		}
+		snprintf(label,sizeof(label),"b64 decode, %s (16KB)",name);
+		bench_report(label,n,n*LEN,tm_now_ns()-start);
+
+		start = tm_now_ns();
+		for(uint64_t i=0; i<n; i++) {
+			codec_hex_encode(enc,bytes,LEN);
+		}
+		snprintf(label,sizeof(label),"hex encode, %s (16KB)",name);
+		bench_report(label,n,n*LEN,tm_now_ns()-start);
+	}
+	_codec_simd = simd;
+}
+
+#endif // !EXCLUDE_BENCHMARKS
@@ -0,0 +1,62 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Base64 (RFC 4648, with padding) and lowercase hex codecs, to and from
+// caller-supplied buffers. On x86-64 CPUs with SSSE3, base64 and hex encoding
+// and base64 decoding process 12-16 bytes at a time. Also LEB128 varints, for
+// compact binary records.
+
+/*! \brief Encoded length of n bytes (no null terminator). */
+#define CODEC_B64_LEN(n) ((((n) + 2) / 3) * 4)
+#define CODEC_HEX_LEN(n) ((n) * 2)
+
+/*! \brief Most bytes that len characters decode to. */
+#define CODEC_B64_DECODED_MAX(len) (((len) / 4) * 3)
+#define CODEC_HEX_DECODED_MAX(len) ((len) / 2)
+
+/*! \brief Base64-encode len bytes into dst, which must have room for
+ *         CODEC_B64_LEN(len) characters. dst is not null-terminated.
+ *  \return The number of characters written.
+ */
+size_t codec_b64_encode(char * dst, const void * src, size_t len);
+
+/*! \brief Decode len base64 characters into dst, which must have room for
+ *         CODEC_B64_DECODED_MAX(len) bytes.
+ *  \return The number of bytes written, or -1 (with errno set to EINVAL) if
+ *          src is not valid base64.
+ */
+ssize_t codec_b64_decode(void * dst, const char * src, size_t len);
+
+/*! \brief Hex-encode len bytes into dst, which must have room for
+ *         CODEC_HEX_LEN(len) characters. dst is not null-terminated.
+ *  \return The number of characters written.
+ */
+size_t codec_hex_encode(char * dst, const void * src, size_t len);
+
+/*! \brief Decode len hex characters (either case) into dst, which must have
+ *         room for CODEC_HEX_DECODED_MAX(len) bytes.
+ *  \return The number of bytes written, or -1 (with errno set to EINVAL) if
+ *          src is not valid hex.
+ */
+ssize_t codec_hex_decode(void * dst, const char * src, size_t len);
+
+/*! \brief Most bytes a varint takes. */
+#define CODEC_VARINT_MAX 10
+
+/*! \brief Write v as an unsigned LEB128 varint, of up to CODEC_VARINT_MAX bytes.
+ *  \return The number of bytes written.
+ */
+size_t codec_varint_put(unsigned char * dst, uint64_t v);
+
+/*! \brief Read an unsigned LEB128 varint from the len bytes at src.
+ *  \return The number of bytes read, 0 if src ends before the varint does,
+ *          or -1 if it is longer than CODEC_VARINT_MAX bytes.
+ */
+int codec_varint_get(const unsigned char * src, size_t len, uint64_t * v);
+
+#endif // __CODEC_H__
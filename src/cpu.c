@@ -0,0 +1,199 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#define _GNU_SOURCE // for cpu_set_t
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+#include "cpu.h"
+
+// From <numaif.h>, which comes with libnuma; we don't link with it
+#define CPU_MPOL_PREFERRED 1
+
+int cpu_parse_list(const char * sz, cpu_set_t * set) {
+	CPU_ZERO(set);
+	const char * p = sz;
+	for(;;) {
+		char * end;
+		long first = strtol(p,&end,10);
+		long last = first;
+		if(end==p) {
+			errno = EINVAL;
+			return -1;
+		}
+		if(*end=='-') {
+			p = end + 1;
+			last = strtol(p,&end,10);
+			if(end==p) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+		if(first<0 || last<first || last>=CPU_SETSIZE) {
+			errno = EINVAL;
+			return -1;
+		}
+		for(long cpu=first; cpu<=last; cpu++) {
+			CPU_SET(cpu,set);
+		}
+		p = end;
+		if(*p!=',') {
+			break;
+		}
+		p++;
+	}
+	if(*p) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+cpu_set_t * cpu_parse_sets(const char * sz, unsigned int * num) {
+	char * copy = strdup(sz);
+	cpu_set_t * sets = NULL;
+	*num = 0;
+	if(!copy) {
+		return NULL;
+	}
+	char * save;
+	for(char * tok = strtok_r(copy,":",&save); tok; tok = strtok_r(NULL,":",&save)) {
+		cpu_set_t * grown = realloc(sets,(*num+1)*sizeof(cpu_set_t));
+		if(grown) {
+			sets = grown;
+		}
+		if(!grown || cpu_parse_list(tok,&sets[*num])!=0) {
+			free(sets);
+			free(copy);
+			*num = 0;
+			return NULL;
+		}
+		(*num)++;
+	}
+	free(copy);
+	if(*num==0) {
+		errno = EINVAL;
+	}
+	return sets;
+}
+
+int cpu_nth(const cpu_set_t * set, unsigned int n) {
+	int count = CPU_COUNT(set);
+	if(count==0) {
+		return -1;
+	}
+	n %= count;
+	for(int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+		if(CPU_ISSET(cpu,set) && n--==0) {
+			return cpu;
+		}
+	}
+	return -1;
+}
+
+int cpu_node(int cpu) {
+	// The cpu directory has a "node<N>" link on NUMA systems
+	char path[64];
+	snprintf(path,sizeof(path),"/sys/devices/system/cpu/cpu%d",cpu);
+	DIR * dir = opendir(path);
+	if(!dir) {
+		return -1;
+	}
+	int node = -1;
+	struct dirent * de;
+	while((de = readdir(dir))) {
+		char * end;
+		if(strncmp(de->d_name,"node",4)==0 && de->d_name[4]) {
+			long l = strtol(de->d_name+4,&end,10);
+			if(!*end) {
+				node = (int)l;
+				break;
+			}
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+int cpu_pin_thread(pthread_t thread, const cpu_set_t * set) {
+	int rc = pthread_setaffinity_np(thread,sizeof(cpu_set_t),set);
+	if(rc!=0) {
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+int cpu_prefer_node(int node) {
+	if(node<0 || node>=(int)(8*sizeof(unsigned long))) {
+		errno = EINVAL;
+		return -1;
+	}
+	unsigned long mask = 1UL << node;
+	// No glibc wrapper
+	if(syscall(SYS_set_mempolicy,CPU_MPOL_PREFERRED,&mask,8*sizeof(mask))<0) {
+		return -1;
+	}
+	return 0;
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+
+UT_TEST_CASE(cpu_parse_list) {
+	cpu_set_t set;
+	ut_assert(cpu_parse_list("0-3,8,10-11",&set)==0);
+	ut_assert(CPU_COUNT(&set)==7);
+	ut_assert(CPU_ISSET(3,&set) && CPU_ISSET(8,&set) && !CPU_ISSET(9,&set) && CPU_ISSET(11,&set));
+	ut_assert(cpu_nth(&set,0)==0);
+	ut_assert(cpu_nth(&set,4)==8);
+	ut_assert(cpu_nth(&set,7)==0);
+	ut_assert(cpu_parse_list("2",&set)==0 && CPU_COUNT(&set)==1 && cpu_nth(&set,5)==2);
+
+	ut_assert(cpu_parse_list("",&set)<0);
+	ut_assert(cpu_parse_list("1,",&set)<0);
+	ut_assert(cpu_parse_list("3-1",&set)<0);
+	ut_assert(cpu_parse_list("a",&set)<0);
+	ut_assert(cpu_parse_list("1-",&set)<0);
+	ut_assert(cpu_parse_list("-1",&set)<0);
+	CPU_ZERO(&set);
+	ut_assert(cpu_nth(&set,0)==-1);
+
+	unsigned int num;
+	cpu_set_t * sets = cpu_parse_sets("0-1:2-3:4",&num);
+	ut_assert(sets && num==3);
+	ut_assert(CPU_COUNT(&sets[0])==2 && CPU_ISSET(3,&sets[1]) && cpu_nth(&sets[2],0)==4);
+	free(sets);
+	ut_assert(cpu_parse_sets("0:x",&num)==NULL && num==0);
+}
+
+static void * test_cpu_pinned(void * arg) {
+	if(cpu_pin_thread(pthread_self(),arg)!=0) {
+		return (void *)-1L;
+	}
+	return (void *)(long)sched_getcpu();
+}
+
+UT_TEST_CASE(cpu_pin_thread) {
+	// The first CPU we may run on (a cpuset may leave out CPU 0)
+	cpu_set_t set;
+	ut_assert(sched_getaffinity(0,sizeof(set),&set)==0);
+	int cpu_first = cpu_nth(&set,0);
+	CPU_ZERO(&set);
+	CPU_SET(cpu_first,&set);
+	// Pin a new thread, so that the test process keeps its affinity
+	pthread_t thread;
+	ut_assert(pthread_create(&thread,NULL,test_cpu_pinned,&set)==0);
+	void * cpu;
+	pthread_join(thread,&cpu);
+	ut_assert((long)cpu==cpu_first);
+	ut_assert(cpu_node(0)>=-1);
+	ut_assert(cpu_node(CPU_SETSIZE)==-1);
+	ut_assert(cpu_prefer_node(-1)<0 && errno==EINVAL);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
@@ -0,0 +1,42 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __CPU_H__
+#define __CPU_H__
+
+// cpu_set_t needs _GNU_SOURCE, defined before any system header is included
+#include <sched.h>
+#include <pthread.h>
+
+// CPU affinity and NUMA placement
+
+/*! \brief Parse a CPU list, e.g. "0-3,8,10-11".
+ *  \return 0 if successful, or -1 if the list is not valid.
+ */
+int cpu_parse_list(const char * sz, cpu_set_t * set);
+
+/*! \brief Parse CPU lists separated by ':', e.g. "0-3:4-7".
+ *  \return A (malloc'd) array of *num sets, or NULL if a list is not valid.
+ */
+cpu_set_t * cpu_parse_sets(const char * sz, unsigned int * num);
+
+/*! \brief The n-th CPU in a set, wrapping around.
+ *  \return The CPU, or -1 if the set is empty.
+ */
+int cpu_nth(const cpu_set_t * set, unsigned int n);
+
+/*! \brief The NUMA node of a CPU.
+ *  \return The node, or -1 if not known.
+ */
+int cpu_node(int cpu);
+
+/*! \brief Pin a thread to a set of CPUs.
+ *  \return 0 if successful, or -1 if something went wrong.
+ */
+int cpu_pin_thread(pthread_t thread, const cpu_set_t * set);
+
+/*! \brief Prefer memory on the given NUMA node for the calling thread's
+ *         future allocations (and threads it creates).
+ *  \return 0 if successful, or -1 if something went wrong.
+ */
+int cpu_prefer_node(int node);
+
+#endif // __CPU_H__
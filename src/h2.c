@@ -0,0 +1,1035 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "sz.h"
+#include "io.h"
+#include "adm.h"
+#include "hpack.h"
+#include "h2.h"
+
+#define H2_MAX_HEADER_BLOCK 65536
+#define H2_MAX_REQ_BODY (1024*1024)
+#define H2_IDLE_TIMEOUT_MS 60000
+
+const char * H_HTTP2_SETTINGS = "http2-settings";
+const char * HV_UPGRADE_H2C = "h2c";
+
+static const char RSP_101_H2C[] =
+	"HTTP/1.1 101 Switching Protocols\r\n"
+	"Connection: Upgrade\r\n"
+	"Upgrade: h2c\r\n"
+	"\r\n";
+
+typedef struct {
+	uint32_t id;        // 0 if the slot is free
+	bool end_stream;    // the client is done sending (half-closed remote)
+	bool admitted;      // owes adm_req_end
+	bool sending;       // response body remains to be sent
+	char * method;
+	char * path;
+	Http_Headers headers; // other request header fields
+	char * req_body;
+	size_t req_body_len;
+	Http_Response rsp;
+	size_t rsp_sent;
+	int64_t send_window;
+} H2_Stream;
+
+typedef struct {
+	int fd_in;
+	int fd_out;
+	const struct sockaddr * client_addr;
+	uint64_t sojourn_ns;
+	uint64_t requests;
+	Hpack_Table dec;
+	Hpack_Table enc;
+	H2_Stream streams[H2_MAX_STREAMS];
+	int rr;                      // where the next round of DATA frames starts
+	uint32_t last_stream_id;     // highest stream id opened by the client
+	int64_t send_window;         // connection flow-control window
+	uint32_t initial_window;     // the client's SETTINGS_INITIAL_WINDOW_SIZE
+	uint32_t max_frame;          // largest frame we'll send
+	bool goaway;                 // the client is going away
+	// Header block being assembled from HEADERS and CONTINUATION frames
+	unsigned char * hblock;
+	size_t hblock_len;
+	uint32_t hblock_stream;
+	bool hblock_end_stream;
+	unsigned char in[H2_DEFAULT_MAX_FRAME_SIZE];
+	unsigned char out[H2_FRAME_HEADER_LEN + H2_DEFAULT_MAX_FRAME_SIZE];
+} H2_Conn;
+
+static uint32_t get_u32(const unsigned char * p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(unsigned char * p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+void h2_pack_frame_header(const H2_Frame_Header * h, unsigned char * out) {
+	out[0] = h->length >> 16;
+	out[1] = h->length >> 8;
+	out[2] = h->length;
+	out[3] = h->type;
+	out[4] = h->flags;
+	put_u32(out+5,h->stream_id & 0x7fffffff);
+}
+
+void h2_unpack_frame_header(const unsigned char * in, H2_Frame_Header * h) {
+	h->length = ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | in[2];
+	h->type = in[3];
+	h->flags = in[4];
+	h->stream_id = get_u32(in+5) & 0x7fffffff;
+}
+
+static int write_all(int fd, const void * buff, size_t len) {
+	const unsigned char * p = buff;
+	while(len>0) {
+		ssize_t n = write(fd,p,len);
+		if(n<0 && errno==EINTR) {
+			continue;
+		}
+		if(n<=0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Write, hinting that more data follows right away
+static int write_more(int fd, const void * buff, size_t len) {
+#ifdef MSG_MORE
+	ssize_t n = send(fd,buff,len,MSG_MORE|MSG_NOSIGNAL);
+	if(n==len) {
+		return 0;
+	}
+	if(n>=0) {
+		return write_all(fd,(const unsigned char *)buff+n,len-n);
+	}
+	if(errno!=ENOTSOCK) {
+		return -1;
+	}
+#endif
+	return write_all(fd,buff,len);
+}
+
+int h2_write_frame(int fd, uint8_t type, uint8_t flags, uint32_t stream_id, const void * payload, size_t len) {
+	unsigned char hdr[H2_FRAME_HEADER_LEN];
+	H2_Frame_Header h = { .length = len, .type = type, .flags = flags, .stream_id = stream_id };
+	h2_pack_frame_header(&h,hdr);
+	struct iovec iov[2] = {
+		{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = (void *)payload, .iov_len = len },
+	};
+	ssize_t n;
+	while((n = writev(fd,iov,len>0?2:1))<0 && errno==EINTR);
+	if(n<0) {
+		return -1;
+	}
+	if(n<sizeof(hdr)) {
+		if(write_all(fd,hdr+n,sizeof(hdr)-n)<0) {
+			return -1;
+		}
+		n = sizeof(hdr);
+	}
+	return write_all(fd,(const unsigned char *)payload+(n-sizeof(hdr)),len-(n-sizeof(hdr)));
+}
+
+static int read_all(int fd, void * buff, size_t len) {
+	unsigned char * p = buff;
+	while(len>0) {
+		ssize_t n = read(fd,p,len);
+		if(n<0 && errno==EINTR) {
+			continue;
+		}
+		if(n<=0) {
+			if(n==0) {
+				errno = 0;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int h2_read_frame(int fd, H2_Frame_Header * h, unsigned char * payload, size_t payload_max) {
+	unsigned char hdr[H2_FRAME_HEADER_LEN];
+	if(read_all(fd,hdr,sizeof(hdr))<0) {
+		return -1;
+	}
+	h2_unpack_frame_header(hdr,h);
+	if(h->length>payload_max) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return read_all(fd,payload,h->length);
+}
+
+// Decode base64url (without padding), as used by the HTTP2-Settings header
+static ssize_t b64url_decode(const char * in, unsigned char * out, size_t out_len) {
+	uint32_t acc = 0;
+	int bits = 0;
+	size_t n = 0;
+	for(; *in && *in!='='; in++) {
+		int v;
+		char ch = *in;
+		if(ch>='A' && ch<='Z') {
+			v = ch - 'A';
+		} else if(ch>='a' && ch<='z') {
+			v = ch - 'a' + 26;
+		} else if(ch>='0' && ch<='9') {
+			v = ch - '0' + 52;
+		} else if(ch=='-') {
+			v = 62;
+		} else if(ch=='_') {
+			v = 63;
+		} else {
+			return -1;
+		}
+		acc = (acc << 6) | v;
+		bits += 6;
+		if(bits>=8) {
+			if(n>=out_len) {
+				return -1;
+			}
+			bits -= 8;
+			out[n++] = acc >> bits;
+		}
+	}
+	return n;
+}
+
+#define H2_MAX_SETTINGS_PAYLOAD 256
+
+bool h2_is_upgrade(const Http_Headers headers) {
+	const char * upgrade = ht_get(headers,H_UPGRADE);
+	const char * settings = ht_get(headers,H_HTTP2_SETTINGS);
+	if(!upgrade || !settings || !sz_equal_ignore_case(upgrade,HV_UPGRADE_H2C)) {
+		return false;
+	}
+	unsigned char payload[H2_MAX_SETTINGS_PAYLOAD];
+	ssize_t len = b64url_decode(settings,payload,sizeof(payload));
+	return len>=0 && len%6==0;
+}
+
+static int h2_send_settings(H2_Conn * c) {
+	unsigned char payload[6];
+	payload[0] = 0;
+	payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+	put_u32(payload+2,H2_MAX_STREAMS);
+	return h2_write_frame(c->fd_out,H2_SETTINGS,0,0,payload,sizeof(payload));
+}
+
+static int h2_send_window_update(H2_Conn * c, uint32_t stream_id, uint32_t increment) {
+	unsigned char payload[4];
+	put_u32(payload,increment);
+	return h2_write_frame(c->fd_out,H2_WINDOW_UPDATE,0,stream_id,payload,sizeof(payload));
+}
+
+static int h2_send_rst_stream(H2_Conn * c, uint32_t stream_id, H2_Error err) {
+	unsigned char payload[4];
+	put_u32(payload,err);
+	return h2_write_frame(c->fd_out,H2_RST_STREAM,0,stream_id,payload,sizeof(payload));
+}
+
+static int h2_send_goaway(H2_Conn * c, H2_Error err) {
+	unsigned char payload[8];
+	put_u32(payload,c->last_stream_id);
+	put_u32(payload+4,err);
+	return h2_write_frame(c->fd_out,H2_GOAWAY,0,0,payload,sizeof(payload));
+}
+
+static H2_Stream * h2_find_stream(H2_Conn * c, uint32_t id) {
+	for(int i=0; i<H2_MAX_STREAMS; i++) {
+		if(c->streams[i].id==id) {
+			return &c->streams[i];
+		}
+	}
+	return NULL;
+}
+
+static int h2_num_streams(const H2_Conn * c) {
+	int n = 0;
+	for(int i=0; i<H2_MAX_STREAMS; i++) {
+		n += c->streams[i].id!=0;
+	}
+	return n;
+}
+
+static void h2_close_stream(H2_Stream * st) {
+	if(st->admitted) {
+		adm_req_end();
+	}
+	http_response_free(&st->rsp);
+	free(st->method);
+	free(st->path);
+	if(st->headers) {
+		ht_free(st->headers);
+	}
+	free(st->req_body);
+	memset(st,0,sizeof(H2_Stream));
+	st->rsp.fd = -1;
+}
+
+// Apply the client's settings
+static H2_Error h2_apply_settings(H2_Conn * c, const unsigned char * p, size_t len) {
+	if(len%6!=0) {
+		return H2_FRAME_SIZE_ERROR;
+	}
+	for(size_t i=0; i<len; i+=6) {
+		uint16_t id = (p[i] << 8) | p[i+1];
+		uint32_t val = get_u32(p+i+2);
+		dlogf("HTTP/2 setting: %d=%u",id,val);
+		switch(id) {
+		case H2_SETTINGS_HEADER_TABLE_SIZE:
+			// We may use less than the client allows, but not more
+			if(val<c->enc.max_size_limit && hpack_table_resize(&c->enc,val)!=0) {
+				return H2_INTERNAL_ERROR;
+			}
+			break;
+		case H2_SETTINGS_ENABLE_PUSH:
+			if(val>1) {
+				return H2_PROTOCOL_ERROR;
+			}
+			break;
+		case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+			if(val>H2_MAX_WINDOW_SIZE) {
+				return H2_FLOW_CONTROL_ERROR;
+			}
+			int64_t delta = (int64_t)val - c->initial_window;
+			for(int s=0; s<H2_MAX_STREAMS; s++) {
+				if(c->streams[s].id) {
+					c->streams[s].send_window += delta;
+					if(c->streams[s].send_window>H2_MAX_WINDOW_SIZE) {
+						return H2_FLOW_CONTROL_ERROR;
+					}
+				}
+			}
+			c->initial_window = val;
+			} break;
+		case H2_SETTINGS_MAX_FRAME_SIZE:
+			if(val<H2_DEFAULT_MAX_FRAME_SIZE || val>0xffffff) {
+				return H2_PROTOCOL_ERROR;
+			}
+			// Our frame buffer is sized for the default
+			break;
+		default:
+			// Unknown settings are ignored
+			break;
+		}
+	}
+	return H2_NO_ERROR;
+}
+
+typedef struct {
+	char * method;
+	char * path;
+	Http_Headers headers;
+	bool malformed;
+} H2_Request_Headers;
+
+static void h2_free_request_headers(H2_Request_Headers * rh) {
+	free(rh->method);
+	free(rh->path);
+	if(rh->headers) {
+		ht_free(rh->headers);
+	}
+	memset(rh,0,sizeof(H2_Request_Headers));
+}
+
+static int h2_on_header(void * ctx, const char * name, size_t name_len, const char * value, size_t value_len) {
+	H2_Request_Headers * rh = ctx;
+	dlogf("HTTP/2 header: %s: %s",name,value);
+	for(size_t i=0; i<name_len; i++) {
+		if(name[i]>='A' && name[i]<='Z') {
+			rh->malformed = true;
+		}
+	}
+	if(strcmp(name,":method")==0) {
+		free(rh->method);
+		rh->method = strdup(value);
+	} else if(strcmp(name,":path")==0) {
+		free(rh->path);
+		rh->path = strdup(value);
+	} else if(name[0]!=':') {
+		// Like HTTP/1.1 headers, with the value allocated together with the name
+		if(!rh->headers) {
+			rh->headers = ht_create(0,NULL,free,NULL);
+		}
+		char * field = malloc(name_len+value_len+2);
+		memcpy(field,name,name_len+1);
+		memcpy(field+name_len+1,value,value_len+1);
+		ht_put(rh->headers,field,field+name_len+1);
+	}
+	return 0;
+}
+
+static int h2_send_headers(H2_Conn * c, H2_Stream * st, bool end_stream) {
+	unsigned char block[512];
+	char status[8];
+	char content_len[24];
+	snprintf(status,sizeof(status),"%d",st->rsp.code);
+	const char * fields[][2] = {
+		{ ":status", status },
+		{ "content-length", NULL },
+		{ "content-type", st->rsp.content_type },
+		{ "content-encoding", st->rsp.content_encoding },
+		{ "etag", st->rsp.etag },
+		{ "vary", st->rsp.vary_encoding ? "accept-encoding" : NULL },
+	};
+	if(st->rsp.content_len>0) {
+		snprintf(content_len,sizeof(content_len),"%zu",st->rsp.content_len);
+		fields[1][1] = content_len;
+	}
+	ssize_t n = 0;
+	for(int i=0; i<sizeof(fields)/sizeof(fields[0]); i++) {
+		if(!fields[i][1]) {
+			continue;
+		}
+		ssize_t m = hpack_encode(&c->enc,block+n,sizeof(block)-n,fields[i][0],fields[i][1]);
+		if(m<0) {
+			return -1;
+		}
+		n += m;
+	}
+	return h2_write_frame(c->fd_out,H2_HEADERS,H2_FLAG_END_HEADERS|(end_stream?H2_FLAG_END_STREAM:0),st->id,block,n);
+}
+
+// The request is complete; resolve the response and send its headers. The
+// body is sent by h2_send_data.
+static int h2_dispatch(H2_Conn * c, H2_Stream * st, const Http_Headers headers) {
+	int method = http_method(st->method);
+	ilogf("HTTP/2 request: stream=%u method=%s(%d) uri=%s",st->id,st->method,method,st->path);
+	// Only the first request has waited in the accept queue
+	uint64_t sojourn_ns = c->requests++==0 ? c->sojourn_ns : 0;
+	int rl_route_ix;
+	int status = http_admit(st->path,false,c->client_addr,sojourn_ns,&rl_route_ix);
+	if(status!=0) {
+		memset(&st->rsp,0,sizeof(Http_Response));
+		st->rsp.fd = -1;
+		st->rsp.code = status;
+	} else {
+		st->admitted = true;
+		http_resolve(method,st->path,headers,st->req_body,st->req_body_len,&st->rsp);
+	}
+	ilogf("HTTP/2 response: stream=%u status=%d",st->id,st->rsp.code);
+	st->sending = st->rsp.content_len>0;
+	if(h2_send_headers(c,st,!st->sending)<0) {
+		return -1;
+	}
+	if(!st->sending) {
+		h2_close_stream(st);
+	}
+	return 0;
+}
+
+static H2_Stream * h2_open_stream(H2_Conn * c, uint32_t id) {
+	H2_Stream * st = h2_find_stream(c,0);
+	if(st) {
+		st->id = id;
+		st->send_window = c->initial_window;
+	}
+	return st;
+}
+
+// A complete header block has arrived
+static H2_Error h2_on_header_block(H2_Conn * c) {
+	uint32_t id = c->hblock_stream;
+	H2_Request_Headers rh = { 0 };
+	// Always decode, to keep the dynamic table in sync
+	if(hpack_decode(&c->dec,c->hblock,c->hblock_len,h2_on_header,&rh)!=0) {
+		h2_free_request_headers(&rh);
+		return H2_COMPRESSION_ERROR;
+	}
+	H2_Stream * st = h2_find_stream(c,id);
+	H2_Error err = H2_NO_ERROR;
+	if(st) {
+		// Trailers
+		h2_free_request_headers(&rh);
+		if(st->end_stream) {
+			return H2_STREAM_CLOSED;
+		}
+		if(!c->hblock_end_stream) {
+			return H2_PROTOCOL_ERROR;
+		}
+		st->end_stream = true;
+		return h2_dispatch(c,st,st->headers)<0 ? H2_INTERNAL_ERROR : H2_NO_ERROR;
+	}
+	if(id<=c->last_stream_id) {
+		err = H2_STREAM_CLOSED;
+	} else if(c->goaway) {
+		// ignore
+	} else if(!(st = h2_open_stream(c,id))) {
+		h2_send_rst_stream(c,id,H2_REFUSED_STREAM);
+	} else if(rh.malformed || !rh.method || !rh.path) {
+		h2_send_rst_stream(c,id,H2_PROTOCOL_ERROR);
+		h2_close_stream(st);
+	} else {
+		st->method = rh.method;
+		st->path = rh.path;
+		st->headers = rh.headers;
+		rh.method = rh.path = NULL;
+		rh.headers = NULL;
+		st->end_stream = c->hblock_end_stream;
+		if(st->end_stream && h2_dispatch(c,st,st->headers)<0) {
+			err = H2_INTERNAL_ERROR;
+		}
+	}
+	if(id>c->last_stream_id) {
+		c->last_stream_id = id;
+	}
+	h2_free_request_headers(&rh);
+	return err;
+}
+
+static H2_Error h2_append_header_block(H2_Conn * c, const unsigned char * p, size_t len, bool end_headers) {
+	if(c->hblock_len + len > H2_MAX_HEADER_BLOCK) {
+		return H2_ENHANCE_YOUR_CALM;
+	}
+	// A header block can't be skipped (it updates the HPACK table), so failing
+	// to keep it fails the connection
+	unsigned char * hblock = realloc(c->hblock,c->hblock_len + len);
+	if(!hblock) {
+		elogf("Failed to allocate header block: len=%zu",c->hblock_len + len);
+		return H2_INTERNAL_ERROR;
+	}
+	c->hblock = hblock;
+	memcpy(c->hblock+c->hblock_len,p,len);
+	c->hblock_len += len;
+	if(!end_headers) {
+		return H2_NO_ERROR;
+	}
+	H2_Error err = h2_on_header_block(c);
+	c->hblock_stream = 0;
+	c->hblock_len = 0;
+	return err;
+}
+
+// Strip padding from DATA and HEADERS payloads
+static bool h2_unpad(const H2_Frame_Header * h, const unsigned char ** p, size_t * len) {
+	if(h->flags & H2_FLAG_PADDED) {
+		if(*len<1 || (*p)[0] >= *len) {
+			return false;
+		}
+		*len -= 1 + (*p)[0];
+		*p += 1;
+	}
+	return true;
+}
+
+static H2_Error h2_on_frame(H2_Conn * c, const H2_Frame_Header * h) {
+	const unsigned char * p = c->in;
+	size_t len = h->length;
+	if(c->hblock_stream && (h->type!=H2_CONTINUATION || h->stream_id!=c->hblock_stream)) {
+		// A header block must not be interleaved with other frames
+		return H2_PROTOCOL_ERROR;
+	}
+	switch(h->type) {
+	case H2_SETTINGS: {
+		if(h->stream_id!=0) {
+			return H2_PROTOCOL_ERROR;
+		}
+		if(h->flags & H2_FLAG_ACK) {
+			return len==0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+		}
+		H2_Error err = h2_apply_settings(c,p,len);
+		if(err==H2_NO_ERROR && h2_write_frame(c->fd_out,H2_SETTINGS,H2_FLAG_ACK,0,NULL,0)<0) {
+			return H2_INTERNAL_ERROR;
+		}
+		return err; }
+	case H2_PING:
+		if(h->stream_id!=0) {
+			return H2_PROTOCOL_ERROR;
+		}
+		if(len!=8) {
+			return H2_FRAME_SIZE_ERROR;
+		}
+		if(!(h->flags & H2_FLAG_ACK) && h2_write_frame(c->fd_out,H2_PING,H2_FLAG_ACK,0,p,len)<0) {
+			return H2_INTERNAL_ERROR;
+		}
+		return H2_NO_ERROR;
+	case H2_GOAWAY:
+		ilogf("HTTP/2 client is going away");
+		c->goaway = true;
+		return H2_NO_ERROR;
+	case H2_WINDOW_UPDATE: {
+		if(len!=4) {
+			return H2_FRAME_SIZE_ERROR;
+		}
+		uint32_t increment = get_u32(p) & 0x7fffffff;
+		if(h->stream_id==0) {
+			if(increment==0) {
+				return H2_PROTOCOL_ERROR;
+			}
+			c->send_window += increment;
+			return c->send_window>H2_MAX_WINDOW_SIZE ? H2_FLOW_CONTROL_ERROR : H2_NO_ERROR;
+		}
+		H2_Stream * st = h2_find_stream(c,h->stream_id);
+		if(st) {
+			st->send_window += increment;
+			if(increment==0 || st->send_window>H2_MAX_WINDOW_SIZE) {
+				h2_send_rst_stream(c,st->id,increment==0?H2_PROTOCOL_ERROR:H2_FLOW_CONTROL_ERROR);
+				h2_close_stream(st);
+			}
+		}
+		return H2_NO_ERROR; }
+	case H2_RST_STREAM: {
+		if(h->stream_id==0) {
+			return H2_PROTOCOL_ERROR;
+		}
+		if(len!=4) {
+			return H2_FRAME_SIZE_ERROR;
+		}
+		H2_Stream * st = h2_find_stream(c,h->stream_id);
+		if(st) {
+			ilogf("HTTP/2 stream reset by client: stream=%u, error=%u",st->id,get_u32(p));
+			h2_close_stream(st);
+		}
+		return H2_NO_ERROR; }
+	case H2_PRIORITY:
+		// Deprecated by RFC 9113; streams are served round-robin
+		if(h->stream_id==0) {
+			return H2_PROTOCOL_ERROR;
+		}
+		return len==5 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+	case H2_HEADERS:
+		if(h->stream_id==0 || (h->stream_id & 1)==0) {
+			return H2_PROTOCOL_ERROR;
+		}
+		if(!h2_unpad(h,&p,&len)) {
+			return H2_PROTOCOL_ERROR;
+		}
+		if(h->flags & H2_FLAG_PRIORITY) {
+			if(len<5) {
+				return H2_FRAME_SIZE_ERROR;
+			}
+			p += 5;
+			len -= 5;
+		}
+		c->hblock_stream = h->stream_id;
+		c->hblock_end_stream = h->flags & H2_FLAG_END_STREAM;
+		return h2_append_header_block(c,p,len,h->flags & H2_FLAG_END_HEADERS);
+	case H2_CONTINUATION:
+		if(!c->hblock_stream) {
+			return H2_PROTOCOL_ERROR;
+		}
+		return h2_append_header_block(c,p,len,h->flags & H2_FLAG_END_HEADERS);
+	case H2_DATA: {
+		if(h->stream_id==0) {
+			return H2_PROTOCOL_ERROR;
+		}
+		// We consume data as soon as it arrives, so the connection window is
+		// replenished right away (including any padding)
+		if(len>0 && h2_send_window_update(c,0,len)<0) {
+			return H2_INTERNAL_ERROR;
+		}
+		if(!h2_unpad(h,&p,&len)) {
+			return H2_PROTOCOL_ERROR;
+		}
+		H2_Stream * st = h2_find_stream(c,h->stream_id);
+		if(!st) {
+			if(h->stream_id>c->last_stream_id) {
+				return H2_PROTOCOL_ERROR;
+			}
+			h2_send_rst_stream(c,h->stream_id,H2_STREAM_CLOSED);
+			return H2_NO_ERROR;
+		}
+		if(st->end_stream || st->req_body_len + len > H2_MAX_REQ_BODY) {
+			h2_send_rst_stream(c,st->id,st->end_stream?H2_STREAM_CLOSED:H2_ENHANCE_YOUR_CALM);
+			h2_close_stream(st);
+			return H2_NO_ERROR;
+		}
+		char * req_body = realloc(st->req_body,st->req_body_len + len);
+		if(!req_body) {
+			elogf("Failed to allocate request body: len=%zu",st->req_body_len + len);
+			h2_send_rst_stream(c,st->id,H2_INTERNAL_ERROR);
+			h2_close_stream(st);
+			return H2_NO_ERROR;
+		}
+		st->req_body = req_body;
+		memcpy(st->req_body+st->req_body_len,p,len);
+		st->req_body_len += len;
+		if(h->flags & H2_FLAG_END_STREAM) {
+			st->end_stream = true;
+			return h2_dispatch(c,st,st->headers)<0 ? H2_INTERNAL_ERROR : H2_NO_ERROR;
+		}
+		if(h->length>0 && h2_send_window_update(c,st->id,h->length)<0) {
+			return H2_INTERNAL_ERROR;
+		}
+		return H2_NO_ERROR; }
+	case H2_PUSH_PROMISE:
+		// Clients can't push
+		return H2_PROTOCOL_ERROR;
+	default:
+		// Unknown frame types are ignored
+		return H2_NO_ERROR;
+	}
+}
+
+static bool h2_can_send(const H2_Conn * c) {
+	if(c->send_window<=0) {
+		return false;
+	}
+	for(int i=0; i<H2_MAX_STREAMS; i++) {
+		if(c->streams[i].sending && c->streams[i].send_window>0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Send (at most) one DATA frame for each stream that has response data, going
+// round-robin, so that all responses make progress.
+static int h2_send_data(H2_Conn * c) {
+	for(int k=0; k<H2_MAX_STREAMS && c->send_window>0; k++) {
+		H2_Stream * st = &c->streams[(c->rr + k) % H2_MAX_STREAMS];
+		if(!st->sending || st->send_window<=0) {
+			continue;
+		}
+		size_t n = st->rsp.content_len - st->rsp_sent;
+		n = n < c->max_frame ? n : c->max_frame;
+		n = n < st->send_window ? n : st->send_window;
+		n = n < c->send_window ? n : c->send_window;
+		off_t offset = st->rsp.fd_offset + st->rsp_sent;
+		bool done = st->rsp_sent+n==st->rsp.content_len;
+		H2_Frame_Header h = { .length = n, .type = H2_DATA, .flags = done?H2_FLAG_END_STREAM:0, .stream_id = st->id };
+		h2_pack_frame_header(&h,c->out);
+		if(st->rsp.body) {
+			memcpy(c->out+H2_FRAME_HEADER_LEN,st->rsp.body+st->rsp_sent,n);
+			if(write_all(c->fd_out,c->out,H2_FRAME_HEADER_LEN + n)<0) {
+				return -1;
+			}
+		} else {
+			// Send the frame header, and let the kernel copy the payload from
+			// the file. A failure part way through a frame ends the connection.
+			if(write_more(c->fd_out,c->out,H2_FRAME_HEADER_LEN)<0 || io_send_file_range(c->fd_out,st->rsp.fd,offset,n)!=n) {
+				wlogf("Failed to send response body: %s",strerror(errno));
+				return -1;
+			}
+		}
+		st->rsp_sent += n;
+		st->send_window -= n;
+		c->send_window -= n;
+		if(done) {
+			h2_close_stream(st);
+		}
+	}
+	c->rr = (c->rr + 1) % H2_MAX_STREAMS;
+	return 0;
+}
+
+static H2_Conn * h2_conn_create(int fd_in, int fd_out, const struct sockaddr * client_addr, uint64_t sojourn_ns) {
+	H2_Conn * c = calloc(1,sizeof(H2_Conn));
+	c->fd_in = fd_in;
+	c->fd_out = fd_out;
+	c->client_addr = client_addr;
+	c->sojourn_ns = sojourn_ns;
+	c->send_window = H2_DEFAULT_WINDOW_SIZE;
+	c->initial_window = H2_DEFAULT_WINDOW_SIZE;
+	c->max_frame = H2_DEFAULT_MAX_FRAME_SIZE;
+	hpack_table_init(&c->dec,HPACK_DEFAULT_TABLE_SIZE);
+	hpack_table_init(&c->enc,HPACK_DEFAULT_TABLE_SIZE);
+	for(int i=0; i<H2_MAX_STREAMS; i++) {
+		c->streams[i].rsp.fd = -1;
+	}
+	return c;
+}
+
+static void h2_conn_free(H2_Conn * c) {
+	for(int i=0; i<H2_MAX_STREAMS; i++) {
+		if(c->streams[i].id) {
+			h2_close_stream(&c->streams[i]);
+		}
+	}
+	hpack_table_free(&c->dec);
+	hpack_table_free(&c->enc);
+	free(c->hblock);
+	free(c);
+}
+
+// Turn the HTTP/1.1 request that asked for the upgrade into stream 1
+static int h2_upgrade(H2_Conn * c, const H2_Upgrade * upgrade) {
+	unsigned char settings[H2_MAX_SETTINGS_PAYLOAD];
+	ssize_t settings_len = b64url_decode(upgrade->settings,settings,sizeof(settings));
+	if(settings_len<0 || h2_apply_settings(c,settings,settings_len)!=H2_NO_ERROR) {
+		return -1;
+	}
+	if(write_all(c->fd_out,RSP_101_H2C,sizeof(RSP_101_H2C)-1)<0 || h2_send_settings(c)<0) {
+		return -1;
+	}
+	char preface[H2_PREFACE_LEN];
+	if(read_all(c->fd_in,preface,sizeof(preface))<0 || memcmp(preface,H2_PREFACE,H2_PREFACE_LEN)!=0) {
+		wlogf("Invalid HTTP/2 connection preface");
+		return -1;
+	}
+	H2_Stream * st = h2_open_stream(c,1);
+	c->last_stream_id = 1;
+	st->end_stream = true;
+	st->method = strdup(upgrade->method);
+	st->path = strdup(upgrade->uri);
+	return h2_dispatch(c,st,upgrade->headers);
+}
+
+int h2_serve(int fd_in, int fd_out, const struct sockaddr * client_addr, uint64_t sojourn_ns, const H2_Upgrade * upgrade) {
+	H2_Conn * c = h2_conn_create(fd_in,fd_out,client_addr,sojourn_ns);
+	int ret_code = 0;
+	if(upgrade) {
+		ilogf("Upgrading connection to HTTP/2");
+		if(h2_upgrade(c,upgrade)<0) {
+			h2_conn_free(c);
+			return -1;
+		}
+	} else if(h2_send_settings(c)<0) {
+		h2_conn_free(c);
+		return -1;
+	}
+	for(;;) {
+		if(c->goaway && h2_num_streams(c)==0) {
+			break;
+		}
+		bool can_send = h2_can_send(c);
+		struct pollfd pfd = { .fd = c->fd_in, .events = POLLIN };
+		int n = poll(&pfd,1,can_send?0:H2_IDLE_TIMEOUT_MS);
+		if(n<0 && errno!=EINTR) {
+			ret_code = -1;
+			break;
+		}
+		if(n==0 && !can_send) {
+			ilogf("HTTP/2 connection is idle; closing");
+			h2_send_goaway(c,H2_NO_ERROR);
+			break;
+		}
+		if(n>0) {
+			H2_Frame_Header h;
+			if(h2_read_frame(c->fd_in,&h,c->in,sizeof(c->in))<0) {
+				if(errno==EMSGSIZE) {
+					h2_send_goaway(c,H2_FRAME_SIZE_ERROR);
+					ret_code = -1;
+				} else if(errno) {
+					wlogf("Failed to read HTTP/2 frame: %s",strerror(errno));
+					ret_code = -1;
+				}
+				break;
+			}
+			dlogf("HTTP/2 frame: type=%d flags=0x%x stream=%u length=%u",h.type,h.flags,h.stream_id,h.length);
+			H2_Error err = h2_on_frame(c,&h);
+			if(err!=H2_NO_ERROR) {
+				wlogf("HTTP/2 connection error: %d",err);
+				h2_send_goaway(c,err);
+				ret_code = -1;
+				break;
+			}
+		}
+		if(can_send && h2_send_data(c)<0) {
+			wlogf("Failed to write HTTP/2 frame: %s",strerror(errno));
+			ret_code = -1;
+			break;
+		}
+	}
+	h2_conn_free(c);
+	return ret_code;
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ut.h"
+
+typedef struct {
+	int fd;
+	int status;
+} Test_H2_Server;
+
+static void * test_h2_server(void * arg) {
+	Test_H2_Server * ts = arg;
+	ts->status = http_client_connect(ts->fd,ts->fd,NULL);
+	return NULL;
+}
+
+static int test_h2_status(void * ctx, const char * name, size_t name_len, const char * value, size_t value_len) {
+	if(strcmp(name,":status")==0) {
+		*(int *)ctx = atoi(value);
+	}
+	return 0;
+}
+
+typedef struct {
+	int status;
+	size_t body_len;
+	bool done;
+} Test_H2_Response;
+
+// Read frames until all responses are complete; returns the number of frames
+// read. Sends WINDOW_UPDATEs of window_update bytes, when non-zero, after each
+// DATA frame.
+static int test_h2_read_responses(int fd, Hpack_Table * dec, Test_H2_Response * rsps, int num_rsps, uint32_t window_update) {
+	unsigned char payload[H2_DEFAULT_MAX_FRAME_SIZE];
+	H2_Frame_Header h;
+	int frames = 0;
+	int pending = num_rsps;
+	while(pending>0 && h2_read_frame(fd,&h,payload,sizeof(payload))==0) {
+		frames++;
+		Test_H2_Response * rsp = (h.stream_id>0 && (h.stream_id-1)/2<num_rsps) ? &rsps[(h.stream_id-1)/2] : NULL;
+		if(h.type==H2_HEADERS && rsp) {
+			ut_assert(hpack_decode(dec,payload,h.length,test_h2_status,&rsp->status)==0);
+		} else if(h.type==H2_DATA && rsp) {
+			rsp->body_len += h.length;
+			if(window_update && !(h.flags & H2_FLAG_END_STREAM)) {
+				unsigned char inc[4];
+				put_u32(inc,window_update);
+				ut_assert(h2_write_frame(fd,H2_WINDOW_UPDATE,0,h.stream_id,inc,4)==0);
+				ut_assert(h2_write_frame(fd,H2_WINDOW_UPDATE,0,0,inc,4)==0);
+			}
+		} else if(h.type==H2_GOAWAY) {
+			break;
+		}
+		if(rsp && (h.type==H2_HEADERS || h.type==H2_DATA) && (h.flags & H2_FLAG_END_STREAM)) {
+			rsp->done = true;
+			pending--;
+		}
+	}
+	return frames;
+}
+
+static void test_h2_request(int fd, Hpack_Table * enc, uint32_t stream_id, const char * path) {
+	unsigned char block[256];
+	ssize_t n = 0;
+	n += hpack_encode(enc,block+n,sizeof(block)-n,":method","GET");
+	n += hpack_encode(enc,block+n,sizeof(block)-n,":scheme","http");
+	n += hpack_encode(enc,block+n,sizeof(block)-n,":path",path);
+	n += hpack_encode(enc,block+n,sizeof(block)-n,":authority","localhost");
+	ut_assert(h2_write_frame(fd,H2_HEADERS,H2_FLAG_END_HEADERS|H2_FLAG_END_STREAM,stream_id,block,n)==0);
+}
+
+static size_t test_file_size(const char * path) {
+	struct stat s;
+	ut_assert(stat(path,&s)==0);
+	return s.st_size;
+}
+
+static void test_h2_multiplexing(uint32_t initial_window) {
+	ut_assert(http_init("./web")==0);
+	int sv[2];
+	ut_assert(socketpair(AF_UNIX,SOCK_STREAM,0,sv)==0);
+	Test_H2_Server ts = { .fd = sv[1] };
+	pthread_t t;
+	ut_assert(pthread_create(&t,NULL,test_h2_server,&ts)==0);
+
+	Hpack_Table enc, dec;
+	hpack_table_init(&enc,HPACK_DEFAULT_TABLE_SIZE);
+	hpack_table_init(&dec,HPACK_DEFAULT_TABLE_SIZE);
+	ut_assert(write(sv[0],H2_PREFACE,H2_PREFACE_LEN)==H2_PREFACE_LEN);
+	unsigned char settings[6] = { 0, H2_SETTINGS_INITIAL_WINDOW_SIZE };
+	put_u32(settings+2,initial_window);
+	ut_assert(h2_write_frame(sv[0],H2_SETTINGS,0,0,settings,sizeof(settings))==0);
+	test_h2_request(sv[0],&enc,1,"/index.html");
+	test_h2_request(sv[0],&enc,3,"/");
+	test_h2_request(sv[0],&enc,5,"/not-found");
+	test_h2_request(sv[0],&enc,7,"/ws_client.js");
+
+	Test_H2_Response rsps[4] = { { 0 } };
+	int frames = test_h2_read_responses(sv[0],&dec,rsps,4,initial_window);
+	ut_assert(rsps[0].status==200 && rsps[0].body_len==test_file_size("web/index.html"));
+	ut_assert(rsps[1].status==200 && rsps[1].body_len==test_file_size("web/index.html"));
+	ut_assert(rsps[2].status==404 && rsps[2].body_len==0);
+	ut_assert(rsps[3].status==200 && rsps[3].body_len==test_file_size("web/ws_client.js"));
+	ut_assert(rsps[0].done && rsps[1].done && rsps[2].done && rsps[3].done);
+	// With a small window, every DATA frame is at most one window in size
+	ut_assert(initial_window>=H2_DEFAULT_MAX_FRAME_SIZE
+		|| frames > (int)(rsps[3].body_len / initial_window));
+	// Indexed the second time around
+	ut_assert(dec.count>0);
+
+	unsigned char goaway[8] = { 0 };
+	ut_assert(h2_write_frame(sv[0],H2_GOAWAY,0,0,goaway,sizeof(goaway))==0);
+	pthread_join(t,NULL);
+	ut_assert(ts.status==0);
+	close(sv[0]);
+	close(sv[1]);
+	hpack_table_free(&enc);
+	hpack_table_free(&dec);
+}
+
+UT_TEST_CASE(h2_prior_knowledge) {
+	test_h2_multiplexing(H2_DEFAULT_WINDOW_SIZE);
+}
+
+UT_TEST_CASE(h2_flow_control) {
+	test_h2_multiplexing(1000);
+}
+
+UT_TEST_CASE(h2_upgrade) {
+	ut_assert(http_init("./web")==0);
+	int sv[2];
+	ut_assert(socketpair(AF_UNIX,SOCK_STREAM,0,sv)==0);
+	Test_H2_Server ts = { .fd = sv[1] };
+	pthread_t t;
+	ut_assert(pthread_create(&t,NULL,test_h2_server,&ts)==0);
+	// HTTP2-Settings: SETTINGS_MAX_CONCURRENT_STREAMS=100, SETTINGS_INITIAL_WINDOW_SIZE=65535
+	static const char req[] =
+		"GET /index.html HTTP/1.1\r\n"
+		"Host: localhost\r\n"
+		"Connection: Upgrade, HTTP2-Settings\r\n"
+		"Upgrade: h2c\r\n"
+		"HTTP2-Settings: AAMAAABkAAQAAP__\r\n"
+		"\r\n";
+	ut_assert(write(sv[0],req,sizeof(req)-1)==sizeof(req)-1);
+	char rsp_101[sizeof(RSP_101_H2C)];
+	ut_assert(read_all(sv[0],rsp_101,sizeof(RSP_101_H2C)-1)==0);
+	ut_assert(memcmp(rsp_101,RSP_101_H2C,sizeof(RSP_101_H2C)-1)==0);
+	ut_assert(write(sv[0],H2_PREFACE,H2_PREFACE_LEN)==H2_PREFACE_LEN);
+	ut_assert(h2_write_frame(sv[0],H2_SETTINGS,0,0,NULL,0)==0);
+
+	Hpack_Table dec;
+	hpack_table_init(&dec,HPACK_DEFAULT_TABLE_SIZE);
+	Test_H2_Response rsp = { 0 };
+	test_h2_read_responses(sv[0],&dec,&rsp,1,0);
+	ut_assert(rsp.done && rsp.status==200 && rsp.body_len==test_file_size("web/index.html"));
+
+	// A protocol error ends the connection
+	ut_assert(h2_write_frame(sv[0],H2_PUSH_PROMISE,0,2,NULL,0)==0);
+	pthread_join(t,NULL);
+	ut_assert(ts.status!=0);
+	close(sv[0]);
+	close(sv[1]);
+	hpack_table_free(&dec);
+}
+
+UT_TEST_CASE(h2_frame_codec) {
+	unsigned char buff[H2_FRAME_HEADER_LEN];
+	H2_Frame_Header h = { .length = 0x123456, .type = H2_HEADERS, .flags = H2_FLAG_END_HEADERS, .stream_id = 0x80000001 };
+	h2_pack_frame_header(&h,buff);
+	H2_Frame_Header h2;
+	h2_unpack_frame_header(buff,&h2);
+	ut_assert(h2.length==0x123456 && h2.type==H2_HEADERS && h2.flags==H2_FLAG_END_HEADERS);
+	ut_assert(h2.stream_id==1); // reserved bit is ignored
+
+	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
+	ut_assert(!h2_is_upgrade(headers));
+	ht_put(headers,(char *)H_UPGRADE,"h2c");
+	ht_put(headers,(char *)H_HTTP2_SETTINGS,"AAMAAABkAAQAAP__");
+	ut_assert(h2_is_upgrade(headers));
+	ht_put(headers,(char *)H_HTTP2_SETTINGS,"AAMAAABk$");
+	ut_assert(!h2_is_upgrade(headers));
+	ht_put(headers,(char *)H_HTTP2_SETTINGS,"AAMA"); // not a multiple of 6 bytes
+	ut_assert(!h2_is_upgrade(headers));
+	ht_free(headers);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
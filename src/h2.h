@@ -0,0 +1,123 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __H2_H__
+#define __H2_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include "http.h"
+
+// HTTP/2
+// See: https://datatracker.ietf.org/doc/html/rfc9113
+
+// The client connection preface. An HTTP/1.1 request parser sees the request
+// line "PRI * HTTP/2.0", followed by the rest of the preface.
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_PREFACE_REQ_LINE "PRI * HTTP/2.0"
+#define H2_PREFACE_REST "\r\nSM\r\n\r\n"
+#define H2_PREFACE_REST_LEN 8
+
+#define H2_FRAME_HEADER_LEN 9
+#define H2_DEFAULT_MAX_FRAME_SIZE 16384
+#define H2_DEFAULT_WINDOW_SIZE 65535
+#define H2_MAX_WINDOW_SIZE 0x7fffffff
+#define H2_MAX_STREAMS 100 // max concurrent streams per connection
+
+extern const char * H_HTTP2_SETTINGS;
+extern const char * HV_UPGRADE_H2C;
+
+typedef enum {
+	H2_DATA = 0,
+	H2_HEADERS,
+	H2_PRIORITY,
+	H2_RST_STREAM,
+	H2_SETTINGS,
+	H2_PUSH_PROMISE,
+	H2_PING,
+	H2_GOAWAY,
+	H2_WINDOW_UPDATE,
+	H2_CONTINUATION,
+} H2_Frame_Type;
+
+// Frame flags
+#define H2_FLAG_END_STREAM  0x01
+#define H2_FLAG_ACK         0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED      0x08
+#define H2_FLAG_PRIORITY    0x20
+
+typedef enum {
+	H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+	H2_SETTINGS_ENABLE_PUSH,
+	H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+	H2_SETTINGS_INITIAL_WINDOW_SIZE,
+	H2_SETTINGS_MAX_FRAME_SIZE,
+	H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+} H2_Setting;
+
+typedef enum {
+	H2_NO_ERROR = 0,
+	H2_PROTOCOL_ERROR,
+	H2_INTERNAL_ERROR,
+	H2_FLOW_CONTROL_ERROR,
+	H2_SETTINGS_TIMEOUT,
+	H2_STREAM_CLOSED,
+	H2_FRAME_SIZE_ERROR,
+	H2_REFUSED_STREAM,
+	H2_CANCEL,
+	H2_COMPRESSION_ERROR,
+	H2_CONNECT_ERROR,
+	H2_ENHANCE_YOUR_CALM,
+	H2_INADEQUATE_SECURITY,
+	H2_HTTP_1_1_REQUIRED,
+} H2_Error;
+
+typedef struct {
+	uint32_t length;
+	uint8_t type;
+	uint8_t flags;
+	uint32_t stream_id;
+} H2_Frame_Header;
+
+void h2_pack_frame_header(const H2_Frame_Header * h, unsigned char * out);
+void h2_unpack_frame_header(const unsigned char * in, H2_Frame_Header * h);
+
+/*! \brief Write a complete frame.
+ *  \return 0 if successful, or -1 if something went wrong.
+ */
+int h2_write_frame(int fd, uint8_t type, uint8_t flags, uint32_t stream_id, const void * payload, size_t len);
+
+/*! \brief Read a complete frame (blocking).
+ *  \return 0 if successful, or -1 on EOF or error. errno is set to EMSGSIZE
+ *          if the frame is larger than payload_max.
+ */
+int h2_read_frame(int fd, H2_Frame_Header * h, unsigned char * payload, size_t payload_max);
+
+/*! \brief Does the request ask to be upgraded to HTTP/2 over cleartext (h2c),
+ *         with a valid HTTP2-Settings header?
+ */
+bool h2_is_upgrade(const Http_Headers headers);
+
+/*! \brief The HTTP/1.1 request that asked for an h2c upgrade. It becomes stream 1.
+ */
+typedef struct {
+	const char * method;
+	const char * uri;
+	const char * settings; // value of the HTTP2-Settings header
+	Http_Headers headers;
+} H2_Upgrade;
+
+/*! \brief Serve an HTTP/2 connection until the client goes away. Requests are
+ *         resolved like HTTP/1.1 requests, and their responses are sent
+ *         concurrently, round-robin between streams, subject to flow control.
+ *
+ * \param upgrade If not NULL, the connection is upgraded from HTTP/1.1 (the
+ *                101 response is sent here); otherwise the caller has already
+ *                consumed the connection preface.
+ * \param sojourn_ns Queue delay experienced by the connection's first request.
+ * \return 0 if the connection ended normally, -1 if something went wrong.
+ */
+int h2_serve(int fd_in, int fd_out, const struct sockaddr * client_addr, uint64_t sojourn_ns, const H2_Upgrade * upgrade);
+
+#endif // __H2_H__
@@ -0,0 +1,720 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "hpack.h"
+
+#define E(N,V) { N, V, sizeof(N)-1, sizeof(V)-1 }
+// See: https://datatracker.ietf.org/doc/html/rfc7541#appendix-A
+static const Hpack_Entry HPACK_STATIC_TABLE[HPACK_STATIC_TABLE_LEN] = {
+	E(":authority",""),
+	E(":method","GET"),
+	E(":method","POST"),
+	E(":path","/"),
+	E(":path","/index.html"),
+	E(":scheme","http"),
+	E(":scheme","https"),
+	E(":status","200"),
+	E(":status","204"),
+	E(":status","206"),
+	E(":status","304"),
+	E(":status","400"),
+	E(":status","404"),
+	E(":status","500"),
+	E("accept-charset",""),
+	E("accept-encoding","gzip, deflate"),
+	E("accept-language",""),
+	E("accept-ranges",""),
+	E("accept",""),
+	E("access-control-allow-origin",""),
+	E("age",""),
+	E("allow",""),
+	E("authorization",""),
+	E("cache-control",""),
+	E("content-disposition",""),
+	E("content-encoding",""),
+	E("content-language",""),
+	E("content-length",""),
+	E("content-location",""),
+	E("content-range",""),
+	E("content-type",""),
+	E("cookie",""),
+	E("date",""),
+	E("etag",""),
+	E("expect",""),
+	E("expires",""),
+	E("from",""),
+	E("host",""),
+	E("if-match",""),
+	E("if-modified-since",""),
+	E("if-none-match",""),
+	E("if-range",""),
+	E("if-unmodified-since",""),
+	E("last-modified",""),
+	E("link",""),
+	E("location",""),
+	E("max-forwards",""),
+	E("proxy-authenticate",""),
+	E("proxy-authorization",""),
+	E("range",""),
+	E("referer",""),
+	E("refresh",""),
+	E("retry-after",""),
+	E("server",""),
+	E("set-cookie",""),
+	E("strict-transport-security",""),
+	E("transfer-encoding",""),
+	E("user-agent",""),
+	E("vary",""),
+	E("via",""),
+	E("www-authenticate",""),
+};
+#undef E
+
+// The Huffman code (code, bit length), indexed by symbol; 256 is EOS.
+// See: https://datatracker.ietf.org/doc/html/rfc7541#appendix-B
+static const struct {
+	uint32_t code;
+	uint8_t bits;
+} HPACK_HUFF[257] = {
+	{0x1ff8,13}, {0x7fffd8,23}, {0xfffffe2,28}, {0xfffffe3,28}, {0xfffffe4,28}, {0xfffffe5,28},
+	{0xfffffe6,28}, {0xfffffe7,28}, {0xfffffe8,28}, {0xffffea,24}, {0x3ffffffc,30}, {0xfffffe9,28},
+	{0xfffffea,28}, {0x3ffffffd,30}, {0xfffffeb,28}, {0xfffffec,28}, {0xfffffed,28}, {0xfffffee,28},
+	{0xfffffef,28}, {0xffffff0,28}, {0xffffff1,28}, {0xffffff2,28}, {0x3ffffffe,30}, {0xffffff3,28},
+	{0xffffff4,28}, {0xffffff5,28}, {0xffffff6,28}, {0xffffff7,28}, {0xffffff8,28}, {0xffffff9,28},
+	{0xffffffa,28}, {0xffffffb,28}, {0x14,6}, {0x3f8,10}, {0x3f9,10}, {0xffa,12},
+	{0x1ff9,13}, {0x15,6}, {0xf8,8}, {0x7fa,11}, {0x3fa,10}, {0x3fb,10},
+	{0xf9,8}, {0x7fb,11}, {0xfa,8}, {0x16,6}, {0x17,6}, {0x18,6},
+	{0x0,5}, {0x1,5}, {0x2,5}, {0x19,6}, {0x1a,6}, {0x1b,6},
+	{0x1c,6}, {0x1d,6}, {0x1e,6}, {0x1f,6}, {0x5c,7}, {0xfb,8},
+	{0x7ffc,15}, {0x20,6}, {0xffb,12}, {0x3fc,10}, {0x1ffa,13}, {0x21,6},
+	{0x5d,7}, {0x5e,7}, {0x5f,7}, {0x60,7}, {0x61,7}, {0x62,7},
+	{0x63,7}, {0x64,7}, {0x65,7}, {0x66,7}, {0x67,7}, {0x68,7},
+	{0x69,7}, {0x6a,7}, {0x6b,7}, {0x6c,7}, {0x6d,7}, {0x6e,7},
+	{0x6f,7}, {0x70,7}, {0x71,7}, {0x72,7}, {0xfc,8}, {0x73,7},
+	{0xfd,8}, {0x1ffb,13}, {0x7fff0,19}, {0x1ffc,13}, {0x3ffc,14}, {0x22,6},
+	{0x7ffd,15}, {0x3,5}, {0x23,6}, {0x4,5}, {0x24,6}, {0x5,5},
+	{0x25,6}, {0x26,6}, {0x27,6}, {0x6,5}, {0x74,7}, {0x75,7},
+	{0x28,6}, {0x29,6}, {0x2a,6}, {0x7,5}, {0x2b,6}, {0x76,7},
+	{0x2c,6}, {0x8,5}, {0x9,5}, {0x2d,6}, {0x77,7}, {0x78,7},
+	{0x79,7}, {0x7a,7}, {0x7b,7}, {0x7ffe,15}, {0x7fc,11}, {0x3ffd,14},
+	{0x1ffd,13}, {0xffffffc,28}, {0xfffe6,20}, {0x3fffd2,22}, {0xfffe7,20}, {0xfffe8,20},
+	{0x3fffd3,22}, {0x3fffd4,22}, {0x3fffd5,22}, {0x7fffd9,23}, {0x3fffd6,22}, {0x7fffda,23},
+	{0x7fffdb,23}, {0x7fffdc,23}, {0x7fffdd,23}, {0x7fffde,23}, {0xffffeb,24}, {0x7fffdf,23},
+	{0xffffec,24}, {0xffffed,24}, {0x3fffd7,22}, {0x7fffe0,23}, {0xffffee,24}, {0x7fffe1,23},
+	{0x7fffe2,23}, {0x7fffe3,23}, {0x7fffe4,23}, {0x1fffdc,21}, {0x3fffd8,22}, {0x7fffe5,23},
+	{0x3fffd9,22}, {0x7fffe6,23}, {0x7fffe7,23}, {0xffffef,24}, {0x3fffda,22}, {0x1fffdd,21},
+	{0xfffe9,20}, {0x3fffdb,22}, {0x3fffdc,22}, {0x7fffe8,23}, {0x7fffe9,23}, {0x1fffde,21},
+	{0x7fffea,23}, {0x3fffdd,22}, {0x3fffde,22}, {0xfffff0,24}, {0x1fffdf,21}, {0x3fffdf,22},
+	{0x7fffeb,23}, {0x7fffec,23}, {0x1fffe0,21}, {0x1fffe1,21}, {0x3fffe0,22}, {0x1fffe2,21},
+	{0x7fffed,23}, {0x3fffe1,22}, {0x7fffee,23}, {0x7fffef,23}, {0xfffea,20}, {0x3fffe2,22},
+	{0x3fffe3,22}, {0x3fffe4,22}, {0x7ffff0,23}, {0x3fffe5,22}, {0x3fffe6,22}, {0x7ffff1,23},
+	{0x3ffffe0,26}, {0x3ffffe1,26}, {0xfffeb,20}, {0x7fff1,19}, {0x3fffe7,22}, {0x7ffff2,23},
+	{0x3fffe8,22}, {0x1ffffec,25}, {0x3ffffe2,26}, {0x3ffffe3,26}, {0x3ffffe4,26}, {0x7ffffde,27},
+	{0x7ffffdf,27}, {0x3ffffe5,26}, {0xfffff1,24}, {0x1ffffed,25}, {0x7fff2,19}, {0x1fffe3,21},
+	{0x3ffffe6,26}, {0x7ffffe0,27}, {0x7ffffe1,27}, {0x3ffffe7,26}, {0x7ffffe2,27}, {0xfffff2,24},
+	{0x1fffe4,21}, {0x1fffe5,21}, {0x3ffffe8,26}, {0x3ffffe9,26}, {0xffffffd,28}, {0x7ffffe3,27},
+	{0x7ffffe4,27}, {0x7ffffe5,27}, {0xfffec,20}, {0xfffff3,24}, {0xfffed,20}, {0x1fffe6,21},
+	{0x3fffe9,22}, {0x1fffe7,21}, {0x1fffe8,21}, {0x7ffff3,23}, {0x3fffea,22}, {0x3fffeb,22},
+	{0x1ffffee,25}, {0x1ffffef,25}, {0xfffff4,24}, {0xfffff5,24}, {0x3ffffea,26}, {0x7ffff4,23},
+	{0x3ffffeb,26}, {0x7ffffe6,27}, {0x3ffffec,26}, {0x3ffffed,26}, {0x7ffffe7,27}, {0x7ffffe8,27},
+	{0x7ffffe9,27}, {0x7ffffea,27}, {0x7ffffeb,27}, {0xffffffe,28}, {0x7ffffec,27}, {0x7ffffed,27},
+	{0x7ffffee,27}, {0x7ffffef,27}, {0x7fffff0,27}, {0x3ffffee,26}, {0x3fffffff,30},
+};
+
+#define HPACK_HUFF_MIN_BITS 5
+#define HPACK_HUFF_MAX_BITS 30
+#define HPACK_HUFF_EOS 256
+
+// The Huffman code is canonical, so it can be decoded knowing, for each code
+// length, the first code of that length and where its symbols start in the
+// list of symbols ordered by (length, symbol).
+static struct {
+	uint32_t first[HPACK_HUFF_MAX_BITS+1];
+	uint16_t count[HPACK_HUFF_MAX_BITS+1];
+	uint16_t offset[HPACK_HUFF_MAX_BITS+1];
+	uint16_t syms[257];
+} _huff_dec;
+static pthread_once_t _huff_dec_once = PTHREAD_ONCE_INIT;
+
+static void huff_dec_init(void) {
+	int n = 0;
+	for(int bits=HPACK_HUFF_MIN_BITS; bits<=HPACK_HUFF_MAX_BITS; bits++) {
+		_huff_dec.offset[bits] = n;
+		for(int sym=0; sym<257; sym++) {
+			if(HPACK_HUFF[sym].bits==bits) {
+				if(_huff_dec.count[bits]==0) {
+					_huff_dec.first[bits] = HPACK_HUFF[sym].code;
+				}
+				_huff_dec.count[bits]++;
+				_huff_dec.syms[n++] = sym;
+			}
+		}
+	}
+}
+
+size_t hpack_huff_encoded_len(const unsigned char * in, size_t len) {
+	uint64_t bits = 0;
+	for(size_t i=0; i<len; i++) {
+		bits += HPACK_HUFF[in[i]].bits;
+	}
+	return (bits + 7) / 8;
+}
+
+ssize_t hpack_huff_encode(const unsigned char * in, size_t len, unsigned char * out, size_t out_len) {
+	uint64_t acc = 0;
+	int acc_bits = 0;
+	size_t n = 0;
+	for(size_t i=0; i<len; i++) {
+		acc = (acc << HPACK_HUFF[in[i]].bits) | HPACK_HUFF[in[i]].code;
+		acc_bits += HPACK_HUFF[in[i]].bits;
+		while(acc_bits>=8) {
+			if(n>=out_len) {
+				errno = ENOSPC;
+				return -1;
+			}
+			acc_bits -= 8;
+			out[n++] = (unsigned char)(acc >> acc_bits);
+		}
+	}
+	if(acc_bits>0) {
+		if(n>=out_len) {
+			errno = ENOSPC;
+			return -1;
+		}
+		// pad with the most significant bits of EOS (all ones)
+		out[n++] = (unsigned char)((acc << (8 - acc_bits)) | (0xff >> acc_bits));
+	}
+	return n;
+}
+
+ssize_t hpack_huff_decode(const unsigned char * in, size_t len, unsigned char * out, size_t out_len) {
+	pthread_once(&_huff_dec_once,huff_dec_init);
+	size_t n = 0;
+	uint32_t code = 0;
+	int bits = 0;
+	for(size_t i=0; i<len; i++) {
+		for(int b=7; b>=0; b--) {
+			code = (code << 1) | ((in[i] >> b) & 1);
+			bits++;
+			if(bits>=HPACK_HUFF_MIN_BITS && code - _huff_dec.first[bits] < _huff_dec.count[bits]) {
+				int sym = _huff_dec.syms[_huff_dec.offset[bits] + code - _huff_dec.first[bits]];
+				if(sym==HPACK_HUFF_EOS) {
+					errno = EINVAL;
+					return -1;
+				}
+				if(n>=out_len) {
+					errno = ENOSPC;
+					return -1;
+				}
+				out[n++] = sym;
+				code = 0;
+				bits = 0;
+			} else if(bits>=HPACK_HUFF_MAX_BITS) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+	}
+	// Padding must be shorter than a byte, and consist of the high bits of EOS
+	if(bits>7 || code!=(1u << bits) - 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	return n;
+}
+
+ssize_t hpack_encode_int(unsigned char * out, size_t out_len, int prefix_bits, unsigned char flags, uint64_t value) {
+	const uint64_t max = (1u << prefix_bits) - 1;
+	if(out_len<1) {
+		errno = ENOSPC;
+		return -1;
+	}
+	flags &= ~max;
+	if(value<max) {
+		out[0] = flags | value;
+		return 1;
+	}
+	out[0] = flags | max;
+	value -= max;
+	size_t n = 1;
+	for(;;) {
+		if(n>=out_len) {
+			errno = ENOSPC;
+			return -1;
+		}
+		if(value<128) {
+			out[n++] = value;
+			return n;
+		}
+		out[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+}
+
+ssize_t hpack_decode_int(const unsigned char * in, size_t len, int prefix_bits, uint64_t * value) {
+	const uint64_t max = (1u << prefix_bits) - 1;
+	if(len<1) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint64_t v = in[0] & max;
+	size_t n = 1;
+	if(v==max) {
+		int shift = 0;
+		unsigned char b;
+		do {
+			if(n>=len || shift>56) {
+				errno = EINVAL;
+				return -1;
+			}
+			b = in[n++];
+			v += (uint64_t)(b & 0x7f) << shift;
+			shift += 7;
+		} while(b & 0x80);
+	}
+	*value = v;
+	return n;
+}
+
+int hpack_table_init(Hpack_Table * t, size_t max_size) {
+	memset(t,0,sizeof(Hpack_Table));
+	t->capacity = max_size / HPACK_ENTRY_OVERHEAD + 1;
+	t->entries = calloc(t->capacity,sizeof(Hpack_Entry));
+	if(!t->entries) {
+		return -1;
+	}
+	t->max_size = t->max_size_limit = max_size;
+	return 0;
+}
+
+// i=0 is the newest entry
+static Hpack_Entry * table_entry(const Hpack_Table * t, size_t i) {
+	return &t->entries[(t->head + t->capacity - i) % t->capacity];
+}
+
+static void table_evict(Hpack_Table * t, size_t max_size) {
+	while(t->count>0 && t->size>max_size) {
+		Hpack_Entry * oldest = table_entry(t,t->count-1);
+		t->size -= oldest->name_len + oldest->value_len + HPACK_ENTRY_OVERHEAD;
+		free(oldest->name);
+		oldest->name = oldest->value = NULL;
+		t->count--;
+	}
+}
+
+void hpack_table_free(Hpack_Table * t) {
+	table_evict(t,0);
+	free(t->entries);
+	memset(t,0,sizeof(Hpack_Table));
+}
+
+static int table_set_max_size(Hpack_Table * t, size_t max_size) {
+	table_evict(t,max_size);
+	size_t capacity = max_size / HPACK_ENTRY_OVERHEAD + 1;
+	if(capacity>t->capacity) {
+		Hpack_Entry * entries = calloc(capacity,sizeof(Hpack_Entry));
+		if(!entries) {
+			return -1;
+		}
+		for(size_t i=0; i<t->count; i++) {
+			entries[t->count-1-i] = *table_entry(t,i);
+		}
+		free(t->entries);
+		t->entries = entries;
+		t->capacity = capacity;
+		t->head = t->count ? t->count-1 : 0;
+	}
+	t->max_size = max_size;
+	return 0;
+}
+
+int hpack_table_resize(Hpack_Table * t, size_t max_size) {
+	if(table_set_max_size(t,max_size)!=0) {
+		return -1;
+	}
+	t->max_size_limit = max_size;
+	t->size_update = true;
+	return 0;
+}
+
+const Hpack_Entry * hpack_table_get(const Hpack_Table * t, size_t index) {
+	if(index==0) {
+		return NULL;
+	}
+	if(index<=HPACK_STATIC_TABLE_LEN) {
+		return &HPACK_STATIC_TABLE[index-1];
+	}
+	index -= HPACK_STATIC_TABLE_LEN + 1;
+	return index<t->count ? table_entry(t,index) : NULL;
+}
+
+static void table_add(Hpack_Table * t, const char * name, size_t name_len, const char * value, size_t value_len) {
+	size_t entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+	if(entry_size>t->max_size) {
+		// Not an error; the table just ends up empty
+		table_evict(t,0);
+		return;
+	}
+	// Copy before evicting, since name may refer to an entry that is evicted
+	char * buff = malloc(name_len + value_len + 2);
+	memcpy(buff,name,name_len);
+	buff[name_len] = 0;
+	memcpy(buff+name_len+1,value,value_len);
+	buff[name_len+1+value_len] = 0;
+	table_evict(t,t->max_size - entry_size);
+	t->head = (t->head + 1) % t->capacity;
+	Hpack_Entry * e = &t->entries[t->head];
+	e->name = buff;
+	e->name_len = name_len;
+	e->value = buff + name_len + 1;
+	e->value_len = value_len;
+	t->count++;
+	t->size += entry_size;
+}
+
+static ssize_t decode_string(const unsigned char * in, size_t len, char * out, size_t * out_len) {
+	uint64_t str_len;
+	ssize_t n = hpack_decode_int(in,len,7,&str_len);
+	if(n<0 || str_len>len-n) {
+		errno = EINVAL;
+		return -1;
+	}
+	ssize_t decoded;
+	if(in[0] & 0x80) {
+		if((decoded = hpack_huff_decode(in+n,str_len,(unsigned char *)out,HPACK_MAX_STRING))<0) {
+			return -1;
+		}
+	} else {
+		if(str_len>HPACK_MAX_STRING) {
+			errno = ENOSPC;
+			return -1;
+		}
+		memcpy(out,in+n,str_len);
+		decoded = str_len;
+	}
+	out[decoded] = 0;
+	*out_len = decoded;
+	return n + str_len;
+}
+
+int hpack_decode(Hpack_Table * t, const unsigned char * in, size_t len, Hpack_Header_Cb cb, void * ctx) {
+	char name[HPACK_MAX_STRING+1];
+	char value[HPACK_MAX_STRING+1];
+	bool fields_seen = false;
+	size_t pos = 0;
+	while(pos<len) {
+		unsigned char b = in[pos];
+		uint64_t index;
+		ssize_t n;
+		if(b & 0x80) {
+			// Indexed header field
+			if((n = hpack_decode_int(in+pos,len-pos,7,&index))<0) {
+				return -1;
+			}
+			pos += n;
+			const Hpack_Entry * e = hpack_table_get(t,index);
+			if(!e) {
+				wlogf("Invalid header table index: %llu",(unsigned long long)index);
+				errno = EINVAL;
+				return -1;
+			}
+			fields_seen = true;
+			if(cb(ctx,e->name,e->name_len,e->value,e->value_len)!=0) {
+				return -1;
+			}
+			continue;
+		}
+		if((b & 0xe0)==0x20) {
+			// Dynamic table size update; only allowed before the first field
+			if((n = hpack_decode_int(in+pos,len-pos,5,&index))<0) {
+				return -1;
+			}
+			pos += n;
+			if(fields_seen || index>t->max_size_limit) {
+				errno = EINVAL;
+				return -1;
+			}
+			if(table_set_max_size(t,index)!=0) {
+				return -1;
+			}
+			continue;
+		}
+		// Literal header field, with incremental indexing (01), without
+		// indexing (0000) or never indexed (0001)
+		bool indexing = (b & 0xc0)==0x40;
+		if((n = hpack_decode_int(in+pos,len-pos,indexing?6:4,&index))<0) {
+			return -1;
+		}
+		pos += n;
+		size_t name_len;
+		if(index==0) {
+			if((n = decode_string(in+pos,len-pos,name,&name_len))<0) {
+				return -1;
+			}
+			pos += n;
+		} else {
+			const Hpack_Entry * e = hpack_table_get(t,index);
+			if(!e) {
+				wlogf("Invalid header table index: %llu",(unsigned long long)index);
+				errno = EINVAL;
+				return -1;
+			}
+			name_len = e->name_len;
+			memcpy(name,e->name,name_len+1);
+		}
+		size_t value_len;
+		if((n = decode_string(in+pos,len-pos,value,&value_len))<0) {
+			return -1;
+		}
+		pos += n;
+		fields_seen = true;
+		if(cb(ctx,name,name_len,value,value_len)!=0) {
+			return -1;
+		}
+		if(indexing) {
+			table_add(t,name,name_len,value,value_len);
+		}
+	}
+	return 0;
+}
+
+static ssize_t encode_string(unsigned char * out, size_t out_len, const char * s, size_t len) {
+	size_t huff_len = hpack_huff_encoded_len((const unsigned char *)s,len);
+	bool huff = huff_len < len;
+	ssize_t n = hpack_encode_int(out,out_len,7,huff?0x80:0,huff?huff_len:len);
+	if(n<0) {
+		return -1;
+	}
+	if(huff) {
+		ssize_t m = hpack_huff_encode((const unsigned char *)s,len,out+n,out_len-n);
+		return m<0 ? -1 : n + m;
+	}
+	if(len>out_len-n) {
+		errno = ENOSPC;
+		return -1;
+	}
+	memcpy(out+n,s,len);
+	return n + len;
+}
+
+ssize_t hpack_encode(Hpack_Table * t, unsigned char * out, size_t out_len, const char * name, const char * value) {
+	size_t n = 0;
+	ssize_t m;
+	if(t->size_update) {
+		if((m = hpack_encode_int(out,out_len,5,0x20,t->max_size))<0) {
+			return -1;
+		}
+		n += m;
+		t->size_update = false;
+	}
+	size_t name_len = strlen(name);
+	size_t value_len = strlen(value);
+	size_t name_index = 0;
+	size_t num_entries = HPACK_STATIC_TABLE_LEN + t->count;
+	for(size_t index=1; index<=num_entries; index++) {
+		const Hpack_Entry * e = hpack_table_get(t,index);
+		if(e->name_len==name_len && memcmp(e->name,name,name_len)==0) {
+			if(e->value_len==value_len && memcmp(e->value,value,value_len)==0) {
+				// Indexed header field
+				return (m = hpack_encode_int(out+n,out_len-n,7,0x80,index))<0 ? -1 : n + m;
+			}
+			if(!name_index) {
+				name_index = index;
+			}
+		}
+	}
+	// Literal header field with incremental indexing
+	if((m = hpack_encode_int(out+n,out_len-n,6,0x40,name_index))<0) {
+		return -1;
+	}
+	n += m;
+	if(!name_index) {
+		if((m = encode_string(out+n,out_len-n,name,name_len))<0) {
+			return -1;
+		}
+		n += m;
+	}
+	if((m = encode_string(out+n,out_len-n,value,value_len))<0) {
+		return -1;
+	}
+	n += m;
+	table_add(t,name,name_len,value,value_len);
+	return n;
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+
+// Parse a hex string (ignoring spaces) from RFC 7541 Appendix C
+static size_t test_unhex(const char * hex, unsigned char * out) {
+	size_t n = 0;
+	unsigned int b;
+	while(*hex) {
+		if(*hex==' ') {
+			hex++;
+			continue;
+		}
+		sscanf(hex,"%2x",&b);
+		out[n++] = b;
+		hex += 2;
+	}
+	return n;
+}
+
+typedef struct {
+	char fields[1024];
+} Test_Fields;
+
+static int test_collect(void * ctx, const char * name, size_t name_len, const char * value, size_t value_len) {
+	Test_Fields * tf = ctx;
+	size_t l = strlen(tf->fields);
+	snprintf(tf->fields+l,sizeof(tf->fields)-l,"%s: %s\n",name,value);
+	return 0;
+}
+
+static bool test_decode(Hpack_Table * t, const char * hex, const char * expected) {
+	unsigned char block[512];
+	size_t len = test_unhex(hex,block);
+	Test_Fields tf = { .fields = "" };
+	if(hpack_decode(t,block,len,test_collect,&tf)!=0) {
+		return false;
+	}
+	return strcmp(tf.fields,expected)==0;
+}
+
+UT_TEST_CASE(hpack_integers) {
+	unsigned char buff[16];
+	uint64_t v;
+	// RFC 7541 C.1
+	ut_assert(hpack_encode_int(buff,sizeof(buff),5,0,10)==1 && buff[0]==0x0a);
+	ut_assert(hpack_encode_int(buff,sizeof(buff),5,0xe0,1337)==3);
+	ut_assert(buff[0]==0xff && buff[1]==0x9a && buff[2]==0x0a);
+	ut_assert(hpack_decode_int(buff,3,5,&v)==3 && v==1337);
+	ut_assert(hpack_encode_int(buff,sizeof(buff),8,0,42)==1 && buff[0]==42);
+	ut_assert(hpack_decode_int(buff,1,8,&v)==1 && v==42);
+	// truncated
+	ut_assert(hpack_encode_int(buff,2,5,0,1337)==-1);
+	buff[0] = 0x1f;
+	buff[1] = 0x9a;
+	ut_assert(hpack_decode_int(buff,2,5,&v)==-1);
+	for(uint64_t i=0; i<100000; i+=7) {
+		ssize_t n = hpack_encode_int(buff,sizeof(buff),4,0,i);
+		ut_assert(n>0 && hpack_decode_int(buff,n,4,&v)==n && v==i);
+	}
+}
+
+UT_TEST_CASE(hpack_huffman) {
+	unsigned char expected[64];
+	unsigned char buff[64];
+	const char * s = "www.example.com";
+	size_t exp_len = test_unhex("f1e3 c2e5 f23a 6ba0 ab90 f4ff",expected);
+	ut_assert(hpack_huff_encoded_len((const unsigned char *)s,strlen(s))==exp_len);
+	ut_assert(hpack_huff_encode((const unsigned char *)s,strlen(s),buff,sizeof(buff))==exp_len);
+	ut_assert(memcmp(buff,expected,exp_len)==0);
+	ut_assert(hpack_huff_decode(expected,exp_len,buff,sizeof(buff))==strlen(s));
+	ut_assert(memcmp(buff,s,strlen(s))==0);
+	// every symbol round-trips
+	unsigned char all[256];
+	unsigned char enc[1024];
+	unsigned char dec[256];
+	for(int i=0; i<256; i++) {
+		all[i] = i;
+	}
+	ssize_t n = hpack_huff_encode(all,256,enc,sizeof(enc));
+	ut_assert(n>0);
+	ut_assert(hpack_huff_decode(enc,n,dec,sizeof(dec))==256);
+	ut_assert(memcmp(all,dec,256)==0);
+	// invalid padding
+	unsigned char bad[] = { 0xf1, 0xe3, 0x00 };
+	ut_assert(hpack_huff_decode(bad,sizeof(bad),buff,sizeof(buff))==-1);
+	// output too small
+	ut_assert(hpack_huff_decode(expected,exp_len,buff,4)==-1);
+}
+
+UT_TEST_CASE(hpack_decode_requests) {
+	// RFC 7541 C.3 (without Huffman coding)
+	Hpack_Table t;
+	ut_assert(hpack_table_init(&t,HPACK_DEFAULT_TABLE_SIZE)==0);
+	ut_assert(test_decode(&t,"8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"));
+	ut_assert(t.size==57);
+	ut_assert(test_decode(&t,"8286 84be 5808 6e6f 2d63 6163 6865",
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n"));
+	ut_assert(t.size==110);
+	ut_assert(test_decode(&t,"8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+		":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n"));
+	ut_assert(t.size==164);
+	ut_assert(strcmp(hpack_table_get(&t,62)->name,"custom-key")==0);
+	hpack_table_free(&t);
+
+	// RFC 7541 C.4 (with Huffman coding)
+	ut_assert(hpack_table_init(&t,HPACK_DEFAULT_TABLE_SIZE)==0);
+	ut_assert(test_decode(&t,"8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"));
+	ut_assert(test_decode(&t,"8286 84be 5886 a8eb 1064 9cbf",
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n"));
+	ut_assert(test_decode(&t,"8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+		":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n"));
+	ut_assert(t.size==164);
+	hpack_table_free(&t);
+}
+
+UT_TEST_CASE(hpack_decode_eviction) {
+	// RFC 7541 C.5, with a 256 byte table
+	Hpack_Table t;
+	ut_assert(hpack_table_init(&t,256)==0);
+	ut_assert(test_decode(&t,"4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+		":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n"));
+	ut_assert(t.size==222 && t.count==4);
+	ut_assert(test_decode(&t,"4803 3330 37c1 c0bf",
+		":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n"));
+	ut_assert(t.size==222 && t.count==4);
+	ut_assert(strcmp(hpack_table_get(&t,62)->value,"307")==0);
+	// a table size update may not exceed the limit, nor follow a field
+	ut_assert(!test_decode(&t,"3fe1 1f",""));
+	ut_assert(!test_decode(&t,"82 20",""));
+	ut_assert(test_decode(&t,"20",""));
+	ut_assert(t.size==0 && t.count==0);
+	// bad index
+	ut_assert(!test_decode(&t,"be",""));
+	hpack_table_free(&t);
+}
+
+UT_TEST_CASE(hpack_encode_round_trip) {
+	Hpack_Table enc, dec;
+	ut_assert(hpack_table_init(&enc,HPACK_DEFAULT_TABLE_SIZE)==0);
+	ut_assert(hpack_table_init(&dec,HPACK_DEFAULT_TABLE_SIZE)==0);
+	unsigned char block[256];
+	for(int round=0; round<2; round++) {
+		size_t n = 0;
+		ssize_t m;
+		ut_assert((m = hpack_encode(&enc,block+n,sizeof(block)-n,":status","200"))==1);
+		n += m;
+		ut_assert((m = hpack_encode(&enc,block+n,sizeof(block)-n,"content-length","1234"))>0);
+		ut_assert(round==0 || m==1); // indexed the second time around
+		n += m;
+		ut_assert((m = hpack_encode(&enc,block+n,sizeof(block)-n,"x-custom","Some Value"))>0);
+		ut_assert(round==0 || m==1);
+		n += m;
+		Test_Fields tf = { .fields = "" };
+		ut_assert(hpack_decode(&dec,block,n,test_collect,&tf)==0);
+		ut_assert(strcmp(tf.fields,":status: 200\ncontent-length: 1234\nx-custom: Some Value\n")==0);
+	}
+	// The decoder learns about a smaller table from the encoder
+	ut_assert(hpack_table_resize(&enc,0)==0);
+	ssize_t m = hpack_encode(&enc,block,sizeof(block),":status","404");
+	ut_assert(m==2 && block[0]==0x20);
+	Test_Fields tf = { .fields = "" };
+	ut_assert(hpack_decode(&dec,block,m,test_collect,&tf)==0);
+	ut_assert(dec.count==0 && enc.count==0);
+	// out of space
+	ut_assert(hpack_encode(&enc,block,3,"x-custom","Some Value")==-1);
+	hpack_table_free(&enc);
+	hpack_table_free(&dec);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
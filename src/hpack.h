@@ -0,0 +1,86 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// HPACK: Header Compression for HTTP/2
+// See: https://datatracker.ietf.org/doc/html/rfc7541
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_STATIC_TABLE_LEN 61
+#define HPACK_MAX_STRING 8192
+
+typedef struct {
+	char * name;  // name and value are allocated together, and are null-terminated
+	char * value;
+	uint32_t name_len;
+	uint32_t value_len;
+} Hpack_Entry;
+
+/*! \brief A dynamic table. The encoder and decoder of a connection each have
+ *         their own.
+ */
+typedef struct {
+	Hpack_Entry * entries; // ring buffer; the newest entry is at head
+	size_t capacity;
+	size_t head;
+	size_t count;
+	size_t size;           // sum of entry sizes, as defined by RFC 7541 section 4.1
+	size_t max_size;       // current maximum size
+	size_t max_size_limit; // the maximum size may not be updated beyond this
+	bool size_update;      // (encoder) signal the new maximum size in the next header block
+} Hpack_Table;
+
+int hpack_table_init(Hpack_Table * t, size_t max_size);
+void hpack_table_free(Hpack_Table * t);
+
+/*! \brief Change the maximum size of the table, evicting entries as needed.
+ *         For an encoder, the change is signalled at the start of the next
+ *         header block.
+ */
+int hpack_table_resize(Hpack_Table * t, size_t max_size);
+
+/*! \brief Get an entry by its HPACK index (1-based; static table entries
+ *         first, followed by the dynamic table, newest first).
+ *  \return The entry, or NULL if the index is not valid.
+ */
+const Hpack_Entry * hpack_table_get(const Hpack_Table * t, size_t index);
+
+/*! \brief Encode an integer with an N-bit prefix. The bits of flags above the
+ *         prefix are or'ed into the first byte.
+ *  \return Number of bytes written, or -1 if out is too small.
+ */
+ssize_t hpack_encode_int(unsigned char * out, size_t out_len, int prefix_bits, unsigned char flags, uint64_t value);
+
+/*! \brief Decode an integer with an N-bit prefix.
+ *  \return Number of bytes consumed, or -1 if the input is truncated or invalid.
+ */
+ssize_t hpack_decode_int(const unsigned char * in, size_t len, int prefix_bits, uint64_t * value);
+
+size_t hpack_huff_encoded_len(const unsigned char * in, size_t len);
+ssize_t hpack_huff_encode(const unsigned char * in, size_t len, unsigned char * out, size_t out_len);
+ssize_t hpack_huff_decode(const unsigned char * in, size_t len, unsigned char * out, size_t out_len);
+
+/*! \brief Called for each decoded header field. Name and value are null-terminated.
+ *  \return 0 to continue decoding, non-zero to stop.
+ */
+typedef int (*Hpack_Header_Cb)(void * ctx, const char * name, size_t name_len, const char * value, size_t value_len);
+
+/*! \brief Decode a complete header block, updating the dynamic table.
+ *  \return 0 if successful, or -1 if the block can't be decoded (a
+ *          compression error; the connection can't continue).
+ */
+int hpack_decode(Hpack_Table * t, const unsigned char * in, size_t len, Hpack_Header_Cb cb, void * ctx);
+
+/*! \brief Encode a header field (with a lower-case name), using the static and
+ *         dynamic tables where possible.
+ *  \return Number of bytes written, or -1 if out is too small.
+ */
+ssize_t hpack_encode(Hpack_Table * t, unsigned char * out, size_t out_len, const char * name, const char * value);
+
+#endif // __HPACK_H__
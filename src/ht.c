@@ -19,6 +19,7 @@ struct Hashtable_S {
 	ht_hash_fn hash; // hash func
 	ht_key_free_fn free_key; // func to free a key
 	ht_val_free_fn free_val; // func to free a value
+	Arena * arena; // if set, the table and its entries are allocated from this arena
 	NVP * chains[0]; // the hash table array
 };
 
@@ -53,7 +54,28 @@ Hashtable ht_create(unsigned int nhash, ht_hash_fn hash, ht_key_free_fn free_key
 	return ht;
 }
 
+Hashtable ht_create_arena(Arena * arena, unsigned int nhash, ht_hash_fn hash) {
+	if(nhash==0) {
+		nhash = 61;
+	}
+	if(hash==NULL) {
+		hash = ht_hash_sz;
+	}
+	Hashtable ht = arena_calloc(arena,sizeof(struct Hashtable_S) + (nhash * sizeof(NVP *)));
+	if(!ht) {
+		return NULL;
+	}
+	ht->nhash = nhash;
+	ht->hash = hash;
+	ht->arena = arena;
+	return ht;
+}
+
 void ht_free(Hashtable ht) {
+	if(ht->arena) {
+		// released with the arena
+		return;
+	}
 	ht_clear(ht);
 	free(ht);
 }
@@ -61,7 +83,7 @@ void ht_free(Hashtable ht) {
 void ht_clear(Hashtable ht) {
 	for(size_t i=0; i<ht->nhash; i++) {
 		NVP * nvp = ht->chains[i];
-		while(nvp!=NULL) {
+		while(nvp!=NULL && !ht->arena) {
 			NVP * next = nvp->next;
 			if(ht->free_key) {
 				ht->free_key(nvp->key);
@@ -96,13 +118,35 @@ void ht_put(Hashtable ht, char * key, void * val) {
 		nvp = nvp->next;
 	}
 	ht->size++;
-	nvp = malloc(sizeof(NVP));
+	nvp = ht->arena ? arena_alloc(ht->arena,sizeof(NVP)) : malloc(sizeof(NVP));
 	nvp->key = key;
 	nvp->val = val;
 	nvp->next = ht->chains[h];
 	ht->chains[h] = nvp;
 }
 
+bool ht_remove(Hashtable ht, const char * key) {
+	unsigned int h = ht->hash(key) % ht->nhash;
+	for(NVP ** link=&ht->chains[h]; *link!=NULL; link=&(*link)->next) {
+		NVP * nvp = *link;
+		if(strcmp(key,nvp->key)==0) {
+			*link = nvp->next;
+			ht->size--;
+			if(!ht->arena) {
+				if(ht->free_key) {
+					ht->free_key(nvp->key);
+				}
+				if(ht->free_val && nvp->val) {
+					ht->free_val(nvp->val);
+				}
+				free(nvp);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
 bool ht_contains(Hashtable ht, const char * key) {
 	unsigned int h = ht->hash(key) % ht->nhash;
 	NVP * nvp = ht->chains[h];
@@ -227,6 +271,43 @@ UT_TEST_CASE(ut_put_replace) {
 	ht_free(ht);
 }
 
+UT_TEST_CASE(ht_remove) {
+	Hashtable ht = ht_create(1,NULL,free,free);
+	ht_put(ht,strdup(key1),strdup(val1));
+	ht_put(ht,strdup("key2"),strdup(val2));
+	ht_put(ht,strdup("key3"),NULL);
+	ut_assert(ht_size(ht)==3);
+	ut_assert(ht_remove(ht,"key2"));
+	ut_assert(!ht_remove(ht,"key2"));
+	ut_assert(ht_size(ht)==2 && !ht_contains(ht,"key2"));
+	ut_assert(0==strcmp(val1,ht_get(ht,key1)) && ht_contains(ht,"key3"));
+	ut_assert(ht_remove(ht,"key3") && ht_remove(ht,key1));
+	ut_assert(ht_size(ht)==0);
+	ht_free(ht);
+}
+
+UT_TEST_CASE(ht_arena) {
+	Arena * arena = arena_create(ARENA_REQ,4096);
+	Hashtable ht = ht_create_arena(arena,0,NULL);
+	ut_assert(ht);
+	ht_put(ht,arena_strndup(arena,key1,4),arena_strndup(arena,val1,6));
+	ht_put(ht,arena_strndup(arena,"key2",4),(char*)val2);
+	ut_assert(ht_size(ht)==2);
+	ut_assert(0==strcmp(val1,ht_get(ht,key1)));
+	ut_assert(0==strcmp(val2,ht_get(ht,"key2")));
+	ht_put(ht,(char*)key1,(char*)val2);
+	ut_assert(ht_size(ht)==2);
+	ut_assert(0==strcmp(val2,ht_get(ht,key1)));
+	ht_clear(ht);
+	ut_assert(!ht_contains(ht,key1) && ht_size(ht)==0);
+	ht_free(ht);
+	size_t used = arena_used(arena);
+	arena_reset(arena);
+	ut_assert(ht_create_arena(arena,0,NULL));
+	ut_assert(arena_used(arena)<used);
+	arena_free(arena);
+}
+
 UT_TEST_CASE(ht_lookups) {
 	Sz_Pool words = szp_from_file("src/test-data/words");
 	ut_assert(words!=NULL);
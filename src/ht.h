@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#include "arena.h"
+
 typedef struct Hashtable_S * Hashtable;
 typedef unsigned int (*ht_hash_fn)(const char * key);
 typedef void (*ht_key_free_fn)(void * val);
@@ -16,6 +18,11 @@ void ht_val_print_sz(FILE * fp, const void * val);
 void ht_val_print_long(FILE * fp, const void * val);
 
 Hashtable ht_create(unsigned int nhash, ht_hash_fn hash, ht_key_free_fn free_key, ht_val_free_fn free_val);
+/* ht_create_arena: The table and its entries are allocated from the given arena,
+ * and released with it; ht_free and ht_clear free nothing. Keys and values
+ * are not freed by the hashtable, and would typically come from the same arena.
+ */
+Hashtable ht_create_arena(Arena * arena, unsigned int nhash, ht_hash_fn hash);
 void ht_clear(Hashtable ht);
 void ht_free(Hashtable ht);
 size_t ht_size(Hashtable ht);
@@ -25,6 +32,10 @@ size_t ht_size(Hashtable ht);
  */
 void ht_put(Hashtable ht, char * key, void * val);
 bool ht_contains(Hashtable ht, const char * key);
+/* ht_remove: Removes the key, freeing its key and value as ht_clear does.
+ * Returns false if it wasn't there.
+ */
+bool ht_remove(Hashtable ht, const char * key);
 /* Returns a borrowed pointer to the value associated with the given key. */
 void * ht_get(const Hashtable ht, const char * key);
 void ht_stats(const Hashtable ht, FILE *);
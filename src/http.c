@@ -1,15 +1,33 @@
 // Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#define _GNU_SOURCE // for memmem
 #include <stdlib.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "log.h"
 #include "sz.h"
 #include "io.h"
 #include "http.h"
 #include "ws.h"
+#include "adm.h"
+#include "rl.h"
+#include "net.h"
+#include "tls.h"
+#include "h2.h"
+#include "pak.h"
+#include "wrk.h"
+#include "arena.h"
+#include "slab.h"
+#include "mux.h"
+#include "topic.h"
+#include "pool.h"
+#include "prof.h"
+#include "trace.h"
+#include "tm.h"
 
 #ifndef PATH_MAX
 #warning "PATH_MAX is not defined, so setting it"
@@ -18,6 +36,15 @@
 
 static char _static_files_dir[PATH_MAX+1]; // leave room for null term
 static size_t _static_files_dir_len = 0;
+static Pak * _static_bundle = NULL; // serve static files from this bundle, if set
+
+// Per-request and per-connection allocations, released when the response
+// has been sent and when the connection is done. These are kept for the next
+// connection served by this thread (or process).
+#define HTTP_REQ_ARENA_BLOCK 16384
+#define HTTP_CONN_ARENA_BLOCK 16384
+static __thread Arena * _req_arena = NULL;
+static __thread Arena * _conn_arena = NULL;
 
 #define HTTP_STATUS(STATUS,CODE,REASON) \
 	enum { HTTP_##STATUS = CODE }; \
@@ -27,12 +54,21 @@ static size_t _static_files_dir_len = 0;
 HTTP_STATUS(OK,200,"OK");
 HTTP_STATUS(CREATED,201,"Created");
 HTTP_STATUS(ACCEPTED,202,"Accepted");
+// 3xx
+HTTP_STATUS(NOT_MODIFIED,304,"Not Modified");
 // 4xx
 HTTP_STATUS(BAD_REQUEST,400,"Bad Request");
 HTTP_STATUS(NOT_FOUND,404,"Not Found");
 HTTP_STATUS(METHOD_NOT_ALLOWED,405,"Method Not Allowed");
+HTTP_STATUS(TOO_MANY_REQUESTS,429,"Too Many Requests");
+// 5xx
+HTTP_STATUS(SERVICE_UNAVAILABLE,503,"Service Unavailable");
 
-char * realpath_uri(const char * uri) {
+/*! \brief Resolve a URI to a path under the static files directory.
+ *  \param resolved Where to put the path; PATH_MAX bytes.
+ *  \return resolved, or NULL (with errno set) if the URI can't be resolved.
+ */
+char * realpath_uri(const char * uri, char * resolved) {
 	int uri_len = strlen(uri);
 	if(_static_files_dir_len + uri_len >= PATH_MAX) {
 		errno = ENAMETOOLONG;
@@ -42,7 +78,7 @@ char * realpath_uri(const char * uri) {
 	strcpy(icky_path,_static_files_dir);
 	strcat(icky_path,uri);
 	dlogf("icky_path=%s",icky_path);
-	char * path = realpath(icky_path,NULL);
+	char * path = realpath(icky_path,resolved);
 	dlogf("realpath=%s",path);
 	#define icky_path DONT_USE_THIS // prevent further use of the icky variable
 	if(path) {
@@ -50,7 +86,6 @@ char * realpath_uri(const char * uri) {
 			// not cool!
 			wlogf("uri resolved to a path outside of the static files dir");
 			errno = EPERM;
-			free(path);
 			path = NULL;
 		}
 	}
@@ -61,7 +96,7 @@ char * realpath_uri(const char * uri) {
 	#undef icky_path
 }
 
-static int http_method(const char * sz_method) {
+int http_method(const char * sz_method) {
 	int method = M_UNKNOWN;
 	if(sz_equal_ignore_case("GET",sz_method)) {
 		method = M_GET;
@@ -80,34 +115,75 @@ const char * H_CONTENT_LENGTH = "content-length";
 const char * H_EXPECT = "expect";
 const char * H_CONNECTION = "connection";
 const char * H_UPGRADE = "upgrade";
+const char * H_ACCEPT_ENCODING = "accept-encoding";
+const char * H_IF_NONE_MATCH = "if-none-match";
 
 // Header values
 const char * HV_EXPECT_100_CONTINUE = "100-continue";
 
 //static const char * HTTP_SEPARATORS = "()<>@,;:\\\"/[]?={} \t";
 
-static Hashtable parse_headers(int fd) {
+typedef struct {
+	char * sz_method;
+	char * uri;
+	int method;
+	int v_maj, v_min;
+} Http_Request_Line;
+
+/*! \brief Parse a request line (without its CRLF) in place.
+ *  \return 0, or the status to answer an invalid request line with.
+ */
+static int parse_request_line(char * req_line, Http_Request_Line * rl) {
+	// Request-Line = Method SP Request-URI SP HTTP-Version CRLF
+	// strtok_r, since worker threads parse requests concurrently
+	char * save;
+	rl->sz_method = strtok_r(req_line," ",&save);
+	rl->uri = strtok_r(NULL," ",&save);
+	char * version = strtok_r(NULL," ",&save);
+	if(!(rl->sz_method && rl->uri && version)) {
+		ilogf("Invalid request line: %s",req_line);
+		return HTTP_BAD_REQUEST;
+	}
+	if(2!=sscanf(version,"HTTP/%d.%d",&rl->v_maj,&rl->v_min)) {
+		ilogf("Invalid HTTP version: %s",version);
+		return HTTP_BAD_REQUEST;
+	}
+	rl->method = http_method(rl->sz_method);
+	if(!rl->method) {
+		ilogf("Invalid HTTP method: %s",rl->sz_method);
+		return HTTP_METHOD_NOT_ALLOWED;
+	}
+	return 0;
+}
+
+// Add a header line (without its CRLF) to the headers
+static void parse_header_line(Hashtable headers, Arena * arena, const char * line, size_t len) {
+	char * header = arena_strndup(arena,line,len);
+	// Does not support "folded" header lines
+	// TODO: https://datatracker.ietf.org/doc/html/rfc7230#section-3.2.6
+	char * save;
+	char * name = strtok_r(header,":",&save);
+	char * val = strtok_r(NULL,"\n\r",&save);
+	if(!(name && val)) {
+		wlogf("Skipping invalid header: %s",header);
+	} else {
+		// Header names are case insensitive
+		sz_to_lower(name);
+		// trim whitespace
+		val = sz_trim(val);
+		// Add to hashtable
+		ht_put(headers,name,val);
+	}
+}
+
+static Hashtable parse_headers(int fd, Arena * arena) {
 	errno = 0;
-	Hashtable headers = ht_create(0,NULL,free,NULL); // we don't free the value, since it will be allocated together with key
+	// Names and values are allocated from the arena, along with the table
+	Hashtable headers = ht_create_arena(arena,0,NULL);
 	char h_buff[MAX_HTTP_HEADER+1];
 	ssize_t h_len;
 	while((h_len = io_read_line_crlf(fd, h_buff, MAX_HTTP_HEADER)) > 0) {
-		char * header = strndup(h_buff,h_len);
-		// Does not support "folded" header lines
-		// TODO: https://datatracker.ietf.org/doc/html/rfc7230#section-3.2.6
-		char * name = strtok(header,":");
-		char * val = strtok(NULL,"\n\r");
-		if(!(name && val)) {
-			wlogf("Skipping invalid header: %s",header);
-			free(header);
-		} else {
-			// Header names are case insensitive
-			sz_to_lower(name);
-			// trim whitespace
-			val = sz_trim(val);
-			// Add to hashtable
-			ht_put(headers,name,val);
-		}
+		parse_header_line(headers,arena,h_buff,h_len);
 	}
 	if(h_len<0) {
 		wlogf("io_read_line_crlf failed: %s",strerror(errno));
@@ -121,181 +197,671 @@ static void free_headers(Http_Headers headers) {
     ht_free(headers);
 }
 
-static int dispatch_websocket(int fd_client_in, int fd_client_out, const Http_Headers headers, HTTP_Method method, const char * uri) {
-	FILE * f_in = fdopen(fd_client_in,"r");
+// Websocket messages handled on a compute pool, created by the first
+// connection to need it in each process
+#define HTTP_OFFLOAD_PENDING 64   // messages a connection may have waiting to be handled
+static int _offload_threads = -1;
+static Pool _offload_pool = NULL;
+static pid_t _offload_pid = 0;
+static pthread_mutex_t _offload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void http_set_offload(int threads) {
+	_offload_threads = threads;
+}
+
+static Pool http_offload_pool(void) {
+	pthread_mutex_lock(&_offload_lock);
+	// A pool inherited from the parent process has no threads
+	if(_offload_pid!=getpid()) {
+		_offload_pool = pool_create(_offload_threads);
+		_offload_pid = getpid();
+		if(!_offload_pool) {
+			elogf("Failed to create websocket offload pool: %s",strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&_offload_lock);
+	return _offload_pool;
+}
+
+// Websocket subprotocols we speak, in order of preference
+static const char * _ws_protocols[] = { MUX_PROTOCOL, NULL };
+
+static bool ws_admit_msg(Websocket ws, const struct sockaddr * client_addr, int rl_route, size_t msg_len) {
+	if(!rl_take(rl_route,RL_WS_MSGS,client_addr,1) || !rl_take(rl_route,RL_WS_BYTES,client_addr,msg_len)) {
+		wlogf("Client exceeded websocket message rate limit; closing connection");
+		ws_close(ws,WS_STATUS_POLICY_VIOLATION);
+		return false;
+	}
+	return true;
+}
+
+static int ws_echo(Websocket ws, const struct sockaddr * client_addr, int rl_route) {
+	for(;;) {
+		WS_Msg_Type type = ws_wait(ws);
+		switch(type) {
+		case WS_ERROR:
+			return -1;
+		case WS_CLOSE:
+			ilogf("Remote client closed connection: status=%d",ws_status(ws));
+			return 0;
+		case WS_MSG_BIN:
+		case WS_MSG_TXT: {
+			size_t msg_len;
+			const unsigned char * msg = ws_get_msg(ws, &msg_len);
+			if(!ws_admit_msg(ws,client_addr,rl_route,msg_len)) {
+				return -1;
+			}
+			if(type==WS_MSG_TXT) {
+				ilogf("WS_MSG_TXT: %.*s",msg_len,msg);
+			}
+			ws_send_msg(ws,type,msg, msg_len);
+			} break;
+		}
+	}
+}
+
+static Pool_Msg * http_offload_echo(void * ctx, Pool_Msg * msg) {
+	return msg;
+}
+
+/*! \brief Echo messages, as ws_echo, but handled on the offload pool: this
+ *         thread only reads messages and sends the replies, as they come back.
+ *         A client sending faster than its messages are handled is closed.
+ */
+static int ws_offload(Websocket ws, Pool pool, const struct sockaddr * client_addr, int rl_route) {
+	WS_Poll poll = ws_poll_create();
+	Pool_Conn conn = poll ? pool_conn_create(pool,http_offload_echo,NULL,poll,HTTP_OFFLOAD_PENDING) : NULL;
+	if(!conn || ws_poll_add(poll,ws,NULL)<0) {
+		elogf("Failed to offload websocket: %s",strerror(errno));
+		if(conn) {
+			pool_conn_free(conn);
+		}
+		if(poll) {
+			ws_poll_free(poll);
+		}
+		ws_close(ws,WS_STATUS_GOING_AWAY);
+		return -1;
+	}
+	int ret_code = -1;
+	for(;;) {
+		WS_Event ev;
+		int n = ws_poll_wait(poll,&ev,1,-1);
+		if(n<0 && errno!=EINTR) {
+			break;
+		}
+		if(n==1) {
+			if(ev.events & (WS_EV_CLOSE | WS_EV_ERROR)) {
+				ret_code = ev.events & WS_EV_CLOSE ? 0 : -1;
+				ilogf("Remote client closed connection: status=%d",ws_status(ws));
+				break;
+			}
+			if(ev.events & WS_EV_MSG) {
+				size_t msg_len;
+				const unsigned char * msg = ws_get_msg(ws,&msg_len);
+				if(!ws_admit_msg(ws,client_addr,rl_route,msg_len)) {
+					break;
+				}
+				if(pool_conn_post(conn,ev.msg_type,msg,msg_len)<0) {
+					wlogf("Client's messages are not being handled fast enough; closing connection");
+					ws_close(ws,errno==EAGAIN ? WS_STATUS_TRY_AGAIN : WS_STATUS_GOING_AWAY);
+					break;
+				}
+			}
+		}
+		// Woken by the pool, or after a message
+		bool sent = true;
+		Pool_Msg * reply;
+		while((reply = pool_conn_reply(conn))) {
+			sent = sent && ws_send_msg(ws,reply->type,reply->data,reply->len);
+			pool_msg_free(reply);
+		}
+		if(!sent) {
+			break;
+		}
+	}
+	pool_conn_free(conn);
+	ws_poll_free(poll);
+	return ret_code;
+}
+
+/*! \brief Echo messages on each of the client's channels (MUX_PROTOCOL).
+ */
+static int ws_mux_echo(Websocket ws, const struct sockaddr * client_addr, int rl_route) {
+	Mux mux = mux_create(ws,true);
+	if(!mux) {
+		ws_close(ws,WS_STATUS_GOING_AWAY);
+		return -1;
+	}
+	int ret_code = 0;
+	bool done = false;
+	while(!done) {
+		uint32_t channel;
+		switch(mux_wait(mux,&channel)) {
+		case MUX_EV_ERROR:
+			ret_code = -1;
+			done = true;
+			break;
+		case MUX_EV_CLOSE:
+			ilogf("Remote client closed connection: status=%d",ws_status(ws));
+			done = true;
+			break;
+		case MUX_EV_OPEN:
+		case MUX_EV_CHANNEL_CLOSE:
+		case MUX_EV_NONE:
+			break;
+		case MUX_EV_MSG: {
+			WS_Msg_Type type;
+			size_t msg_len;
+			const unsigned char * msg = mux_get_msg(mux,channel,&type,&msg_len);
+			if(!ws_admit_msg(ws,client_addr,rl_route,msg_len)) {
+				ret_code = -1;
+				done = true;
+				break;
+			}
+			mux_send(mux,channel,type,msg,msg_len);
+			} break;
+		}
+	}
+	mux_free(mux);
+	return ret_code;
+}
+
+#define HTTP_TOPICS_URI "/topics/"
+#define HTTP_TOPIC_NONE    -1   // not a topic uri
+#define HTTP_TOPIC_INVALID -2   // under HTTP_TOPICS_URI, but not a valid topic uri
+
+/*! \brief Parse a topic uri, /topics/<name>[?since=<seq>], into name. Other
+ *         query parameters are ignored.
+ *  \return The sequence number to replay from (0 for none), HTTP_TOPIC_NONE
+ *          if the uri isn't under HTTP_TOPICS_URI, or HTTP_TOPIC_INVALID if
+ *          the name or since isn't valid.
+ */
+static int64_t http_topic_uri(const char * uri, char name[TOPIC_MAX_NAME+1]) {
+	if(strncmp(uri,HTTP_TOPICS_URI,sizeof(HTTP_TOPICS_URI)-1)!=0) {
+		return HTTP_TOPIC_NONE;
+	}
+	uri += sizeof(HTTP_TOPICS_URI)-1;
+	size_t name_len = strspn(uri,"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-");
+	if(name_len==0 || name_len>TOPIC_MAX_NAME || (uri[name_len] && uri[name_len]!='?')) {
+		return HTTP_TOPIC_INVALID;
+	}
+	memcpy(name,uri,name_len);
+	name[name_len] = 0;
+	int64_t since = 0;
+	for(const char * p=uri + name_len; *p; p += strcspn(p,"&")) {
+		p++; // '?' or '&'
+		if(!sz_starts_with(p,"since=")) {
+			continue;
+		}
+		p += sizeof("since=")-1;
+		// Digits only: strtoull would take a sign or spaces
+		char * end;
+		errno = 0;
+		unsigned long long val = *p>='0' && *p<='9' ? strtoull(p,&end,10) : ULLONG_MAX;
+		if(val>INT64_MAX || errno || (*end && *end!='&')) {
+			return HTTP_TOPIC_INVALID;
+		}
+		since = val;
+	}
+	return since;
+}
+
+/*! \brief Subscribe the client to a topic, publishing what it sends. The
+ *         client is first told the sequence number of the next message it
+ *         will be sent, to replay from should it reconnect.
+ */
+static int ws_topic(Websocket ws, Topic * topic, uint64_t since, const struct sockaddr * client_addr, int rl_route) {
+	const char * name = topic_name(topic);
+	WS_Poll poll = ws_poll_create();
+	if(!poll || ws_poll_add(poll,ws,NULL)<0) {
+		elogf("Failed to subscribe to topic: %s: %s",name,strerror(errno));
+		if(poll) {
+			ws_poll_free(poll);
+		}
+		ws_close(ws,WS_STATUS_GOING_AWAY);
+		return -1;
+	}
+	Topic_Sub sub = topic_subscribe(topic,since,poll);
+	int ret_code = -1;
+	if(sub) {
+		char hello[TOPIC_MAX_NAME+64];
+		int len = snprintf(hello,sizeof(hello),"{\"topic\":\"%s\",\"next\":%llu}",name,(unsigned long long)topic_position(sub));
+		bool done = !ws_send_msg(ws,WS_MSG_TXT,(unsigned char *)hello,len) || topic_send(sub,ws)<0;
+		while(!done) {
+			WS_Event ev;
+			int n = ws_poll_wait(poll,&ev,1,-1);
+			if(n<0 && errno!=EINTR) {
+				break;
+			}
+			if(n==1) {
+				if(ev.events & (WS_EV_CLOSE | WS_EV_ERROR)) {
+					ret_code = ev.events & WS_EV_CLOSE ? 0 : -1;
+					ilogf("Topic subscriber left: topic=%s, status=%d",name,ws_status(ws));
+					break;
+				}
+				if(ev.events & WS_EV_MSG) {
+					size_t msg_len;
+					const unsigned char * msg = ws_get_msg(ws,&msg_len);
+					if(!ws_admit_msg(ws,client_addr,rl_route,msg_len)) {
+						break;
+					}
+					topic_publish(topic,ev.msg_type,msg,msg_len);
+				}
+			}
+			// Woken by a publish, or after our own
+			done = topic_send(sub,ws)<0;
+		}
+		topic_unsubscribe(sub);
+	}
+	ws_poll_free(poll);
+	return ret_code;
+}
+
+static int dispatch_websocket(int fd_client_in, int fd_client_out, const Http_Headers headers, HTTP_Method method, const char * uri,
+		const struct sockaddr * client_addr, int rl_route) {
+	char topic[TOPIC_MAX_NAME+1];
+	int64_t since = http_topic_uri(uri,topic);
+	if(since==HTTP_TOPIC_INVALID) {
+		ilogf("Invalid topic uri: %s",uri);
+		static const char RSP_400[] = "HTTP/1.1 400 Bad Request\r\ncontent-length: 0\r\nconnection: close\r\n\r\n";
+		if(io_write_all(fd_client_out,RSP_400,sizeof(RSP_400)-1)<0) {
+			wlogf("Failed to write response: %s",strerror(errno));
+		}
+		return HTTP_BAD_REQUEST;
+	}
+	// The topic is opened before the upgrade, to refuse it if there are as
+	// many topics as allowed
+	Topic * t = since>=0 ? topic_open(topic) : NULL;
+	if(since>=0 && !t) {
+		wlogf("Failed to open topic: %s: %s",topic,strerror(errno));
+		static const char RSP_503[] = "HTTP/1.1 503 Service Unavailable\r\ncontent-length: 0\r\nconnection: close\r\n\r\n";
+		if(io_write_all(fd_client_out,RSP_503,sizeof(RSP_503)-1)<0) {
+			wlogf("Failed to write response: %s",strerror(errno));
+		}
+		return HTTP_SERVICE_UNAVAILABLE;
+	}
+	// The streams are closed with the websocket; the caller closes the
+	// connection itself
+	FILE * f_in = fdopen(dup(fd_client_in),"r");
 	if(f_in==NULL) {
 		elogf("fopen failed for reading: %s",strerror(errno));
+		if(t) {
+			topic_close(t);
+		}
 		return -1;
 	}
-	FILE * f_out = fdopen(fd_client_out,"w");
+	FILE * f_out = fdopen(dup(fd_client_out),"w");
 	if(f_out==NULL) {
 		elogf("fopen failed for writing : %s",strerror(errno));
+		fclose(f_in);
+		if(t) {
+			topic_close(t);
+		}
 		return -1;
 	}
+	// Stream buffers live as long as the connection
+	setvbuf(f_in,arena_alloc(_conn_arena,BUFSIZ),_IOFBF,BUFSIZ);
+	setvbuf(f_out,arena_alloc(_conn_arena,BUFSIZ),_IOFBF,BUFSIZ);
 	int ret_code = 0;
-	Websocket ws = ws_upgrade(f_in,f_out,headers,uri,true);
+	Websocket ws = ws_upgrade(f_in,f_out,headers,uri,true,_conn_arena);
 	if(ws==NULL) {
 		wlogf("Failed create websocket");
+		fclose(f_in);
+		fclose(f_out);
 		ret_code = -1;
 	} else {
-		bool done=false;
-		while(!done) {
-			WS_Msg_Type type = ws_wait(ws);
-			switch(type) {
-			case WS_ERROR:
-				ret_code = -1;
-				done = true;
-				break;
-			case WS_CLOSE:
-				done = true;
-				ilogf("Remote client closed connection: status=%d",ws_status(ws));
-				break;
-			case WS_MSG_BIN:
-			case WS_MSG_TXT: {
-				size_t msg_len;
-				const unsigned char * msg = ws_get_msg(ws, &msg_len);
-				if(type==WS_MSG_TXT) {
-					ilogf("WS_MSG_TXT: %.*s",msg_len,msg);
-				}
-				ws_send_msg(ws,type,msg, msg_len);
-				} break;
-			}
+		TRACE2(upgrade,uri,ws_protocol(ws));
+		if(sz_equal(ws_protocol(ws),MUX_PROTOCOL)) {
+			ret_code = ws_mux_echo(ws,client_addr,rl_route);
+		} else if(t) {
+			ret_code = ws_topic(ws,t,since,client_addr,rl_route);
+		} else {
+			Pool pool = _offload_threads>=0 ? http_offload_pool() : NULL;
+			ret_code = pool ? ws_offload(ws,pool,client_addr,rl_route) : ws_echo(ws,client_addr,rl_route);
 		}
 		ws_free(ws);
 	}
+	if(t) {
+		topic_close(t);
+	}
 	return ret_code;
 }
 
-static int dispatch_http(int fd_in, int fd_out, const Http_Headers headers, HTTP_Method method, const char * uri) {
-	FILE * fp_out = fdopen(dup(fd_out),"w");
-	int req_content_len = 0;
-	char * valT;
-	if((valT=ht_get(headers,H_CONTENT_LENGTH))) {
-		req_content_len = atoi(valT);
+/*! \brief Does an Accept-Encoding value accept the given content coding?
+ */
+static bool http_accepts_encoding(const char * accept, const char * coding) {
+	if(!accept) {
+		return false;
+	}
+	size_t coding_len = strlen(coding);
+	const char * p = accept;
+	while(*p) {
+		// element = coding [ ";" "q=" qvalue ]
+		p += strspn(p," \t,");
+		size_t name_len = strcspn(p,",; \t");
+		bool match = (name_len==coding_len && strncasecmp(p,coding,coding_len)==0) || (name_len==1 && *p=='*');
+		const char * end = p + strcspn(p,",");
+		if(match) {
+			const char * q = strstr(p,"q=");
+			if(!q || q>end) {
+				return true;
+			}
+			// q=0, q=0.0 etc. means "not acceptable"
+			for(q+=2; q<end && (*q=='0' || *q=='.'); q++);
+			if(q<end && *q>='1' && *q<='9') {
+				return true;
+			}
+			if(q>=end || *q==' ' || *q=='\t') {
+				return false;
+			}
+		}
+		p = end;
 	}
+	return false;
+}
 
-	if((valT=ht_get(headers,H_EXPECT))) {
-		if(sz_equal_ignore_case(valT,HV_EXPECT_100_CONTINUE)) {
-			// REVIEW: We shouldn't send the HTTP 100 until we've checked all request headers
-			ilogf("Sending HTTP continue");
-			fprintf(fp_out,"HTTP/1.1 100 Continue\r\n\r\n");
-			fflush(fp_out);
+/*! \brief Does an If-None-Match value match the entity tag? Uses the weak
+ *         comparison, as required for If-None-Match.
+ */
+static bool http_etag_match(const char * if_none_match, const char * etag) {
+	size_t etag_len = strlen(etag);
+	const char * p = if_none_match;
+	while(*p) {
+		p += strspn(p," \t,");
+		if(*p=='*') {
+			return true;
+		}
+		if(strncmp(p,"W/",2)==0) {
+			p += 2;
+		}
+		size_t len = strcspn(p,", \t");
+		if(len==etag_len && strncmp(p,etag,len)==0) {
+			return true;
 		}
+		p += len;
 	}
+	return false;
+}
 
-	char * req_body = NULL;
+// One lookup in the mapped bundle; the body is sent from the bundle file
+static void http_resolve_bundle(const char * uri, const Http_Headers headers, Http_Response * rsp) {
+	const char * accept = headers ? ht_get(headers,H_ACCEPT_ENCODING) : NULL;
+	Pak_File f;
+	if(!pak_lookup(_static_bundle,uri,strlen(uri),http_accepts_encoding(accept,"gzip")?PAK_GZIP:PAK_IDENTITY,&f)) {
+		ilogf("Not found in static bundle: %s",uri);
+		rsp->code = HTTP_NOT_FOUND;
+		rsp->reason = HTTP_NOT_FOUND_REASON;
+		return;
+	}
+	rsp->etag = f.etag;
+	rsp->vary_encoding = f.has_variants;
+	const char * if_none_match = headers ? ht_get(headers,H_IF_NONE_MATCH) : NULL;
+	if(if_none_match && http_etag_match(if_none_match,f.etag)) {
+		rsp->code = HTTP_NOT_MODIFIED;
+		rsp->reason = HTTP_NOT_MODIFIED_REASON;
+		return;
+	}
+	rsp->code = HTTP_OK;
+	rsp->reason = HTTP_OK_REASON;
+	rsp->content_type = f.content_type;
+	rsp->content_encoding = pak_encoding_name(f.encoding);
+	rsp->headers = f.headers;
+	rsp->headers_len = f.headers_len;
+	rsp->fd = pak_fd(_static_bundle);
+	rsp->fd_offset = f.offset;
+	rsp->fd_shared = true;
+	rsp->content_len = f.len;
+}
 
-	int rsp_content_len = 0;
-	int rsp_code = HTTP_OK;
-	int rsp_fd = -1;
-	size_t rsp_block_size = 0;
-	const char * rsp_reason = NULL; 
+// Take a profile of this process, as folded stacks; the thread serving the
+// request waits for it. The query is "?seconds=<s>&hz=<hz>" (both optional).
+static void http_resolve_profile(const char * query, Http_Response * rsp) {
+	unsigned long seconds = PROF_DEFAULT_SECONDS, hz = PROF_DEFAULT_HZ;
+	bool valid = true;
+	for(const char * p=query; valid && *p; ) {
+		p++; // '?' or '&'
+		unsigned long * val = sz_starts_with(p,"seconds=") ? &seconds : sz_starts_with(p,"hz=") ? &hz : NULL;
+		if((valid = val!=NULL)) {
+			const char * sz_val = strchr(p,'=') + 1;
+			char * end;
+			*val = strtoul(sz_val,&end,10);
+			valid = end>sz_val && (*end==0 || *end=='&');
+			p = end;
+		}
+	}
+	if(!valid || seconds==0 || seconds>PROF_MAX_SECONDS || hz==0 || hz>PROF_MAX_HZ) {
+		ilogf("Invalid profile request: %s",query);
+		rsp->code = HTTP_BAD_REQUEST;
+		rsp->reason = HTTP_BAD_REQUEST_REASON;
+		return;
+	}
+	FILE * f_body = open_memstream(&rsp->body,&rsp->body_len);
+	int rc = f_body ? prof_profile(seconds,hz,f_body) : -1;
+	if(f_body) {
+		fclose(f_body);
+	}
+	if(rc<0) {
+		// Another profile is being taken (or sampling isn't supported here)
+		wlogf("Failed to take profile: %s",strerror(errno));
+		free(rsp->body);
+		rsp->body = NULL;
+		rsp->body_len = 0;
+		rsp->code = HTTP_SERVICE_UNAVAILABLE;
+		rsp->reason = HTTP_SERVICE_UNAVAILABLE_REASON;
+		return;
+	}
+	rsp->code = HTTP_OK;
+	rsp->reason = HTTP_OK_REASON;
+	rsp->content_type = "text/plain";
+	rsp->content_len = rsp->body_len;
+}
+
+/*! \brief Resolve the response to a request. This is independent of the
+ *         protocol version (HTTP/1.1 or HTTP/2) that the response is sent with.
+ */
+int http_resolve(HTTP_Method method, const char * uri, const Http_Headers headers,
+		const char * req_body, size_t req_body_len, Http_Response * rsp) {
+	memset(rsp,0,sizeof(Http_Response));
+	rsp->fd = -1;
 	switch(method) {
 	default:
 		// Method not supported
-		// TODO
 		wlogf("Method not allowed: method=%d\n",method);
-		rsp_code = HTTP_METHOD_NOT_ALLOWED;
+		rsp->code = HTTP_METHOD_NOT_ALLOWED;
+		rsp->reason = HTTP_METHOD_NOT_ALLOWED_REASON;
 		break;
 	case M_POST:
 	case M_PUT:
-		if(req_content_len>0) {
-			// Read request body
-			ilogf("Reading request body: content-length=%d",req_content_len);
-			req_body = malloc(req_content_len);
-			int cb_total = 0;
-			while(cb_total < req_content_len) {
-				int cb_read = read(fd_in, req_body+cb_total, req_content_len-cb_total);
-				if(cb_read<0) {
-					wlogf("Error reading request body: %s",strerror(errno));
-					free(req_body);
-					// FIXME - what HTTP code to return
-					rsp_code = HTTP_BAD_REQUEST;
-					break;
-				}
-				if(cb_read==0) {
-					// EOF
-					// REVIEW: in this state, we have read fewer bytes
-					// than is claimed in the request content-length	
-					rsp_code = HTTP_BAD_REQUEST;
-					break;
-				}
-				cb_total += cb_read;
-			}
-			ilogf("Done reading request body: actual_size=%d",cb_total);
-		}
-		if(rsp_code==HTTP_OK) {
-			// TODO - dispatch POST/PUT
-			rsp_code = HTTP_CREATED;
-		}		
+		// TODO - dispatch POST/PUT
+		rsp->code = HTTP_CREATED;
+		rsp->reason = HTTP_CREATED_REASON;
 		break;
 	case M_GET: {
 		// GET
+		if(prof_enabled() && sz_starts_with(uri,PROF_URI) && (uri[strlen(PROF_URI)]==0 || uri[strlen(PROF_URI)]=='?')) {
+			http_resolve_profile(uri + strlen(PROF_URI),rsp);
+			break;
+		}
+		if(strcmp(uri,ADM_STATS_URI)==0) {
+			FILE * f_body = open_memstream(&rsp->body,&rsp->body_len);
+			adm_dump_stats(f_body);
+			rl_dump_stats(f_body);
+			tls_dump_stats(f_body);
+			wrk_dump_stats(f_body);
+			arena_dump_stats(f_body);
+			slab_dump_stats(f_body);
+			prof_dump_stats(f_body);
+			topic_dump_stats(f_body);
+			if(_offload_pool && _offload_pid==getpid()) {
+				pool_dump_stats(_offload_pool,f_body);
+			}
+			fclose(f_body);
+			rsp->code = HTTP_OK;
+			rsp->reason = HTTP_OK_REASON;
+			rsp->content_len = rsp->body_len;
+			break;
+		}
 		if(strcmp(uri,"/")==0) {
 			uri = "/index.html";
 		}
+		if(_static_bundle) {
+			http_resolve_bundle(uri,headers,rsp);
+			break;
+		}
 		// Assume we can't find it
-		rsp_code = HTTP_NOT_FOUND;
-		rsp_reason = HTTP_NOT_FOUND_REASON;
-		char * uri_path = realpath_uri(uri);
+		rsp->code = HTTP_NOT_FOUND;
+		rsp->reason = HTTP_NOT_FOUND_REASON;
+		char resolved[PATH_MAX];
+		char * uri_path = realpath_uri(uri,resolved);
 		if(!uri_path) {
 			ilogf("Error resolving uri to path: %s",strerror(errno));
 		} else {
-			// Open the file and write it to the output stream
+			// Open the file; it is written to the output stream once the
+			// headers are written.
 			struct stat uri_stat;
 			if(stat(uri_path,&uri_stat)<0) {
 				wlogf("Can't stat uri path: %s",strerror(errno));
 			} else if(!S_ISREG(uri_stat.st_mode)) {
 				ilogf("Must be a regular file: %s",strerror(errno));
-			} else if((rsp_fd = open(uri_path,O_RDONLY))<0) {
+			} else if((rsp->fd = open(uri_path,O_RDONLY))<0) {
 				wlogf("Can't open file",strerror(errno));
 			} else {
-				// Set-up the response body.
-				// This is used to write the body once the headers are written.
-				rsp_code = HTTP_OK;
-				rsp_reason = HTTP_OK_REASON;
-				rsp_content_len = uri_stat.st_size;
-				rsp_block_size = uri_stat.st_blksize;
+				rsp->code = HTTP_OK;
+				rsp->reason = HTTP_OK_REASON;
+				rsp->content_len = uri_stat.st_size;
+				rsp->block_size = uri_stat.st_blksize;
 			}
-			free(uri_path);
 		}
 		break; }
 	}
+	return rsp->code;
+}
+
+void http_response_free(Http_Response * rsp) {
+	free(rsp->body);
+	rsp->body = NULL;
+	if(rsp->fd>=0 && !rsp->fd_shared) {
+		close(rsp->fd);
+		rsp->fd = -1;
+	}
+}
+
+static int dispatch_http(int fd_in, int fd_out, const Http_Headers headers, HTTP_Method method, const char * uri) {
+	int req_content_len = 0;
+	char * valT;
+	if((valT=ht_get(headers,H_CONTENT_LENGTH))) {
+		req_content_len = atoi(valT);
+	}
+
+	if((valT=ht_get(headers,H_EXPECT))) {
+		if(sz_equal_ignore_case(valT,HV_EXPECT_100_CONTINUE)) {
+			// REVIEW: We shouldn't send the HTTP 100 until we've checked all request headers
+			ilogf("Sending HTTP continue");
+			static const char RSP_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+			if(write(fd_out,RSP_100,sizeof(RSP_100)-1)<0) {
+				wlogf("Failed to write HTTP continue: %s",strerror(errno));
+			}
+		}
+	}
+
+	char * req_body = NULL;
+	bool req_ok = true;
+	if((method==M_POST || method==M_PUT) && req_content_len>0) {
+		// Read request body
+		ilogf("Reading request body: content-length=%d",req_content_len);
+		req_body = arena_alloc(_req_arena,req_content_len);
+		int cb_total = 0;
+		while(cb_total < req_content_len) {
+			int cb_read = read(fd_in, req_body+cb_total, req_content_len-cb_total);
+			if(cb_read<0) {
+				wlogf("Error reading request body: %s",strerror(errno));
+				req_ok = false;
+				break;
+			}
+			if(cb_read==0) {
+				// EOF
+				// REVIEW: in this state, we have read fewer bytes
+				// than is claimed in the request content-length
+				req_ok = false;
+				break;
+			}
+			cb_total += cb_read;
+		}
+		ilogf("Done reading request body: actual_size=%d",cb_total);
+	}
+
+	Http_Response rsp;
+	if(req_ok) {
+		http_resolve(method,uri,headers,req_body,req_content_len,&rsp);
+	} else {
+		// FIXME - what HTTP code to return
+		memset(&rsp,0,sizeof(rsp));
+		rsp.fd = -1;
+		rsp.code = HTTP_BAD_REQUEST;
+		rsp.reason = HTTP_BAD_REQUEST_REASON;
+	}
 
 	// Response
-	ilogf("HTTP response: status=%d %s",rsp_code,rsp_reason?rsp_reason:"");
+	ilogf("HTTP response: status=%d %s",rsp.code,rsp.reason?rsp.reason:"");
+
+	// The status line and headers are written with a single write
+	size_t head_size = 256 + rsp.headers_len + (rsp.etag ? strlen(rsp.etag) : 0);
+	char * head = arena_alloc(_req_arena,head_size);
+	size_t head_len = 0;
+	#define HEAD_PRINTF(...) head_len += snprintf(head+head_len,head_size-head_len,__VA_ARGS__)
 
 	// Status-Line = HTTP-Version SP Status-Code SP Reason-Phrase CRLF
-	fprintf(fp_out,"HTTP/1.1 %d %s\r\n",rsp_code,rsp_reason?rsp_reason:"");
+	HEAD_PRINTF("HTTP/1.1 %d %s\r\n",rsp.code,rsp.reason?rsp.reason:"");
 
 	// Response headers
-	// ...
-	if(rsp_content_len>0) {
-		fprintf(fp_out,"Content-Length: %d\r\n",rsp_content_len);
+	if(rsp.headers) {
+		// precomputed
+		memcpy(head+head_len,rsp.headers,rsp.headers_len);
+		head_len += rsp.headers_len;
+	} else {
+		if(rsp.content_len>0) {
+			HEAD_PRINTF("Content-Length: %zu\r\n",rsp.content_len);
+		}
+		if(rsp.etag) {
+			HEAD_PRINTF("ETag: %s\r\n",rsp.etag);
+		}
+		if(rsp.vary_encoding) {
+			HEAD_PRINTF("Vary: Accept-Encoding\r\n");
+		}
 	}
 	// Done with response headers
-	fprintf(fp_out,"\r\n");
-	fflush(fp_out);
+	HEAD_PRINTF("\r\n");
+	#undef HEAD_PRINTF
+	size_t rsp_bytes = 0;
+	if(io_write_all(fd_out,head,head_len)<0) {
+		wlogf("Failed to write response headers: %s",strerror(errno));
+	} else {
+		rsp_bytes += head_len;
+	}
 
 	// Write response body
-	if(rsp_fd>=0) {
-		if(io_copy_stream(fd_out,rsp_fd,rsp_block_size)<0) {
-			wlogf("Failed to copy file",strerror(errno));
+	if(rsp.body) {
+		ssize_t written = write(fd_out,rsp.body,rsp.body_len);
+		if(written!=rsp.body_len) {
+			wlogf("Failed to write response body: %s",strerror(errno));
 		}
-		close(rsp_fd);
-		rsp_fd = -1;
+		rsp_bytes += written>0 ? written : 0;
 	}
-
-	if(req_body) {
-		free(req_body);
+	if(rsp.fd>=0) {
+		ssize_t sent = rsp.fd_shared ? io_send_file_range(fd_out,rsp.fd,rsp.fd_offset,rsp.content_len)
+			: io_send_file(fd_out,rsp.fd,rsp.content_len,rsp.block_size);
+		if(sent<0) {
+			wlogf("Failed to copy file",strerror(errno));
+		} else {
+			rsp_bytes += sent;
+		}
 	}
+	TRACE2(response,rsp.code,rsp_bytes);
+	http_response_free(&rsp);
 
-	fclose(fp_out);
-
-	return rsp_code;
+	return rsp.code;
 }
 
-
 /*! \brief Initialize the http subsytem
  *
  * \param icky_files_dir Path to static files directory. This variable is icky
@@ -306,6 +872,8 @@ static int dispatch_http(int fd_in, int fd_out, const Http_Headers headers, HTTP
 int http_init(const char * icky_files_dir) {
 	errno = 0;
 	ilogf("Initializing http subsystem");
+	http_cleanup();
+	ws_set_protocols(_ws_protocols);
 	// Get the canonical path of the given files directory
     if(!realpath(icky_files_dir, _static_files_dir)) {
 		elogf("realpath failed: %s: %s", strerror(errno), icky_files_dir);
@@ -342,12 +910,52 @@ int http_init(const char * icky_files_dir) {
 	#undef icky_files_dir
 }
 
+int http_init_bundle(const char * bundle_path) {
+	errno = 0;
+	ilogf("Initializing http subsystem");
+	http_cleanup();
+	ws_set_protocols(_ws_protocols);
+	if(!(_static_bundle = pak_open(bundle_path))) {
+		return -1;
+	}
+	ilogf("Using files from static bundle: %s",bundle_path);
+	return 0;
+}
+
+void http_cleanup(void) {
+	pak_close(_static_bundle);
+	_static_bundle = NULL;
+}
+
+int http_admit(const char * uri, bool upgrade, const struct sockaddr * client_addr, uint64_t sojourn_ns, int * rl_route_ix) {
+	*rl_route_ix = rl_route(uri);
+	if(!rl_take(*rl_route_ix,upgrade?RL_UPGRADE:RL_REQ,client_addr,1)) {
+		if(logging(LEVEL_INFO)) {
+			char sz_addr[NET_ADDR_STR_LEN];
+			// The client's address is held in a zeroed sockaddr_storage (see
+			// the accept loop and the worker handoff)
+			ilogf("Client exceeded rate limit: client=%s, uri=%s",
+				net_addr_to_sz(client_addr,sizeof(struct sockaddr_storage),sz_addr,sizeof(sz_addr)),uri);
+		}
+		return HTTP_TOO_MANY_REQUESTS;
+	}
+	if(adm_req_begin(sojourn_ns,upgrade)!=ADM_ADMIT) {
+		// Shed load: excess requests get a fast 503, and excess upgrades are refused
+		ilogf("Shedding request: uri=%s, upgrade=%d",uri,upgrade);
+		return HTTP_SERVICE_UNAVAILABLE;
+	}
+	return 0;
+}
+
 /*! \brief Process a client request. Called when a client connects to the server.
  *
  * See: https://www.w3.org/Protocols/rfc2616/rfc2616.html
  * 
  */	
-int http_client_connect(int fd_client_in, int fd_client_out) {
+int http_client_connect(int fd_client_in, int fd_client_out, const struct sockaddr * client_addr) {
+	// Time this connection spent waiting to be handled
+	uint64_t sojourn_ns = adm_sojourn_ns();
+
 	// Read and parse request line
 	char req_line[MAX_HTTP_REQ+1];
 	ssize_t req_line_len;;
@@ -356,52 +964,95 @@ int http_client_connect(int fd_client_in, int fd_client_out) {
 		return HTTP_BAD_REQUEST;
 	}
 
-	// Request-Line = Method SP Request-URI SP HTTP-Version CRLF
-	char * sz_method = strtok(req_line," ");
-	char * uri = strtok(NULL," ");
-	char * version = strtok(NULL," ");
-	if(!(sz_method && uri && version)) {
-		ilogf("Invalid request line: %s",req_line);
-		return HTTP_BAD_REQUEST;
-	}
-	int v_maj, v_min;
-	if(2!=sscanf(version,"HTTP/%d.%d",&v_maj,&v_min)) {
-		ilogf("Invalid HTTP version: %s",version);
-		return HTTP_BAD_REQUEST;
+	if(strcmp(req_line,H2_PREFACE_REQ_LINE)==0) {
+		// HTTP/2 with prior knowledge (or negotiated by TLS ALPN)
+		char preface_rest[H2_PREFACE_REST_LEN];
+		if(io_read_all(fd_client_in,preface_rest,sizeof(preface_rest))<0
+				|| memcmp(preface_rest,H2_PREFACE_REST,sizeof(preface_rest))!=0) {
+			ilogf("Invalid HTTP/2 connection preface");
+			return HTTP_BAD_REQUEST;
+		}
+		return h2_serve(fd_client_in,fd_client_out,client_addr,sojourn_ns,NULL);
 	}
-	int method = http_method(sz_method);
-	if(!method) {
-		ilogf("Invalid HTTP method: %s",sz_method);
-		return HTTP_METHOD_NOT_ALLOWED;
+
+	Http_Request_Line rl;
+	int rl_status = parse_request_line(req_line,&rl);
+	if(rl_status) {
+		return rl_status;
 	}
-	ilogf("HTTP request: method=%s(%d) version=%d.%d uri=%s",sz_method,method,v_maj,v_min,uri);
+	char * sz_method = rl.sz_method;
+	char * uri = rl.uri;
+	int method = rl.method;
+	ilogf("HTTP request: method=%s(%d) version=%d.%d uri=%s",sz_method,method,rl.v_maj,rl.v_min,uri);
+	TRACE4(request_line,sz_method,uri,rl.v_maj,rl.v_min);
 
 	int ret_code = 0;
+	if(!_req_arena) {
+		_req_arena = arena_create(ARENA_REQ,HTTP_REQ_ARENA_BLOCK);
+		_conn_arena = arena_create(ARENA_CONN,HTTP_CONN_ARENA_BLOCK);
+		if(!_req_arena || !_conn_arena) {
+			return HTTP_SERVICE_UNAVAILABLE;
+		}
+	}
 
 	// Read and parse request headers
-	Http_Headers headers = parse_headers(fd_client_in);
+	Http_Headers headers = parse_headers(fd_client_in,_req_arena);
 	if(!headers) {
 		ilogf("Failed to parse headers");
 		ret_code = HTTP_BAD_REQUEST;
 	} else {
+		TRACE2(headers,ht_size(headers),adm_sojourn_ns());
 		if(logging(LEVEL_DEBUG)) {
 			dlogf("Headers:");
 			ht_dump(headers,stdlog,ht_val_print_sz);
 			ht_stats(headers,stdlog);
 		}
-		if(ws_is_upgradable(headers)) {
-			ret_code = dispatch_websocket(fd_client_in, fd_client_out, headers, method, uri);
+		bool upgrade = ws_is_upgradable(headers);
+		int rl_route_ix;
+		int admit;
+		if(!upgrade && h2_is_upgrade(headers) && !ht_get(headers,H_CONTENT_LENGTH)) {
+			// Upgrade to HTTP/2; the request is served as stream 1, which is
+			// subject to admission control like any other stream. (Requests
+			// with a body are served over HTTP/1.1, which the RFC allows.)
+			H2_Upgrade h2_upgrade = {
+				.method = sz_method,
+				.uri = uri,
+				.settings = ht_get(headers,H_HTTP2_SETTINGS),
+				.headers = headers,
+			};
+			ret_code = h2_serve(fd_client_in,fd_client_out,client_addr,sojourn_ns,&h2_upgrade);
+		} else if((admit = http_admit(uri,upgrade,client_addr,sojourn_ns,&rl_route_ix))==HTTP_TOO_MANY_REQUESTS) {
+			rl_send_429(fd_client_out);
+			ret_code = admit;
+		} else if(admit==HTTP_SERVICE_UNAVAILABLE) {
+			adm_send_503(fd_client_out);
+			ret_code = admit;
+		} else if(upgrade) {
+			// An upgraded connection is no longer an in-flight request;
+			// it is accounted for by the connection limit instead.
+			adm_req_end();
+			ret_code = dispatch_websocket(fd_client_in, fd_client_out, headers, method, uri, client_addr, rl_route_ix);
 		} else {
+			// Timed only if traced from the start (a tracer may attach meanwhile)
+			uint64_t t_dispatch_ns = TRACING(dispatch_start) || TRACING(dispatch_end) ? tm_now_ns() : 0;
+			TRACE2(dispatch_start,sz_method,uri);
 			ret_code = dispatch_http(fd_client_in, fd_client_out, headers, method, uri);
+			if(t_dispatch_ns) {
+				TRACE4(dispatch_end,sz_method,uri,ret_code,tm_now_ns() - t_dispatch_ns);
+			}
+			adm_req_end();
 		}
 		free_headers(headers);
 	}
+	arena_reset(_req_arena);
+	arena_reset(_conn_arena);
 	ilogf("ret_code=%d",ret_code);
 	return ret_code;
 }
 
 #ifndef EXCLUDE_UNIT_TESTS
 
+#include <arpa/inet.h>
 #include "ut.h"
 #include "rnd.h"
 
@@ -423,24 +1074,42 @@ UT_TEST_CASE(http_init) {
 	ut_assert(errno == 0);
 }
 
+UT_TEST_CASE(http_topic_uri) {
+	char name[TOPIC_MAX_NAME+1];
+	ut_assert(http_topic_uri("/index.html",name)==HTTP_TOPIC_NONE);
+	ut_assert(http_topic_uri("/topics/news",name)==0 && strcmp(name,"news")==0);
+	ut_assert(http_topic_uri("/topics/news?since=42",name)==42);
+	ut_assert(http_topic_uri("/topics/news?v=2&since=7&x",name)==7);
+	ut_assert(http_topic_uri("/topics/news?nosince=5",name)==0);
+	ut_assert(http_topic_uri("/topics/news?since=-1",name)==HTTP_TOPIC_INVALID);
+	ut_assert(http_topic_uri("/topics/news?since=+1",name)==HTTP_TOPIC_INVALID);
+	ut_assert(http_topic_uri("/topics/news?since=",name)==HTTP_TOPIC_INVALID);
+	ut_assert(http_topic_uri("/topics/news?since=12ab",name)==HTTP_TOPIC_INVALID);
+	ut_assert(http_topic_uri("/topics/news?since=99999999999999999999",name)==HTTP_TOPIC_INVALID);
+	ut_assert(http_topic_uri("/topics/news?since=9223372036854775808",name)==HTTP_TOPIC_INVALID);
+	ut_assert(http_topic_uri("/topics/",name)==HTTP_TOPIC_INVALID);
+	ut_assert(http_topic_uri("/topics/a/b",name)==HTTP_TOPIC_INVALID);
+}
+
 UT_TEST_CASE(http_realpath_uri) {
 	ut_assert(http_init("./web/")==0);
 
+	char resolved[PATH_MAX];
 	char * big_uri = rnd_sz(PATH_MAX,NULL);
-	ut_assert(realpath_uri(big_uri)==NULL);
+	ut_assert(realpath_uri(big_uri,resolved)==NULL);
 	ut_assert(errno==ENAMETOOLONG);
 	free(big_uri);
 
-	ut_assert(realpath_uri("/../..")==NULL);
+	ut_assert(realpath_uri("/../..",resolved)==NULL);
 	ut_assert(errno == EPERM);
 
-	ut_assert(realpath_uri("bogus/path")==NULL);
+	ut_assert(realpath_uri("bogus/path",resolved)==NULL);
 	ut_assert(errno==ENOENT);
 
-	char * path = realpath_uri("/index.html");
-	ut_assert(path!=NULL);
+	char * path = realpath_uri("/index.html",resolved);
+	ut_assert(path==resolved);
 	ut_assert(errno==0);
-	free(path);
+	ut_assert(strstr(path,"/web/index.html")!=NULL);
 }
 
 static const char * test_headers_file = TEST_DATA_DIR "http-headers.txt";
@@ -449,7 +1118,8 @@ UT_TEST_CASE(http_parse_headers) {
 	ilogf("Reading test headers file: %s",test_headers_file);
 	int fd = open(test_headers_file, O_RDONLY);
 	ut_assert(fd>=0);
-	Http_Headers headers = parse_headers(fd);
+	Arena * arena = arena_create(ARENA_REQ,1024);
+	Http_Headers headers = parse_headers(fd,arena);
 	close(fd);
 	ut_assert(headers!=NULL);
 	dlogf("Headers:");
@@ -462,6 +1132,9 @@ UT_TEST_CASE(http_parse_headers) {
 	ut_assert(!ht_contains(headers,"ignored-1"));
 	ut_assert(!ht_contains(headers,"ignored-2"));
 	free_headers(headers);
+	// All from the arena
+	ut_assert(arena_used(arena)>0);
+	arena_free(arena);
 }
 
 UT_TEST_CASE(http_method) {
@@ -475,6 +1148,8 @@ UT_TEST_CASE(http_method) {
 typedef struct _http_req_testcase {
 	const char * filename;
 	int expected_status;
+	const struct sockaddr * client_addr;
+	const char * expected_rsp;   // if set, the start of the response (ignoring case)
 } HTTPRequestTestCase;
 
 
@@ -488,6 +1163,8 @@ HTTPRequestTestCase req_testcases[] = {
     {TEST_DATA_DIR "POST-400.txt", HTTP_BAD_REQUEST},
     {TEST_DATA_DIR "BOGUS-405-method-not-allowed.txt", HTTP_METHOD_NOT_ALLOWED},
 	{TEST_DATA_DIR "POST-ws.bin", 0},
+	{TEST_DATA_DIR "GET-ws-426-bad-version.txt", -1, NULL,
+		"HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\n"},
 };
 
 int test_http_req(HTTPRequestTestCase * testcase) {
@@ -495,12 +1172,19 @@ int test_http_req(HTTPRequestTestCase * testcase) {
 	ilogf("Reading request file: %s",testcase->filename);
 	int fd_in = open(testcase->filename, O_RDONLY);
 	ut_assert(fd_in>=0);
-	int fd_out = open("/dev/null", O_RDWR);
+	int fd_out = testcase->expected_rsp ? open("build/http-test-rsp.txt",O_RDWR|O_CREAT|O_TRUNC,0644) : open("/dev/null", O_RDWR);
 	ut_assert(fd_out>=0);
-	int status = http_client_connect(fd_in, fd_out);
+	int status = http_client_connect(fd_in, fd_out, testcase->client_addr);
+	bool rsp_ok = true;
+	if(testcase->expected_rsp) {
+		char rsp[256];
+		size_t len = strlen(testcase->expected_rsp);
+		ut_assert(len<sizeof(rsp));
+		rsp_ok = pread(fd_out,rsp,len,0)==len && strncasecmp(rsp,testcase->expected_rsp,len)==0;
+	}
 	close(fd_in);
 	close(fd_out);
-	return status == testcase->expected_status;
+	return status == testcase->expected_status && rsp_ok;
 }
 
 const int num_req_testcases = sizeof(req_testcases)/sizeof(HTTPRequestTestCase);
@@ -511,6 +1195,43 @@ UT_TEST_CASE(http_request) {
 	}
 }
 
+UT_TEST_CASE(http_load_shedding) {
+	ut_assert(http_init("./web")==0);
+	Adm_Config cfg = { .max_inflight = 1 };
+	ut_assert(adm_init(&cfg)==0);
+	ut_assert(adm_req_begin(0,false)==ADM_ADMIT); // occupy the only slot
+	HTTPRequestTestCase shed = {TEST_DATA_DIR "GET-200.txt", HTTP_SERVICE_UNAVAILABLE};
+	ut_assert(test_http_req(&shed));
+	adm_req_end();
+	HTTPRequestTestCase ok = {TEST_DATA_DIR "GET-200.txt", HTTP_OK};
+	ut_assert(test_http_req(&ok));
+	Adm_Stats stats;
+	adm_get_stats(&stats);
+	ut_assert(stats.reqs_shed_inflight==1);
+	ut_assert(stats.reqs_inflight==0);
+	Adm_Config unlimited = {0};
+	ut_assert(adm_init(&unlimited)==0);
+}
+
+UT_TEST_CASE(http_rate_limiting) {
+	ut_assert(http_init("./web")==0);
+	ut_assert(rl_init(0)==0);
+	Rl_Route route;
+	ut_assert(rl_parse_route("/:req=1000/2",&route)==0);
+	rl_clear_routes();
+	ut_assert(rl_add_route(&route)==0);
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(0x7f000001) };
+	HTTPRequestTestCase ok = {TEST_DATA_DIR "GET-200.txt", HTTP_OK, (struct sockaddr *)&addr};
+	HTTPRequestTestCase limited = {TEST_DATA_DIR "GET-200.txt", HTTP_TOO_MANY_REQUESTS, (struct sockaddr *)&addr};
+	ut_assert(test_http_req(&ok));
+	ut_assert(test_http_req(&ok));
+	ut_assert(test_http_req(&limited));
+	// without a client address there's nothing to rate limit by
+	ok.client_addr = NULL;
+	ut_assert(test_http_req(&ok));
+	rl_clear_routes();
+}
+
 UT_TEST_CASE(http_dispatch_misc) {
 	int fd_in = open("/dev/random", O_RDWR);
 	int fd_out = open("/dev/null", O_RDWR);
@@ -518,10 +1239,358 @@ UT_TEST_CASE(http_dispatch_misc) {
 	ut_assert(fd_out>=0);
 	Http_Headers headers = headers = ht_create(0,NULL,free,NULL);
 	ut_assert(dispatch_http(fd_in,fd_out,headers,M_TRACE,"/")==HTTP_METHOD_NOT_ALLOWED);
+	ut_assert(dispatch_http(fd_in,fd_out,headers,M_GET,ADM_STATS_URI)==HTTP_OK);
 	free_headers(headers);
 	close(fd_in);
 	close(fd_out);
 }
 
+UT_TEST_CASE(http_accept_encoding) {
+	ut_assert(http_accepts_encoding("gzip","gzip"));
+	ut_assert(http_accepts_encoding("deflate, GZIP;q=0.5, br","gzip"));
+	ut_assert(http_accepts_encoding("*","gzip"));
+	ut_assert(http_accepts_encoding("gzip;q=1.0","gzip"));
+	ut_assert(!http_accepts_encoding(NULL,"gzip"));
+	ut_assert(!http_accepts_encoding("","gzip"));
+	ut_assert(!http_accepts_encoding("br, deflate","gzip"));
+	ut_assert(!http_accepts_encoding("x-gzip","gzip"));
+	ut_assert(!http_accepts_encoding("gzip;q=0","gzip"));
+	ut_assert(!http_accepts_encoding("gzip; q=0.000, br","gzip"));
+
+	ut_assert(http_etag_match("\"abc\"","\"abc\""));
+	ut_assert(http_etag_match("\"x\", W/\"abc\"","\"abc\""));
+	ut_assert(http_etag_match("*","\"abc\""));
+	ut_assert(!http_etag_match("\"abcd\"","\"abc\""));
+	ut_assert(!http_etag_match("","\"abc\""));
+}
+
+// Dispatch a GET request, returning the status and (part of) the response
+static int test_http_get(Http_Headers headers, const char * uri, char * rsp, size_t rsp_len) {
+	const char * rsp_file = "build/http-test-rsp.txt";
+	int fd_out = open(rsp_file,O_RDWR|O_CREAT|O_TRUNC,0644);
+	int fd_in = open("/dev/null",O_RDONLY);
+	int status = dispatch_http(fd_in,fd_out,headers,M_GET,uri);
+	ssize_t n = pread(fd_out,rsp,rsp_len-1,0);
+	rsp[n>0?n:0] = 0;
+	close(fd_in);
+	close(fd_out);
+	return status;
+}
+
+UT_TEST_CASE(http_static_bundle) {
+	ut_assert(pak_build("./web","build/http-test.pak")>0);
+	ut_assert(http_init_bundle("build/no-such.pak")!=0);
+	ut_assert(http_init_bundle("build/http-test.pak")==0);
+
+	char rsp[65536];
+	Http_Headers headers = ht_create(0,NULL,free,NULL);
+	ut_assert(test_http_get(headers,"/",rsp,sizeof(rsp))==HTTP_OK);
+	ut_assert(strstr(rsp,"Content-Type: text/html; charset=utf-8\r\n")!=NULL);
+	ut_assert(strstr(rsp,"<html")!=NULL);
+	// The same body as the file
+	FILE * fp = fopen("./web/index.html","r");
+	char file[65536];
+	size_t file_len = fread(file,1,sizeof(file),fp);
+	fclose(fp);
+	char * body = strstr(rsp,"\r\n\r\n") + 4;
+	ut_assert(strlen(body)==file_len && memcmp(body,file,file_len)==0);
+
+	// Conditional request
+	char * etag = strstr(rsp,"ETag: ");
+	ut_assert(etag!=NULL);
+	etag = strndup(etag+6,strcspn(etag+6,"\r"));
+	ht_put(headers,strdup(H_IF_NONE_MATCH),etag);
+	ut_assert(test_http_get(headers,"/index.html",rsp,sizeof(rsp))==HTTP_NOT_MODIFIED);
+	ut_assert(strstr(rsp,"ETag: ")!=NULL);
+	ut_assert(strstr(rsp,"Content-Length")==NULL);
+	ut_assert(test_http_get(headers,"/ws_client.js",rsp,sizeof(rsp))==HTTP_OK);
+	ut_assert(strstr(rsp,"Content-Type: text/javascript")!=NULL);
+
+	ut_assert(test_http_get(headers,"/not-found.html",rsp,sizeof(rsp))==HTTP_NOT_FOUND);
+	ut_assert(test_http_get(headers,"/../web/index.html",rsp,sizeof(rsp))==HTTP_NOT_FOUND);
+	ht_free(headers);
+	free(etag);
+
+	ut_assert(http_init("./web")==0);
+}
+
 #endif // !EXCLUDE_UNIT_TESTS
 
+#ifndef EXCLUDE_BENCHMARKS
+
+#include <pthread.h>
+#include <poll.h>
+#include "bench.h"
+
+#define BENCH_UNIX_PATH "build/bench-http.sock"
+
+typedef struct {
+	int fd_listen;
+	uint64_t requests;
+} Bench_Server;
+
+// Accept connections and dispatch them, like the server does with --no-fork
+static void * bench_http_server(void * arg) {
+	Bench_Server * bs = arg;
+	for(uint64_t i=0; i<bs->requests; i++) {
+		struct pollfd pfd = { .fd = bs->fd_listen, .events = POLLIN };
+		poll(&pfd,1,1000);
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		int fd = accept(bs->fd_listen,(struct sockaddr *)&addr,&addr_len);
+		if(fd<0) {
+			break;
+		}
+		int ov = 0;
+		ioctl(fd,FIONBIO,&ov);
+		http_client_connect(fd,fd,(struct sockaddr *)&addr);
+		close(fd);
+	}
+	return NULL;
+}
+
+BENCH_CASE(http_get_tcp_vs_unix) {
+	if(http_init("./web")!=0) {
+		return;
+	}
+	static const char req[] = "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	const uint64_t requests = bench_iterations(2000);
+	uint32_t loopback = net_atoipv4("127.0.0.1");
+	for(int use_unix=0; use_unix<=1; use_unix++) {
+		Bench_Server bs = {
+			.fd_listen = use_unix ? net_listen_unix(BENCH_UNIX_PATH,false,128) : net_listen_tcp(loopback,0,128),
+			.requests = requests,
+		};
+		if(bs.fd_listen<0) {
+			return;
+		}
+		int port = net_local_port(bs.fd_listen);
+		pthread_t t;
+		pthread_create(&t,NULL,bench_http_server,&bs);
+		uint64_t bytes = 0;
+		uint64_t start = tm_now_ns();
+		for(uint64_t i=0; i<requests; i++) {
+			int fd = use_unix ? net_connect_unix(BENCH_UNIX_PATH,false) : net_connect_tcp(loopback,port);
+			if(fd<0 || write(fd,req,sizeof(req)-1)<0) {
+				break;
+			}
+			char buff[4096];
+			ssize_t n;
+			while((n = read(fd,buff,sizeof(buff)))>0) {
+				bytes += n;
+			}
+			close(fd);
+		}
+		uint64_t elapsed = tm_now_ns() - start;
+		pthread_join(t,NULL);
+		close(bs.fd_listen);
+		if(use_unix) {
+			unlink(BENCH_UNIX_PATH);
+		}
+		bench_report(use_unix ? "unix GET /index.html" : "tcp GET /index.html",requests,bytes,elapsed);
+	}
+}
+
+// Request parsing, from memory: a corpus of requests (the test data, and
+// requests like browsers send) parsed as http_client_connect does, less the
+// reads, one request per buffer and pipelined (many back to back)
+
+#include <dirent.h>
+#include "rnd.h"
+
+#define BENCH_DATA_DIR "src/test-data/"
+#define BENCH_BROWSER_REQS 64     // browser requests generated
+#define BENCH_PIPELINE_DEPTH 32   // requests per pipelined buffer
+
+typedef struct {
+	char * reqs[BENCH_BROWSER_REQS*2];  // each request's line and headers, through the empty line
+	size_t lens[BENCH_BROWSER_REQS*2];
+	size_t num;
+	size_t bytes;
+} Bench_Corpus;
+
+static void bench_corpus_add(Bench_Corpus * c, const char * req, size_t len) {
+	// Only the head is parsed; bodies are read by the handlers
+	const char * end = memmem(req,len,"\r\n\r\n",4);
+	if(!end || c->num==sizeof(c->reqs)/sizeof(c->reqs[0])) {
+		return;
+	}
+	len = end + 4 - req;
+	c->reqs[c->num] = malloc(len);
+	memcpy(c->reqs[c->num],req,len);
+	c->lens[c->num++] = len;
+	c->bytes += len;
+}
+
+static void bench_corpus_load_test_data(Bench_Corpus * c) {
+	DIR * dir = opendir(BENCH_DATA_DIR);
+	struct dirent * de;
+	while(dir && (de = readdir(dir))) {
+		size_t name_len = strlen(de->d_name);
+		if(name_len<4 || strcmp(de->d_name + name_len - 4,".txt")!=0) {
+			continue;
+		}
+		char path[PATH_MAX];
+		snprintf(path,sizeof(path),BENCH_DATA_DIR "%s",de->d_name);
+		FILE * f = fopen(path,"r");
+		char buff[MAX_HTTP_REQ];
+		size_t len = f ? fread(buff,1,sizeof(buff),f) : 0;
+		if(f) {
+			fclose(f);
+		}
+		bench_corpus_add(c,buff,len);
+	}
+	if(dir) {
+		closedir(dir);
+	}
+}
+
+static const char * _bench_agents[] = {
+	"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36",
+	"Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4 Safari/605.1.15",
+	"Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0",
+	"Mozilla/5.0 (iPhone; CPU iPhone OS 17_4 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4 Mobile/15E148 Safari/604.1",
+};
+
+static const char * _bench_uris[] = {
+	"/", "/index.html", "/js/app.js?v=1714060800", "/css/site.css", "/img/logo.png",
+	"/api/items?page=2&sort=desc&filter=open", "/favicon.ico", "/ws",
+};
+
+// A request like a browser sends: page loads, subresources, fetches and websocket upgrades
+static void bench_corpus_add_browser(Bench_Corpus * c) {
+	char req[MAX_HTTP_REQ];
+	const char * uri = _bench_uris[rnd_u32()%(sizeof(_bench_uris)/sizeof(_bench_uris[0]))];
+	const char * agent = _bench_agents[rnd_u32()%(sizeof(_bench_agents)/sizeof(_bench_agents[0]))];
+	bool page = strcmp(uri,"/")==0 || strcmp(uri,"/index.html")==0;
+	bool ws = strcmp(uri,"/ws")==0;
+	int len = snprintf(req,sizeof(req),
+			"GET %s HTTP/1.1\r\n"
+			"Host: www.example.com\r\n"
+			"Connection: %s\r\n"
+			"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+			"sec-ch-ua-mobile: ?0\r\n"
+			"sec-ch-ua-platform: \"Windows\"\r\n"
+			"User-Agent: %s\r\n"
+			"Accept: %s\r\n"
+			"Sec-Fetch-Site: %s\r\n"
+			"Sec-Fetch-Mode: %s\r\n"
+			"Sec-Fetch-Dest: %s\r\n",
+			uri,ws ? "Upgrade" : "keep-alive",agent,
+			page ? "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8" : "*/*",
+			page ? "none" : "same-origin",page ? "navigate" : ws ? "websocket" : "cors",page ? "document" : "empty");
+	if(!page) {
+		len += snprintf(req+len,sizeof(req)-len,"Referer: https://www.example.com/\r\n");
+	}
+	if(ws) {
+		len += snprintf(req+len,sizeof(req)-len,
+				"Upgrade: websocket\r\nSec-WebSocket-Version: 13\r\n"
+				"Sec-WebSocket-Key: %016llx%016llx\r\nSec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n",
+				(unsigned long long)rnd_u64(),(unsigned long long)rnd_u64());
+	}
+	len += snprintf(req+len,sizeof(req)-len,
+			"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+			"Accept-Language: en-US,en;q=0.9,nb;q=0.8\r\n"
+			"Cookie: session=%016llx%016llx; _ga=GA1.1.%u.%u",
+			(unsigned long long)rnd_u64(),(unsigned long long)rnd_u64(),rnd_u32(),rnd_u32());
+	// Cookies vary most in length between sites
+	for(unsigned int i=rnd_u32()%8; i>0; i--) {
+		len += snprintf(req+len,sizeof(req)-len,"; pref%u=%016llx",i,(unsigned long long)rnd_u64());
+	}
+	len += snprintf(req+len,sizeof(req)-len,"\r\n");
+	if(!page && !ws && rnd_u32()%2) {
+		len += snprintf(req+len,sizeof(req)-len,"If-None-Match: \"%08x-%x\"\r\n",rnd_u32(),rnd_u32()%100000);
+	}
+	len += snprintf(req+len,sizeof(req)-len,"\r\n");
+	bench_corpus_add(c,req,len);
+}
+
+/* Parse the requests, back to back in buff, as http_client_connect does.
+ * The headers of an invalid request line are parsed too, to find the next
+ * request. Returns the number of valid requests. */
+static size_t bench_parse_requests(const char * buff, size_t len, Arena * arena) {
+	size_t valid = 0;
+	const char * p = buff, * end = buff + len;
+	while(p<end) {
+		const char * eol = memmem(p,end-p,"\r\n",2);
+		if(!eol || eol-p>MAX_HTTP_REQ) {
+			break;
+		}
+		char req_line[MAX_HTTP_REQ+1];
+		memcpy(req_line,p,eol-p);
+		req_line[eol-p] = 0;
+		Http_Request_Line rl;
+		valid += parse_request_line(req_line,&rl)==0;
+		Hashtable headers = ht_create_arena(arena,0,NULL);
+		for(p=eol+2; (eol = memmem(p,end-p,"\r\n",2)) && eol>p; p=eol+2) {
+			parse_header_line(headers,arena,p,eol-p);
+		}
+		p = eol ? eol+2 : end;
+		free_headers(headers);
+		arena_reset(arena);
+	}
+	return valid;
+}
+
+static void bench_parse_corpus(const char * label, const Bench_Corpus * c, Arena * arena) {
+	if(c->num==0) {
+		return;
+	}
+	char sz_label[64];
+	// One request per buffer
+	uint64_t passes = bench_iterations(200000)/c->num + 1;
+	size_t valid = 0;
+	uint64_t start = tm_now_ns();
+	for(uint64_t i=0; i<passes; i++) {
+		for(size_t j=0; j<c->num; j++) {
+			valid += bench_parse_requests(c->reqs[j],c->lens[j],arena);
+		}
+	}
+	uint64_t elapsed = tm_now_ns() - start;
+	snprintf(sz_label,sizeof(sz_label),"%s (%zu/%zu valid)",label,valid/passes,c->num);
+	bench_report(sz_label,passes*c->num,passes*c->bytes,elapsed);
+
+	// Pipelined: BENCH_PIPELINE_DEPTH requests per buffer, cycling through the corpus
+	size_t pipe_len = 0;
+	char * pipe = malloc(BENCH_PIPELINE_DEPTH*(c->bytes/c->num + MAX_HTTP_REQ));
+	for(size_t j=0; j<BENCH_PIPELINE_DEPTH; j++) {
+		memcpy(pipe+pipe_len,c->reqs[j%c->num],c->lens[j%c->num]);
+		pipe_len += c->lens[j%c->num];
+	}
+	passes = bench_iterations(200000)/BENCH_PIPELINE_DEPTH + 1;
+	start = tm_now_ns();
+	for(uint64_t i=0; i<passes; i++) {
+		bench_parse_requests(pipe,pipe_len,arena);
+	}
+	elapsed = tm_now_ns() - start;
+	free(pipe);
+	snprintf(sz_label,sizeof(sz_label),"%s, pipelined x%d",label,BENCH_PIPELINE_DEPTH);
+	bench_report(sz_label,passes*BENCH_PIPELINE_DEPTH,passes*pipe_len,elapsed);
+}
+
+BENCH_CASE(http_parse_corpus) {
+	Bench_Corpus test_data = { 0 }, browser = { 0 };
+	bench_corpus_load_test_data(&test_data);
+	for(int i=0; i<BENCH_BROWSER_REQS; i++) {
+		bench_corpus_add_browser(&browser);
+	}
+	Arena * arena = arena_create(ARENA_REQ,HTTP_REQ_ARENA_BLOCK);
+	if(!arena) {
+		return;
+	}
+	// Invalid requests in the corpus would otherwise log
+	Log_Level level = log_get_level();
+	log_set_level(LEVEL_ERROR);
+	bench_parse_corpus("test-data requests",&test_data,arena);
+	bench_parse_corpus("browser requests",&browser,arena);
+	log_set_level(level);
+	arena_free(arena);
+	for(size_t i=0; i<test_data.num; i++) {
+		free(test_data.reqs[i]);
+	}
+	for(size_t i=0; i<browser.num; i++) {
+		free(browser.reqs[i]);
+	}
+}
+
+#endif // !EXCLUDE_BENCHMARKS
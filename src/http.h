@@ -2,6 +2,9 @@
 #ifndef __HTTP_H__
 #define __HTTP_H__
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
 #include <sys/socket.h>
 #include "ht.h"
 
@@ -25,6 +28,8 @@ extern const char * H_CONTENT_LENGTH;
 extern const char * H_EXPECT;
 extern const char * H_CONNECTION;
 extern const char * H_UPGRADE;
+extern const char * H_ACCEPT_ENCODING;
+extern const char * H_IF_NONE_MATCH;
 
 // Header values
 extern const char * HV_EXPECT_100_CONTINUE;
@@ -32,7 +37,59 @@ extern const char * HV_EXPECT_100_CONTINUE;
 #define MAX_HTTP_REQ 8192
 #define MAX_HTTP_HEADER 8192
 
+/*! \brief A response to a request, independent of the protocol version it is
+ *         sent with.
+ */
+typedef struct {
+	int code;
+	const char * reason;
+	char * body;        // response body held in memory, or NULL
+	size_t body_len;
+	int fd;             // file to send as the response body, or -1
+	off_t fd_offset;    // where the body starts in fd
+	bool fd_shared;     // fd is not owned by the response (the static bundle), so don't close it
+	size_t content_len;
+	size_t block_size;  // preferred I/O size for fd
+	// Representation headers, if known
+	const char * content_type;
+	const char * content_encoding;
+	const char * etag;
+	bool vary_encoding;
+	const char * headers; // the same, with Content-Length, as HTTP/1.1 header lines
+	size_t headers_len;
+} Http_Response;
+
 extern int http_init(const char * static_files_dir);
-extern int http_client_connect(int fd_client_in, int fd_client_out);
+
+/*! \brief Serve static files from a bundle (see pak.h), rather than from the
+ *         static files directory.
+ *  \return Returns 0 if initialized successfully, non-zero if something went wrong.
+ */
+extern int http_init_bundle(const char * bundle_path);
+extern void http_cleanup(void);
+extern int http_client_connect(int fd_client_in, int fd_client_out, const struct sockaddr * client_addr);
+
+extern int http_method(const char * sz_method);
+
+/*! \brief Handle websocket messages on a compute pool (see pool.h), of the
+ *         given number of threads per process (0 for one per CPU), rather
+ *         than on the connection's thread; -1 (the default) to not.
+ */
+extern void http_set_offload(int threads);
+
+/*! \brief Apply rate limits and admission control to a request.
+ *  \return 0 if the request is admitted, in which case the caller must call
+ *          adm_req_end once the request is complete; otherwise the HTTP status
+ *          to respond with.
+ */
+extern int http_admit(const char * uri, bool upgrade, const struct sockaddr * client_addr, uint64_t sojourn_ns, int * rl_route);
+
+/*! \brief Resolve the response to a request.
+ *  \param headers Request headers (names in lower-case), or NULL.
+ *  \return The response status.
+ */
+extern int http_resolve(HTTP_Method method, const char * uri, const Http_Headers headers,
+		const char * req_body, size_t req_body_len, Http_Response * rsp);
+extern void http_response_free(Http_Response * rsp);
 
 #endif // __HTTP_H__
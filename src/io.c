@@ -3,13 +3,15 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <unistd.h>
-#include <openssl/bio.h>
-#include <openssl/evp.h>
 #include <sys/stat.h>
 #include <string.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "io.h"
 #include "log.h"
+#include "codec.h"
 
 size_t io_copy_stream(int fd_out, int fd_in, size_t buff_size) {
 	long total = 0;
@@ -28,6 +30,111 @@ size_t io_copy_stream(int fd_out, int fd_in, size_t buff_size) {
 	return total;
 }
 
+ssize_t io_send_file(int fd_out, int fd_in, size_t len, size_t block_size) {
+#ifdef __linux__
+	// Let the kernel copy the file; when fd_out is a kTLS socket this also
+	// keeps the encryption in the kernel
+	size_t total = 0;
+	while(total<len) {
+		ssize_t n = sendfile(fd_out,fd_in,NULL,len-total);
+		if(n<0 && errno==EINTR) {
+			continue;
+		}
+		if(n<0 && total==0 && (errno==EINVAL || errno==ENOSYS)) {
+			// Not supported for this pair of file descriptors
+			break;
+		}
+		if(n<=0) {
+			return -1;
+		}
+		total += n;
+	}
+	if(total==len) {
+		return total;
+	}
+#endif
+	return io_copy_stream(fd_out,fd_in,block_size);
+}
+
+int io_write_all(int fd, const void * buff, size_t len) {
+	const unsigned char * p = buff;
+	while(len>0) {
+		ssize_t n = write(fd,p,len);
+		if(n<0 && errno==EINTR) {
+			continue;
+		}
+		if(n<=0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int io_read_all(int fd, void * buff, size_t len) {
+	unsigned char * p = buff;
+	while(len>0) {
+		ssize_t n = read(fd,p,len);
+		if(n<0 && errno==EINTR) {
+			continue;
+		}
+		if(n<=0) {
+			if(n==0) {
+				errno = 0;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+ssize_t io_send_file_range(int fd_out, int fd_in, off_t offset, size_t len) {
+	size_t total = 0;
+#ifdef __linux__
+	while(total<len) {
+		// sendfile advances offset, rather than the file offset
+		ssize_t n = sendfile(fd_out,fd_in,&offset,len-total);
+		if(n<0 && errno==EINTR) {
+			continue;
+		}
+		if(n<0 && total==0 && (errno==EINVAL || errno==ENOSYS)) {
+			break;
+		}
+		if(n<=0) {
+			return -1;
+		}
+		total += n;
+	}
+#endif
+	unsigned char buff[16384];
+	while(total<len) {
+		size_t want = len-total < sizeof(buff) ? len-total : sizeof(buff);
+		ssize_t n = pread(fd_in,buff,want,offset);
+		if(n<=0) {
+			if(n==0) {
+				errno = EIO; // the file is shorter than expected
+			}
+			return -1;
+		}
+		for(ssize_t w=0; w<n; ) {
+			ssize_t m = write(fd_out,buff+w,n-w);
+			if(m<0) {
+				if(errno==EINTR) {
+					continue;
+				}
+				return -1;
+			}
+			w += m;
+		}
+		offset += n;
+		total += n;
+	}
+	return total;
+}
+
 ssize_t io_read_line_crlf(int fd, void *buffer, size_t buffer_len) {
     if(!buffer || buffer_len < 1) {
 		errno = EINVAL;
@@ -66,10 +173,19 @@ ssize_t io_read_line_crlf(int fd, void *buffer, size_t buffer_len) {
     return line_len-1;
 }
 
+// Bytes encoded per fwrite
+#define IO_ENCODE_CHUNK 768
+
 int io_encode_hex(FILE * out, const unsigned char * bytes, size_t len) {
+	char buff[CODEC_HEX_LEN(IO_ENCODE_CHUNK)];
 	int n = 0;
-	for(size_t i=0; i<len; i++) {
-		n += fprintf(out,"%02x",(unsigned int)(bytes[i]));
+	for(size_t i=0; i<len; i+=IO_ENCODE_CHUNK) {
+		size_t chunk = len - i < IO_ENCODE_CHUNK ? len - i : IO_ENCODE_CHUNK;
+		size_t buff_len = codec_hex_encode(buff,bytes+i,chunk);
+		if(fwrite(buff,1,buff_len,out)!=buff_len) {
+			return -1;
+		}
+		n += buff_len;
 	}
 	return n;
 }
@@ -103,15 +219,16 @@ int io_encode_bin(FILE * out, const unsigned char * bytes, size_t len) {
 }
 
 int io_encode_b64(FILE * out, const unsigned char * bytes, size_t len) {
-	BIO *bio, *b64;
-	b64 = BIO_new(BIO_f_base64());
-	BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-	bio = BIO_new_fp(out, BIO_NOCLOSE);
-	BIO_push(b64, bio);
-	int n = BIO_write(b64, bytes, len);
-	BIO_flush(b64);
-	BIO_free_all(b64);
-	return n;
+	// A multiple of 3 bytes, so that only the last chunk is padded
+	char buff[CODEC_B64_LEN(IO_ENCODE_CHUNK)];
+	for(size_t i=0; i<len; i+=IO_ENCODE_CHUNK) {
+		size_t chunk = len - i < IO_ENCODE_CHUNK ? len - i : IO_ENCODE_CHUNK;
+		size_t buff_len = codec_b64_encode(buff,bytes+i,chunk);
+		if(fwrite(buff,1,buff_len,out)!=buff_len) {
+			return -1;
+		}
+	}
+	return len;
 }
 
 bool io_is_dir(const char * path) {
@@ -132,6 +249,7 @@ bool io_is_dir(const char * path) {
 
 #include "ut.h"
 #include "rnd.h"
+#include <sys/socket.h>
 
 #define TEST_DATA_DIR "src/test-data/"
 static const char * words_file = TEST_DATA_DIR "words";
@@ -148,6 +266,43 @@ UT_TEST_CASE(io_copy_io_stream) {
 	close(out);
 }
 
+UT_TEST_CASE(io_send_file) {
+	struct stat s;
+	ut_assert(stat(words_file,&s)>=0);
+	int in = open(words_file, O_RDONLY);
+	int out = open("/dev/null", O_WRONLY);
+	ut_assert(in>=0);
+	ut_assert(out>=0);
+	ut_assert(io_send_file(out,in,s.st_size,s.st_blksize)==s.st_size);
+	// nothing left to send
+	ut_assert(io_send_file(out,in,0,s.st_blksize)==0);
+	close(in);
+	close(out);
+}
+
+UT_TEST_CASE(io_send_file_range) {
+	struct stat s;
+	ut_assert(stat(words_file,&s)>=0);
+	ut_assert(s.st_size>100);
+	int in = open(words_file, O_RDONLY);
+	ut_assert(in>=0);
+	int fds[2];
+	ut_assert(socketpair(AF_UNIX,SOCK_STREAM,0,fds)==0);
+	ut_assert(io_send_file_range(fds[0],in,10,50)==50);
+	// the file offset is unchanged
+	ut_assert(lseek(in,0,SEEK_CUR)==0);
+	char expect[50];
+	char got[50];
+	ut_assert(pread(in,expect,sizeof(expect),10)==sizeof(expect));
+	ut_assert(recv(fds[1],got,sizeof(got),MSG_WAITALL)==sizeof(got));
+	ut_assert(memcmp(expect,got,sizeof(got))==0);
+	// beyond the end of the file
+	ut_assert(io_send_file_range(fds[0],in,s.st_size-10,20)<0);
+	close(fds[0]);
+	close(fds[1]);
+	close(in);
+}
+
 UT_TEST_CASE(io_encodings) {
 	#define NUM_BYTES 64
 	unsigned char * bytes = rnd_mem(NUM_BYTES, NULL);
@@ -178,6 +333,19 @@ UT_TEST_CASE(io_encodings) {
 	free(bytes);
 }
 
+UT_TEST_CASE(io_read_all) {
+	int fds[2];
+	ut_assert(pipe(fds)==0);
+	ut_assert(io_write_all(fds[1],"abc",3)==0);
+	ut_assert(io_write_all(fds[1],"def",3)==0);
+	close(fds[1]);
+	char buff[8];
+	ut_assert(io_read_all(fds[0],buff,6)==0);
+	ut_assert(memcmp(buff,"abcdef",6)==0);
+	ut_assert(io_read_all(fds[0],buff,1)<0 && errno==0);
+	close(fds[0]);
+}
+
 UT_TEST_CASE(io_is_dir) {
 	ut_assert(io_is_dir("./src"));
 	ut_assert(!io_is_dir("./Makefile"));
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 /*! \brief Reads a CRLF-terminated line from the given file descriptor. Returns
  *         the length of the line (not including the CRLF terminator). If the
@@ -16,12 +17,42 @@
 ssize_t io_read_line_crlf(int fd, void *buffer, size_t buffer_len);
 
 
+/*! \brief Write data to out, hex encoded (see codec.h for encoding to a buffer).
+ *  \return The number of characters written, or -1 if something went wrong.
+ */
 int io_encode_hex(FILE * out, const unsigned char * data, size_t len);
 int io_encode_bin(FILE * out, const unsigned char * data, size_t len);
+/*! \brief Write data to out, base64 encoded (see codec.h for encoding to a buffer).
+ *  \return len, or -1 if something went wrong.
+ */
 int io_encode_b64(FILE * out, const unsigned char * data, size_t len);
 
 size_t io_copy_stream(int fd_dst, int fd_src, size_t block_size);
 
+/*! \brief Copies len bytes from the file fd_src to fd_dst, using sendfile(2)
+ *         where available, and falling back to io_copy_stream otherwise.
+ *  \return The number of bytes copied, or -1 if something went wrong.
+ */
+ssize_t io_send_file(int fd_dst, int fd_src, size_t len, size_t block_size);
+
+/*! \brief Copies len bytes, starting at offset, from the file fd_src to fd_dst,
+ *         using sendfile(2) where available. The file offset of fd_src is not
+ *         used or changed, so fd_src may be shared (e.g. between processes).
+ *  \return The number of bytes copied, or -1 if something went wrong.
+ */
+ssize_t io_send_file_range(int fd_dst, int fd_src, off_t offset, size_t len);
+
+/*! \brief Write all len bytes, retrying partial writes.
+ *  \return 0 if successful, or -1 if something went wrong.
+ */
+int io_write_all(int fd, const void * buff, size_t len);
+
+/*! \brief Read all len bytes, retrying partial reads.
+ *  \return 0 if successful, or -1 if something went wrong (errno 0 at end
+ *          of file).
+ */
+int io_read_all(int fd, void * buff, size_t len);
+
 bool io_is_dir(const char * path);
 
 #endif // __IO_H__
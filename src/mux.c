@@ -0,0 +1,549 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "math.h"
+#include "slab.h"
+#include "mux.h"
+
+// A message queued on a channel, a pooled buffer
+typedef struct Mux_Msg_S {
+	struct Mux_Msg_S * next;
+	bool text;
+	size_t len;
+	size_t sent;
+	unsigned char data[];
+} Mux_Msg;
+
+typedef struct {
+	uint32_t id;            // 0 if the slot is free
+	bool closing;           // close once the queue has been sent
+	int64_t send_window;    // bytes we may send
+	int64_t recv_window;    // bytes the peer may send
+	uint32_t owed;          // bytes delivered, and not yet granted back to the peer
+	Mux_Msg * out;          // queue of messages to send
+	Mux_Msg * out_tail;
+	size_t queued;          // bytes in the queue not yet sent
+	unsigned char * buff;   // message reassembly, a pooled buffer
+	size_t buff_len;
+	bool text;
+} Mux_Channel;
+
+struct Mux_S {
+	Websocket ws;
+	bool server;
+	uint32_t next_id;       // for the next channel we open
+	int rr;                 // where the next round of fragments starts
+	Mux_Channel * delivered; // the channel whose message the application has
+	Mux_Channel channels[MUX_MAX_CHANNELS];
+	unsigned char out[MUX_HEADER_LEN + MUX_MAX_FRAGMENT];
+};
+
+static uint32_t get_u32(const unsigned char * p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(unsigned char * p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static int mux_send_frame(Mux mux, Mux_Frame_Type type, unsigned char flags, uint32_t id, const void * payload, size_t len) {
+	mux->out[0] = type;
+	mux->out[1] = flags;
+	put_u32(mux->out+2,id);
+	if(len>0) {
+		memcpy(mux->out+MUX_HEADER_LEN,payload,len);
+	}
+	return ws_send_msg(mux->ws,WS_MSG_BIN,mux->out,MUX_HEADER_LEN+len) ? 0 : -1;
+}
+
+static int mux_send_window(Mux mux, Mux_Channel * ch, uint32_t increment) {
+	unsigned char payload[4];
+	put_u32(payload,increment);
+	ch->recv_window += increment;
+	return mux_send_frame(mux,MUX_WINDOW,0,ch->id,payload,sizeof(payload));
+}
+
+static Mux_Channel * mux_channel(Mux mux, uint32_t id) {
+	for(int i=0; id!=0 && i<MUX_MAX_CHANNELS; i++) {
+		if(mux->channels[i].id==id) {
+			return &mux->channels[i];
+		}
+	}
+	return NULL;
+}
+
+static Mux_Channel * mux_add_channel(Mux mux, uint32_t id) {
+	Mux_Channel * ch = NULL;
+	for(int i=0; !ch && i<MUX_MAX_CHANNELS; i++) {
+		if(mux->channels[i].id==0) {
+			ch = &mux->channels[i];
+		}
+	}
+	if(ch) {
+		*ch = (Mux_Channel) {
+			.id = id,
+			.send_window = MUX_INITIAL_WINDOW,
+			.recv_window = MUX_INITIAL_WINDOW,
+		};
+	}
+	return ch;
+}
+
+static void mux_free_channel(Mux mux, Mux_Channel * ch) {
+	while(ch->out) {
+		Mux_Msg * m = ch->out;
+		ch->out = m->next;
+		slab_free(m);
+	}
+	slab_free(ch->buff);
+	if(mux->delivered==ch) {
+		mux->delivered = NULL;
+	}
+	*ch = (Mux_Channel) { .id = 0 };
+}
+
+// Send (at most) one fragment per channel per round, going round-robin, until
+// no channel has both something queued and window to send it.
+static int mux_pump(Mux mux) {
+	for(bool progress=true; progress; ) {
+		progress = false;
+		for(int k=0; k<MUX_MAX_CHANNELS; k++) {
+			Mux_Channel * ch = &mux->channels[(mux->rr + k) % MUX_MAX_CHANNELS];
+			if(ch->id==0) {
+				continue;
+			}
+			Mux_Msg * m = ch->out;
+			if(!m) {
+				if(ch->closing) {
+					int rc = mux_send_frame(mux,MUX_CLOSE,0,ch->id,NULL,0);
+					mux_free_channel(mux,ch);
+					if(rc<0) {
+						return -1;
+					}
+				}
+				continue;
+			}
+			size_t n = min(m->len - m->sent,(size_t)MUX_MAX_FRAGMENT);
+			if(ch->send_window < (int64_t)n) {
+				if(ch->send_window<=0) {
+					continue;
+				}
+				n = ch->send_window;
+			}
+			bool fin = m->sent + n == m->len;
+			unsigned char flags = (fin ? MUX_FLAG_FIN : 0) | (m->text ? MUX_FLAG_TEXT : 0);
+			if(mux_send_frame(mux,MUX_DATA,flags,ch->id,m->data + m->sent,n)<0) {
+				return -1;
+			}
+			m->sent += n;
+			ch->send_window -= n;
+			ch->queued -= n;
+			if(fin) {
+				ch->out = m->next;
+				if(!ch->out) {
+					ch->out_tail = NULL;
+				}
+				slab_free(m);
+			}
+			progress = true;
+		}
+		mux->rr = (mux->rr + 1) % MUX_MAX_CHANNELS;
+	}
+	return 0;
+}
+
+// The application is done with the last message: grant its bytes back to the peer
+static int mux_release(Mux mux) {
+	Mux_Channel * ch = mux->delivered;
+	if(!ch) {
+		return 0;
+	}
+	mux->delivered = NULL;
+	ch->buff_len = 0;
+	uint32_t owed = ch->owed;
+	ch->owed = 0;
+	return owed>0 ? mux_send_window(mux,ch,owed) : 0;
+}
+
+static Mux_Event mux_protocol_error(Mux mux, const char * reason) {
+	wlogf("mux protocol error: %s",reason);
+	ws_close(mux->ws,WS_STATUS_PROTOCOL_ERROR);
+	return MUX_EV_ERROR;
+}
+
+// PUBLIC interface
+
+Mux mux_create(Websocket ws, bool server) {
+	Mux mux = calloc(1,sizeof(struct Mux_S));
+	if(!mux) {
+		return NULL;
+	}
+	mux->ws = ws;
+	mux->server = server;
+	mux->next_id = server ? 2 : 1;
+	return mux;
+}
+
+void mux_free(Mux mux) {
+	for(int i=0; i<MUX_MAX_CHANNELS; i++) {
+		if(mux->channels[i].id) {
+			mux_free_channel(mux,&mux->channels[i]);
+		}
+	}
+	free(mux);
+}
+
+int mux_open(Mux mux, uint32_t * channel) {
+	Mux_Channel * ch = mux_add_channel(mux,mux->next_id);
+	if(!ch) {
+		errno = ENOSPC;
+		return -1;
+	}
+	mux->next_id += 2;
+	if(mux_send_frame(mux,MUX_OPEN,0,ch->id,NULL,0)<0) {
+		mux_free_channel(mux,ch);
+		return -1;
+	}
+	*channel = ch->id;
+	return 0;
+}
+
+int mux_close(Mux mux, uint32_t channel) {
+	Mux_Channel * ch = mux_channel(mux,channel);
+	if(!ch || ch->closing) {
+		errno = ENOENT;
+		return -1;
+	}
+	ch->closing = true;
+	return mux_pump(mux);
+}
+
+int mux_send(Mux mux, uint32_t channel, WS_Msg_Type type, const void * msg, size_t msg_len) {
+	Mux_Channel * ch = mux_channel(mux,channel);
+	if(!ch || ch->closing) {
+		errno = ENOENT;
+		return -1;
+	}
+	if(msg_len>MUX_MAX_MSG) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	Mux_Msg * m = slab_alloc(sizeof(Mux_Msg) + msg_len);
+	if(!m) {
+		errno = ENOMEM;
+		return -1;
+	}
+	*m = (Mux_Msg) { .text = type==WS_MSG_TXT, .len = msg_len };
+	memcpy(m->data,msg,msg_len);
+	if(ch->out_tail) {
+		ch->out_tail->next = m;
+	} else {
+		ch->out = m;
+	}
+	ch->out_tail = m;
+	ch->queued += msg_len;
+	return mux_pump(mux);
+}
+
+size_t mux_queued(Mux mux, uint32_t channel) {
+	Mux_Channel * ch = mux_channel(mux,channel);
+	return ch ? ch->queued : 0;
+}
+
+Mux_Event mux_process(Mux mux, const unsigned char * msg, size_t msg_len, uint32_t * channel) {
+	if(mux_release(mux)<0) {
+		return MUX_EV_ERROR;
+	}
+	if(msg_len<MUX_HEADER_LEN) {
+		return mux_protocol_error(mux,"short frame");
+	}
+	unsigned char type = msg[0];
+	unsigned char flags = msg[1];
+	uint32_t id = get_u32(msg+2);
+	const unsigned char * payload = msg + MUX_HEADER_LEN;
+	size_t len = msg_len - MUX_HEADER_LEN;
+	*channel = id;
+	Mux_Channel * ch = mux_channel(mux,id);
+	switch(type) {
+	case MUX_OPEN:
+		// The peer's ids are odd if we're the server
+		if(id==0 || (id & 1)!=(mux->server ? 1 : 0) || ch) {
+			return mux_protocol_error(mux,"bad channel id");
+		}
+		if(!mux_add_channel(mux,id)) {
+			wlogf("Too many channels; refusing channel %u",id);
+			return mux_send_frame(mux,MUX_CLOSE,0,id,NULL,0)<0 ? MUX_EV_ERROR : MUX_EV_NONE;
+		}
+		dlogf("mux channel %u opened",id);
+		return MUX_EV_OPEN;
+	case MUX_CLOSE:
+		if(!ch) {
+			// Closed from both ends at once
+			return MUX_EV_NONE;
+		}
+		mux_free_channel(mux,ch);
+		dlogf("mux channel %u closed",id);
+		return MUX_EV_CHANNEL_CLOSE;
+	case MUX_WINDOW: {
+		if(len!=4) {
+			return mux_protocol_error(mux,"bad window update");
+		}
+		uint32_t increment = get_u32(payload);
+		if(!ch) {
+			return MUX_EV_NONE;
+		}
+		if(increment==0 || ch->send_window + increment > MUX_MAX_WINDOW) {
+			return mux_protocol_error(mux,"bad window increment");
+		}
+		ch->send_window += increment;
+		return mux_pump(mux)<0 ? MUX_EV_ERROR : MUX_EV_NONE;
+		}
+	case MUX_DATA: {
+		if(!ch) {
+			// For a channel we have just closed
+			return MUX_EV_NONE;
+		}
+		if((int64_t)len > ch->recv_window) {
+			return mux_protocol_error(mux,"window exceeded");
+		}
+		if(ch->buff_len + len > MUX_MAX_MSG) {
+			return mux_protocol_error(mux,"message too big");
+		}
+		ch->recv_window -= len;
+		if(ch->buff_len==0) {
+			ch->text = flags & MUX_FLAG_TEXT;
+		}
+		if(len>0) {
+			unsigned char * buff = slab_grow(ch->buff,ch->buff_len+len,ch->buff_len);
+			if(!buff) {
+				return MUX_EV_ERROR;
+			}
+			memcpy(buff+ch->buff_len,payload,len);
+			ch->buff = buff;
+			ch->buff_len += len;
+		}
+		if(!(flags & MUX_FLAG_FIN)) {
+			// Part of a message; the window paces whole messages, so the
+			// parts of one larger than the window are granted back right away
+			if(len>0 && mux_send_window(mux,ch,len)<0) {
+				return MUX_EV_ERROR;
+			}
+			return MUX_EV_NONE;
+		}
+		ch->owed = len;
+		mux->delivered = ch;
+		return MUX_EV_MSG;
+		}
+	default:
+		// Unknown frame types are ignored
+		return MUX_EV_NONE;
+	}
+}
+
+Mux_Event mux_wait(Mux mux, uint32_t * channel) {
+	// Grant the window for the last message before blocking
+	if(mux_release(mux)<0) {
+		return MUX_EV_ERROR;
+	}
+	for/*ever*/(;;) {
+		switch(ws_wait(mux->ws)) {
+		case WS_CLOSE:
+			return MUX_EV_CLOSE;
+		case WS_MSG_BIN: {
+			size_t msg_len;
+			const unsigned char * msg = ws_get_msg(mux->ws,&msg_len);
+			Mux_Event ev = mux_process(mux,msg,msg_len,channel);
+			if(ev!=MUX_EV_NONE) {
+				return ev;
+			}
+			} break;
+		case WS_MSG_TXT:
+			return mux_protocol_error(mux,"text message");
+		default:
+			return MUX_EV_ERROR;
+		}
+	}
+}
+
+const unsigned char * mux_get_msg(Mux mux, uint32_t channel, WS_Msg_Type * type, size_t * msg_len) {
+	Mux_Channel * ch = mux_channel(mux,channel);
+	if(!ch || ch!=mux->delivered) {
+		return NULL;
+	}
+	if(type) {
+		*type = ch->text ? WS_MSG_TXT : WS_MSG_BIN;
+	}
+	if(msg_len) {
+		*msg_len = ch->buff_len;
+	}
+	return ch->buff;
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "ht.h"
+#include "rnd.h"
+#include "ut.h"
+
+// Skip the 101 response and the ping that ws_upgrade sends
+static void test_skip_upgrade(int fd) {
+	char last[4] = {0};
+	while(memcmp(last,"\r\n\r\n",4)!=0) {
+		memmove(last,last+1,3);
+		ut_assert(read(fd,last+3,1)==1);
+	}
+	unsigned char ping[2];
+	ut_assert(read(fd,ping,2)==2);
+}
+
+// Two websockets connected to each other
+static void test_ws_pair(Websocket * client, Websocket * server) {
+	// Either end may close first, as in the server
+	signal(SIGPIPE,SIG_IGN);
+	int sv[2];
+	ut_assert(socketpair(AF_UNIX,SOCK_STREAM,0,sv)==0);
+	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
+	ht_put(headers,"connection","Upgrade");
+	ht_put(headers,"upgrade","websocket");
+	ht_put(headers,"sec-websocket-version","13");
+	ht_put(headers,"sec-websocket-key","dGhlIHNhbXBsZSBub25jZQ==");
+	*server = ws_upgrade(fdopen(sv[0],"r"),fdopen(dup(sv[0]),"w"),headers,"/",false,NULL);
+	test_skip_upgrade(sv[1]);
+	*client = ws_upgrade(fdopen(sv[1],"r"),fdopen(dup(sv[1]),"w"),headers,"/",false,NULL);
+	test_skip_upgrade(sv[0]);
+	ut_assert(*server && *client);
+	ht_free(headers);
+}
+
+typedef struct {
+	Mux mux;
+	int opened, closed, msgs;
+	Mux_Event last;
+} Test_Mux_Echo;
+
+// Echo messages back on their channel, until the websocket closes
+static void * test_mux_echo(void * arg) {
+	Test_Mux_Echo * echo = arg;
+	for(;;) {
+		uint32_t ch;
+		Mux_Event ev = echo->last = mux_wait(echo->mux,&ch);
+		if(ev==MUX_EV_OPEN) {
+			echo->opened++;
+		} else if(ev==MUX_EV_CHANNEL_CLOSE) {
+			echo->closed++;
+		} else if(ev==MUX_EV_MSG) {
+			echo->msgs++;
+			WS_Msg_Type type;
+			size_t len;
+			const unsigned char * msg = mux_get_msg(echo->mux,ch,&type,&len);
+			if(mux_send(echo->mux,ch,type,msg,len)<0) {
+				return NULL;
+			}
+		} else {
+			return NULL;
+		}
+	}
+}
+
+UT_TEST_CASE(mux_channels) {
+	Websocket ws_client, ws_server;
+	test_ws_pair(&ws_client,&ws_server);
+	Mux client = mux_create(ws_client,false);
+	Test_Mux_Echo echo = { .mux = mux_create(ws_server,true) };
+
+	uint32_t bulk, chat;
+	ut_assert(mux_open(client,&bulk)==0 && bulk==1);
+	ut_assert(mux_open(client,&chat)==0 && chat==3);
+
+	// The bulk message goes as far as the window allows, before anyone reads
+	static unsigned char big[300000];
+	rnd_fill(big,sizeof(big));
+	ut_assert(mux_send(client,bulk,WS_MSG_BIN,big,sizeof(big))==0);
+	ut_assert(mux_queued(client,bulk)==sizeof(big) - MUX_INITIAL_WINDOW);
+	// ... and doesn't hold up the other channel
+	ut_assert(mux_send(client,chat,WS_MSG_TXT,"hello",5)==0);
+	ut_assert(mux_queued(client,chat)==0);
+
+	pthread_t thread;
+	ut_assert(pthread_create(&thread,NULL,test_mux_echo,&echo)==0);
+
+	// The chat echo comes back before the bulk one
+	uint32_t ch;
+	WS_Msg_Type type;
+	size_t len;
+	const unsigned char * msg;
+	ut_assert(mux_wait(client,&ch)==MUX_EV_MSG && ch==chat);
+	msg = mux_get_msg(client,ch,&type,&len);
+	ut_assert(type==WS_MSG_TXT && len==5 && memcmp(msg,"hello",5)==0);
+	ut_assert(mux_wait(client,&ch)==MUX_EV_MSG && ch==bulk);
+	msg = mux_get_msg(client,ch,&type,&len);
+	ut_assert(type==WS_MSG_BIN && len==sizeof(big) && memcmp(msg,big,len)==0);
+	ut_assert(mux_queued(client,bulk)==0);
+
+	// Closing a channel, then the websocket
+	ut_assert(mux_close(client,chat)==0);
+	ut_assert(mux_send(client,chat,WS_MSG_TXT,"x",1)<0 && errno==ENOENT);
+	ws_close(ws_client,WS_STATUS_NORMAL);
+	ut_assert(pthread_join(thread,NULL)==0);
+	ut_assert(echo.opened==2 && echo.msgs==2 && echo.closed==1);
+	ut_assert(echo.last==MUX_EV_CLOSE);
+
+	mux_free(client);
+	mux_free(echo.mux);
+	ws_free(ws_client);
+	ws_free(ws_server);
+}
+
+UT_TEST_CASE(mux_protocol_errors) {
+	Websocket ws_client, ws_server;
+	test_ws_pair(&ws_client,&ws_server);
+	Mux client = mux_create(ws_client,false);
+	Mux server = mux_create(ws_server,true);
+	uint32_t ch;
+
+	// A client can't open an even channel
+	unsigned char frame[MUX_HEADER_LEN + MUX_INITIAL_WINDOW + 1] = { MUX_OPEN, 0, 0, 0, 0, 2 };
+	ut_assert(mux_process(server,frame,MUX_HEADER_LEN,&ch)==MUX_EV_ERROR);
+	mux_free(server);
+	ws_free(ws_server);
+	mux_free(client);
+	ws_free(ws_client);
+
+	// Nor send more than its window
+	test_ws_pair(&ws_client,&ws_server);
+	client = mux_create(ws_client,false);
+	server = mux_create(ws_server,true);
+	uint32_t id;
+	ut_assert(mux_open(client,&id)==0);
+	frame[0] = MUX_DATA;
+	frame[5] = id;
+	ut_assert(ws_send_msg(ws_client,WS_MSG_BIN,frame,sizeof(frame)));
+	ut_assert(mux_wait(server,&ch)==MUX_EV_OPEN && ch==id);
+	ut_assert(mux_wait(server,&ch)==MUX_EV_ERROR);
+	ut_assert(!ws_is_open(ws_server));
+
+	// Unknown channels and frame types are ignored
+	Mux other = mux_create(ws_client,true);
+	frame[0] = MUX_DATA;
+	ut_assert(mux_process(other,frame,MUX_HEADER_LEN+1,&ch)==MUX_EV_NONE);
+	frame[0] = 0x7f;
+	ut_assert(mux_process(other,frame,MUX_HEADER_LEN,&ch)==MUX_EV_NONE);
+	mux_free(other);
+
+	mux_free(server);
+	ws_free(ws_server);
+	mux_free(client);
+	ws_free(ws_client);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
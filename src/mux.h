@@ -0,0 +1,100 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __MUX_H__
+#define __MUX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ws.h"
+
+// Logical channels over one websocket, for the MUX_PROTOCOL subprotocol
+// (negotiated with Sec-WebSocket-Protocol). Each (binary) websocket message
+// carries one mux frame:
+//
+//    +--------+--------+-----------------------------------+-------------
+//    |  type  | flags  |      channel id (32, big-endian)  | payload ...
+//    +--------+--------+-----------------------------------+-------------
+//
+// MUX_OPEN opens a channel (the client's ids are odd, the server's even),
+// MUX_DATA carries a fragment of a channel message, MUX_WINDOW grants the
+// peer more bytes to send on the channel (a 32-bit increment), and MUX_CLOSE
+// closes the channel. A channel may send MUX_INITIAL_WINDOW bytes before it
+// is granted more. Fragments of queued messages go out round-robin across
+// channels, so a busy channel can't starve the others.
+
+#define MUX_PROTOCOL "nuthatch.mux.1"
+
+#define MUX_HEADER_LEN     6
+#define MUX_MAX_CHANNELS   64          // open channels per websocket
+#define MUX_INITIAL_WINDOW 65536
+#define MUX_MAX_WINDOW     0x7fffffff
+#define MUX_MAX_FRAGMENT   16384       // largest MUX_DATA payload
+#define MUX_MAX_MSG        (16*1024*1024)
+
+typedef enum {
+	MUX_DATA   = 0,
+	MUX_OPEN   = 1,
+	MUX_CLOSE  = 2,
+	MUX_WINDOW = 3,
+} Mux_Frame_Type;
+
+#define MUX_FLAG_FIN  0x1 // last fragment of a message
+#define MUX_FLAG_TEXT 0x2 // a text message
+
+typedef enum {
+	MUX_EV_ERROR=0,       // an error has occurred (the websocket is closed on protocol errors)
+	MUX_EV_CLOSE,         // the remote endpoint has closed the websocket; use ws_status
+	MUX_EV_OPEN,          // the remote endpoint has opened a channel
+	MUX_EV_CHANNEL_CLOSE, // the remote endpoint has closed a channel
+	MUX_EV_MSG,           // a message has been received on a channel; use mux_get_msg
+	MUX_EV_NONE,          // (mux_process) nothing to report
+} Mux_Event;
+
+typedef struct Mux_S * Mux;
+
+/*! \brief Multiplex channels over ws, as the server or the client.
+ *  \return The mux, or NULL if out of memory.
+ */
+Mux mux_create(Websocket ws, bool server);
+
+/*! \brief Free the mux, and any messages not yet sent. The websocket is not closed.
+ */
+void mux_free(Mux mux);
+
+/*! \brief Open a channel.
+ *  \return 0, with the new channel's id, or -1 (errno ENOSPC if
+ *          MUX_MAX_CHANNELS are open already).
+ */
+int mux_open(Mux mux, uint32_t * channel);
+
+/*! \brief Close a channel, once its queued messages have been sent.
+ */
+int mux_close(Mux mux, uint32_t channel);
+
+/*! \brief Queue a message on a channel, and send what the channels' windows allow.
+ *  \return 0, or -1 (errno ENOENT for an unknown or closing channel, EMSGSIZE
+ *          for a message over MUX_MAX_MSG).
+ */
+int mux_send(Mux mux, uint32_t channel, WS_Msg_Type type, const void * msg, size_t msg_len);
+
+/*! \brief Bytes queued on a channel, waiting for the peer to grant more window.
+ */
+size_t mux_queued(Mux mux, uint32_t channel);
+
+/*! \brief Wait for an event on any channel, reading from the websocket (and
+ *         sending what window updates allow meanwhile).
+ *  \param channel Set to the channel the event is for.
+ */
+Mux_Event mux_wait(Mux mux, uint32_t * channel);
+
+/*! \brief Process a websocket message received by other means (e.g. ws_poll).
+ *  \return An event as for mux_wait, or MUX_EV_NONE.
+ */
+Mux_Event mux_process(Mux mux, const unsigned char * msg, size_t msg_len, uint32_t * channel);
+
+/*! \brief The message from the last MUX_EV_MSG, valid until the next mux_wait
+ *         or mux_process (when the peer is granted window for it).
+ */
+const unsigned char * mux_get_msg(Mux mux, uint32_t channel, WS_Msg_Type * type, size_t * msg_len);
+
+#endif // __MUX_H__
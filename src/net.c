@@ -1,8 +1,20 @@
 // Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#define _GNU_SOURCE // for struct ucred
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "log.h"
 #include "net.h"
+#include "math.h"
 
 /*! \brief Parse the given string as a dot notated ipv4 address.
  *
@@ -34,6 +46,246 @@ uint32_t net_atoipv4(const char * sz) {
 	return ipv4;
 }
 
+char * net_addr_to_sz(const struct sockaddr * addr, socklen_t addr_len, char * buff, size_t buff_len) {
+	char ip[INET6_ADDRSTRLEN];
+	if(addr==NULL) {
+		snprintf(buff,buff_len,"<none>");
+	} else if(addr->sa_family==AF_INET) {
+		const struct sockaddr_in * in = (const struct sockaddr_in *)addr;
+		inet_ntop(AF_INET,&in->sin_addr,ip,sizeof(ip));
+		snprintf(buff,buff_len,"%s:%u",ip,ntohs(in->sin_port));
+	} else if(addr->sa_family==AF_INET6) {
+		const struct sockaddr_in6 * in6 = (const struct sockaddr_in6 *)addr;
+		inet_ntop(AF_INET6,&in6->sin6_addr,ip,sizeof(ip));
+		snprintf(buff,buff_len,"[%s]:%u",ip,ntohs(in6->sin6_port));
+	} else if(addr->sa_family==AF_UNIX) {
+		const struct sockaddr_un * un = (const struct sockaddr_un *)addr;
+		// The path needn't be terminated, and isn't there at all for an
+		// unnamed socket
+		size_t path_max = addr_len > offsetof(struct sockaddr_un,sun_path)
+			? min((size_t)addr_len,sizeof(*un)) - offsetof(struct sockaddr_un,sun_path) : 0;
+		if(path_max>0 && un->sun_path[0]) {
+			snprintf(buff,buff_len,"unix:%.*s",(int)strnlen(un->sun_path,path_max),un->sun_path);
+		} else if(path_max>1 && un->sun_path[1]) {
+			snprintf(buff,buff_len,"unix:@%.*s",(int)strnlen(un->sun_path+1,path_max-1),un->sun_path+1);
+		} else {
+			snprintf(buff,buff_len,"unix");
+		}
+	} else {
+		snprintf(buff,buff_len,"<family=%d>",addr->sa_family);
+	}
+	return buff;
+}
+
+static int net_listen(int fd, const struct sockaddr * addr, socklen_t addr_len, int backlog) {
+	int ov = 1;
+	if(ioctl(fd,FIONBIO,&ov)<0) {
+		elogf("Failed to enable non-blocking IO mode: %s",strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if(bind(fd,addr,addr_len)<0) {
+		elogf("Failed to bind to server socket: %s",strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if(listen(fd,backlog)<0) {
+		elogf("Failed to listen to server socket: %s",strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int net_listen_tcp(uint32_t ipv4, int port, int backlog) {
+	int fd;
+	if((fd = socket(AF_INET,SOCK_STREAM,0))<0) {
+		elogf("Failed to create server socket: %s",strerror(errno));
+		return -1;
+	}
+	int ov = 1;
+	if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&ov,sizeof(ov))<0) {
+		elogf("Failed to set socket options: %s",strerror(errno));
+		close(fd);
+		return -1;
+	}
+	struct sockaddr_in addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = ipv4==INVALID_ADDR ? INADDR_ANY : ipv4;
+	return net_listen(fd,(struct sockaddr *)&addr,sizeof(addr),backlog);
+}
+
+static int unix_addr(const char * path, bool abstract, struct sockaddr_un * addr, socklen_t * addr_len) {
+	memset(addr,0,sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	size_t path_len = strlen(path);
+	// leave room for the null terminator, or the leading null of an abstract name
+	if(path_len==0 || path_len >= sizeof(addr->sun_path)-1) {
+		elogf("Invalid unix socket path: %s",path);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if(abstract) {
+		memcpy(addr->sun_path+1,path,path_len);
+		*addr_len = offsetof(struct sockaddr_un,sun_path) + 1 + path_len;
+	} else {
+		strcpy(addr->sun_path,path);
+		*addr_len = sizeof(*addr);
+	}
+	return 0;
+}
+
+int net_listen_unix(const char * path, bool abstract, int backlog) {
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	if(unix_addr(path,abstract,&addr,&addr_len)<0) {
+		return -1;
+	}
+	// remove a stale socket left behind by a previous run
+	if(!abstract && unlink(path)==0) {
+		ilogf("Removed existing unix socket: %s",path);
+	}
+	int fd;
+	if((fd = socket(AF_UNIX,SOCK_STREAM,0))<0) {
+		elogf("Failed to create server socket: %s",strerror(errno));
+		return -1;
+	}
+	return net_listen(fd,(struct sockaddr *)&addr,addr_len,backlog);
+}
+
+int net_connect_tcp(uint32_t ipv4, int port) {
+	int fd;
+	if((fd = socket(AF_INET,SOCK_STREAM,0))<0) {
+		elogf("Failed to create socket: %s",strerror(errno));
+		return -1;
+	}
+	struct sockaddr_in addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = ipv4;
+	if(connect(fd,(struct sockaddr *)&addr,sizeof(addr))<0) {
+		wlogf("Failed to connect: %s",strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int net_connect_unix(const char * path, bool abstract) {
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	if(unix_addr(path,abstract,&addr,&addr_len)<0) {
+		return -1;
+	}
+	int fd;
+	if((fd = socket(AF_UNIX,SOCK_STREAM,0))<0) {
+		elogf("Failed to create socket: %s",strerror(errno));
+		return -1;
+	}
+	if(connect(fd,(struct sockaddr *)&addr,addr_len)<0) {
+		wlogf("Failed to connect: %s",strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int net_incoming_cpu(int fd) {
+	int cpu = -1;
+	socklen_t len = sizeof(cpu);
+	if(getsockopt(fd,SOL_SOCKET,SO_INCOMING_CPU,&cpu,&len)<0) {
+		return -1;
+	}
+	return cpu;
+}
+
+int net_local_port(int fd) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	if(getsockname(fd,(struct sockaddr *)&addr,&addr_len)<0 || addr.sin_family!=AF_INET) {
+		return -1;
+	}
+	return ntohs(addr.sin_port);
+}
+
+void net_log_peer_cred(int fd) {
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	if(getsockopt(fd,SOL_SOCKET,SO_PEERCRED,&cred,&cred_len)<0) {
+		wlogf("Failed to get peer credentials: %s",strerror(errno));
+		return;
+	}
+	ilogf("Unix socket peer: pid=%d, uid=%d, gid=%d",cred.pid,cred.uid,cred.gid);
+#endif
+}
+
+int net_send_fd(int fd_chan, int fd, const void * msg, size_t msg_len) {
+	struct iovec iov = { .iov_base = (void *)msg, .iov_len = msg_len };
+	union {
+		struct cmsghdr align;
+		char buff[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control,0,sizeof(control));
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buff,
+		.msg_controllen = sizeof(control.buff),
+	};
+	struct cmsghdr * cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm),&fd,sizeof(int));
+	ssize_t n;
+	while((n = sendmsg(fd_chan,&mh,MSG_NOSIGNAL))<0 && errno==EINTR);
+	if(n<0) {
+		return -1;
+	}
+	if(n!=msg_len) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t net_recv_fd(int fd_chan, int * fd, void * msg, size_t msg_len) {
+	struct iovec iov = { .iov_base = msg, .iov_len = msg_len };
+	union {
+		struct cmsghdr align;
+		char buff[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buff,
+		.msg_controllen = sizeof(control.buff),
+	};
+	*fd = -1;
+	ssize_t n;
+#ifdef MSG_CMSG_CLOEXEC
+	while((n = recvmsg(fd_chan,&mh,MSG_CMSG_CLOEXEC))<0 && errno==EINTR);
+#else
+	while((n = recvmsg(fd_chan,&mh,0))<0 && errno==EINTR);
+#endif
+	if(n<0) {
+		return -1;
+	}
+	for(struct cmsghdr * cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh,cm)) {
+		if(cm->cmsg_level==SOL_SOCKET && cm->cmsg_type==SCM_RIGHTS && cm->cmsg_len==CMSG_LEN(sizeof(int))) {
+			memcpy(fd,CMSG_DATA(cm),sizeof(int));
+		}
+	}
+	if(mh.msg_flags & MSG_CTRUNC) {
+		wlogf("File descriptor was not received: control data truncated");
+	}
+	return n;
+}
+
 #ifndef EXCLUDE_UNIT_TESTS
 
 #include "ut.h"
@@ -50,4 +302,211 @@ UT_TEST_CASE(net_atoipv4) {
 	ut_assert(net_atoipv4("...")==INVALID_ADDR);
 }
 
+UT_TEST_CASE(net_addr_to_sz) {
+	char buff[NET_ADDR_STR_LEN];
+	struct sockaddr_in in = { .sin_family = AF_INET, .sin_port = htons(8088), .sin_addr.s_addr = htonl(0x7f000001) };
+	ut_assert(strcmp("127.0.0.1:8088",net_addr_to_sz((struct sockaddr *)&in,sizeof(in),buff,sizeof(buff)))==0);
+	struct sockaddr_in6 in6 = { .sin6_family = AF_INET6, .sin6_port = htons(80), .sin6_addr = IN6ADDR_LOOPBACK_INIT };
+	ut_assert(strcmp("[::1]:80",net_addr_to_sz((struct sockaddr *)&in6,sizeof(in6),buff,sizeof(buff)))==0);
+	ut_assert(strcmp("<none>",net_addr_to_sz(NULL,0,buff,sizeof(buff)))==0);
+	struct sockaddr_un un = { .sun_family = AF_UNIX, .sun_path = "/tmp/nuthatch.sock" };
+	ut_assert(strcmp("unix:/tmp/nuthatch.sock",net_addr_to_sz((struct sockaddr *)&un,sizeof(un),buff,sizeof(buff)))==0);
+	memcpy(un.sun_path,"\0name",6);
+	ut_assert(strcmp("unix:@name",net_addr_to_sz((struct sockaddr *)&un,sizeof(un),buff,sizeof(buff)))==0);
+	// An abstract name is as long as the address says, without a terminator
+	ut_assert(strcmp("unix:@na",net_addr_to_sz((struct sockaddr *)&un,offsetof(struct sockaddr_un,sun_path) + 3,buff,sizeof(buff)))==0);
+	// Unnamed (a client that didn't bind), with whatever is in the path
+	memset(un.sun_path,'x',sizeof(un.sun_path));
+	ut_assert(strcmp("unix",net_addr_to_sz((struct sockaddr *)&un,sizeof(sa_family_t),buff,sizeof(buff)))==0);
+	ut_assert(strcmp("unix:xxx",net_addr_to_sz((struct sockaddr *)&un,offsetof(struct sockaddr_un,sun_path) + 3,buff,sizeof(buff)))==0);
+}
+
+UT_TEST_CASE(net_listen_unix) {
+	const char * path = "build/net-test.sock";
+	int fd = net_listen_unix(path,false,1);
+	ut_assert(fd>=0);
+	// a stale socket file is replaced
+	int fd2 = net_listen_unix(path,false,1);
+	ut_assert(fd2>=0);
+	close(fd);
+
+	int fd_client = net_connect_unix(path,false);
+	ut_assert(fd_client>=0);
+	int fd_accepted = accept(fd2,NULL,NULL);
+	ut_assert(fd_accepted>=0);
+	net_log_peer_cred(fd_accepted);
+	close(fd_accepted);
+	close(fd_client);
+	close(fd2);
+	unlink(path);
+
+#ifdef __linux__
+	fd = net_listen_unix("nuthatch-test",true,1);
+	ut_assert(fd>=0);
+	fd_client = net_connect_unix("nuthatch-test",true);
+	ut_assert(fd_client>=0);
+	close(fd_client);
+	close(fd);
+#endif
+	char long_path[sizeof(((struct sockaddr_un *)0)->sun_path)+1];
+	memset(long_path,'x',sizeof(long_path)-1);
+	long_path[sizeof(long_path)-1] = 0;
+	ut_assert(net_listen_unix(long_path,false,1)<0);
+}
+
+UT_TEST_CASE(net_listen_tcp) {
+	uint32_t loopback = net_atoipv4("127.0.0.1");
+	int fd = net_listen_tcp(loopback,0,1);
+	ut_assert(fd>=0);
+	int port = net_local_port(fd);
+	ut_assert(port>0);
+	int fd_client = net_connect_tcp(loopback,port);
+	ut_assert(fd_client>=0);
+	ut_assert(write(fd_client,"x",1)==1);
+	int fd_accepted;
+	while((fd_accepted = accept(fd,NULL,NULL))<0 && errno==EAGAIN) {
+		usleep(1000);
+	}
+	ut_assert(fd_accepted>=0);
+	ut_assert(net_incoming_cpu(fd_accepted)>=0);
+	ut_assert(net_incoming_cpu(-1)==-1);
+	close(fd_accepted);
+	close(fd_client);
+	close(fd);
+}
+
+UT_TEST_CASE(net_send_fd) {
+	int chan[2];
+	ut_assert(socketpair(AF_UNIX,SOCK_SEQPACKET,0,chan)==0);
+	int fd = open("web/index.html",O_RDONLY);
+	ut_assert(fd>=0);
+	ut_assert(net_send_fd(chan[0],fd,"hello",5)==0);
+	close(fd);
+	char msg[16];
+	int fd_recv;
+	ut_assert(net_recv_fd(chan[1],&fd_recv,msg,sizeof(msg))==5);
+	ut_assert(memcmp(msg,"hello",5)==0);
+	ut_assert(fd_recv>=0);
+	char buff[6];
+	ut_assert(read(fd_recv,buff,sizeof(buff))==sizeof(buff));
+	ut_assert(memcmp(buff,"<!--\nC",6)==0);
+	close(fd_recv);
+	// A message without a file descriptor
+	ut_assert(write(chan[0],"x",1)==1);
+	ut_assert(net_recv_fd(chan[1],&fd_recv,msg,sizeof(msg))==1);
+	ut_assert(fd_recv==-1);
+	close(chan[0]);
+	ut_assert(net_recv_fd(chan[1],&fd_recv,msg,sizeof(msg))==0);
+	close(chan[1]);
+}
+
 #endif // !EXCLUDE_UNIT_TESTS
+
+#ifndef EXCLUDE_BENCHMARKS
+
+#include <pthread.h>
+#include <poll.h>
+#include "bench.h"
+
+#define BENCH_UNIX_PATH "build/bench-net.sock"
+
+typedef struct {
+	int fd_listen;
+	int fd_client;
+	int fd_server;
+} Bench_Conn;
+
+// Connect a client to a listener over either loopback TCP or a Unix socket
+static bool bench_connect(Bench_Conn * c, bool use_unix) {
+	uint32_t loopback = net_atoipv4("127.0.0.1");
+	c->fd_listen = use_unix ? net_listen_unix(BENCH_UNIX_PATH,false,1) : net_listen_tcp(loopback,0,1);
+	if(c->fd_listen<0) {
+		return false;
+	}
+	c->fd_client = use_unix ? net_connect_unix(BENCH_UNIX_PATH,false) : net_connect_tcp(loopback,net_local_port(c->fd_listen));
+	struct pollfd pfd = { .fd = c->fd_listen, .events = POLLIN };
+	poll(&pfd,1,1000);
+	c->fd_server = accept(c->fd_listen,NULL,NULL);
+	int ov = 0;
+	ioctl(c->fd_server,FIONBIO,&ov);
+	return c->fd_client>=0 && c->fd_server>=0;
+}
+
+static void bench_disconnect(Bench_Conn * c, bool use_unix) {
+	close(c->fd_client);
+	close(c->fd_server);
+	close(c->fd_listen);
+	if(use_unix) {
+		unlink(BENCH_UNIX_PATH);
+	}
+}
+
+static void * bench_echo(void * arg) {
+	int fd = *(int *)arg;
+	char buff[64];
+	ssize_t n;
+	while((n = read(fd,buff,sizeof(buff)))>0) {
+		if(write(fd,buff,n)!=n) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void * bench_sink(void * arg) {
+	int fd = *(int *)arg;
+	char buff[65536];
+	while(read(fd,buff,sizeof(buff))>0);
+	return NULL;
+}
+
+BENCH_CASE(net_loopback_tcp_vs_unix) {
+	const uint64_t round_trips = bench_iterations(20000);
+	const size_t chunk = 65536;
+	const uint64_t chunks = bench_iterations(16384);
+	static char buff[65536];
+	for(int use_unix=0; use_unix<=1; use_unix++) {
+		const char * transport = use_unix ? "unix" : "tcp";
+		char label[64];
+		Bench_Conn c;
+		pthread_t t;
+
+		// Latency: 1 byte ping-pong
+		if(!bench_connect(&c,use_unix)) {
+			elogf("Failed to set up %s connection",transport);
+			return;
+		}
+		pthread_create(&t,NULL,bench_echo,&c.fd_server);
+		uint64_t start = tm_now_ns();
+		for(uint64_t i=0; i<round_trips; i++) {
+			char b = (char)i;
+			if(write(c.fd_client,&b,1)!=1 || read(c.fd_client,&b,1)!=1) {
+				break;
+			}
+		}
+		uint64_t elapsed = tm_now_ns() - start;
+		shutdown(c.fd_client,SHUT_WR);
+		pthread_join(t,NULL);
+		bench_disconnect(&c,use_unix);
+		snprintf(label,sizeof(label),"%s round trip (1 byte)",transport);
+		bench_report(label,round_trips,0,elapsed);
+
+		// Throughput: 64KB writes
+		bench_connect(&c,use_unix);
+		pthread_create(&t,NULL,bench_sink,&c.fd_server);
+		start = tm_now_ns();
+		for(uint64_t i=0; i<chunks; i++) {
+			if(write(c.fd_client,buff,chunk)<0) {
+				break;
+			}
+		}
+		shutdown(c.fd_client,SHUT_WR);
+		pthread_join(t,NULL);
+		elapsed = tm_now_ns() - start;
+		bench_disconnect(&c,use_unix);
+		snprintf(label,sizeof(label),"%s stream (64KB writes)",transport);
+		bench_report(label,chunks,chunks*chunk,elapsed);
+	}
+}
+
+#endif // !EXCLUDE_BENCHMARKS
@@ -3,9 +3,71 @@
 #define __NET_H__
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/socket.h>
 
 #define INVALID_ADDR ((uint32_t)-1)
 
+// Big enough for an IPv6 address and port, e.g. "[ffff:...:ffff]:65535"
+#define NET_ADDR_STR_LEN 64
+
 uint32_t net_atoipv4(const char * sz);
 
+/*! \brief Format the given socket address as a string, for logging. The
+ *  length is the address's (as accept returns it), which for a unix socket
+ *  bounds the path; an unnamed unix socket is "unix".
+ *  \return The given buffer.
+ */
+char * net_addr_to_sz(const struct sockaddr * addr, socklen_t addr_len, char * buff, size_t buff_len);
+
+/*! \brief Create a non-blocking TCP socket listening on the given address and port.
+ *  \param addr IPv4 address in network byte order, or INVALID_ADDR for any address.
+ *  \return The listening socket, or -1 if something went wrong.
+ */
+int net_listen_tcp(uint32_t addr, int port, int backlog);
+
+/*! \brief Create a non-blocking Unix domain socket listening on the given path.
+ *  \param abstract If true, the socket is bound to the given name in the
+ *         (Linux) abstract namespace, instead of a file system path.
+ *  \return The listening socket, or -1 if something went wrong.
+ */
+int net_listen_unix(const char * path, bool abstract, int backlog);
+
+/*! \brief Connect to the given TCP address and port.
+ *  \return The connected (blocking) socket, or -1 if something went wrong.
+ */
+int net_connect_tcp(uint32_t addr, int port);
+
+/*! \brief Connect to the given Unix domain socket.
+ *  \return The connected (blocking) socket, or -1 if something went wrong.
+ */
+int net_connect_unix(const char * path, bool abstract);
+
+/*! \brief The port number a TCP socket is bound to, or -1 if something went wrong.
+ */
+int net_local_port(int fd);
+
+/*! \brief The CPU that handled the incoming packets of a connection
+ *         (SO_INCOMING_CPU), or -1 if not known.
+ */
+int net_incoming_cpu(int fd);
+
+/*! \brief Log the credentials (pid, uid, gid) of the peer process connected to
+ *         the given Unix domain socket.
+ */
+void net_log_peer_cred(int fd);
+
+/*! \brief Send a message, along with a file descriptor (SCM_RIGHTS), over a
+ *         connected Unix domain socket.
+ *  \return 0 if successful, or -1 if something went wrong.
+ */
+int net_send_fd(int fd_chan, int fd, const void * msg, size_t msg_len);
+
+/*! \brief Receive a message, and the file descriptor that came with it, if any.
+ *  \param fd Set to the received file descriptor, or -1 if there was none.
+ *  \return The length of the message, 0 on EOF, or -1 if something went wrong.
+ */
+ssize_t net_recv_fd(int fd_chan, int * fd, void * msg, size_t msg_len);
+
 #endif // __NET_H__
@@ -0,0 +1,51 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+#include "sz.h"
+#include "io.h"
+#include "pak.h"
+
+// Pack a static files directory into a bundle, for the server's --static-bundle option
+
+static void usage(FILE * out, const char * prog) {
+	fprintf(out,"Usage: %s [options] <static-files-dir> <bundle-file>\n",prog);
+	fprintf(out,"Packs the files under <static-files-dir> into <bundle-file>. A file \"x.gz\" next to\n");
+	fprintf(out,"a file \"x\" is served as the gzip encoding of \"x\", to clients that accept it.\n");
+	fprintf(out,"Options:\n");
+	fprintf(out,"  --debug                Enable debug output\n");
+}
+
+int main(int argc, char ** argv) {
+	log_set_level(LEVEL_INFO);
+	const char * dir = NULL;
+	const char * out = NULL;
+	for(int iarg=1; iarg<argc; iarg++) {
+		const char * arg = argv[iarg];
+		if(sz_starts_with(arg,"--")) {
+			if(0==strcmp("--debug",arg)) {
+				log_set_level(LEVEL_DEBUG);
+			} else {
+				fprintf(stderr,"Unrecognized command line option: %s\n",arg);
+				return 1;
+			}
+		} else if(!dir) {
+			dir = arg;
+		} else if(!out) {
+			out = arg;
+		} else {
+			fprintf(stderr,"Unexpected command line argument: %s\n",arg);
+			return 1;
+		}
+	}
+	if(!dir || !out) {
+		usage(stderr,argv[0]);
+		return 1;
+	}
+	if(!io_is_dir(dir)) {
+		fprintf(stderr,"Must be a directory: %s\n",dir);
+		return 1;
+	}
+	return pak_build(dir,out)<0 ? 1 : 0;
+}
@@ -0,0 +1,741 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#define _GNU_SOURCE // for asprintf
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "sz.h"
+#include "endian.h"
+#include "pak.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+#define PAK_SEED 0x9e3779b9u
+#define PAK_BODY_ALIGN 16
+#define PAK_MAX_DISPLACEMENT 10000000
+
+struct Pak_S {
+	int fd;
+	const unsigned char * map;
+	size_t size;
+	uint32_t num_entries;
+	uint32_t seed;
+	const int32_t * index;
+	const Pak_Entry * entries;
+	const char * strings;
+	size_t strings_len;
+};
+
+static const struct {
+	const char * ext;
+	const char * type;
+} PAK_CONTENT_TYPES[] = {
+	{ "html", "text/html; charset=utf-8" },
+	{ "htm", "text/html; charset=utf-8" },
+	{ "css", "text/css; charset=utf-8" },
+	{ "js", "text/javascript; charset=utf-8" },
+	{ "mjs", "text/javascript; charset=utf-8" },
+	{ "json", "application/json" },
+	{ "map", "application/json" },
+	{ "txt", "text/plain; charset=utf-8" },
+	{ "xml", "application/xml" },
+	{ "svg", "image/svg+xml" },
+	{ "png", "image/png" },
+	{ "jpg", "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "gif", "image/gif" },
+	{ "webp", "image/webp" },
+	{ "avif", "image/avif" },
+	{ "ico", "image/x-icon" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "ttf", "font/ttf" },
+	{ "wasm", "application/wasm" },
+	{ "pdf", "application/pdf" },
+	{ "mp4", "video/mp4" },
+	{ "webm", "video/webm" },
+	{ "mp3", "audio/mpeg" },
+	{ "ogg", "audio/ogg" },
+};
+
+static const char * PAK_DEFAULT_CONTENT_TYPE = "application/octet-stream";
+
+static const char * pak_content_type(const char * path) {
+	const char * slash = strrchr(path,'/');
+	const char * dot = strrchr(path,'.');
+	if(!dot || (slash && dot<slash)) {
+		return PAK_DEFAULT_CONTENT_TYPE;
+	}
+	for(size_t i=0; i<sizeof(PAK_CONTENT_TYPES)/sizeof(PAK_CONTENT_TYPES[0]); i++) {
+		if(sz_equal_ignore_case(dot+1,PAK_CONTENT_TYPES[i].ext)) {
+			return PAK_CONTENT_TYPES[i].type;
+		}
+	}
+	return PAK_DEFAULT_CONTENT_TYPE;
+}
+
+const char * pak_encoding_name(Pak_Encoding encoding) {
+	return encoding==PAK_GZIP ? "gzip" : NULL;
+}
+
+// FNV-1a, with a seed, and a final mix so that the low bits depend on all of
+// the key (slots are taken modulo the number of entries)
+static uint32_t pak_hash(uint32_t seed, const char * key, size_t len) {
+	uint32_t h = 0x811c9dc5u ^ seed;
+	for(size_t i=0; i<len; i++) {
+		h = (h ^ (unsigned char)key[i]) * 0x01000193u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+// The entry slot of a key: the first level hash selects a displacement; a
+// negative displacement is the slot itself (buckets with one key), otherwise
+// it seeds the second level hash.
+static uint32_t pak_slot(uint32_t seed, const int32_t * index, uint32_t n, const char * key, size_t len) {
+	int32_t d = (int32_t)le32toh((uint32_t)index[pak_hash(seed,key,len) % n]);
+	if(d<0) {
+		return (uint32_t)(-(d+1));
+	}
+	return pak_hash((uint32_t)d,key,len) % n;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Reading
+
+static bool pak_valid_string(const Pak * pak, uint32_t off) {
+	return off<pak->strings_len && memchr(pak->strings+off,0,pak->strings_len-off);
+}
+
+static bool pak_valid_entry(const Pak * pak, const Pak_Entry * e) {
+	if(!pak_valid_string(pak,le32toh(e->path)) || strlen(pak->strings+le32toh(e->path))!=le32toh(e->path_len)) {
+		return false;
+	}
+	if(!e->variants[PAK_IDENTITY].headers) {
+		return false;
+	}
+	for(int i=0; i<PAK_NUM_ENCODINGS; i++) {
+		const Pak_Variant * v = &e->variants[i];
+		if(!v->headers) {
+			continue;
+		}
+		uint64_t off = le64toh(v->body_off);
+		uint64_t len = le64toh(v->body_len);
+		if(off>pak->size || len>pak->size-off) {
+			return false;
+		}
+		if(!pak_valid_string(pak,le32toh(v->headers)) || !pak_valid_string(pak,le32toh(v->content_type))
+			|| !pak_valid_string(pak,le32toh(v->etag))
+			|| strlen(pak->strings+le32toh(v->headers))!=le32toh(v->headers_len)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool pak_valid(const Pak * pak) {
+	const Pak_Header * h = (const Pak_Header *)pak->map;
+	if(pak->size<sizeof(Pak_Header) || memcmp(h->magic,PAK_MAGIC,PAK_MAGIC_LEN)!=0) {
+		elogf("Not a static bundle");
+		return false;
+	}
+	if(le32toh(h->version)!=PAK_VERSION) {
+		elogf("Unsupported static bundle version: %u",le32toh(h->version));
+		return false;
+	}
+	uint64_t n = le32toh(h->num_entries);
+	uint64_t index_off = le64toh(h->index_off);
+	uint64_t entries_off = le64toh(h->entries_off);
+	uint64_t strings_off = le64toh(h->strings_off);
+	uint64_t strings_len = le64toh(h->strings_len);
+	if(le64toh(h->size)!=pak->size
+		|| index_off%sizeof(int32_t) || entries_off%sizeof(uint64_t)
+		|| index_off>pak->size || n*sizeof(int32_t)>pak->size-index_off
+		|| entries_off>pak->size || n*sizeof(Pak_Entry)>pak->size-entries_off
+		|| strings_off>pak->size || strings_len>pak->size-strings_off
+		|| strings_len==0 || pak->map[strings_off]!=0) {
+		elogf("Static bundle is truncated or corrupt");
+		return false;
+	}
+	return true;
+}
+
+Pak * pak_open(const char * path) {
+	errno = 0;
+	int fd = open(path,O_RDONLY|O_CLOEXEC);
+	if(fd<0) {
+		elogf("Can't open static bundle: %s: %s",path,strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if(fstat(fd,&st)<0 || !S_ISREG(st.st_mode) || st.st_size==0) {
+		elogf("Static bundle must be a non-empty regular file: %s",path);
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	void * map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	if(map==MAP_FAILED) {
+		elogf("Can't map static bundle: %s: %s",path,strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	Pak * pak = calloc(1,sizeof(Pak));
+	pak->fd = fd;
+	pak->map = map;
+	pak->size = st.st_size;
+	if(!pak_valid(pak)) {
+		pak_close(pak);
+		errno = EINVAL;
+		return NULL;
+	}
+	const Pak_Header * h = (const Pak_Header *)pak->map;
+	pak->num_entries = le32toh(h->num_entries);
+	pak->seed = le32toh(h->seed);
+	pak->index = (const int32_t *)(pak->map + le64toh(h->index_off));
+	pak->entries = (const Pak_Entry *)(pak->map + le64toh(h->entries_off));
+	pak->strings = (const char *)pak->map + le64toh(h->strings_off);
+	pak->strings_len = le64toh(h->strings_len);
+	// Validate once, so that lookups can trust the archive
+	for(uint32_t i=0; i<pak->num_entries; i++) {
+		int32_t d = (int32_t)le32toh((uint32_t)pak->index[i]);
+		if(!pak_valid_entry(pak,&pak->entries[i]) || (d<0 && (uint32_t)(-(d+1))>=pak->num_entries)) {
+			elogf("Static bundle has an invalid entry: %u",i);
+			pak_close(pak);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	ilogf("Opened static bundle: %s: files=%u size=%zu",path,pak->num_entries,pak->size);
+	return pak;
+}
+
+void pak_close(Pak * pak) {
+	if(pak) {
+		munmap((void *)pak->map,pak->size);
+		close(pak->fd);
+		free(pak);
+	}
+}
+
+int pak_fd(const Pak * pak) {
+	return pak->fd;
+}
+
+size_t pak_num_entries(const Pak * pak) {
+	return pak->num_entries;
+}
+
+bool pak_lookup(const Pak * pak, const char * path, size_t path_len, Pak_Encoding encoding, Pak_File * file) {
+	if(pak->num_entries==0) {
+		return false;
+	}
+	const Pak_Entry * e = &pak->entries[pak_slot(pak->seed,pak->index,pak->num_entries,path,path_len)];
+	// Any key hashes to some slot; make sure it's the right one
+	if(le32toh(e->path_len)!=path_len || memcmp(pak->strings+le32toh(e->path),path,path_len)!=0) {
+		return false;
+	}
+	if(encoding>=PAK_NUM_ENCODINGS || !e->variants[encoding].headers) {
+		encoding = PAK_IDENTITY;
+	}
+	const Pak_Variant * v = &e->variants[encoding];
+	file->path = pak->strings + le32toh(e->path);
+	file->encoding = encoding;
+	file->has_variants = false;
+	for(int i=0; i<PAK_NUM_ENCODINGS; i++) {
+		if(i!=PAK_IDENTITY && e->variants[i].headers) {
+			file->has_variants = true;
+		}
+	}
+	file->content_type = pak->strings + le32toh(v->content_type);
+	file->etag = pak->strings + le32toh(v->etag);
+	file->headers = pak->strings + le32toh(v->headers);
+	file->headers_len = le32toh(v->headers_len);
+	file->offset = le64toh(v->body_off);
+	file->len = le64toh(v->body_len);
+	file->data = pak->map + file->offset;
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Building
+
+typedef struct {
+	char * uri;           // "/dir/file"
+	char * fs_path;
+	char * gz_fs_path;    // gzip variant, or NULL
+	bool is_variant;      // this is the gzip variant of another file
+} Pak_Build_File;
+
+typedef struct {
+	Pak_Build_File * files;
+	size_t count;
+	size_t capacity;
+	// String table
+	char * strings;
+	size_t strings_len;
+	size_t strings_cap;
+} Pak_Builder;
+
+static int pak_collect(Pak_Builder * b, const char * fs_dir, const char * uri_dir) {
+	DIR * dir = opendir(fs_dir);
+	if(!dir) {
+		elogf("Can't open directory: %s: %s",fs_dir,strerror(errno));
+		return -1;
+	}
+	int ret = 0;
+	struct dirent * de;
+	while(ret==0 && (de = readdir(dir))) {
+		if(strcmp(de->d_name,".")==0 || strcmp(de->d_name,"..")==0) {
+			continue;
+		}
+		char * fs_path = NULL;
+		char * uri = NULL;
+		if(asprintf(&fs_path,"%s/%s",fs_dir,de->d_name)<0 || asprintf(&uri,"%s/%s",uri_dir,de->d_name)<0) {
+			ret = -1;
+			break;
+		}
+		struct stat st;
+		if(stat(fs_path,&st)<0) {
+			wlogf("Skipping %s: %s",fs_path,strerror(errno));
+		} else if(S_ISDIR(st.st_mode)) {
+			ret = pak_collect(b,fs_path,uri);
+		} else if(S_ISREG(st.st_mode)) {
+			if(b->count==b->capacity) {
+				b->capacity = b->capacity ? b->capacity*2 : 64;
+				b->files = realloc(b->files,b->capacity*sizeof(Pak_Build_File));
+			}
+			b->files[b->count++] = (Pak_Build_File){ .uri = uri, .fs_path = fs_path };
+			uri = fs_path = NULL;
+		}
+		free(fs_path);
+		free(uri);
+	}
+	closedir(dir);
+	return ret;
+}
+
+static int pak_cmp_uri(const void * a, const void * b) {
+	return strcmp(((const Pak_Build_File *)a)->uri,((const Pak_Build_File *)b)->uri);
+}
+
+// Pair "x.gz" with "x"
+static void pak_match_variants(Pak_Builder * b) {
+	qsort(b->files,b->count,sizeof(Pak_Build_File),pak_cmp_uri);
+	for(size_t i=0; i<b->count; i++) {
+		Pak_Build_File * gz = &b->files[i];
+		size_t len = strlen(gz->uri);
+		if(len<4 || strcmp(gz->uri+len-3,".gz")!=0) {
+			continue;
+		}
+		Pak_Build_File key = { .uri = strndup(gz->uri,len-3) };
+		Pak_Build_File * f = bsearch(&key,b->files,b->count,sizeof(Pak_Build_File),pak_cmp_uri);
+		free(key.uri);
+		if(f) {
+			f->gz_fs_path = gz->fs_path;
+			gz->is_variant = true;
+		}
+	}
+}
+
+static uint32_t pak_add_string(Pak_Builder * b, const char * s, size_t len) {
+	if(b->strings_len+len+1>b->strings_cap) {
+		b->strings_cap = (b->strings_len+len+1)*2;
+		b->strings = realloc(b->strings,b->strings_cap);
+	}
+	uint32_t off = b->strings_len;
+	memcpy(b->strings+off,s,len);
+	b->strings[off+len] = 0;
+	b->strings_len += len+1;
+	return off;
+}
+
+static int pak_write_all(int fd, const void * data, size_t len) {
+	const unsigned char * p = data;
+	while(len>0) {
+		ssize_t n = write(fd,p,len);
+		if(n<0) {
+			if(errno==EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Copy a file body into the archive, and fill in its variant
+static int pak_write_variant(Pak_Builder * b, int fd_out, off_t * out_off, const char * fs_path,
+		const char * content_type, Pak_Encoding encoding, bool vary, Pak_Variant * v) {
+	int fd = open(fs_path,O_RDONLY);
+	if(fd<0) {
+		elogf("Can't open %s: %s",fs_path,strerror(errno));
+		return -1;
+	}
+	// Bodies are aligned, which helps with reading them from the map
+	static const unsigned char zeros[PAK_BODY_ALIGN] = { 0 };
+	size_t pad = (PAK_BODY_ALIGN - *out_off % PAK_BODY_ALIGN) % PAK_BODY_ALIGN;
+	if(pak_write_all(fd_out,zeros,pad)<0) {
+		close(fd);
+		return -1;
+	}
+	*out_off += pad;
+	uint64_t body_off = *out_off;
+	uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a (64 bit) of the body, for the ETag
+	unsigned char buff[65536];
+	ssize_t n;
+	while((n = read(fd,buff,sizeof(buff)))>0) {
+		for(ssize_t i=0; i<n; i++) {
+			h = (h ^ buff[i]) * 0x100000001b3ULL;
+		}
+		if(pak_write_all(fd_out,buff,n)<0) {
+			break;
+		}
+		*out_off += n;
+	}
+	close(fd);
+	if(n!=0) {
+		elogf("Can't copy %s: %s",fs_path,strerror(errno));
+		return -1;
+	}
+	uint64_t len = *out_off - body_off;
+	char etag[24];
+	snprintf(etag,sizeof(etag),"\"%016llx\"",(unsigned long long)h);
+	char * headers = NULL;
+	int headers_len = asprintf(&headers,
+		"Content-Type: %s\r\n"
+		"Content-Length: %llu\r\n"
+		"ETag: %s\r\n"
+		"%s%s%s"
+		"%s",
+		content_type,(unsigned long long)len,etag,
+		encoding!=PAK_IDENTITY?"Content-Encoding: ":"",encoding!=PAK_IDENTITY?pak_encoding_name(encoding):"",encoding!=PAK_IDENTITY?"\r\n":"",
+		vary?"Vary: Accept-Encoding\r\n":"");
+	if(headers_len<0) {
+		return -1;
+	}
+	v->body_off = htole64(body_off);
+	v->body_len = htole64(len);
+	v->headers = htole32(pak_add_string(b,headers,headers_len));
+	v->headers_len = htole32(headers_len);
+	v->content_type = htole32(pak_add_string(b,content_type,strlen(content_type)));
+	v->etag = htole32(pak_add_string(b,etag,strlen(etag)));
+	free(headers);
+	return 0;
+}
+
+// Build a minimal perfect hash of the keys ("hash and displace"): keys are
+// hashed into n buckets; starting with the largest buckets, find a
+// displacement that puts all keys of a bucket into free slots. Buckets with a
+// single key are then given the remaining slots directly.
+static int pak_perfect_hash(char * const * keys, uint32_t n, uint32_t seed, int32_t * index, uint32_t * slots) {
+	uint32_t * bucket_of = malloc((n+1)*sizeof(uint32_t));
+	uint32_t * bucket_start = calloc(n+1,sizeof(uint32_t));
+	uint32_t * members = malloc((n+1)*sizeof(uint32_t)); // keys, grouped by bucket
+	uint32_t * fill = calloc(n+1,sizeof(uint32_t));
+	uint32_t * candidate = malloc((n+1)*sizeof(uint32_t));
+	bool * used = calloc(n+1,sizeof(bool));
+	int ret = 0;
+	uint32_t max_size = 0;
+	for(uint32_t i=0; i<n; i++) {
+		bucket_of[i] = pak_hash(seed,keys[i],strlen(keys[i])) % n;
+		bucket_start[bucket_of[i]+1]++;
+		index[i] = 0;
+	}
+	for(uint32_t i=0; i<n; i++) {
+		if(bucket_start[i+1]>max_size) {
+			max_size = bucket_start[i+1];
+		}
+		bucket_start[i+1] += bucket_start[i];
+	}
+	for(uint32_t i=0; i<n; i++) {
+		uint32_t bucket = bucket_of[i];
+		members[bucket_start[bucket] + fill[bucket]++] = i;
+	}
+	for(uint32_t size=max_size; size>1 && ret==0; size--) {
+		for(uint32_t bucket=0; bucket<n; bucket++) {
+			if(bucket_start[bucket+1]-bucket_start[bucket]!=size) {
+				continue;
+			}
+			const uint32_t * m = &members[bucket_start[bucket]];
+			uint32_t d;
+			for(d=1; d<PAK_MAX_DISPLACEMENT; d++) {
+				uint32_t j;
+				for(j=0; j<size; j++) {
+					candidate[j] = pak_hash(d,keys[m[j]],strlen(keys[m[j]])) % n;
+					if(used[candidate[j]]) {
+						break;
+					}
+					used[candidate[j]] = true; // tentatively
+				}
+				if(j==size) {
+					break;
+				}
+				while(j-->0) {
+					used[candidate[j]] = false;
+				}
+			}
+			if(d==PAK_MAX_DISPLACEMENT) {
+				elogf("Failed to find a perfect hash");
+				errno = EOVERFLOW;
+				ret = -1;
+				break;
+			}
+			for(uint32_t j=0; j<size; j++) {
+				slots[m[j]] = candidate[j];
+			}
+			index[bucket] = d;
+		}
+	}
+	uint32_t next_free = 0;
+	for(uint32_t bucket=0; bucket<n && ret==0; bucket++) {
+		if(bucket_start[bucket+1]-bucket_start[bucket]!=1) {
+			continue;
+		}
+		while(used[next_free]) {
+			next_free++;
+		}
+		used[next_free] = true;
+		slots[members[bucket_start[bucket]]] = next_free;
+		index[bucket] = -(int32_t)next_free - 1;
+	}
+	for(uint32_t i=0; i<n; i++) {
+		index[i] = (int32_t)htole32((uint32_t)index[i]);
+	}
+	free(bucket_of);
+	free(bucket_start);
+	free(members);
+	free(fill);
+	free(candidate);
+	free(used);
+	return ret;
+}
+
+int pak_build(const char * dir, const char * out_path) {
+	errno = 0;
+	Pak_Builder b = { 0 };
+	int fd_out = -1;
+	int ret = -1;
+	char * tmp_path = NULL;
+	char ** keys = NULL;
+	uint32_t * slots = NULL;
+	int32_t * index = NULL;
+	Pak_Entry * entries = NULL;
+
+	char root[PATH_MAX];
+	if(!realpath(dir,root)) {
+		elogf("realpath failed: %s: %s",strerror(errno),dir);
+		return -1;
+	}
+	if(pak_collect(&b,root,"")<0) {
+		goto done;
+	}
+	pak_match_variants(&b);
+	uint32_t n = 0;
+	keys = malloc((b.count+1)*sizeof(char *));
+	for(size_t i=0; i<b.count; i++) {
+		if(!b.files[i].is_variant) {
+			keys[n++] = b.files[i].uri;
+		}
+	}
+	slots = malloc((n+1)*sizeof(uint32_t));
+	index = calloc(n+1,sizeof(int32_t));
+	entries = calloc(n+1,sizeof(Pak_Entry));
+	if(pak_perfect_hash(keys,n,PAK_SEED,index,slots)<0) {
+		goto done;
+	}
+
+	if(asprintf(&tmp_path,"%s.tmp",out_path)<0) {
+		goto done;
+	}
+	fd_out = open(tmp_path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if(fd_out<0) {
+		elogf("Can't create %s: %s",tmp_path,strerror(errno));
+		goto done;
+	}
+	pak_add_string(&b,"",0); // offset 0 is the empty string
+	Pak_Header h = { 0 };
+	off_t off = sizeof(h);
+	if(lseek(fd_out,off,SEEK_SET)!=off) {
+		goto done;
+	}
+	uint32_t k = 0;
+	for(size_t i=0; i<b.count; i++) {
+		Pak_Build_File * f = &b.files[i];
+		if(f->is_variant) {
+			continue;
+		}
+		Pak_Entry * e = &entries[slots[k++]];
+		const char * content_type = pak_content_type(f->uri);
+		e->path = htole32(pak_add_string(&b,f->uri,strlen(f->uri)));
+		e->path_len = htole32(strlen(f->uri));
+		bool vary = f->gz_fs_path!=NULL;
+		if(pak_write_variant(&b,fd_out,&off,f->fs_path,content_type,PAK_IDENTITY,vary,&e->variants[PAK_IDENTITY])<0) {
+			goto done;
+		}
+		if(vary && pak_write_variant(&b,fd_out,&off,f->gz_fs_path,content_type,PAK_GZIP,vary,&e->variants[PAK_GZIP])<0) {
+			goto done;
+		}
+		dlogf("Packed %s%s",f->uri,vary?" (+gzip)":"");
+	}
+	// Tables follow the bodies
+	static const unsigned char zeros[8] = { 0 };
+	size_t pad = (8 - off % 8) % 8;
+	memcpy(h.magic,PAK_MAGIC,PAK_MAGIC_LEN);
+	h.version = htole32(PAK_VERSION);
+	h.num_entries = htole32(n);
+	h.seed = htole32(PAK_SEED);
+	h.index_off = htole64(off+pad);
+	h.entries_off = htole64(off+pad + n*sizeof(int32_t) + (n%2)*sizeof(int32_t));
+	h.strings_off = htole64(le64toh(h.entries_off) + n*sizeof(Pak_Entry));
+	h.strings_len = htole64(b.strings_len);
+	h.size = htole64(le64toh(h.strings_off) + b.strings_len);
+	if(pak_write_all(fd_out,zeros,pad)<0
+		|| pak_write_all(fd_out,index,n*sizeof(int32_t))<0
+		|| pak_write_all(fd_out,zeros,(n%2)*sizeof(int32_t))<0
+		|| pak_write_all(fd_out,entries,n*sizeof(Pak_Entry))<0
+		|| pak_write_all(fd_out,b.strings,b.strings_len)<0
+		|| pwrite(fd_out,&h,sizeof(h),0)!=sizeof(h)
+		|| fsync(fd_out)<0) {
+		elogf("Can't write %s: %s",tmp_path,strerror(errno));
+		goto done;
+	}
+	if(close(fd_out)<0) {
+		fd_out = -1;
+		goto done;
+	}
+	fd_out = -1;
+	// Replace the archive atomically; a server that has the old one open
+	// keeps serving it
+	if(rename(tmp_path,out_path)<0) {
+		elogf("Can't rename %s: %s",tmp_path,strerror(errno));
+		goto done;
+	}
+	ilogf("Packed %u files into %s (%llu bytes)",n,out_path,(unsigned long long)le64toh(h.size));
+	ret = n;
+done:
+	if(fd_out>=0) {
+		close(fd_out);
+	}
+	if(ret<0 && tmp_path) {
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+	for(size_t i=0; i<b.count; i++) {
+		free(b.files[i].uri);
+		free(b.files[i].fs_path);
+	}
+	free(b.files);
+	free(b.strings);
+	free(keys);
+	free(slots);
+	free(index);
+	free(entries);
+	return ret;
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+
+#define TEST_PAK_DIR "build/pak-test"
+#define TEST_PAK_FILE "build/pak-test.pak"
+
+static void test_pak_write(const char * path, const char * data) {
+	FILE * fp = fopen(path,"w");
+	fputs(data,fp);
+	fclose(fp);
+}
+
+UT_TEST_CASE(pak_build_and_lookup) {
+	mkdir(TEST_PAK_DIR,0755);
+	mkdir(TEST_PAK_DIR "/sub",0755);
+	test_pak_write(TEST_PAK_DIR "/index.html","<html></html>\n");
+	test_pak_write(TEST_PAK_DIR "/app.js","console.log('hi')\n");
+	test_pak_write(TEST_PAK_DIR "/app.js.gz","not really gzip");
+	test_pak_write(TEST_PAK_DIR "/sub/data.bin","\x01\x02\x03");
+	// Enough files to get buckets with more than one key
+	char path[64];
+	for(int i=0; i<200; i++) {
+		snprintf(path,sizeof(path),TEST_PAK_DIR "/sub/f%d.txt",i);
+		test_pak_write(path,path);
+	}
+	ut_assert(pak_build(TEST_PAK_DIR,TEST_PAK_FILE)==203);
+
+	Pak * pak = pak_open(TEST_PAK_FILE);
+	ut_assert(pak!=NULL);
+	ut_assert(pak_num_entries(pak)==203);
+
+	Pak_File f;
+	ut_assert(pak_lookup(pak,"/index.html",11,PAK_GZIP,&f));
+	ut_assert(f.encoding==PAK_IDENTITY && !f.has_variants);
+	ut_assert(f.len==14 && memcmp(f.data,"<html></html>\n",14)==0);
+	ut_assert(strcmp(f.content_type,"text/html; charset=utf-8")==0);
+	ut_assert(strstr(f.headers,"Content-Length: 14\r\n")!=NULL);
+	ut_assert(strstr(f.headers,"ETag: \"")!=NULL);
+	// The body can be read from the archive file at its offset
+	char buff[14];
+	ut_assert(pread(pak_fd(pak),buff,sizeof(buff),f.offset)==sizeof(buff));
+	ut_assert(memcmp(buff,f.data,sizeof(buff))==0);
+
+	// Precompressed variant
+	Pak_File gz;
+	ut_assert(pak_lookup(pak,"/app.js",7,PAK_IDENTITY,&f));
+	ut_assert(pak_lookup(pak,"/app.js",7,PAK_GZIP,&gz));
+	ut_assert(f.encoding==PAK_IDENTITY && f.has_variants);
+	ut_assert(gz.encoding==PAK_GZIP && gz.has_variants);
+	ut_assert(gz.len==15 && memcmp(gz.data,"not really gzip",15)==0);
+	ut_assert(strcmp(f.etag,gz.etag)!=0);
+	ut_assert(strstr(gz.headers,"Content-Encoding: gzip\r\n")!=NULL);
+	ut_assert(strstr(f.headers,"Vary: Accept-Encoding\r\n")!=NULL);
+	ut_assert(strcmp(gz.content_type,"text/javascript; charset=utf-8")==0);
+	// The variant is not a file of its own
+	ut_assert(!pak_lookup(pak,"/app.js.gz",10,PAK_IDENTITY,&f));
+
+	ut_assert(pak_lookup(pak,"/sub/data.bin",13,PAK_IDENTITY,&f));
+	ut_assert(strcmp(f.content_type,"application/octet-stream")==0);
+	for(int i=0; i<200; i++) {
+		snprintf(path,sizeof(path),"/sub/f%d.txt",i);
+		ut_assert(pak_lookup(pak,path,strlen(path),PAK_IDENTITY,&f));
+		ut_assert(strcmp(f.path,path)==0);
+		snprintf(path,sizeof(path),TEST_PAK_DIR "/sub/f%d.txt",i);
+		ut_assert(f.len==strlen(path) && memcmp(f.data,path,f.len)==0);
+	}
+	ut_assert(!pak_lookup(pak,"/",1,PAK_IDENTITY,&f));
+	ut_assert(!pak_lookup(pak,"/sub",4,PAK_IDENTITY,&f));
+	ut_assert(!pak_lookup(pak,"/index.htm",10,PAK_IDENTITY,&f));
+	pak_close(pak);
+}
+
+UT_TEST_CASE(pak_open_invalid) {
+	ut_assert(pak_open("build/no-such.pak")==NULL);
+	test_pak_write("build/pak-test-bad.pak","this is not a bundle, but it's long enough to have a header");
+	ut_assert(pak_open("build/pak-test-bad.pak")==NULL);
+
+	// Truncate a valid archive
+	mkdir(TEST_PAK_DIR "-2",0755);
+	test_pak_write(TEST_PAK_DIR "-2/a.txt","a");
+	ut_assert(pak_build(TEST_PAK_DIR "-2","build/pak-test-2.pak")==1);
+	struct stat st;
+	ut_assert(stat("build/pak-test-2.pak",&st)==0);
+	ut_assert(truncate("build/pak-test-2.pak",st.st_size-1)==0);
+	ut_assert(pak_open("build/pak-test-2.pak")==NULL);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
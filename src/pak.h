@@ -0,0 +1,107 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __PAK_H__
+#define __PAK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Static file bundle: a directory of static files packed into one archive,
+// which the server maps into memory and serves without touching the file
+// system per request.
+//
+// Layout:
+//   Pak_Header
+//   file bodies
+//   index     int32_t[num_entries]    perfect hash displacements
+//   entries   Pak_Entry[num_entries]  in hash slot order
+//   strings   null-terminated strings referenced by entries; offset 0 is ""
+//
+// All integers are little-endian.
+
+#define PAK_MAGIC "NHPAK\r\n\x1a"
+#define PAK_MAGIC_LEN 8
+#define PAK_VERSION 1
+
+typedef enum {
+	PAK_IDENTITY = 0,
+	PAK_GZIP,
+	PAK_NUM_ENCODINGS
+} Pak_Encoding;
+
+typedef struct {
+	char magic[PAK_MAGIC_LEN];
+	uint32_t version;
+	uint32_t num_entries;
+	uint32_t seed;          // seed of the first level hash
+	uint32_t reserved;
+	uint64_t index_off;
+	uint64_t entries_off;
+	uint64_t strings_off;
+	uint64_t strings_len;
+	uint64_t size;          // size of the archive
+} Pak_Header;
+
+/*! \brief One encoding of a file. */
+typedef struct {
+	uint64_t body_off;      // offset of the body in the archive
+	uint64_t body_len;
+	uint32_t headers;       // HTTP/1.1 header lines (CRLF-terminated), or 0 if there's no such variant
+	uint32_t headers_len;
+	uint32_t content_type;
+	uint32_t etag;          // quoted
+} Pak_Variant;
+
+typedef struct {
+	uint32_t path;          // URI path, e.g. "/index.html"
+	uint32_t path_len;
+	Pak_Variant variants[PAK_NUM_ENCODINGS];
+} Pak_Entry;
+
+typedef struct Pak_S Pak;
+
+/*! \brief A file found in a bundle. Strings and data point into the mapped
+ *         archive, and are valid until the bundle is closed.
+ */
+typedef struct {
+	const char * path;
+	Pak_Encoding encoding;
+	bool has_variants;          // the file is available in more than one encoding
+	const char * content_type;
+	const char * etag;
+	const char * headers;       // Content-Type, Content-Length, ETag etc. as HTTP/1.1 header lines
+	size_t headers_len;
+	off_t offset;               // where the body starts in the archive file (see pak_fd)
+	size_t len;
+	const unsigned char * data; // the body
+} Pak_File;
+
+/*! \brief Pack the regular files under dir into an archive. A file "x.gz" next
+ *         to a file "x" is taken to be the gzip encoding of "x".
+ *  \return The number of files packed, or -1 if something went wrong.
+ */
+int pak_build(const char * dir, const char * out_path);
+
+/*! \brief Open and map an archive, validating its layout.
+ *  \return The bundle, or NULL if the archive can't be opened or is not valid.
+ */
+Pak * pak_open(const char * path);
+void pak_close(Pak * pak);
+
+/*! \brief The open archive file, for sending file bodies with sendfile(2).
+ *         Use explicit offsets; the file offset is shared by forked children.
+ */
+int pak_fd(const Pak * pak);
+size_t pak_num_entries(const Pak * pak);
+
+/*! \brief Look up a file by its URI path.
+ *  \param encoding The preferred encoding. The identity encoding is returned
+ *                  if the file isn't available in the preferred encoding.
+ *  \return true if the file was found.
+ */
+bool pak_lookup(const Pak * pak, const char * path, size_t path_len, Pak_Encoding encoding, Pak_File * file);
+
+/*! \brief The Content-Encoding value for an encoding, or NULL for identity. */
+const char * pak_encoding_name(Pak_Encoding encoding);
+
+#endif // __PAK_H__
@@ -0,0 +1,728 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "slab.h"
+#include "rnd.h"
+#include "pool.h"
+
+#define POOL_SPINS  64      // rounds of looking for work before sleeping
+
+#define ATOMIC_ADD(V,N) __atomic_add_fetch(&(V),(N),__ATOMIC_RELAXED)
+
+/////////////////////////////////////////////////////////////////////////////
+// Lock-free queues
+
+// Tasks and messages are queued through their first member
+typedef struct Pool_Link_S {
+	struct Pool_Link_S * next;
+} Pool_Link;
+
+// Intrusive MPSC queue (Vyukov): producers push with an atomic exchange; the
+// single consumer pops without atomic read-modify-writes
+typedef struct {
+	Pool_Link * head;       // the last pushed
+	char pad[64];           // producers and the consumer on separate cache lines
+	Pool_Link * tail;       // the next to pop
+	Pool_Link stub;
+} Pool_Mpsc;
+
+static void mpsc_init(Pool_Mpsc * q) {
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+}
+
+static void mpsc_push(Pool_Mpsc * q, Pool_Link * n) {
+	__atomic_store_n(&n->next,NULL,__ATOMIC_RELAXED);
+	Pool_Link * prev = __atomic_exchange_n(&q->head,n,__ATOMIC_ACQ_REL);
+	// Until this store, the consumer sees the queue end at prev
+	__atomic_store_n(&prev->next,n,__ATOMIC_RELEASE);
+}
+
+// The next node, or NULL if the queue is empty (or a push is half done: the
+// producer follows it with a wakeup of its own)
+static Pool_Link * mpsc_pop(Pool_Mpsc * q) {
+	Pool_Link * tail = q->tail;
+	Pool_Link * next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+	if(tail==&q->stub) {
+		if(!next) {
+			return NULL;
+		}
+		q->tail = tail = next;
+		next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+	}
+	if(next) {
+		q->tail = next;
+		return tail;
+	}
+	if(tail!=__atomic_load_n(&q->head,__ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	// tail is the last node: put the stub behind it, to take it
+	mpsc_push(q,&q->stub);
+	next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+	if(next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+// (The consumer's view)
+static bool mpsc_empty(Pool_Mpsc * q) {
+	return q->tail==&q->stub && __atomic_load_n(&q->head,__ATOMIC_ACQUIRE)==&q->stub;
+}
+
+// Chase-Lev work-stealing deque, of fixed size ("Correct and Efficient
+// Work-Stealing for Weak Memory Models", Lê et al.). The owner pushes and pops
+// at the bottom; thieves take from the top.
+typedef struct {
+	int64_t top;
+	char pad[64];
+	int64_t bottom;
+	Pool_Task * tasks[POOL_DEQUE_LEN];
+} Pool_Deque;
+
+#define DEQUE_MASK (POOL_DEQUE_LEN-1)
+
+static bool deque_push(Pool_Deque * d, Pool_Task * task) {
+	int64_t b = __atomic_load_n(&d->bottom,__ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top,__ATOMIC_ACQUIRE);
+	if(b - t >= POOL_DEQUE_LEN) {
+		return false;
+	}
+	__atomic_store_n(&d->tasks[b & DEQUE_MASK],task,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom,b+1,__ATOMIC_RELAXED);
+	return true;
+}
+
+static Pool_Task * deque_pop(Pool_Deque * d) {
+	int64_t b = __atomic_load_n(&d->bottom,__ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&d->bottom,b,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&d->top,__ATOMIC_RELAXED);
+	if(t>b) {
+		__atomic_store_n(&d->bottom,b+1,__ATOMIC_RELAXED);
+		return NULL;
+	}
+	Pool_Task * task = __atomic_load_n(&d->tasks[b & DEQUE_MASK],__ATOMIC_RELAXED);
+	if(t==b) {
+		// The last one: race the thieves for it
+		if(!__atomic_compare_exchange_n(&d->top,&t,t+1,false,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED)) {
+			task = NULL;
+		}
+		__atomic_store_n(&d->bottom,b+1,__ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+static Pool_Task * deque_steal(Pool_Deque * d) {
+	int64_t t = __atomic_load_n(&d->top,__ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&d->bottom,__ATOMIC_ACQUIRE);
+	if(t>=b) {
+		return NULL;
+	}
+	Pool_Task * task = __atomic_load_n(&d->tasks[t & DEQUE_MASK],__ATOMIC_RELAXED);
+	if(!__atomic_compare_exchange_n(&d->top,&t,t+1,false,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED)) {
+		// Lost it to the owner, or another thief
+		return NULL;
+	}
+	return task;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Pool
+
+typedef struct {
+	Pool pool;
+	unsigned int ix;
+	pthread_t thread;
+	Pool_Deque deque;
+	Pool_Mpsc inbox;        // tasks handed to this thread
+	int fd_wake;            // an eventfd the thread sleeps on
+	bool sleeping;
+	uint64_t tasks, steals, sleeps;
+} Pool_Thread;
+
+struct Pool_S {
+	unsigned int num_threads;
+	Pool_Thread * threads;
+	unsigned int started;
+	uint32_t next;          // the thread to hand the next task to, if none is sleeping
+	bool stopping;
+	uint64_t posted, refused;
+};
+
+static void pool_wake(Pool_Thread * th) {
+	uint64_t one = 1;
+	if(write(th->fd_wake,&one,sizeof(one))<0) {
+		wlogf("Failed to wake pool thread: %s",strerror(errno));
+	}
+}
+
+// Wake a sleeping thread (other than the given one), if there is one
+static void pool_wake_one(Pool pool, const Pool_Thread * except) {
+	for(unsigned int i=0; i<pool->num_threads; i++) {
+		Pool_Thread * th = &pool->threads[i];
+		if(th!=except && __atomic_exchange_n(&th->sleeping,false,__ATOMIC_SEQ_CST)) {
+			pool_wake(th);
+			return;
+		}
+	}
+}
+
+void pool_submit(Pool pool, Pool_Task * task) {
+	// A sleeping thread, or else the next in turn
+	uint32_t start = __atomic_fetch_add(&pool->next,1,__ATOMIC_RELAXED);
+	Pool_Thread * th = NULL;
+	for(unsigned int i=0; i<pool->num_threads && !th; i++) {
+		Pool_Thread * s = &pool->threads[(start + i) % pool->num_threads];
+		if(__atomic_load_n(&s->sleeping,__ATOMIC_RELAXED)) {
+			th = s;
+		}
+	}
+	if(!th) {
+		th = &pool->threads[start % pool->num_threads];
+	}
+	mpsc_push(&th->inbox,(Pool_Link *)task);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_exchange_n(&th->sleeping,false,__ATOMIC_SEQ_CST)) {
+		pool_wake(th);
+	}
+}
+
+// Move what the thread has been handed to its deque, where others can steal it
+static Pool_Task * pool_take_inbox(Pool_Thread * th) {
+	Pool_Task * first = (Pool_Task *)mpsc_pop(&th->inbox);
+	if(!first) {
+		return NULL;
+	}
+	bool more = false;
+	Pool_Task * task;
+	while((task = (Pool_Task *)mpsc_pop(&th->inbox))) {
+		if(!deque_push(&th->deque,task)) {
+			task->fn(task);
+			ATOMIC_ADD(th->tasks,1);
+		}
+		more = true;
+	}
+	if(more) {
+		pool_wake_one(th->pool,th);
+	}
+	return first;
+}
+
+static Pool_Task * pool_steal(Pool_Thread * th) {
+	Pool pool = th->pool;
+	unsigned int start = rnd_u32() % pool->num_threads;
+	for(unsigned int i=0; i<pool->num_threads; i++) {
+		Pool_Thread * victim = &pool->threads[(start + i) % pool->num_threads];
+		Pool_Task * task;
+		if(victim!=th && (task = deque_steal(&victim->deque))) {
+			ATOMIC_ADD(th->steals,1);
+			return task;
+		}
+	}
+	return NULL;
+}
+
+static void * pool_thread(void * arg) {
+	Pool_Thread * th = arg;
+	Pool pool = th->pool;
+	int spins = 0;
+	for(;;) {
+		Pool_Task * task = pool_take_inbox(th);
+		if(!task) {
+			task = deque_pop(&th->deque);
+		}
+		if(!task) {
+			task = pool_steal(th);
+		}
+		if(task) {
+			task->fn(task);
+			ATOMIC_ADD(th->tasks,1);
+			spins = 0;
+			continue;
+		}
+		if(__atomic_load_n(&pool->stopping,__ATOMIC_ACQUIRE)) {
+			break;
+		}
+		if(++spins<POOL_SPINS) {
+			sched_yield();
+			continue;
+		}
+		// Sleep, unless something was handed to us meanwhile
+		__atomic_store_n(&th->sleeping,true,__ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(!mpsc_empty(&th->inbox) || __atomic_load_n(&pool->stopping,__ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&th->sleeping,false,__ATOMIC_SEQ_CST);
+			continue;
+		}
+		ATOMIC_ADD(th->sleeps,1);
+		uint64_t count;
+		if(read(th->fd_wake,&count,sizeof(count))<0 && errno!=EINTR) {
+			elogf("Pool thread failed to sleep: %s",strerror(errno));
+			break;
+		}
+		__atomic_store_n(&th->sleeping,false,__ATOMIC_SEQ_CST);
+		spins = 0;
+	}
+	return NULL;
+}
+
+Pool pool_create(unsigned int threads) {
+	if(threads==0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus>0 ? cpus : 1;
+	}
+	if(threads>POOL_MAX_THREADS) {
+		threads = POOL_MAX_THREADS;
+	}
+	Pool pool = calloc(1,sizeof(struct Pool_S));
+	Pool_Thread * th = pool ? calloc(threads,sizeof(Pool_Thread)) : NULL;
+	if(!th) {
+		free(pool);
+		errno = ENOMEM;
+		return NULL;
+	}
+	pool->num_threads = threads;
+	pool->threads = th;
+	// pool_free closes those created, should one fail
+	for(unsigned int i=0; i<threads; i++) {
+		th[i].fd_wake = -1;
+	}
+	for(unsigned int i=0; i<threads; i++) {
+		th[i].pool = pool;
+		th[i].ix = i;
+		mpsc_init(&th[i].inbox);
+		th[i].fd_wake = eventfd(0,EFD_CLOEXEC);
+		if(th[i].fd_wake<0) {
+			elogf("Failed to create pool thread eventfd: %s",strerror(errno));
+			pool_free(pool);
+			return NULL;
+		}
+	}
+	for(unsigned int i=0; i<threads; i++) {
+		if((errno = pthread_create(&th[i].thread,NULL,pool_thread,&th[i]))!=0) {
+			elogf("Failed to start pool thread: %s",strerror(errno));
+			pool_free(pool);
+			return NULL;
+		}
+		pool->started++;
+	}
+	dlogf("Pool started: threads=%u",threads);
+	return pool;
+}
+
+void pool_free(Pool pool) {
+	__atomic_store_n(&pool->stopping,true,__ATOMIC_RELEASE);
+	for(unsigned int i=0; i<pool->started; i++) {
+		pool_wake(&pool->threads[i]);
+	}
+	for(unsigned int i=0; i<pool->started; i++) {
+		pthread_join(pool->threads[i].thread,NULL);
+	}
+	for(unsigned int i=0; i<pool->num_threads; i++) {
+		if(pool->threads[i].fd_wake>=0) {
+			close(pool->threads[i].fd_wake);
+		}
+	}
+	free(pool->threads);
+	free(pool);
+}
+
+unsigned int pool_threads(Pool pool) {
+	return pool->num_threads;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Connections
+
+struct Pool_Conn_S {
+	Pool_Task task;         // handles the messages, while scheduled
+	Pool pool;
+	Pool_Handler handler;
+	void * ctx;
+	WS_Poll wake;
+	uint32_t max_pending;
+	Pool_Mpsc in;           // messages, from the connection's thread
+	Pool_Mpsc out;          // replies, to the connection's thread
+	uint32_t pending;
+	bool scheduled;         // the task is on the pool, or running
+	bool signalled;         // the poller has been woken, and not yet taken the replies
+	bool closed;
+	int waking;             // a pool thread is waking the poller (which is the connection's thread's)
+	int refs;               // the connection's thread's, and the task's while scheduled
+};
+
+Pool_Msg * pool_msg_alloc(size_t len) {
+	Pool_Msg * msg = slab_alloc(sizeof(Pool_Msg) + len);
+	if(msg) {
+		msg->len = len;
+	}
+	return msg;
+}
+
+void pool_msg_free(Pool_Msg * msg) {
+	slab_free(msg);
+}
+
+static void pool_conn_release(Pool_Conn conn) {
+	if(__atomic_sub_fetch(&conn->refs,1,__ATOMIC_ACQ_REL)>0) {
+		return;
+	}
+	Pool_Link * l;
+	while((l = mpsc_pop(&conn->in))) {
+		pool_msg_free((Pool_Msg *)l);
+	}
+	while((l = mpsc_pop(&conn->out))) {
+		pool_msg_free((Pool_Msg *)l);
+	}
+	free(conn);
+}
+
+static void pool_conn_run(Pool_Task * task) {
+	Pool_Conn conn = (Pool_Conn)task;
+	for(int i=0; i<POOL_CONN_BATCH; i++) {
+		Pool_Msg * msg = (Pool_Msg *)mpsc_pop(&conn->in);
+		if(!msg) {
+			// Done, unless a message was posted meanwhile (and we get to it
+			// before a task scheduled for it does)
+			__atomic_store_n(&conn->scheduled,false,__ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if(mpsc_empty(&conn->in) || __atomic_exchange_n(&conn->scheduled,true,__ATOMIC_SEQ_CST)) {
+				pool_conn_release(conn);
+				return;
+			}
+			continue;
+		}
+		Pool_Msg * reply = NULL;
+		if(!__atomic_load_n(&conn->closed,__ATOMIC_ACQUIRE)) {
+			reply = conn->handler(conn->ctx,msg);
+		}
+		if(reply!=msg) {
+			pool_msg_free(msg);
+		}
+		__atomic_sub_fetch(&conn->pending,1,__ATOMIC_RELEASE);
+		if(reply) {
+			mpsc_push(&conn->out,(Pool_Link *)reply);
+			if(!__atomic_exchange_n(&conn->signalled,true,__ATOMIC_SEQ_CST)) {
+				// The poller is only ours to wake until the connection is freed
+				__atomic_add_fetch(&conn->waking,1,__ATOMIC_SEQ_CST);
+				if(!__atomic_load_n(&conn->closed,__ATOMIC_SEQ_CST)) {
+					ws_poll_wake(conn->wake);
+				}
+				__atomic_sub_fetch(&conn->waking,1,__ATOMIC_SEQ_CST);
+			}
+		}
+	}
+	// Let other connections have the thread; the task keeps its reference
+	pool_submit(conn->pool,&conn->task);
+}
+
+Pool_Conn pool_conn_create(Pool pool, Pool_Handler handler, void * ctx, WS_Poll wake, uint32_t max_pending) {
+	Pool_Conn conn = calloc(1,sizeof(struct Pool_Conn_S));
+	if(!conn) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	conn->task.fn = pool_conn_run;
+	conn->pool = pool;
+	conn->handler = handler;
+	conn->ctx = ctx;
+	conn->wake = wake;
+	conn->max_pending = max_pending;
+	mpsc_init(&conn->in);
+	mpsc_init(&conn->out);
+	conn->refs = 1;
+	return conn;
+}
+
+void pool_conn_free(Pool_Conn conn) {
+	__atomic_store_n(&conn->closed,true,__ATOMIC_SEQ_CST);
+	// The caller may free the poller next: wait out a wakeup in progress
+	while(__atomic_load_n(&conn->waking,__ATOMIC_SEQ_CST)) {
+		sched_yield();
+	}
+	pool_conn_release(conn);
+}
+
+int pool_conn_post(Pool_Conn conn, WS_Msg_Type type, const unsigned char * msg, size_t msg_len) {
+	if(__atomic_load_n(&conn->pending,__ATOMIC_ACQUIRE)>=conn->max_pending) {
+		ATOMIC_ADD(conn->pool->refused,1);
+		errno = EAGAIN;
+		return -1;
+	}
+	Pool_Msg * m = pool_msg_alloc(msg_len);
+	if(!m) {
+		errno = ENOMEM;
+		return -1;
+	}
+	m->type = type;
+	memcpy(m->data,msg,msg_len);
+	__atomic_add_fetch(&conn->pending,1,__ATOMIC_RELAXED);
+	ATOMIC_ADD(conn->pool->posted,1);
+	mpsc_push(&conn->in,(Pool_Link *)m);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(!__atomic_exchange_n(&conn->scheduled,true,__ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&conn->refs,1,__ATOMIC_RELAXED);
+		pool_submit(conn->pool,&conn->task);
+	}
+	return 0;
+}
+
+Pool_Msg * pool_conn_reply(Pool_Conn conn) {
+	// A reply from here on wakes the poller again
+	__atomic_store_n(&conn->signalled,false,__ATOMIC_SEQ_CST);
+	return (Pool_Msg *)mpsc_pop(&conn->out);
+}
+
+uint32_t pool_conn_pending(Pool_Conn conn) {
+	return __atomic_load_n(&conn->pending,__ATOMIC_ACQUIRE);
+}
+
+void pool_get_stats(Pool pool, Pool_Stats * stats) {
+	memset(stats,0,sizeof(*stats));
+	for(unsigned int i=0; i<pool->num_threads; i++) {
+		Pool_Thread * th = &pool->threads[i];
+		stats->tasks += __atomic_load_n(&th->tasks,__ATOMIC_RELAXED);
+		stats->steals += __atomic_load_n(&th->steals,__ATOMIC_RELAXED);
+		stats->sleeps += __atomic_load_n(&th->sleeps,__ATOMIC_RELAXED);
+	}
+	stats->posted = __atomic_load_n(&pool->posted,__ATOMIC_RELAXED);
+	stats->refused = __atomic_load_n(&pool->refused,__ATOMIC_RELAXED);
+}
+
+void pool_dump_stats(Pool pool, FILE * fp) {
+	Pool_Stats s;
+	pool_get_stats(pool,&s);
+	fprintf(fp,"pool_threads %u\n",pool->num_threads);
+	fprintf(fp,"pool_tasks %llu\n",(unsigned long long)s.tasks);
+	fprintf(fp,"pool_steals %llu\n",(unsigned long long)s.steals);
+	fprintf(fp,"pool_sleeps %llu\n",(unsigned long long)s.sleeps);
+	fprintf(fp,"pool_posted %llu\n",(unsigned long long)s.posted);
+	fprintf(fp,"pool_refused %llu\n",(unsigned long long)s.refused);
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "tm.h"
+#include "ut.h"
+
+static uint32_t _test_pool_count = 0;
+
+static void test_pool_count(Pool_Task * task) {
+	__atomic_add_fetch(&_test_pool_count,1,__ATOMIC_RELEASE);
+}
+
+UT_TEST_CASE(pool_tasks) {
+	Pool pool = pool_create(4);
+	ut_assert(pool!=NULL && pool_threads(pool)==4);
+	const uint32_t count = 10000;
+	static Pool_Task tasks[10000];
+	for(uint32_t i=0; i<count; i++) {
+		tasks[i].fn = test_pool_count;
+		pool_submit(pool,&tasks[i]);
+	}
+	uint64_t deadline = tm_now_ns() + 10000000000ULL;
+	while(__atomic_load_n(&_test_pool_count,__ATOMIC_ACQUIRE)<count && tm_now_ns()<deadline) {
+		sched_yield();
+	}
+	ut_assert(_test_pool_count==count);
+	Pool_Stats stats;
+	pool_get_stats(pool,&stats);
+	ut_assert(stats.tasks==count);
+	pool_free(pool);
+}
+
+typedef struct {
+	int busy;
+	uint32_t next;
+	bool ok;
+	volatile bool gate;     // while false, the handler waits
+} Test_Pool_Ctx;
+
+// Replies with the message, checking they come one at a time, in order
+static Pool_Msg * test_pool_handler(void * arg, Pool_Msg * msg) {
+	Test_Pool_Ctx * ctx = arg;
+	if(__atomic_exchange_n(&ctx->busy,1,__ATOMIC_ACQUIRE)) {
+		ctx->ok = false;
+	}
+	while(!ctx->gate) {
+		sched_yield();
+	}
+	uint32_t seq;
+	memcpy(&seq,msg->data,sizeof(seq));
+	if(seq!=ctx->next++) {
+		ctx->ok = false;
+	}
+	__atomic_store_n(&ctx->busy,0,__ATOMIC_RELEASE);
+	return msg;
+}
+
+UT_TEST_CASE(pool_conn_order) {
+	Pool pool = pool_create(4);
+	WS_Poll poll = ws_poll_create();
+	ut_assert(pool!=NULL && poll!=NULL);
+	enum { CONNS = 4, MSGS = 2000 };
+	Test_Pool_Ctx ctx[CONNS];
+	Pool_Conn conns[CONNS];
+	uint32_t replies[CONNS];
+	for(int c=0; c<CONNS; c++) {
+		ctx[c] = (Test_Pool_Ctx){ .ok = true, .gate = true };
+		conns[c] = pool_conn_create(pool,test_pool_handler,&ctx[c],poll,MSGS);
+		replies[c] = 0;
+	}
+	for(uint32_t i=0; i<MSGS; i++) {
+		for(int c=0; c<CONNS; c++) {
+			ut_assert(pool_conn_post(conns[c],WS_MSG_BIN,(unsigned char *)&i,sizeof(i))==0);
+		}
+	}
+	// The replies come back to this thread, waking the poller, in order
+	uint32_t total = 0;
+	bool ordered = true;
+	uint64_t deadline = tm_now_ns() + 10000000000ULL;
+	while(total<CONNS*MSGS && tm_now_ns()<deadline) {
+		WS_Event ev[8];
+		ws_poll_wait(poll,ev,8,100);
+		for(int c=0; c<CONNS; c++) {
+			Pool_Msg * reply;
+			while((reply = pool_conn_reply(conns[c]))) {
+				uint32_t seq;
+				memcpy(&seq,reply->data,sizeof(seq));
+				ordered = ordered && seq==replies[c]++ && reply->type==WS_MSG_BIN;
+				total++;
+				pool_msg_free(reply);
+			}
+		}
+	}
+	ut_assert(total==CONNS*MSGS);
+	ut_assert(ordered);
+	for(int c=0; c<CONNS; c++) {
+		ut_assert(ctx[c].ok && ctx[c].next==MSGS);
+		ut_assert(pool_conn_pending(conns[c])==0);
+		pool_conn_free(conns[c]);
+	}
+	pool_free(pool);
+	ws_poll_free(poll);
+}
+
+UT_TEST_CASE(pool_conn_pending) {
+	Pool pool = pool_create(2);
+	WS_Poll poll = ws_poll_create();
+	ut_assert(pool!=NULL && poll!=NULL);
+	Pool_Stats before, after;
+	pool_get_stats(pool,&before);
+	Test_Pool_Ctx ctx = { .ok = true, .gate = false };
+	Pool_Conn conn = pool_conn_create(pool,test_pool_handler,&ctx,poll,2);
+	uint32_t seq = 0;
+	ut_assert(pool_conn_post(conn,WS_MSG_TXT,(unsigned char *)&seq,sizeof(seq))==0);
+	seq++;
+	ut_assert(pool_conn_post(conn,WS_MSG_TXT,(unsigned char *)&seq,sizeof(seq))==0);
+	ut_assert(pool_conn_pending(conn)==2);
+	// The handler is held up: posting doesn't wait for it
+	ut_assert(pool_conn_post(conn,WS_MSG_TXT,(unsigned char *)&seq,sizeof(seq))<0 && errno==EAGAIN);
+	pool_get_stats(pool,&after);
+	ut_assert(after.posted-before.posted==2 && after.refused-before.refused==1);
+	ctx.gate = true;
+	uint64_t deadline = tm_now_ns() + 10000000000ULL;
+	while(pool_conn_pending(conn)>0 && tm_now_ns()<deadline) {
+		sched_yield();
+	}
+	ut_assert(pool_conn_pending(conn)==0);
+	seq++;
+	ut_assert(pool_conn_post(conn,WS_MSG_TXT,(unsigned char *)&seq,sizeof(seq))==0);
+
+	// Freed with messages in flight, and replies not taken
+	ctx.gate = false;
+	seq++;
+	pool_conn_post(conn,WS_MSG_TXT,(unsigned char *)&seq,sizeof(seq));
+	pool_conn_free(conn);
+	ws_poll_free(poll);
+	ctx.gate = true;
+	pool_free(pool);
+	ut_assert(ctx.ok);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
+
+#ifndef EXCLUDE_BENCHMARKS
+
+#include "sha1.h"
+#include "bench.h"
+
+#define BENCH_POOL_MSG_LEN (16*1024)
+
+// Something CPU-heavy: the message's digest
+static Pool_Msg * bench_pool_handler(void * ctx, Pool_Msg * msg) {
+	Pool_Msg * reply = pool_msg_alloc(SHA1_DIGEST_LEN);
+	if(reply) {
+		reply->type = WS_MSG_BIN;
+		sha1(msg->data,msg->len,reply->data);
+	}
+	return reply;
+}
+
+// Handling messages from several connections on the I/O thread, and offloaded
+BENCH_CASE(pool_offload) {
+	enum { CONNS = 16 };
+	static unsigned char msg[BENCH_POOL_MSG_LEN];
+	memset(msg,'m',sizeof(msg));
+	const uint64_t count = bench_iterations(100000);
+
+	Pool_Msg * m = pool_msg_alloc(sizeof(msg));
+	memcpy(m->data,msg,sizeof(msg));
+	uint64_t start = tm_now_ns();
+	for(uint64_t i=0; i<count; i++) {
+		pool_msg_free(bench_pool_handler(NULL,m));
+	}
+	bench_report("sha1 16 KB, inline",count,count*sizeof(msg),tm_now_ns()-start);
+	pool_msg_free(m);
+
+	Pool pool = pool_create(0);
+	WS_Poll poll = ws_poll_create();
+	if(!pool || !poll) {
+		return;
+	}
+	Pool_Conn conns[CONNS];
+	for(int c=0; c<CONNS; c++) {
+		conns[c] = pool_conn_create(pool,bench_pool_handler,NULL,poll,64);
+	}
+	uint64_t posted = 0, replies = 0;
+	start = tm_now_ns();
+	while(replies<count) {
+		for(int c=0; c<CONNS && posted<count; c++) {
+			while(posted<count && pool_conn_post(conns[c],WS_MSG_BIN,msg,sizeof(msg))==0) {
+				posted++;
+			}
+		}
+		WS_Event ev[8];
+		ws_poll_wait(poll,ev,8,10);
+		for(int c=0; c<CONNS; c++) {
+			Pool_Msg * reply;
+			while((reply = pool_conn_reply(conns[c]))) {
+				replies++;
+				pool_msg_free(reply);
+			}
+		}
+	}
+	uint64_t elapsed = tm_now_ns() - start;
+	char label[64];
+	snprintf(label,sizeof(label),"sha1 16 KB, offloaded (%u threads)",pool_threads(pool));
+	bench_report(label,count,count*sizeof(msg),elapsed);
+	for(int c=0; c<CONNS; c++) {
+		pool_conn_free(conns[c]);
+	}
+	pool_free(pool);
+	ws_poll_free(poll);
+}
+
+#endif // !EXCLUDE_BENCHMARKS
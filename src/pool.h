@@ -0,0 +1,110 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ws.h"
+
+// A compute pool: threads that run tasks, for work that would hold up a
+// connection's I/O. Each thread keeps the tasks it has been given in a
+// work-stealing deque (Chase-Lev), running the newest first, and an idle
+// thread steals the oldest from the others. Tasks are handed to a thread
+// (preferably a sleeping one) through a lock-free MPSC queue, so submitting
+// never blocks.
+//
+// A connection's messages (Pool_Conn) are posted to the pool and handled in
+// order, one at a time, on whichever thread is free, and the handler's replies
+// are posted back to the connection's own thread through another lock-free
+// MPSC queue, waking its poller (ws_poll_wake).
+
+#define POOL_MAX_THREADS  256
+#define POOL_DEQUE_LEN    4096   // tasks a thread holds; beyond that, it runs them as they come
+#define POOL_CONN_BATCH   32     // messages handled for a connection before letting others have the thread
+
+typedef struct Pool_S * Pool;
+typedef struct Pool_Conn_S * Pool_Conn;
+
+/*! \brief A task, run once for each pool_submit. Tasks are intrusive: embed
+ *         one (first) in whatever the task works on.
+ */
+typedef struct Pool_Task_S {
+	struct Pool_Task_S * next;   // the pool's
+	void (*fn)(struct Pool_Task_S * task);
+} Pool_Task;
+
+/*! \brief A message, posted to a connection's handler, or a reply (a pooled buffer).
+ */
+typedef struct Pool_Msg_S {
+	struct Pool_Msg_S * next;    // the pool's
+	WS_Msg_Type type;
+	size_t len;
+	unsigned char data[];
+} Pool_Msg;
+
+/*! \brief Handle a message, in a pool thread. A connection's messages are
+ *         handled in the order they were posted, and never two at once.
+ *  \return The reply (which may be msg itself, changed), or NULL for none.
+ *          msg is freed unless it is returned.
+ */
+typedef Pool_Msg * (*Pool_Handler)(void * ctx, Pool_Msg * msg);
+
+typedef struct {
+	uint64_t tasks;      // tasks run
+	uint64_t steals;     // tasks run by a thread other than the one they were handed to
+	uint64_t sleeps;     // times a thread ran out of work and slept
+	uint64_t posted;     // connection messages posted
+	uint64_t refused;    // ... and refused, for having too many waiting
+} Pool_Stats;
+
+/*! \brief Start a pool of threads (0 for one per CPU, up to POOL_MAX_THREADS).
+ *  \return The pool, or NULL (with errno set).
+ */
+Pool pool_create(unsigned int threads);
+
+/*! \brief Stop the pool, once the tasks given to it have been run. Connections
+ *         must have been freed.
+ */
+void pool_free(Pool pool);
+
+unsigned int pool_threads(Pool pool);
+
+/*! \brief Run the task on a pool thread. Safe to call from any thread; never blocks.
+ */
+void pool_submit(Pool pool, Pool_Task * task);
+
+Pool_Msg * pool_msg_alloc(size_t len);
+void pool_msg_free(Pool_Msg * msg);
+
+/*! \brief A connection's messages, to be handled on the pool.
+ *  \param wake The poller to wake when there are replies.
+ *  \param max_pending The most messages posted and not yet handled.
+ *  \return The connection, or NULL (errno ENOMEM).
+ */
+Pool_Conn pool_conn_create(Pool pool, Pool_Handler handler, void * ctx, WS_Poll wake, uint32_t max_pending);
+
+/*! \brief Done with the connection: messages not yet handled are dropped, and
+ *         replies not yet taken are freed. The handler may still be running.
+ */
+void pool_conn_free(Pool_Conn conn);
+
+/*! \brief Post a copy of a message, to be handled on the pool.
+ *  \return 0, or -1 with errno EAGAIN (max_pending messages are waiting) or ENOMEM.
+ */
+int pool_conn_post(Pool_Conn conn, WS_Msg_Type type, const unsigned char * msg, size_t msg_len);
+
+/*! \brief Take the next reply, in the order of the messages they reply to.
+ *         Free it with pool_msg_free.
+ *  \return The reply, or NULL if there is none (yet).
+ */
+Pool_Msg * pool_conn_reply(Pool_Conn conn);
+
+/*! \brief Messages posted, and not yet handled. */
+uint32_t pool_conn_pending(Pool_Conn conn);
+
+void pool_get_stats(Pool pool, Pool_Stats * stats);
+void pool_dump_stats(Pool pool, FILE * fp);
+
+#endif // __POOL_H__
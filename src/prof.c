@@ -0,0 +1,535 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#define _GNU_SOURCE // for REG_RIP, REG_RBP, REG_RSP and dladdr
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "tm.h"
+#include "prof.h"
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define PROF_SUPPORTED 1
+#endif
+
+#define PROF_PROBES 32           // slots probed for a stack, before it is dropped
+#define PROF_MAX_FRAME (1<<20)   // the largest stack frame walked over
+#define PROF_PAGE 4096           // (at least) the granularity of memory protection
+#define PROF_MAX_THREADS 1024    // threads sampled; those beyond aren't
+
+// Older C libraries don't name it
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// The CPU-time clock of a thread of this process, by its tid (the kernel's
+// encoding, as glibc's pthread_getcpuclockid uses)
+#define PROF_THREAD_CPUCLOCK(tid) ((~(clockid_t)(tid) << 3) | 6)
+
+// A stack sampled, and how many times
+typedef struct {
+	uint64_t hash;               // 0 if the slot is free
+	uint32_t ready;              // depth and pcs are written
+	uint32_t depth;
+	uint64_t count;
+	uintptr_t pcs[PROF_MAX_DEPTH]; // innermost first
+} Prof_Stack;
+
+static struct {
+	bool enabled;
+	bool installed;              // the SIGPROF handler
+	int busy;                    // a profile is being taken
+	int sampling;                // the handler records samples
+	int in_handler;              // handlers running
+	timer_t timers[PROF_MAX_THREADS]; // one per thread
+	unsigned int num_timers;
+	Prof_Stack * stacks;         // PROF_STACKS (a power of 2)
+	uint64_t profiles;
+	uint64_t samples;
+	uint64_t dropped;            // samples not counted, the table being full (or a slot being claimed)
+} _prof = { 0 };
+
+void prof_enable(bool enable) {
+	_prof.enabled = enable;
+}
+
+bool prof_enabled(void) {
+	return _prof.enabled;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Sampling (in the signal handler: async-signal-safe, and lock-free)
+
+/* Whether the memory at addr can be read, without faulting if it can't:
+ * rt_sigprocmask copies in the new set (failing with EFAULT) before it looks
+ * at how (failing with EINVAL, and leaving the mask alone). Pages found
+ * readable are remembered in *page_ok. */
+static bool prof_readable(uintptr_t addr, uintptr_t * page_ok) {
+	uintptr_t page = addr & ~(uintptr_t)(PROF_PAGE-1);
+	if(page==*page_ok) {
+		return true;
+	}
+	if(syscall(SYS_rt_sigprocmask,~0,(void *)addr,NULL,sizeof(uint64_t))<0 && errno==EFAULT) {
+		return false;
+	}
+	*page_ok = page;
+	return true;
+}
+
+/* Walk the interrupted thread's stack by its frame pointers: each frame
+ * starts with the caller's frame pointer, then the return address. The
+ * callers of functions built without frame pointers (in libc, say) may be
+ * missed, or end the walk. */
+static uint32_t prof_walk(const ucontext_t * uc, uintptr_t * pcs) {
+	uint32_t depth = 0;
+#ifdef PROF_SUPPORTED
+#if defined(__x86_64__)
+	uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+	uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+	uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+#else
+	uintptr_t pc = uc->uc_mcontext.pc;
+	uintptr_t fp = uc->uc_mcontext.regs[29];
+	uintptr_t sp = uc->uc_mcontext.sp;
+#endif
+	pcs[depth++] = pc;
+	uintptr_t page_ok = 0;
+	// Frames are 16-byte aligned, so a frame's two words are on one page
+	while(depth<PROF_MAX_DEPTH && fp>=sp && fp%16==0 && prof_readable(fp,&page_ok)) {
+		const uintptr_t * frame = (const uintptr_t *)fp;
+		uintptr_t next = frame[0], ret = frame[1];
+		if(ret==0) {
+			break;
+		}
+		// Within the call, rather than after it (which may be another function)
+		pcs[depth++] = ret - 1;
+		if(next<=fp || next - fp > PROF_MAX_FRAME) {
+			break;
+		}
+		fp = next;
+	}
+#endif
+	return depth;
+}
+
+static void prof_record(const uintptr_t * pcs, uint32_t depth) {
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for(uint32_t i=0; i<depth; i++) {
+		hash = (hash ^ pcs[i])*1099511628211ULL;
+	}
+	hash |= 1; // 0 marks a free slot
+	for(unsigned i=0; i<PROF_PROBES; i++) {
+		Prof_Stack * s = &_prof.stacks[(hash + i) & (PROF_STACKS-1)];
+		uint64_t h = __atomic_load_n(&s->hash,__ATOMIC_ACQUIRE);
+		if(h==0) {
+			if(__atomic_compare_exchange_n(&s->hash,&h,hash,false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {
+				s->depth = depth;
+				memcpy(s->pcs,pcs,depth*sizeof(uintptr_t));
+				s->count = 1;
+				__atomic_store_n(&s->ready,1,__ATOMIC_RELEASE);
+				__atomic_add_fetch(&_prof.samples,1,__ATOMIC_RELAXED);
+				return;
+			}
+			// Claimed by another thread (h is now its hash)
+		}
+		if(h==hash) {
+			if(!__atomic_load_n(&s->ready,__ATOMIC_ACQUIRE)) {
+				// Being written by the thread that claimed it; it won't be long, but we don't wait
+				break;
+			}
+			if(s->depth==depth && memcmp(s->pcs,pcs,depth*sizeof(uintptr_t))==0) {
+				__atomic_add_fetch(&s->count,1,__ATOMIC_RELAXED);
+				__atomic_add_fetch(&_prof.samples,1,__ATOMIC_RELAXED);
+				return;
+			}
+		}
+	}
+	__atomic_add_fetch(&_prof.dropped,1,__ATOMIC_RELAXED);
+}
+
+static void prof_handler(int sig, siginfo_t * info, void * uc) {
+	int saved_errno = errno;
+	// Counted in before looking at sampling, so that prof_stop can wait for us
+	__atomic_add_fetch(&_prof.in_handler,1,__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&_prof.sampling,__ATOMIC_SEQ_CST)) {
+		uintptr_t pcs[PROF_MAX_DEPTH];
+		prof_record(pcs,prof_walk(uc,pcs));
+	}
+	__atomic_sub_fetch(&_prof.in_handler,1,__ATOMIC_SEQ_CST);
+	errno = saved_errno;
+}
+
+/* Start a timer on each thread's CPU-time clock, signalling that thread. (A
+ * timer on the process's clock signals the process, and before Linux 6.3 the
+ * signal mostly went to the main thread, whichever thread was running.)
+ * Threads started later aren't sampled. Returns the number of timers. */
+static unsigned int prof_start_timers(unsigned int hz) {
+	DIR * dir = opendir("/proc/self/task");
+	if(!dir) {
+		return 0;
+	}
+	uint64_t interval_ns = TM_NS_PER_S/hz;
+	struct itimerspec its = {
+		.it_interval = { .tv_sec = interval_ns/TM_NS_PER_S, .tv_nsec = interval_ns%TM_NS_PER_S },
+		.it_value = { .tv_sec = interval_ns/TM_NS_PER_S, .tv_nsec = interval_ns%TM_NS_PER_S },
+	};
+	_prof.num_timers = 0;
+	struct dirent * de;
+	while((de = readdir(dir))) {
+		pid_t tid = atoi(de->d_name);
+		if(tid<=0) {
+			continue;
+		}
+		if(_prof.num_timers==PROF_MAX_THREADS) {
+			wlogf("Profiling only the first %d threads",PROF_MAX_THREADS);
+			break;
+		}
+		struct sigevent sev = { .sigev_notify = SIGEV_THREAD_ID, .sigev_signo = SIGPROF };
+		sev.sigev_notify_thread_id = tid;
+		timer_t * timer = &_prof.timers[_prof.num_timers];
+		if(timer_create(PROF_THREAD_CPUCLOCK(tid),&sev,timer)<0) {
+			// The thread may have exited
+			dlogf("Failed to create profiler timer: tid=%d: %s",tid,strerror(errno));
+			continue;
+		}
+		if(timer_settime(*timer,0,&its,NULL)<0) {
+			dlogf("Failed to start profiler timer: tid=%d: %s",tid,strerror(errno));
+			timer_delete(*timer);
+			continue;
+		}
+		_prof.num_timers++;
+	}
+	closedir(dir);
+	return _prof.num_timers;
+}
+
+int prof_start(unsigned int hz) {
+#ifndef PROF_SUPPORTED
+	errno = ENOTSUP;
+	return -1;
+#endif
+	if(hz==0 || hz>PROF_MAX_HZ) {
+		errno = EINVAL;
+		return -1;
+	}
+	int busy = 0;
+	if(!__atomic_compare_exchange_n(&_prof.busy,&busy,1,false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {
+		errno = EBUSY;
+		return -1;
+	}
+	if(!(_prof.stacks = calloc(PROF_STACKS,sizeof(Prof_Stack)))) {
+		goto on_error;
+	}
+	if(!_prof.installed) {
+		// Kept once installed: a SIGPROF pending when a profile stops would otherwise end the process
+		struct sigaction sa = { .sa_sigaction = prof_handler, .sa_flags = SA_SIGINFO | SA_RESTART };
+		sigemptyset(&sa.sa_mask);
+		if(sigaction(SIGPROF,&sa,NULL)<0) {
+			elogf("Failed to install profiler signal handler: %s",strerror(errno));
+			goto on_error;
+		}
+		_prof.installed = true;
+	}
+	__atomic_store_n(&_prof.sampling,1,__ATOMIC_SEQ_CST);
+	if(prof_start_timers(hz)==0) {
+		elogf("Failed to start profiler timers: %s",strerror(errno));
+		__atomic_store_n(&_prof.sampling,0,__ATOMIC_SEQ_CST);
+		goto on_error;
+	}
+	__atomic_add_fetch(&_prof.profiles,1,__ATOMIC_RELAXED);
+	ilogf("Profiling: hz=%u, threads=%u",hz,_prof.num_timers);
+	return 0;
+
+on_error:
+	free(_prof.stacks);
+	_prof.stacks = NULL;
+	__atomic_store_n(&_prof.busy,0,__ATOMIC_RELEASE);
+	return -1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Writing (symbolizing) the stacks
+
+typedef struct {
+	uintptr_t addr;
+	uintptr_t size;
+	const char * name;
+} Prof_Sym;
+
+// The executable's function symbols (from its symbol table, which has static
+// functions too), by address; the names are in the executable, mapped for good
+static Prof_Sym * _prof_syms = NULL;
+static size_t _prof_num_syms = 0;
+static pthread_once_t _prof_syms_once = PTHREAD_ONCE_INIT;
+
+static int prof_cmp_sym(const void * a, const void * b) {
+	const Prof_Sym * sa = a, * sb = b;
+	return sa->addr<sb->addr ? -1 : sa->addr>sb->addr;
+}
+
+// The first object is the executable
+static int prof_exe_bias(struct dl_phdr_info * info, size_t size, void * data) {
+	*(uintptr_t *)data = info->dlpi_addr;
+	return 1;
+}
+
+static void prof_load_syms(void) {
+	int fd = open("/proc/self/exe",O_RDONLY);
+	struct stat st;
+	if(fd<0 || fstat(fd,&st)<0 || st.st_size<sizeof(ElfW(Ehdr))) {
+		wlogf("Failed to read executable symbols: %s",strerror(errno));
+		if(fd>=0) {
+			close(fd);
+		}
+		return;
+	}
+	const unsigned char * map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(map==MAP_FAILED) {
+		wlogf("Failed to map executable: %s",strerror(errno));
+		return;
+	}
+	const ElfW(Ehdr) * eh = (const ElfW(Ehdr) *)map;
+	if(memcmp(eh->e_ident,ELFMAG,SELFMAG)!=0 || eh->e_shoff + (uint64_t)eh->e_shnum*sizeof(ElfW(Shdr)) > st.st_size) {
+		wlogf("Executable isn't ELF, or is truncated");
+		munmap((void *)map,st.st_size);
+		return;
+	}
+	uintptr_t bias = 0;
+	dl_iterate_phdr(prof_exe_bias,&bias);
+	const ElfW(Shdr) * sh = (const ElfW(Shdr) *)(map + eh->e_shoff);
+	for(int i=0; i<eh->e_shnum; i++) {
+		if(sh[i].sh_type!=SHT_SYMTAB || sh[i].sh_link>=eh->e_shnum
+				|| sh[i].sh_offset + sh[i].sh_size > st.st_size
+				|| sh[sh[i].sh_link].sh_offset + sh[sh[i].sh_link].sh_size > st.st_size) {
+			continue;
+		}
+		const ElfW(Sym) * syms = (const ElfW(Sym) *)(map + sh[i].sh_offset);
+		size_t num = sh[i].sh_size/sizeof(ElfW(Sym));
+		const char * names = (const char *)map + sh[sh[i].sh_link].sh_offset;
+		size_t names_len = sh[sh[i].sh_link].sh_size;
+		if(!(_prof_syms = calloc(num ? num : 1,sizeof(Prof_Sym)))) {
+			break;
+		}
+		for(size_t j=0; j<num; j++) {
+			if(ELF64_ST_TYPE(syms[j].st_info)==STT_FUNC && syms[j].st_value!=0 && syms[j].st_size>0 && syms[j].st_name<names_len) {
+				_prof_syms[_prof_num_syms++] = (Prof_Sym) {
+					.addr = bias + syms[j].st_value,
+					.size = syms[j].st_size,
+					.name = names + syms[j].st_name,
+				};
+			}
+		}
+		break;
+	}
+	qsort(_prof_syms,_prof_num_syms,sizeof(Prof_Sym),prof_cmp_sym);
+	dlogf("Loaded executable symbols: %zu",_prof_num_syms);
+}
+
+// Write the name of the function at pc (for folded stacks, without ';' or ' ')
+static void prof_sym(FILE * out, uintptr_t pc) {
+	size_t lo = 0, hi = _prof_num_syms;
+	while(lo<hi) {
+		size_t mid = (lo + hi)/2;
+		if(_prof_syms[mid].addr<=pc) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if(lo>0 && pc<_prof_syms[lo-1].addr + _prof_syms[lo-1].size) {
+		fputs(_prof_syms[lo-1].name,out);
+		return;
+	}
+	Dl_info info = { 0 };
+	if(!dladdr((void *)pc,&info)) {
+		fprintf(out,"0x%lx",(unsigned long)pc);
+	} else if(info.dli_sname) {
+		fputs(info.dli_sname,out);
+	} else if(info.dli_fname) {
+		const char * base = strrchr(info.dli_fname,'/');
+		fprintf(out,"%s+0x%lx",base ? base+1 : info.dli_fname,(unsigned long)(pc - (uintptr_t)info.dli_fbase));
+	} else {
+		fprintf(out,"0x%lx",(unsigned long)pc);
+	}
+}
+
+typedef struct {
+	char * folded;
+	uint64_t count;
+} Prof_Folded;
+
+static int prof_cmp_folded(const void * a, const void * b) {
+	return strcmp(((const Prof_Folded *)a)->folded,((const Prof_Folded *)b)->folded);
+}
+
+int prof_stop(FILE * out) {
+	if(!__atomic_load_n(&_prof.busy,__ATOMIC_ACQUIRE) || !_prof.stacks) {
+		errno = EINVAL;
+		return -1;
+	}
+	for(unsigned int i=0; i<_prof.num_timers; i++) {
+		timer_delete(_prof.timers[i]);
+	}
+	_prof.num_timers = 0;
+	__atomic_store_n(&_prof.sampling,0,__ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&_prof.in_handler,__ATOMIC_SEQ_CST)>0) {
+		sched_yield();
+	}
+	pthread_once(&_prof_syms_once,prof_load_syms);
+
+	// Stacks of different pcs in the same functions fold to the same line
+	Prof_Folded * folded = calloc(PROF_STACKS,sizeof(Prof_Folded));
+	size_t num = 0;
+	for(size_t i=0; folded && i<PROF_STACKS; i++) {
+		Prof_Stack * s = &_prof.stacks[i];
+		if(!s->ready) {
+			continue;
+		}
+		size_t len;
+		FILE * f = open_memstream(&folded[num].folded,&len);
+		if(!f) {
+			continue;
+		}
+		for(uint32_t j=s->depth; j>0; j--) {
+			prof_sym(f,s->pcs[j-1]);
+			if(j>1) {
+				fputc(';',f);
+			}
+		}
+		fclose(f);
+		folded[num++].count = s->count;
+	}
+	qsort(folded,num,sizeof(Prof_Folded),prof_cmp_folded);
+	for(size_t i=0; i<num; i++) {
+		uint64_t count = folded[i].count;
+		while(i+1<num && strcmp(folded[i].folded,folded[i+1].folded)==0) {
+			free(folded[i++].folded);
+			count += folded[i].count;
+		}
+		fprintf(out,"%s %llu\n",folded[i].folded,(unsigned long long)count);
+		free(folded[i].folded);
+	}
+	free(folded);
+	free(_prof.stacks);
+	_prof.stacks = NULL;
+	__atomic_store_n(&_prof.busy,0,__ATOMIC_RELEASE);
+	ilogf("Profiled: stacks=%zu",num);
+	return 0;
+}
+
+int prof_profile(unsigned int seconds, unsigned int hz, FILE * out) {
+	if(prof_start(hz)<0) {
+		return -1;
+	}
+	struct timespec ts = { .tv_sec = seconds }, rem;
+	while(nanosleep(&ts,&rem)<0 && errno==EINTR) {
+		ts = rem;
+	}
+	return prof_stop(out);
+}
+
+void prof_dump_stats(FILE * fp) {
+	fprintf(fp,"prof_profiles %llu\n",(unsigned long long)__atomic_load_n(&_prof.profiles,__ATOMIC_RELAXED));
+	fprintf(fp,"prof_samples %llu\n",(unsigned long long)__atomic_load_n(&_prof.samples,__ATOMIC_RELAXED));
+	fprintf(fp,"prof_dropped %llu\n",(unsigned long long)__atomic_load_n(&_prof.dropped,__ATOMIC_RELAXED));
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+
+static volatile uint64_t _test_prof_sink = 0;
+
+// Burn CPU time in a function of our own, to find in the profile
+static __attribute__((noinline)) void test_prof_burn(uint64_t ns) {
+	struct timespec start, now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&start);
+	do {
+		for(int i=0; i<10000; i++) {
+			_test_prof_sink = _test_prof_sink*31 + i;
+		}
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&now);
+	} while((now.tv_sec - start.tv_sec)*TM_NS_PER_S + now.tv_nsec - start.tv_nsec < ns);
+}
+
+static int _test_prof_go = 0;
+
+// Burn CPU time on another thread, once the profile is started
+static __attribute__((noinline)) void * test_prof_thread(void * arg) {
+	while(!__atomic_load_n(&_test_prof_go,__ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+	test_prof_burn(200*TM_NS_PER_MS);
+	return NULL;
+}
+
+UT_TEST_CASE(prof) {
+	ut_assert(prof_start(0)<0 && errno==EINVAL);
+	ut_assert(prof_start(PROF_MAX_HZ+1)<0 && errno==EINVAL);
+	ut_assert(prof_stop(stdlog)<0 && errno==EINVAL);
+
+	uint64_t samples = _prof.samples;
+	ut_assert(prof_start(PROF_MAX_HZ)==0);
+	ut_assert(prof_start(PROF_MAX_HZ)<0 && errno==EBUSY);
+	test_prof_burn(200*TM_NS_PER_MS);
+	char * buff = NULL;
+	size_t len = 0;
+	FILE * out = open_memstream(&buff,&len);
+	ut_assert(prof_stop(out)==0);
+	fclose(out);
+	dlogf("Profile:\n%s",buff);
+	// About 200 samples (fewer when the timer is coarse)
+	ut_assert(_prof.samples - samples >= 20);
+	// Folded stacks: "outer;...;inner count", with the burner's callers
+	ut_assert(strstr(buff,"test_prof_burn")!=NULL);
+	ut_assert(strstr(buff,"_ut_prof;test_prof_burn")!=NULL);
+	uint64_t total = 0;
+	for(char * line=buff; *line; ) {
+		char * eol = strchr(line,'\n');
+		ut_assert(eol!=NULL);
+		char * count = memrchr(line,' ',eol - line);
+		ut_assert(count!=NULL && count>line);
+		total += strtoull(count+1,NULL,10);
+		line = eol + 1;
+	}
+	ut_assert(total==_prof.samples - samples);
+	free(buff);
+
+	// Each thread is sampled: the main thread waits on one that burns
+	pthread_t thread;
+	ut_assert(pthread_create(&thread,NULL,test_prof_thread,NULL)==0);
+	samples = _prof.samples;
+	ut_assert(prof_start(PROF_MAX_HZ)==0);
+	__atomic_store_n(&_test_prof_go,1,__ATOMIC_RELEASE);
+	pthread_join(thread,NULL);
+	buff = NULL;
+	out = open_memstream(&buff,&len);
+	ut_assert(prof_stop(out)==0);
+	fclose(out);
+	ut_assert(_prof.samples - samples >= 20);
+	ut_assert(strstr(buff,"test_prof_thread;test_prof_burn")!=NULL);
+	free(buff);
+
+	// Sampling stops with the profile
+	samples = _prof.samples;
+	test_prof_burn(50*TM_NS_PER_MS);
+	ut_assert(_prof.samples==samples);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
@@ -0,0 +1,54 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __PROF_H__
+#define __PROF_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// Sampling CPU profiler: while a profile is taken, a timer (timer_create) on
+// each thread's CPU-time clock sends that thread SIGPROF hz times per CPU
+// second of it, and the handler walks the thread's stack by its frame pointers
+// (the build keeps them; see the Makefile). Stacks are counted in a
+// fixed-size, lock-free hashtable, and written as folded stacks (one
+// "outer;...;inner count" line per stack), the input of flamegraph.pl and
+// most flame graph viewers.
+//
+// Threads are those running when the profile starts; threads started during
+// it aren't sampled.
+//
+// Nothing is installed until the first profile is taken, and between
+// profiles the handler (which is kept, since a SIGPROF may still be pending)
+// returns at once.
+
+#define PROF_URI "/_nuthatch/profile"   // ?seconds=<s>&hz=<hz>; served if enabled
+#define PROF_DEFAULT_SECONDS 10
+#define PROF_MAX_SECONDS 300
+#define PROF_DEFAULT_HZ 99              // not a divisor of common timer rates
+#define PROF_MAX_HZ 1000
+#define PROF_MAX_DEPTH 64               // frames kept per stack
+#define PROF_STACKS 4096                // distinct stacks counted per profile
+
+/*! \brief Serve profiles at PROF_URI (off by default). */
+void prof_enable(bool enable);
+
+bool prof_enabled(void);
+
+/*! \brief Start sampling this process's threads.
+ *  \return 0, or -1 with errno set: EINVAL if hz isn't from 1 to PROF_MAX_HZ,
+ *          EBUSY if a profile is being taken.
+ */
+int prof_start(unsigned int hz);
+
+/*! \brief Stop sampling, and write the stacks sampled as folded stacks.
+ *  \return 0, or -1 (errno EINVAL) if no profile is being taken.
+ */
+int prof_stop(FILE * out);
+
+/*! \brief Take a profile: sample for the given time, then write it.
+ *  \return As prof_start and prof_stop.
+ */
+int prof_profile(unsigned int seconds, unsigned int hz, FILE * out);
+
+void prof_dump_stats(FILE * fp);
+
+#endif // __PROF_H__
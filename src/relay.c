@@ -0,0 +1,1167 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#define _GNU_SOURCE // for accept4
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "log.h"
+#include "net.h"
+#include "ht.h"
+#include "math.h"
+#include "slab.h"
+#include "rnd.h"
+#include "tm.h"
+#include "endian.h"
+#include "codec.h"
+#include "topic.h"
+#include "relay.h"
+
+typedef enum {
+	RELAY_HELLO = 1,
+	RELAY_SUB   = 2,
+	RELAY_UNSUB = 3,
+	RELAY_PUB   = 4,
+} Relay_Kind;
+
+#define RELAY_HELLO_LEN  10
+#define RELAY_PUB_HEADER (2 + TOPIC_MAX_NAME + 9 + 10 + 10)   // longest, before the payload
+#define RELAY_READ_LEN   65536
+#define RELAY_EVENTS     64
+
+#define STAT_ADD(F,N) __atomic_add_fetch(&_relay.stats.F,(N),__ATOMIC_RELAXED)
+
+// A record, as parsed
+typedef struct {
+	Relay_Kind kind;
+	uint64_t node;                   // RELAY_HELLO
+	char name[TOPIC_MAX_NAME+1];     // RELAY_SUB, RELAY_UNSUB, RELAY_PUB
+	WS_Msg_Type type;                // RELAY_PUB ...
+	uint64_t origin, seq;
+	const unsigned char * msg;
+	size_t msg_len;
+} Relay_Record;
+
+// Something published here, or a change in what we are subscribed to, for the
+// relay thread (a pooled buffer)
+typedef struct Relay_Event_S {
+	struct Relay_Event_S * next;
+	Relay_Kind kind;
+	WS_Msg_Type type;
+	uint64_t seq;
+	size_t len;
+	char name[TOPIC_MAX_NAME+1];
+	unsigned char data[];
+} Relay_Event;
+
+typedef struct Relay_Link_S {
+	struct Relay_Link_S * next;
+	int fd;
+	int peer;               // index of the configured peer, or -1 if accepted
+	bool connecting;
+	bool closed;            // freed once the events at hand have been handled
+	bool want_out;          // waiting for the socket to be writable
+	uint64_t node;          // the peer's node id, 0 until its HELLO
+	bool primary;           // PUB records for the node are sent on this link
+	Hashtable interest;     // topics the peer has subscribers for (non-NULL values)
+	unsigned char * in;     // pooled buffers
+	size_t in_len;
+	unsigned char * out;
+	size_t out_off, out_len;
+} Relay_Link;
+
+// A topic we have subscribers for, or had
+typedef struct Relay_Interest_S {
+	struct Relay_Interest_S * next;
+	bool on;
+	char name[TOPIC_MAX_NAME+1];
+} Relay_Interest;
+
+// The PUB records seen from an origin: the highest seq, and the 63 before it
+typedef struct {
+	uint64_t node;
+	uint64_t top;
+	uint64_t window;        // bit i: seen top-i
+	uint64_t used;
+} Relay_Origin;
+
+typedef struct {
+	Relay_Peer addr;
+	Relay_Link * link;
+	uint64_t retry_ns;      // when to (re)connect
+	unsigned int retry_ms;
+	bool self;              // the peer is this node
+} Relay_Peer_State;
+
+static struct {
+	pthread_mutex_t lock;   // the event queue, and running
+	bool running;
+	Relay_Event * head, * tail;
+	uint64_t seq;           // of the last PUB
+	bool stopping;
+	pthread_t thread;
+	int fd_epoll, fd_listen, fd_wake;
+	uint64_t node;
+	// The relay thread's
+	Relay_Link * links;
+	Relay_Interest * interest;
+	Relay_Peer_State peers[RELAY_MAX_PEERS];
+	int num_peers;
+	Relay_Origin origins[RELAY_MAX_ORIGINS];
+	uint64_t origins_used;
+	Relay_Stats stats;
+} _relay = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd_epoll = -1,
+	.fd_listen = -1,
+	.fd_wake = -1,
+};
+
+int relay_parse_peer(const char * sz, Relay_Peer * peer) {
+	const char * colon = strrchr(sz,':');
+	char host[16];
+	char * end;
+	long port = colon ? strtol(colon+1,&end,10) : 0;
+	if(!colon || colon==sz || colon-sz>=(ptrdiff_t)sizeof(host) || *end || port<=0 || port>65535) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(host,sz,colon-sz);
+	host[colon-sz] = 0;
+	if((peer->addr = net_atoipv4(host))==INVALID_ADDR) {
+		errno = EINVAL;
+		return -1;
+	}
+	peer->port = port;
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Records
+
+static size_t put_u64(unsigned char * p, uint64_t v) {
+	v = htole64(v);
+	memcpy(p,&v,8);
+	return 8;
+}
+
+static uint64_t get_u64(const unsigned char * p) {
+	uint64_t v;
+	memcpy(&v,p,8);
+	return le64toh(v);
+}
+
+static size_t relay_put_hello(unsigned char * p, uint64_t node) {
+	p[0] = RELAY_HELLO;
+	p[1] = RELAY_VERSION;
+	return 2 + put_u64(p+2,node);
+}
+
+static size_t relay_put_name(unsigned char * p, Relay_Kind kind, const char * name) {
+	size_t name_len = strlen(name);
+	p[0] = kind;
+	p[1] = name_len;
+	memcpy(p+2,name,name_len);
+	return 2 + name_len;
+}
+
+// A PUB record, up to its payload
+static size_t relay_put_pub(unsigned char * p, const char * name, WS_Msg_Type type, uint64_t origin, uint64_t seq, size_t msg_len) {
+	size_t n = relay_put_name(p,RELAY_PUB,name);
+	// Websocket opcodes
+	p[n++] = type==WS_MSG_TXT ? 1 : 2;
+	n += put_u64(p+n,origin);
+	n += codec_varint_put(p+n,seq);
+	return n + codec_varint_put(p+n,msg_len);
+}
+
+// Parse the record at p.
+// Returns its length, 0 if it is incomplete, or -1 if it is not valid.
+static ssize_t relay_parse(const unsigned char * p, size_t len, Relay_Record * r) {
+	if(len<2) {
+		return 0;
+	}
+	r->kind = p[0];
+	if(r->kind==RELAY_HELLO) {
+		if(p[1]!=RELAY_VERSION) {
+			return -1;
+		}
+		if(len<RELAY_HELLO_LEN) {
+			return 0;
+		}
+		r->node = get_u64(p+2);
+		return RELAY_HELLO_LEN;
+	}
+	if(r->kind!=RELAY_SUB && r->kind!=RELAY_UNSUB && r->kind!=RELAY_PUB) {
+		return -1;
+	}
+	size_t name_len = p[1];
+	if(name_len==0 || name_len>TOPIC_MAX_NAME || memchr(p+2,0,min(name_len,len-2))) {
+		return -1;
+	}
+	size_t n = 2 + name_len;
+	if(len<n) {
+		return 0;
+	}
+	memcpy(r->name,p+2,name_len);
+	r->name[name_len] = 0;
+	if(r->kind!=RELAY_PUB) {
+		return n;
+	}
+	if(len<n+9) {
+		return 0;
+	}
+	if(p[n]!=1 && p[n]!=2) {
+		return -1;
+	}
+	r->type = p[n]==1 ? WS_MSG_TXT : WS_MSG_BIN;
+	r->origin = get_u64(p+n+1);
+	n += 9;
+	int v = codec_varint_get(p+n,len-n,&r->seq);
+	if(v<=0) {
+		return v;
+	}
+	n += v;
+	uint64_t msg_len;
+	if((v = codec_varint_get(p+n,len-n,&msg_len))<=0) {
+		return v;
+	}
+	n += v;
+	if(msg_len>RELAY_MAX_MSG) {
+		return -1;
+	}
+	if(len<n+msg_len) {
+		return 0;
+	}
+	r->msg = p+n;
+	r->msg_len = msg_len;
+	return n + msg_len;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Topic hooks (in the publishing threads)
+
+static void relay_enqueue(Relay_Event * ev) {
+	ev->next = NULL;
+	pthread_mutex_lock(&_relay.lock);
+	if(!_relay.running) {
+		pthread_mutex_unlock(&_relay.lock);
+		slab_free(ev);
+		return;
+	}
+	if(ev->kind==RELAY_PUB) {
+		ev->seq = ++_relay.seq;
+	}
+	if(_relay.tail) {
+		_relay.tail->next = ev;
+	} else {
+		_relay.head = ev;
+		// The relay thread takes the whole queue when woken
+		uint64_t one = 1;
+		if(write(_relay.fd_wake,&one,sizeof(one))<0) {
+			wlogf("Failed to wake the relay: %s",strerror(errno));
+		}
+	}
+	_relay.tail = ev;
+	pthread_mutex_unlock(&_relay.lock);
+}
+
+static void relay_on_publish(Topic * topic, WS_Msg_Type type, const unsigned char * msg, size_t msg_len) {
+	if(msg_len>RELAY_MAX_MSG) {
+		wlogf("Message too big to relay: topic=%s len=%zu",topic_name(topic),msg_len);
+		return;
+	}
+	Relay_Event * ev = slab_alloc(sizeof(Relay_Event) + msg_len);
+	if(!ev) {
+		wlogf("Out of memory; message not relayed: topic=%s",topic_name(topic));
+		return;
+	}
+	ev->kind = RELAY_PUB;
+	ev->type = type;
+	ev->len = msg_len;
+	strcpy(ev->name,topic_name(topic));
+	memcpy(ev->data,msg,msg_len);
+	relay_enqueue(ev);
+}
+
+static void relay_on_interest(Topic * topic, bool subscribed) {
+	Relay_Event * ev = slab_alloc(sizeof(Relay_Event));
+	if(!ev) {
+		wlogf("Out of memory; interest not relayed: topic=%s",topic_name(topic));
+		return;
+	}
+	ev->kind = subscribed ? RELAY_SUB : RELAY_UNSUB;
+	ev->len = 0;
+	strcpy(ev->name,topic_name(topic));
+	relay_enqueue(ev);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Links (in the relay thread)
+
+static void relay_link_close(Relay_Link * l, const char * why);
+
+static void relay_link_want_out(Relay_Link * l, bool want_out) {
+	if(l->want_out==want_out) {
+		return;
+	}
+	struct epoll_event ev = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = l };
+	if(epoll_ctl(_relay.fd_epoll,EPOLL_CTL_MOD,l->fd,&ev)<0) {
+		relay_link_close(l,strerror(errno));
+		return;
+	}
+	l->want_out = want_out;
+}
+
+// Room for len more bytes of output, or NULL if the link has been dropped
+static unsigned char * relay_link_reserve(Relay_Link * l, size_t len) {
+	if(l->out_off>0) {
+		memmove(l->out,l->out+l->out_off,l->out_len-l->out_off);
+		l->out_len -= l->out_off;
+		l->out_off = 0;
+	}
+	if(l->out_len+len>RELAY_MAX_BACKLOG) {
+		STAT_ADD(dropped,1);
+		relay_link_close(l,"too far behind");
+		return NULL;
+	}
+	unsigned char * out = slab_grow(l->out,l->out_len+len,l->out_len);
+	if(!out) {
+		relay_link_close(l,"out of memory");
+		return NULL;
+	}
+	l->out = out;
+	return out + l->out_len;
+}
+
+static void relay_link_send_name(Relay_Link * l, Relay_Kind kind, const char * name) {
+	unsigned char * p = relay_link_reserve(l,2+TOPIC_MAX_NAME);
+	if(p) {
+		l->out_len += relay_put_name(p,kind,name);
+	}
+}
+
+static void relay_link_send_pub(Relay_Link * l, const Relay_Event * ev) {
+	unsigned char * p = relay_link_reserve(l,RELAY_PUB_HEADER+ev->len);
+	if(p) {
+		size_t n = relay_put_pub(p,ev->name,ev->type,_relay.node,ev->seq,ev->len);
+		memcpy(p+n,ev->data,ev->len);
+		l->out_len += n + ev->len;
+		STAT_ADD(sent,1);
+	}
+}
+
+// Write what we can of the output, without blocking
+static void relay_link_flush(Relay_Link * l) {
+	while(l->out_off<l->out_len) {
+		ssize_t n = send(l->fd,l->out+l->out_off,l->out_len-l->out_off,MSG_DONTWAIT|MSG_NOSIGNAL);
+		if(n<0) {
+			if(errno==EINTR) {
+				continue;
+			}
+			if(errno!=EAGAIN && errno!=EWOULDBLOCK) {
+				relay_link_close(l,strerror(errno));
+				return;
+			}
+			break;
+		}
+		l->out_off += n;
+		STAT_ADD(writes,1);
+		STAT_ADD(bytes_out,n);
+	}
+	if(l->out_off==l->out_len) {
+		l->out_off = l->out_len = 0;
+	}
+	relay_link_want_out(l,l->out_len>0);
+}
+
+// The link is up: introduce ourselves, and what we are subscribed to
+static void relay_link_open(Relay_Link * l) {
+	l->connecting = false;
+	unsigned char * p = relay_link_reserve(l,RELAY_HELLO_LEN);
+	if(!p) {
+		return;
+	}
+	l->out_len += relay_put_hello(p,_relay.node);
+	for(Relay_Interest * i=_relay.interest; i && !l->closed; i=i->next) {
+		if(i->on) {
+			relay_link_send_name(l,RELAY_SUB,i->name);
+		}
+	}
+	if(!l->closed) {
+		relay_link_flush(l);
+	}
+}
+
+static Relay_Link * relay_link_add(int fd, int peer, bool connecting) {
+	Relay_Link * l = calloc(1,sizeof(Relay_Link));
+	Hashtable interest = ht_create(0,NULL,free,NULL);
+	if(!l || !interest) {
+		elogf("Out of memory for relay link");
+		free(l);
+		ht_free(interest);
+		close(fd);
+		return NULL;
+	}
+	l->fd = fd;
+	l->peer = peer;
+	l->connecting = connecting;
+	l->want_out = connecting;
+	l->interest = interest;
+	int ov = 1;
+	setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&ov,sizeof(ov));
+	struct epoll_event ev = { .events = EPOLLIN | (connecting ? EPOLLOUT : 0), .data.ptr = l };
+	if(epoll_ctl(_relay.fd_epoll,EPOLL_CTL_ADD,fd,&ev)<0) {
+		elogf("Failed to add relay link: %s",strerror(errno));
+		ht_free(interest);
+		free(l);
+		close(fd);
+		return NULL;
+	}
+	l->next = _relay.links;
+	_relay.links = l;
+	if(peer>=0) {
+		_relay.peers[peer].link = l;
+	}
+	if(!connecting) {
+		relay_link_open(l);
+	}
+	return l;
+}
+
+static void relay_link_close(Relay_Link * l, const char * why) {
+	if(l->closed) {
+		return;
+	}
+	l->closed = true;
+	epoll_ctl(_relay.fd_epoll,EPOLL_CTL_DEL,l->fd,NULL);
+	close(l->fd);
+	if(l->peer>=0) {
+		Relay_Peer_State * ps = &_relay.peers[l->peer];
+		ps->link = NULL;
+		ps->retry_ns = tm_now_ns() + (uint64_t)ps->retry_ms*TM_NS_PER_MS;
+		ps->retry_ms = min(2*ps->retry_ms,RELAY_RETRY_MAX_MS);
+	}
+	if(l->node) {
+		ilogf("Relay link to node %016" PRIx64 " closed: %s",l->node,why);
+	} else {
+		dlogf("Relay link closed: %s",why);
+	}
+	if(l->primary) {
+		// Carry on over another link to the node, if there is one
+		for(Relay_Link * o=_relay.links; o; o=o->next) {
+			if(!o->closed && o->node==l->node) {
+				o->primary = true;
+				break;
+			}
+		}
+	}
+}
+
+static void relay_link_free(Relay_Link * l) {
+	ht_free(l->interest);
+	slab_free(l->in);
+	slab_free(l->out);
+	free(l);
+}
+
+static void relay_connect(int peer) {
+	Relay_Peer_State * ps = &_relay.peers[peer];
+	int fd = socket(AF_INET,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+	if(fd<0) {
+		elogf("Failed to create relay socket: %s",strerror(errno));
+		ps->retry_ns = tm_now_ns() + (uint64_t)RELAY_RETRY_MAX_MS*TM_NS_PER_MS;
+		return;
+	}
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(ps->addr.port),
+		.sin_addr.s_addr = ps->addr.addr,
+	};
+	if(connect(fd,(struct sockaddr *)&addr,sizeof(addr))<0 && errno!=EINPROGRESS) {
+		dlogf("Failed to connect to relay peer %d: %s",peer,strerror(errno));
+		close(fd);
+		ps->retry_ns = tm_now_ns() + (uint64_t)ps->retry_ms*TM_NS_PER_MS;
+		ps->retry_ms = min(2*ps->retry_ms,RELAY_RETRY_MAX_MS);
+		return;
+	}
+	relay_link_add(fd,peer,true);
+}
+
+static void relay_link_connected(Relay_Link * l) {
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	if(getsockopt(l->fd,SOL_SOCKET,SO_ERROR,&err,&err_len)<0) {
+		err = errno;
+	}
+	if(err) {
+		relay_link_close(l,strerror(err));
+		return;
+	}
+	relay_link_want_out(l,false);
+	relay_link_open(l);
+}
+
+static void relay_accept(void) {
+	for(;;) {
+		int fd = accept4(_relay.fd_listen,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if(fd<0) {
+			if(errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR) {
+				wlogf("Failed to accept relay link: %s",strerror(errno));
+			}
+			if(errno!=EINTR) {
+				return;
+			}
+			continue;
+		}
+		relay_link_add(fd,-1,false);
+	}
+}
+
+// Have we seen this PUB record before?
+static bool relay_seen(uint64_t origin, uint64_t seq) {
+	Relay_Origin * o = NULL;
+	Relay_Origin * lru = &_relay.origins[0];
+	for(int i=0; i<RELAY_MAX_ORIGINS && !o; i++) {
+		if(_relay.origins[i].node==origin) {
+			o = &_relay.origins[i];
+		} else if(_relay.origins[i].used<lru->used) {
+			lru = &_relay.origins[i];
+		}
+	}
+	if(!o) {
+		*lru = (Relay_Origin){ .node = origin, .top = seq, .window = 1, .used = ++_relay.origins_used };
+		return false;
+	}
+	o->used = ++_relay.origins_used;
+	if(seq>o->top) {
+		uint64_t shift = seq - o->top;
+		o->window = (shift>=64 ? 0 : o->window << shift) | 1;
+		o->top = seq;
+		return false;
+	}
+	uint64_t age = o->top - seq;
+	// Older than the window: assume so
+	if(age>=64 || (o->window & (1ull << age))) {
+		return true;
+	}
+	o->window |= 1ull << age;
+	return false;
+}
+
+static int relay_link_record(Relay_Link * l, const Relay_Record * r) {
+	if(r->kind==RELAY_HELLO) {
+		if(l->node) {
+			return -1;
+		}
+		if(r->node==_relay.node) {
+			if(l->peer>=0) {
+				wlogf("Relay peer %d is this node; not linking to it",l->peer);
+				_relay.peers[l->peer].self = true;
+			}
+			relay_link_close(l,"linked to self");
+			return 0;
+		}
+		l->node = r->node;
+		l->primary = true;
+		for(Relay_Link * o=_relay.links; o; o=o->next) {
+			if(o!=l && !o->closed && o->node==l->node && o->primary) {
+				l->primary = false;
+			}
+		}
+		if(l->peer>=0) {
+			_relay.peers[l->peer].retry_ms = RELAY_RETRY_MS;
+		}
+		STAT_ADD(links,1);
+		ilogf("Relay link to node %016" PRIx64 " up%s",l->node,l->primary?"":" (standby)");
+		return 0;
+	}
+	if(!l->node) {
+		return -1;
+	}
+	if(r->kind==RELAY_PUB) {
+		if(r->origin==_relay.node || relay_seen(r->origin,r->seq)) {
+			STAT_ADD(duplicates,1);
+			return 0;
+		}
+		Topic * topic = topic_open(r->name);
+		bool delivered = topic && topic_deliver(topic,r->type,r->msg,r->msg_len)>0;
+		if(!delivered) {
+			wlogf("Failed to deliver relayed message: topic=%s: %s",r->name,strerror(errno));
+		}
+		if(topic) {
+			topic_close(topic);
+		}
+		if(!delivered) {
+			return 0;
+		}
+		STAT_ADD(received,1);
+		return 0;
+	}
+	void * on = r->kind==RELAY_SUB ? l : NULL;
+	if(ht_contains(l->interest,r->name)) {
+		ht_put(l->interest,(char *)r->name,on);
+	} else if(on) {
+		char * name = strdup(r->name);
+		if(!name) {
+			return -1;
+		}
+		ht_put(l->interest,name,on);
+	}
+	return 0;
+}
+
+static void relay_link_read(Relay_Link * l) {
+	while(!l->closed) {
+		unsigned char * in = slab_grow(l->in,l->in_len+RELAY_READ_LEN,l->in_len);
+		if(!in) {
+			relay_link_close(l,"out of memory");
+			return;
+		}
+		l->in = in;
+		ssize_t n = recv(l->fd,in+l->in_len,RELAY_READ_LEN,MSG_DONTWAIT);
+		if(n<=0) {
+			if(n==0) {
+				relay_link_close(l,"closed by peer");
+			} else if(errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR) {
+				relay_link_close(l,strerror(errno));
+			}
+			if(n==0 || errno!=EINTR) {
+				return;
+			}
+			continue;
+		}
+		l->in_len += n;
+		STAT_ADD(bytes_in,n);
+		size_t off = 0;
+		Relay_Record r;
+		ssize_t len;
+		while(!l->closed && (len = relay_parse(in+off,l->in_len-off,&r))!=0) {
+			if(len<0 || relay_link_record(l,&r)<0) {
+				relay_link_close(l,"protocol error");
+				return;
+			}
+			off += len;
+		}
+		memmove(in,in+off,l->in_len-off);
+		l->in_len -= off;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Relay thread
+
+static void relay_set_interest(const char * name, bool on) {
+	Relay_Interest * i = _relay.interest;
+	while(i && strcmp(i->name,name)!=0) {
+		i = i->next;
+	}
+	if(!i) {
+		if(!on || !(i = calloc(1,sizeof(Relay_Interest)))) {
+			return;
+		}
+		strcpy(i->name,name);
+		i->next = _relay.interest;
+		_relay.interest = i;
+	}
+	i->on = on;
+}
+
+// Pass on what the publishing threads have queued
+static void relay_dispatch(void) {
+	pthread_mutex_lock(&_relay.lock);
+	Relay_Event * ev = _relay.head;
+	_relay.head = _relay.tail = NULL;
+	pthread_mutex_unlock(&_relay.lock);
+	while(ev) {
+		Relay_Event * next = ev->next;
+		if(ev->kind==RELAY_PUB) {
+			for(Relay_Link * l=_relay.links; l; l=l->next) {
+				if(!l->closed && l->primary && ht_get(l->interest,ev->name)) {
+					relay_link_send_pub(l,ev);
+				}
+			}
+		} else {
+			relay_set_interest(ev->name,ev->kind==RELAY_SUB);
+			for(Relay_Link * l=_relay.links; l; l=l->next) {
+				if(!l->closed && !l->connecting) {
+					relay_link_send_name(l,ev->kind,ev->name);
+				}
+			}
+		}
+		slab_free(ev);
+		ev = next;
+	}
+}
+
+static void * relay_thread(void * arg) {
+	struct epoll_event events[RELAY_EVENTS];
+	while(!__atomic_load_n(&_relay.stopping,__ATOMIC_ACQUIRE)) {
+		// (Re)connect to peers, when it is time to
+		uint64_t now = tm_now_ns();
+		int timeout = -1;
+		for(int i=0; i<_relay.num_peers; i++) {
+			Relay_Peer_State * ps = &_relay.peers[i];
+			if(ps->link || ps->self) {
+				continue;
+			}
+			if(ps->retry_ns<=now) {
+				relay_connect(i);
+			}
+			if(!ps->link) {
+				int ms = ps->retry_ns>now ? (ps->retry_ns - now)/TM_NS_PER_MS + 1 : 0;
+				timeout = timeout<0 ? ms : min(timeout,ms);
+			}
+		}
+		int n = epoll_wait(_relay.fd_epoll,events,RELAY_EVENTS,timeout);
+		if(n<0 && errno!=EINTR) {
+			elogf("Relay failed to wait for events: %s",strerror(errno));
+			break;
+		}
+		for(int i=0; i<n; i++) {
+			void * ptr = events[i].data.ptr;
+			if(ptr==&_relay.fd_wake) {
+				uint64_t count;
+				if(read(_relay.fd_wake,&count,sizeof(count))<0 && errno!=EAGAIN) {
+					wlogf("Failed to read relay wakeup: %s",strerror(errno));
+				}
+			} else if(ptr==&_relay.fd_listen) {
+				relay_accept();
+			} else {
+				Relay_Link * l = ptr;
+				if(l->closed) {
+					continue;
+				}
+				if(l->connecting) {
+					relay_link_connected(l);
+					continue;
+				}
+				if(events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+					relay_link_read(l);
+				}
+				if(!l->closed && (events[i].events & EPOLLOUT)) {
+					relay_link_flush(l);
+				}
+			}
+		}
+		// What has been queued meanwhile goes out in one write per link
+		relay_dispatch();
+		Relay_Link ** pl = &_relay.links;
+		while(*pl) {
+			Relay_Link * l = *pl;
+			if(!l->closed && !l->want_out && l->out_len>0) {
+				relay_link_flush(l);
+			}
+			if(l->closed) {
+				*pl = l->next;
+				relay_link_free(l);
+			} else {
+				pl = &l->next;
+			}
+		}
+	}
+	while(_relay.links) {
+		Relay_Link * l = _relay.links;
+		_relay.links = l->next;
+		relay_link_close(l,"relay stopping");
+		relay_link_free(l);
+	}
+	return NULL;
+}
+
+static void relay_close_fds(void) {
+	int * fds[] = { &_relay.fd_listen, &_relay.fd_wake, &_relay.fd_epoll };
+	for(int i=0; i<3; i++) {
+		if(*fds[i]>=0) {
+			close(*fds[i]);
+			*fds[i] = -1;
+		}
+	}
+}
+
+int relay_start(const Relay_Config * cfg) {
+	if(_relay.node) {
+		errno = EALREADY;
+		return -1;
+	}
+	if(cfg->num_peers<0 || cfg->num_peers>RELAY_MAX_PEERS) {
+		errno = EINVAL;
+		return -1;
+	}
+	_relay.fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+	_relay.fd_wake = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if(_relay.fd_epoll<0 || _relay.fd_wake<0) {
+		elogf("Failed to create relay event sources: %s",strerror(errno));
+		relay_close_fds();
+		return -1;
+	}
+	if(cfg->port>=0 && (_relay.fd_listen = net_listen_tcp(cfg->addr,cfg->port,RELAY_MAX_PEERS))<0) {
+		relay_close_fds();
+		return -1;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &_relay.fd_wake };
+	epoll_ctl(_relay.fd_epoll,EPOLL_CTL_ADD,_relay.fd_wake,&ev);
+	if(_relay.fd_listen>=0) {
+		ev.data.ptr = &_relay.fd_listen;
+		epoll_ctl(_relay.fd_epoll,EPOLL_CTL_ADD,_relay.fd_listen,&ev);
+	}
+	memset(_relay.peers,0,sizeof(_relay.peers));
+	for(int i=0; i<cfg->num_peers; i++) {
+		_relay.peers[i].addr = cfg->peers[i];
+		_relay.peers[i].retry_ms = RELAY_RETRY_MS;
+	}
+	_relay.num_peers = cfg->num_peers;
+	memset(_relay.origins,0,sizeof(_relay.origins));
+	memset(&_relay.stats,0,sizeof(_relay.stats));
+	while(!(_relay.node = rnd_u64())) {
+	}
+	_relay.stopping = false;
+	pthread_mutex_lock(&_relay.lock);
+	_relay.running = true;
+	pthread_mutex_unlock(&_relay.lock);
+	topic_set_hooks(relay_on_publish,relay_on_interest);
+	if((errno = pthread_create(&_relay.thread,NULL,relay_thread,NULL))!=0) {
+		elogf("Failed to start relay thread: %s",strerror(errno));
+		// There is no thread for relay_stop to join
+		int err = errno;
+		pthread_mutex_lock(&_relay.lock);
+		_relay.running = false;
+		pthread_mutex_unlock(&_relay.lock);
+		relay_stop();
+		errno = err;
+		return -1;
+	}
+	ilogf("Relay node %016" PRIx64 " started: port=%d peers=%d",_relay.node,relay_port(),cfg->num_peers);
+	return 0;
+}
+
+void relay_stop(void) {
+	if(!_relay.node) {
+		return;
+	}
+	topic_set_hooks(NULL,NULL);
+	pthread_mutex_lock(&_relay.lock);
+	bool started = _relay.running;
+	_relay.running = false;
+	pthread_mutex_unlock(&_relay.lock);
+	if(started) {
+		__atomic_store_n(&_relay.stopping,true,__ATOMIC_RELEASE);
+		uint64_t one = 1;
+		if(write(_relay.fd_wake,&one,sizeof(one))<0) {
+			wlogf("Failed to wake the relay: %s",strerror(errno));
+		}
+		pthread_join(_relay.thread,NULL);
+	}
+	relay_dispatch();
+	while(_relay.interest) {
+		Relay_Interest * i = _relay.interest;
+		_relay.interest = i->next;
+		free(i);
+	}
+	relay_close_fds();
+	_relay.seq = 0;
+	_relay.node = 0;
+}
+
+int relay_port(void) {
+	return _relay.fd_listen>=0 ? net_local_port(_relay.fd_listen) : -1;
+}
+
+uint64_t relay_node_id(void) {
+	return _relay.node;
+}
+
+void relay_get_stats(Relay_Stats * stats) {
+	// All uint64_t, each updated atomically
+	const uint64_t * src = (const uint64_t *)&_relay.stats;
+	uint64_t * dst = (uint64_t *)stats;
+	for(size_t i=0; i<sizeof(Relay_Stats)/sizeof(uint64_t); i++) {
+		dst[i] = __atomic_load_n(&src[i],__ATOMIC_RELAXED);
+	}
+}
+
+void relay_dump_stats(FILE * fp) {
+	if(!_relay.node) {
+		return;
+	}
+	Relay_Stats s;
+	relay_get_stats(&s);
+	fprintf(fp,"relay_links %llu\n",(unsigned long long)s.links);
+	fprintf(fp,"relay_sent %llu\n",(unsigned long long)s.sent);
+	fprintf(fp,"relay_received %llu\n",(unsigned long long)s.received);
+	fprintf(fp,"relay_duplicates %llu\n",(unsigned long long)s.duplicates);
+	fprintf(fp,"relay_writes %llu\n",(unsigned long long)s.writes);
+	fprintf(fp,"relay_bytes_out %llu\n",(unsigned long long)s.bytes_out);
+	fprintf(fp,"relay_bytes_in %llu\n",(unsigned long long)s.bytes_in);
+	fprintf(fp,"relay_dropped %llu\n",(unsigned long long)s.dropped);
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include <fcntl.h>
+#include <sys/time.h>
+#include "ut.h"
+
+// Read a record, byte by byte, from a test peer's link
+static void test_relay_recv(int fd, unsigned char * buff, size_t buff_len, Relay_Record * r) {
+	size_t len = 0;
+	ssize_t n = 0;
+	while(n==0) {
+		ut_assert(len<buff_len);
+		ut_assert(recv(fd,buff+len,1,0)==1);
+		len++;
+		n = relay_parse(buff,len,r);
+	}
+	ut_assert(n==(ssize_t)len);
+}
+
+static void test_relay_send_pub(int fd, const char * name, uint64_t origin, uint64_t seq, const char * msg) {
+	unsigned char buff[RELAY_PUB_HEADER+64];
+	size_t n = relay_put_pub(buff,name,WS_MSG_TXT,origin,seq,strlen(msg));
+	memcpy(buff+n,msg,strlen(msg));
+	n += strlen(msg);
+	ut_assert(send(fd,buff,n,0)==(ssize_t)n);
+}
+
+static bool test_relay_wait_received(uint64_t received, uint64_t duplicates) {
+	uint64_t deadline = tm_now_ns() + 2000*TM_NS_PER_MS;
+	Relay_Stats stats;
+	do {
+		relay_get_stats(&stats);
+		if(stats.received==received && stats.duplicates==duplicates) {
+			return true;
+		}
+		usleep(1000);
+	} while(tm_now_ns()<deadline);
+	return false;
+}
+
+// A peer that timed out would hang the test
+static void test_relay_timeout(int fd) {
+	struct timeval tv = { .tv_sec = 2 };
+	ut_assert(setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv))==0);
+}
+
+UT_TEST_CASE(relay_records) {
+	Relay_Peer peer;
+	ut_assert(relay_parse_peer("127.0.0.1:9000",&peer)==0);
+	ut_assert(peer.addr==net_atoipv4("127.0.0.1") && peer.port==9000);
+	ut_assert(relay_parse_peer("127.0.0.1",&peer)<0 && errno==EINVAL);
+	ut_assert(relay_parse_peer("127.0.0.1:0",&peer)<0);
+	ut_assert(relay_parse_peer("127.0.0.1:9x",&peer)<0);
+	ut_assert(relay_parse_peer(":9000",&peer)<0);
+
+	unsigned char buff[RELAY_PUB_HEADER+8];
+	Relay_Record r;
+	size_t n = relay_put_pub(buff,"chat",WS_MSG_BIN,0x0102030405060708ull,300,5);
+	memcpy(buff+n,"hello",5);
+	n += 5;
+	ut_assert(n==2+4+1+8+2+1+5);
+	for(size_t i=0; i<n; i++) {
+		ut_assert(relay_parse(buff,i,&r)==0);
+	}
+	ut_assert(relay_parse(buff,n,&r)==(ssize_t)n);
+	ut_assert(r.kind==RELAY_PUB && strcmp(r.name,"chat")==0 && r.type==WS_MSG_BIN);
+	ut_assert(r.origin==0x0102030405060708ull && r.seq==300);
+	ut_assert(r.msg_len==5 && memcmp(r.msg,"hello",5)==0);
+	ut_assert(relay_put_hello(buff,42)==RELAY_HELLO_LEN);
+	ut_assert(relay_parse(buff,RELAY_HELLO_LEN,&r)==RELAY_HELLO_LEN && r.kind==RELAY_HELLO && r.node==42);
+	buff[1] = RELAY_VERSION+1;
+	ut_assert(relay_parse(buff,RELAY_HELLO_LEN,&r)<0);
+	ut_assert(relay_put_name(buff,RELAY_UNSUB,"x")==3);
+	ut_assert(relay_parse(buff,3,&r)==3 && r.kind==RELAY_UNSUB && strcmp(r.name,"x")==0);
+	buff[1] = 0;
+	ut_assert(relay_parse(buff,3,&r)<0);
+	buff[0] = 9;
+	ut_assert(relay_parse(buff,3,&r)<0);
+}
+
+UT_TEST_CASE(relay_link) {
+	uint32_t localhost = net_atoipv4("127.0.0.1");
+	Relay_Config cfg = { .port = 0, .addr = localhost };
+	ut_assert(relay_start(&cfg)==0);
+	ut_assert(relay_start(&cfg)<0 && errno==EALREADY);
+	uint64_t node = relay_node_id();
+	ut_assert(node!=0 && relay_port()>0);
+
+	// A peer (this test) links to the node, and is greeted
+	int fd = net_connect_tcp(localhost,relay_port());
+	ut_assert(fd>=0);
+	test_relay_timeout(fd);
+	unsigned char buff[256];
+	Relay_Record r;
+	test_relay_recv(fd,buff,sizeof(buff),&r);
+	ut_assert(r.kind==RELAY_HELLO && r.node==node);
+	const uint64_t peer = 0x5eed;
+	ut_assert(send(fd,buff,relay_put_hello(buff,peer),0)==RELAY_HELLO_LEN);
+
+	// The node tells the peer what it is subscribed to
+	WS_Poll poll = ws_poll_create();
+	Topic * a = topic_open("relay-a");
+	Topic * b = topic_open("relay-b");
+	Topic_Sub sub = topic_subscribe(a,0,poll);
+	test_relay_recv(fd,buff,sizeof(buff),&r);
+	ut_assert(r.kind==RELAY_SUB && strcmp(r.name,"relay-a")==0);
+
+	// ... and is sent what the peer publishes (the SUB before it has been seen then)
+	ut_assert(send(fd,buff,relay_put_name(buff,RELAY_SUB,"relay-b"),0)==9);
+	test_relay_send_pub(fd,"relay-a",peer,1,"p1");
+	WS_Event ev[1];
+	ut_assert(ws_poll_wait(poll,ev,1,2000)==0);
+	Topic_Stats ts;
+	topic_get_stats(a,&ts);
+	ut_assert(ts.published==1);
+
+	// Only topics the peer has subscribers for are sent to it
+	ut_assert(topic_publish(a,WS_MSG_TXT,(unsigned char *)"a1",2)==2);
+	ut_assert(topic_publish(b,WS_MSG_TXT,(unsigned char *)"b1",2)==1);
+	ut_assert(topic_publish(b,WS_MSG_BIN,(unsigned char *)"b2",2)==2);
+	test_relay_recv(fd,buff,sizeof(buff),&r);
+	ut_assert(r.kind==RELAY_PUB && strcmp(r.name,"relay-b")==0 && r.type==WS_MSG_TXT);
+	ut_assert(r.origin==node && r.seq==2 && r.msg_len==2 && memcmp(r.msg,"b1",2)==0);
+	test_relay_recv(fd,buff,sizeof(buff),&r);
+	ut_assert(r.kind==RELAY_PUB && r.type==WS_MSG_BIN && r.seq==3 && memcmp(r.msg,"b2",2)==0);
+
+	// Records seen before, or sent by the node itself, are dropped
+	test_relay_send_pub(fd,"relay-a",peer,5,"p5");
+	test_relay_send_pub(fd,"relay-a",peer,5,"p5");
+	test_relay_send_pub(fd,"relay-a",peer,3,"p3");
+	test_relay_send_pub(fd,"relay-a",peer,1,"p1");
+	test_relay_send_pub(fd,"relay-a",node,9,"n9");
+	test_relay_send_pub(fd,"relay-a",peer,200,"p200");
+	test_relay_send_pub(fd,"relay-a",peer,100,"p100");
+	ut_assert(test_relay_wait_received(4,4));
+	topic_get_stats(a,&ts);
+	ut_assert(ts.published==2+3);
+
+	// ... and so is a link that breaks the protocol
+	topic_unsubscribe(sub);
+	test_relay_recv(fd,buff,sizeof(buff),&r);
+	ut_assert(r.kind==RELAY_UNSUB && strcmp(r.name,"relay-a")==0);
+	buff[0] = 0xff;
+	ut_assert(send(fd,buff,2,0)==2);
+	ut_assert(recv(fd,buff,1,0)==0);
+	close(fd);
+
+	Relay_Stats stats;
+	relay_get_stats(&stats);
+	ut_assert(stats.links==1 && stats.sent==2 && stats.writes>=1 && stats.bytes_in>0);
+	relay_stop();
+	ut_assert(relay_node_id()==0);
+	ws_poll_free(poll);
+	topic_cleanup();
+}
+
+UT_TEST_CASE(relay_reconnect) {
+	// The node links to its peers, and relinks when a link is lost
+	uint32_t localhost = net_atoipv4("127.0.0.1");
+	int fd_listen = net_listen_tcp(localhost,0,4);
+	ut_assert(fd_listen>=0);
+	Relay_Config cfg = { .port = -1, .num_peers = 1 };
+	cfg.peers[0] = (Relay_Peer){ .addr = localhost, .port = net_local_port(fd_listen) };
+	ut_assert(relay_start(&cfg)==0);
+	ut_assert(relay_port()<0);
+	fcntl(fd_listen,F_SETFL,0);
+	unsigned char buff[64];
+	Relay_Record r;
+	for(int i=0; i<2; i++) {
+		int fd = accept(fd_listen,NULL,NULL);
+		ut_assert(fd>=0);
+		test_relay_timeout(fd);
+		test_relay_recv(fd,buff,sizeof(buff),&r);
+		ut_assert(r.kind==RELAY_HELLO && r.node==relay_node_id());
+		close(fd);
+	}
+	relay_stop();
+	close(fd_listen);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
+
+#ifndef EXCLUDE_BENCHMARKS
+
+#include <sched.h>
+#include "bench.h"
+
+static uint64_t _bench_relay_received = 0;
+
+// A peer counting the PUB records it is sent
+static void * bench_relay_peer(void * arg) {
+	int fd = (int)(intptr_t)arg;
+	size_t len = 0;
+	unsigned char * buff = malloc(2*RELAY_READ_LEN);
+	ssize_t n;
+	while((n = recv(fd,buff+len,RELAY_READ_LEN,0))>0) {
+		len += n;
+		size_t off = 0;
+		Relay_Record r;
+		ssize_t rec_len;
+		while((rec_len = relay_parse(buff+off,len-off,&r))>0) {
+			if(r.kind==RELAY_PUB) {
+				__atomic_add_fetch(&_bench_relay_received,1,__ATOMIC_RELEASE);
+			}
+			off += rec_len;
+		}
+		memmove(buff,buff+off,len-off);
+		len -= off;
+	}
+	free(buff);
+	return NULL;
+}
+
+// Publishing to a topic with a subscriber on another node
+BENCH_CASE(relay_publish) {
+	uint32_t localhost = net_atoipv4("127.0.0.1");
+	Relay_Config cfg = { .port = 0, .addr = localhost };
+	if(relay_start(&cfg)!=0) {
+		return;
+	}
+	int fd = net_connect_tcp(localhost,relay_port());
+	unsigned char hello[RELAY_PUB_HEADER+RELAY_HELLO_LEN];
+	size_t n = relay_put_hello(hello,1);
+	n += relay_put_name(hello+n,RELAY_SUB,"bench-relay");
+	n += relay_put_pub(hello+n,"bench-relay",WS_MSG_BIN,1,1,0);
+	if(fd<0 || send(fd,hello,n,0)!=(ssize_t)n) {
+		relay_stop();
+		return;
+	}
+	// Once the PUB has been delivered, so has the SUB
+	Relay_Stats stats;
+	do {
+		sched_yield();
+		relay_get_stats(&stats);
+	} while(stats.received==0);
+	Topic * topic = topic_open("bench-relay");
+	pthread_t peer;
+	pthread_create(&peer,NULL,bench_relay_peer,(void *)(intptr_t)fd);
+	unsigned char msg[100];
+	memset(msg,'m',sizeof(msg));
+	const uint64_t count = bench_iterations(500000);
+	uint64_t start = tm_now_ns();
+	for(uint64_t i=0; i<count; i++) {
+		topic_publish(topic,WS_MSG_BIN,msg,sizeof(msg));
+		// Keep within the backlog a link is allowed
+		while(i+1 - __atomic_load_n(&_bench_relay_received,__ATOMIC_ACQUIRE) > 16384) {
+			sched_yield();
+		}
+	}
+	while(__atomic_load_n(&_bench_relay_received,__ATOMIC_ACQUIRE)<count) {
+		sched_yield();
+	}
+	bench_report("publish 100 B, relayed",count,count*sizeof(msg),tm_now_ns()-start);
+	shutdown(fd,SHUT_RDWR);
+	pthread_join(peer,NULL);
+	close(fd);
+	relay_stop();
+	topic_cleanup();
+}
+
+#endif // !EXCLUDE_BENCHMARKS
@@ -0,0 +1,87 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Relay: passes what's published to topics (topic.h) on to other nuthatch
+// processes, on this host or others, so that subscribers everywhere see it.
+// Each process is a node, with a random 64-bit id, and keeps a persistent TCP
+// link to each of its configured peers (reconnecting as needed); the nodes
+// are meant to form a full mesh, and a node sends only its own publishes.
+// A link carries records, back to back:
+//
+//    HELLO  kind | version | node id (64)
+//    SUB    kind | name length | name
+//    UNSUB  kind | name length | name
+//    PUB    kind | name length | name | type | origin (64) | seq (varint) | length (varint) | payload
+//
+// (integers little-endian, varints LEB128). A node tells its peers which
+// topics it has subscribers for (SUB, UNSUB), and is sent only those. PUB
+// records are numbered by the node they originate from, and a node drops any
+// it has seen before (from the same origin, with the same sequence number),
+// as can happen when two nodes have linked to each other twice. Records are
+// written by one thread, in batches: what was published while the last batch
+// was being sent goes out in the next. What's published while a link is down
+// is not sent to the peer later.
+
+#define RELAY_VERSION     1
+#define RELAY_MAX_PEERS   64
+#define RELAY_MAX_MSG     (16*1024*1024)   // largest message relayed
+#define RELAY_MAX_BACKLOG (8*1024*1024)    // bytes queued for a link, at most, before it is dropped
+#define RELAY_MAX_ORIGINS 256              // origins tracked for de-duplication
+#define RELAY_RETRY_MS    100              // first reconnect delay, doubling up to RELAY_RETRY_MAX_MS
+#define RELAY_RETRY_MAX_MS 5000
+
+typedef struct {
+	uint32_t addr;         // IPv4 address (network byte order)
+	int port;
+} Relay_Peer;
+
+typedef struct {
+	int port;              // port to accept links on (0 for any free port); -1 to only connect to peers
+	uint32_t addr;         // IPv4 address to accept links on; INVALID_ADDR for any
+	Relay_Peer peers[RELAY_MAX_PEERS];
+	int num_peers;
+} Relay_Config;
+
+typedef struct {
+	uint64_t links;        // links established
+	uint64_t sent;         // PUB records sent (to all links)
+	uint64_t received;     // PUB records received, and delivered to topics
+	uint64_t duplicates;   // PUB records received, and dropped as already seen
+	uint64_t writes;       // writes to links (sent / writes is the average batch)
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint64_t dropped;      // links dropped for falling RELAY_MAX_BACKLOG behind
+} Relay_Stats;
+
+/*! \brief Parse a peer address, "a.b.c.d:port".
+ *  \return 0, or -1 (errno EINVAL) if it is not valid.
+ */
+int relay_parse_peer(const char * sz, Relay_Peer * peer);
+
+/*! \brief Start relaying (in a thread of its own) what's published to topics
+ *         in this process to the given peers, and what they publish to them.
+ *         Topics subscribed to before the relay starts are not relayed.
+ *  \return 0, or -1 if the relay could not be started (errno EALREADY if it
+ *          is running).
+ */
+int relay_start(const Relay_Config * cfg);
+
+/*! \brief Stop relaying, closing the links. */
+void relay_stop(void);
+
+/*! \brief The port links are accepted on, or -1 if not accepting links.
+ */
+int relay_port(void);
+
+/*! \brief This node's id (0 if the relay is not running). */
+uint64_t relay_node_id(void);
+
+void relay_get_stats(Relay_Stats * stats);
+void relay_dump_stats(FILE * fp);
+
+#endif // __RELAY_H__
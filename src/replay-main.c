@@ -0,0 +1,116 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "log.h"
+#include "sz.h"
+#include "net.h"
+#include "replay.h"
+
+// Replay a websocket capture, made with the server's --ws-record option, against a server
+
+static void usage(FILE * out, const char * prog) {
+	fprintf(out,"Usage: %s [options] <capture-file> <port> [ip-address]\n",prog);
+	fprintf(out,"Plays the websocket sessions of <capture-file> against the server, at their recorded timing,\n");
+	fprintf(out,"and reports how the server's responses diverge from those recorded.\n");
+	fprintf(out,"Options:\n");
+	fprintf(out,"  --debug                Enable debug output\n");
+	fprintf(out,"  --speed <x>            Play x times as fast as recorded; 0 to send without waiting (default: 1)\n");
+	fprintf(out,"  --conns <n>            Sessions played at once (default: 1)\n");
+	fprintf(out,"  --linger <ms>          How long a session waits for the server after its last frame (default: %d)\n",REPLAY_LINGER_MS);
+}
+
+static bool parse_uint_arg(int argc, char ** argv, int * iarg, unsigned int * val) {
+	const char * arg = argv[*iarg];
+	if(++(*iarg)>=argc) {
+		fprintf(stderr,"Argument missing for command line option: %s\n",arg);
+		return false;
+	}
+	char * end;
+	long l = strtol(argv[*iarg],&end,10);
+	if(*end || l<0) {
+		fprintf(stderr,"Invalid argument for command line option: %s %s\n",arg,argv[*iarg]);
+		return false;
+	}
+	*val = (unsigned int)l;
+	return true;
+}
+
+int main(int argc, char ** argv) {
+	log_set_level(LEVEL_INFO);
+	// Writes to a server that has gone away should fail, not kill us
+	signal(SIGPIPE, SIG_IGN);
+	const char * path = NULL;
+	Replay_Config cfg = {
+		.addr = INVALID_ADDR,
+		.speed = 1,
+		.conns = 1,
+	};
+	for(int iarg=1; iarg<argc; iarg++) {
+		const char * arg = argv[iarg];
+		if(sz_starts_with(arg,"--")) {
+			if(0==strcmp("--debug",arg)) {
+				log_set_level(LEVEL_DEBUG);
+			} else if(0==strcmp("--speed",arg)) {
+				char * end = NULL;
+				if(++iarg>=argc || (cfg.speed = strtod(argv[iarg],&end))<0 || *end) {
+					fprintf(stderr,"Invalid argument for command line option: %s\n",arg);
+					return 1;
+				}
+			} else if(0==strcmp("--conns",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.conns)) {
+					return 1;
+				}
+				if(cfg.conns==0 || cfg.conns>REPLAY_MAX_CONNS) {
+					fprintf(stderr,"Connections must be from 1 to %d\n",REPLAY_MAX_CONNS);
+					return 1;
+				}
+			} else if(0==strcmp("--linger",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.linger_ms)) {
+					return 1;
+				}
+			} else {
+				fprintf(stderr,"Unrecognized command line option: %s\n",arg);
+				return 1;
+			}
+		} else if(!path) {
+			path = arg;
+		} else if(cfg.port==0) {
+			cfg.port = atoi(arg);
+			if(cfg.port<=0) {
+				fprintf(stderr,"Invalid port number: %s\n",arg);
+				return 1;
+			}
+		} else if(cfg.addr==INVALID_ADDR) {
+			cfg.addr = net_atoipv4(arg);
+			if(cfg.addr==INVALID_ADDR) {
+				fprintf(stderr,"Invalid ip address: %s\n",arg);
+				return 1;
+			}
+		} else {
+			fprintf(stderr,"Unexpected command line argument: %s\n",arg);
+			return 1;
+		}
+	}
+	if(!path || cfg.port<=0) {
+		usage(stderr,argv[0]);
+		return 1;
+	}
+	if(cfg.addr==INVALID_ADDR) {
+		cfg.addr = net_atoipv4("127.0.0.1");
+	}
+	Replay replay = replay_load(path);
+	if(!replay) {
+		return 1;
+	}
+	Replay_Stats stats;
+	int rc = replay_run(replay,&cfg,&stats);
+	replay_free(replay);
+	if(rc!=0) {
+		return 1;
+	}
+	replay_dump_stats(&stats,stdout);
+	return stats.failed>0 ? 1 : 0;
+}
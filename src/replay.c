@@ -0,0 +1,708 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#define _GNU_SOURCE // for memmem and ppoll
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "log.h"
+#include "math.h"
+#include "net.h"
+#include "io.h"
+#include "rnd.h"
+#include "tm.h"
+#include "endian.h"
+#include "http.h"
+#include "ws.h"
+#include "replay.h"
+
+#define REPLAY_READ_LEN   65536
+#define REPLAY_MAX_101    4096    // longest upgrade response
+
+// Frame bytes (FIN and opcode)
+#define REPLAY_FIN        0x80
+#define REPLAY_OPCODE     0x0f
+
+typedef struct {
+	const WS_Record * recs;  // the session's records, in order; the first is WS_REC_OPEN
+	const size_t * refs;     // for each WS_REC_OUT, the index of the WS_REC_IN before it (0 if none)
+	size_t num_recs;
+} Replay_Session;
+
+struct Replay_S {
+	unsigned char * data;    // the capture
+	WS_Record * recs;        // by connection, then in capture order
+	size_t * refs;
+	size_t num_recs;
+	Replay_Session * sessions;
+	size_t num_sessions;
+};
+
+// Records by connection, then in capture order (payloads point into the
+// capture, so their order is the capture's)
+static int replay_cmp_rec(const void * a, const void * b) {
+	const WS_Record * ra = a, * rb = b;
+	if(ra->conn!=rb->conn) {
+		return ra->conn<rb->conn ? -1 : 1;
+	}
+	return ra->payload<rb->payload ? -1 : ra->payload>rb->payload;
+}
+
+// Sessions in the order they were opened
+static int replay_cmp_session(const void * a, const void * b) {
+	const Replay_Session * sa = a, * sb = b;
+	if(sa->recs[0].t_ns!=sb->recs[0].t_ns) {
+		return sa->recs[0].t_ns<sb->recs[0].t_ns ? -1 : 1;
+	}
+	return sa->recs<sb->recs ? -1 : 1;
+}
+
+Replay replay_load(const char * path) {
+	FILE * f = fopen(path,"r");
+	if(!f) {
+		elogf("Failed to open capture: %s: %s",path,strerror(errno));
+		return NULL;
+	}
+	Replay replay = calloc(1,sizeof(struct Replay_S));
+	long len = -1;
+	if(replay && fseek(f,0,SEEK_END)==0 && (len = ftell(f))>=0 && fseek(f,0,SEEK_SET)==0) {
+		replay->data = malloc(len>0 ? len : 1);
+	}
+	if(!replay || !replay->data || (len>0 && fread(replay->data,len,1,f)!=1)) {
+		elogf("Failed to read capture: %s: %s",path,strerror(errno ? errno : EIO));
+		fclose(f);
+		replay_free(replay);
+		return NULL;
+	}
+	fclose(f);
+	if(len<WS_REC_MAGIC_LEN || memcmp(replay->data,WS_REC_MAGIC,WS_REC_MAGIC_LEN)!=0) {
+		elogf("Not a capture: %s",path);
+		replay_free(replay);
+		errno = EINVAL;
+		return NULL;
+	}
+	size_t cap = 0;
+	for(size_t off=WS_REC_MAGIC_LEN; off<(size_t)len; ) {
+		if(replay->num_recs==cap) {
+			cap = cap ? 2*cap : 1024;
+			WS_Record * recs = realloc(replay->recs,cap*sizeof(WS_Record));
+			if(!recs) {
+				replay_free(replay);
+				errno = ENOMEM;
+				return NULL;
+			}
+			replay->recs = recs;
+		}
+		ssize_t n = ws_record_parse(replay->data + off,len - off,&replay->recs[replay->num_recs]);
+		if(n<=0) {
+			// A capture cut short (by a crash, say) is played as far as it goes
+			wlogf("Capture is %s at offset %zu; ignoring the rest",n==0 ? "cut short" : "invalid",off);
+			break;
+		}
+		off += n;
+		replay->num_recs++;
+	}
+	qsort(replay->recs,replay->num_recs,sizeof(WS_Record),replay_cmp_rec);
+
+	// Sessions are runs of a connection's records, from its WS_REC_OPEN
+	replay->refs = calloc(replay->num_recs ? replay->num_recs : 1,sizeof(size_t));
+	replay->sessions = calloc(replay->num_recs ? replay->num_recs : 1,sizeof(Replay_Session));
+	if(!replay->refs || !replay->sessions) {
+		replay_free(replay);
+		errno = ENOMEM;
+		return NULL;
+	}
+	for(size_t i=0; i<replay->num_recs; ) {
+		size_t end = i+1;
+		while(end<replay->num_recs && replay->recs[end].conn==replay->recs[i].conn) {
+			end++;
+		}
+		if(replay->recs[i].kind!=WS_REC_OPEN) {
+			wlogf("Capture has a connection without its upgrade; skipping it");
+		} else {
+			size_t ref = 0;
+			for(size_t j=i; j<end; j++) {
+				if(replay->recs[j].kind==WS_REC_IN) {
+					ref = j - i;
+				}
+				replay->refs[j] = ref;
+			}
+			replay->sessions[replay->num_sessions++] = (Replay_Session) {
+				.recs = replay->recs + i,
+				.refs = replay->refs + i,
+				.num_recs = end - i,
+			};
+		}
+		i = end;
+	}
+	qsort(replay->sessions,replay->num_sessions,sizeof(Replay_Session),replay_cmp_session);
+	ilogf("Loaded capture: %s, records=%zu, sessions=%zu",path,replay->num_recs,replay->num_sessions);
+	return replay;
+}
+
+size_t replay_sessions(Replay replay) {
+	return replay->num_sessions;
+}
+
+void replay_free(Replay replay) {
+	if(replay) {
+		free(replay->data);
+		free(replay->recs);
+		free(replay->refs);
+		free(replay->sessions);
+		free(replay);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Playing
+
+typedef struct {
+	int64_t * v;
+	size_t len, cap;
+} Replay_Samples;
+
+static void replay_sample(Replay_Samples * s, int64_t v) {
+	if(s->len==s->cap) {
+		size_t cap = s->cap ? 2*s->cap : 1024;
+		int64_t * p = realloc(s->v,cap*sizeof(int64_t));
+		if(!p) {
+			return;
+		}
+		s->v = p;
+		s->cap = cap;
+	}
+	s->v[s->len++] = v;
+}
+
+// A connection, playing sessions one after another
+typedef struct {
+	Replay replay;
+	const Replay_Config * cfg;
+	size_t * next;           // the next session to play, shared
+	pthread_t thread;
+	Replay_Stats stats;      // counts only
+	Replay_Samples divs, lates;
+	unsigned char * rx;      // received, not yet parsed
+	size_t rx_len, rx_cap;
+	unsigned char * tx;      // a frame being sent
+	size_t tx_cap;
+	uint64_t * sent_at;      // when each of the session's records was sent (0 if not)
+	size_t sent_at_cap;
+} Replay_Slot;
+
+static bool replay_reserve(unsigned char ** p, size_t * cap, size_t len) {
+	if(*cap>=len) {
+		return true;
+	}
+	size_t want = len>2*(*cap) ? len : 2*(*cap);
+	unsigned char * q = realloc(*p,want);
+	if(!q) {
+		return false;
+	}
+	*p = q;
+	*cap = want;
+	return true;
+}
+
+/* Parse a server frame header from the len bytes at p, returning its length
+ * (0 if incomplete). */
+static size_t replay_frame_header(const unsigned char * p, size_t len, uint64_t * payload_len) {
+	if(len<2) {
+		return 0;
+	}
+	size_t n = 2;
+	uint64_t l = p[1] & 0x7f;
+	if(l==126) {
+		if(len<4) {
+			return 0;
+		}
+		uint16_t l16;
+		memcpy(&l16,p+2,2);
+		l = be16toh(l16);
+		n = 4;
+	} else if(l==127) {
+		if(len<10) {
+			return 0;
+		}
+		uint64_t l64;
+		memcpy(&l64,p+2,8);
+		l = be64toh(l64);
+		n = 10;
+	}
+	if(p[1] & 0x80) {
+		n += 4;
+	}
+	*payload_len = l;
+	return len<n ? 0 : n;
+}
+
+// Send a recorded client frame (masked, as clients must); the payload beyond what was captured is zeros
+static bool replay_send(Replay_Slot * slot, int fd, const WS_Record * rec) {
+	unsigned char hdr[14];
+	size_t n = 2;
+	hdr[0] = rec->frame;
+	if(rec->len<=125) {
+		hdr[1] = 0x80 | rec->len;
+	} else if(rec->len<=0xffff) {
+		uint16_t l16 = htobe16(rec->len);
+		hdr[1] = 0x80 | 126;
+		memcpy(hdr+2,&l16,2);
+		n = 4;
+	} else {
+		uint64_t l64 = htobe64(rec->len);
+		hdr[1] = 0x80 | 127;
+		memcpy(hdr+2,&l64,8);
+		n = 10;
+	}
+	unsigned char mask_key[4];
+	rnd_mask(mask_key);
+	memcpy(hdr+n,mask_key,4);
+	n += 4;
+	if(!replay_reserve(&slot->tx,&slot->tx_cap,n + rec->len)) {
+		errno = ENOMEM;
+		return false;
+	}
+	memcpy(slot->tx,hdr,n);
+	unsigned char * payload = slot->tx + n;
+	memcpy(payload,rec->payload,rec->captured);
+	memset(payload + rec->captured,0,rec->len - rec->captured);
+	for(uint64_t i=0; i<rec->len; i++) {
+		payload[i] ^= mask_key[i%4];
+	}
+	return io_write_all(fd,slot->tx,n + rec->len)==0;
+}
+
+// Connect, and upgrade at the session's uri; the frames that came with the response are left in rx
+static int replay_upgrade(Replay_Slot * slot, const WS_Record * open) {
+	const char * uri = (const char *)open->payload;
+	size_t uri_len = strnlen(uri,open->captured);
+	const char * protocol = uri + uri_len + 1;
+	size_t protocol_len = uri_len<open->captured ? open->captured - uri_len - 1 : 0;
+	char req[MAX_HTTP_REQ];
+	int len = snprintf(req,sizeof(req),"GET %.*s HTTP/1.1\r\nHost: replay\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n",(int)uri_len,uri);
+	if(protocol_len>0 && len<sizeof(req)) {
+		len += snprintf(req+len,sizeof(req)-len,"Sec-WebSocket-Protocol: %.*s\r\n",(int)protocol_len,protocol);
+	}
+	if(len<sizeof(req)) {
+		len += snprintf(req+len,sizeof(req)-len,"\r\n");
+	}
+	if(len>=sizeof(req)) {
+		wlogf("Session's uri is too long to replay");
+		return -1;
+	}
+	int fd = net_connect_tcp(slot->cfg->addr,slot->cfg->port);
+	if(fd<0) {
+		wlogf("Failed to connect to the server: %s",strerror(errno));
+		return -1;
+	}
+	int on = 1;
+	setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+	if(io_write_all(fd,req,len)!=0) {
+		close(fd);
+		return -1;
+	}
+	slot->rx_len = 0;
+	for(;;) {
+		if(!replay_reserve(&slot->rx,&slot->rx_cap,REPLAY_MAX_101)) {
+			break;
+		}
+		ssize_t n = recv(fd,slot->rx + slot->rx_len,REPLAY_MAX_101 - slot->rx_len,0);
+		if(n<=0) {
+			break;
+		}
+		slot->rx_len += n;
+		unsigned char * end = memmem(slot->rx,slot->rx_len,"\r\n\r\n",4);
+		if(end) {
+			if(slot->rx_len<12 || memcmp(slot->rx + 9,"101",3)!=0) {
+				wlogf("Server refused the upgrade: %.*s",(int)min(slot->rx_len,64),slot->rx);
+				break;
+			}
+			size_t hdr_len = end + 4 - slot->rx;
+			memmove(slot->rx,slot->rx + hdr_len,slot->rx_len - hdr_len);
+			slot->rx_len -= hdr_len;
+			return fd;
+		}
+		if(slot->rx_len==REPLAY_MAX_101) {
+			break;
+		}
+	}
+	close(fd);
+	return -1;
+}
+
+static void replay_session(Replay_Slot * slot, const Replay_Session * s) {
+	const Replay_Config * cfg = slot->cfg;
+	Replay_Stats * stats = &slot->stats;
+	stats->sessions++;
+	stats->recorded_ns += s->recs[s->num_recs-1].t_ns - s->recs[0].t_ns;
+	int fd = replay_upgrade(slot,&s->recs[0]);
+	if(fd<0) {
+		stats->failed++;
+		for(size_t i=0; i<s->num_recs; i++) {
+			stats->missing += s->recs[i].kind==WS_REC_OUT;
+		}
+		return;
+	}
+	if(slot->sent_at_cap<s->num_recs) {
+		uint64_t * sent_at = realloc(slot->sent_at,s->num_recs*sizeof(uint64_t));
+		if(!sent_at) {
+			stats->failed++;
+			close(fd);
+			return;
+		}
+		slot->sent_at = sent_at;
+		slot->sent_at_cap = s->num_recs;
+	}
+	memset(slot->sent_at,0,s->num_recs*sizeof(uint64_t));
+	uint64_t start = tm_now_ns();
+	slot->sent_at[0] = start;
+	uint64_t t0 = s->recs[0].t_ns;
+	uint64_t linger_ns = (uint64_t)(cfg->linger_ms ? cfg->linger_ms : REPLAY_LINGER_MS)*TM_NS_PER_MS;
+	uint64_t linger_until = 0;
+	size_t send = 1, match = 1;   // the next record to send, and to match a received frame to
+	bool ok = true, closed = false, pending = slot->rx_len>0;
+	while(ok && !closed) {
+		while(send<s->num_recs && s->recs[send].kind!=WS_REC_IN) {
+			send++;
+		}
+		while(match<s->num_recs && s->recs[match].kind!=WS_REC_OUT) {
+			match++;
+		}
+		uint64_t now = tm_now_ns();
+		if(send<s->num_recs) {
+			const WS_Record * rec = &s->recs[send];
+			uint64_t due = start + (cfg->speed>0 ? (uint64_t)((rec->t_ns - t0)/cfg->speed) : 0);
+			if(now>=due) {
+				if(!(ok = replay_send(slot,fd,rec))) {
+					break;
+				}
+				slot->sent_at[send] = now;
+				replay_sample(&slot->lates,now - due);
+				stats->sent++;
+				stats->bytes_sent += rec->len;
+				send++;
+				continue;
+			}
+			linger_until = 0;
+		} else if(match>=s->num_recs) {
+			break;
+		} else if(!linger_until) {
+			linger_until = now + linger_ns;
+		} else if(now>=linger_until) {
+			break;
+		}
+		uint64_t wake = send<s->num_recs ? start + (cfg->speed>0 ? (uint64_t)((s->recs[send].t_ns - t0)/cfg->speed) : 0) : linger_until;
+		uint64_t timeout_ns = wake>now ? wake - now : 0;
+		struct timespec timeout = { .tv_sec = timeout_ns/TM_NS_PER_S, .tv_nsec = timeout_ns%TM_NS_PER_S };
+		// Frames that came with the upgrade response are matched before waiting for more
+		if(!pending) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			if(ppoll(&pfd,1,&timeout,NULL)<=0) {
+				continue;
+			}
+			if(!replay_reserve(&slot->rx,&slot->rx_cap,slot->rx_len + REPLAY_READ_LEN)) {
+				ok = false;
+				break;
+			}
+			ssize_t n = recv(fd,slot->rx + slot->rx_len,REPLAY_READ_LEN,MSG_DONTWAIT);
+			if(n<0 && errno!=EAGAIN && errno!=EINTR) {
+				ok = false;
+				break;
+			}
+			if(n==0) {
+				closed = true;
+			}
+			if(n>0) {
+				slot->rx_len += n;
+			}
+		}
+		pending = false;
+		// Match what came, whole frames, to the recorded ones
+		now = tm_now_ns();
+		size_t off = 0;
+		for(;;) {
+			uint64_t payload_len;
+			size_t hdr_len = replay_frame_header(slot->rx + off,slot->rx_len - off,&payload_len);
+			if(hdr_len==0 || slot->rx_len - off - hdr_len < payload_len) {
+				if(hdr_len>0 && !replay_reserve(&slot->rx,&slot->rx_cap,off + hdr_len + payload_len)) {
+					ok = false;
+				}
+				break;
+			}
+			unsigned char frame = slot->rx[off];
+			off += hdr_len + payload_len;
+			stats->received++;
+			stats->bytes_received += payload_len;
+			while(match<s->num_recs && s->recs[match].kind!=WS_REC_OUT) {
+				match++;
+			}
+			if(match>=s->num_recs) {
+				stats->unexpected++;
+				continue;
+			}
+			const WS_Record * rec = &s->recs[match];
+			if(rec->frame!=frame || rec->len!=payload_len) {
+				stats->mismatched++;
+			}
+			size_t ref = s->refs[match];
+			uint64_t ref_at = slot->sent_at[ref];
+			if(!ref_at) {
+				// Before the frame it answered went out (the server isn't the one recorded, say)
+				ref_at = start + (cfg->speed>0 ? (uint64_t)((s->recs[ref].t_ns - t0)/cfg->speed) : 0);
+			}
+			replay_sample(&slot->divs,(int64_t)(now - ref_at) - (int64_t)(rec->t_ns - s->recs[ref].t_ns));
+			match++;
+		}
+		memmove(slot->rx,slot->rx + off,slot->rx_len - off);
+		slot->rx_len -= off;
+	}
+	for(; match<s->num_recs; match++) {
+		stats->missing += s->recs[match].kind==WS_REC_OUT;
+	}
+	if(!ok || send<s->num_recs) {
+		stats->failed++;
+	}
+	close(fd);
+}
+
+static void * replay_slot(void * arg) {
+	Replay_Slot * slot = arg;
+	size_t i;
+	while((i = __atomic_fetch_add(slot->next,1,__ATOMIC_RELAXED))<slot->replay->num_sessions) {
+		replay_session(slot,&slot->replay->sessions[i]);
+	}
+	return NULL;
+}
+
+static int replay_cmp_sample(const void * a, const void * b) {
+	int64_t va = *(const int64_t *)a, vb = *(const int64_t *)b;
+	return va<vb ? -1 : va>vb;
+}
+
+static int64_t replay_percentile(const Replay_Samples * s, double p) {
+	if(s->len==0) {
+		return 0;
+	}
+	size_t i = (size_t)(p*(s->len-1) + 0.5);
+	return s->v[i];
+}
+
+int replay_run(Replay replay, const Replay_Config * cfg, Replay_Stats * stats) {
+	if(cfg->conns==0 || cfg->conns>REPLAY_MAX_CONNS || cfg->speed<0) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(stats,0,sizeof(*stats));
+	unsigned int conns = cfg->conns<replay->num_sessions ? cfg->conns : replay->num_sessions;
+	Replay_Slot * slots = calloc(conns ? conns : 1,sizeof(Replay_Slot));
+	if(!slots) {
+		errno = ENOMEM;
+		return -1;
+	}
+	size_t next = 0;
+	uint64_t start = tm_now_ns();
+	unsigned int started = 0;
+	for(; started<conns; started++) {
+		slots[started] = (Replay_Slot) { .replay = replay, .cfg = cfg, .next = &next };
+		if((errno = pthread_create(&slots[started].thread,NULL,replay_slot,&slots[started]))!=0) {
+			elogf("Failed to start replay connection: %s",strerror(errno));
+			break;
+		}
+	}
+	Replay_Samples divs = { 0 }, lates = { 0 };
+	for(unsigned int i=0; i<started; i++) {
+		Replay_Slot * slot = &slots[i];
+		pthread_join(slot->thread,NULL);
+		Replay_Stats * s = &slot->stats;
+		stats->sessions += s->sessions;
+		stats->failed += s->failed;
+		stats->sent += s->sent;
+		stats->received += s->received;
+		stats->missing += s->missing;
+		stats->unexpected += s->unexpected;
+		stats->mismatched += s->mismatched;
+		stats->bytes_sent += s->bytes_sent;
+		stats->bytes_received += s->bytes_received;
+		stats->recorded_ns += s->recorded_ns;
+		for(size_t j=0; j<slot->divs.len; j++) {
+			replay_sample(&divs,slot->divs.v[j]);
+		}
+		for(size_t j=0; j<slot->lates.len; j++) {
+			replay_sample(&lates,slot->lates.v[j]);
+		}
+		free(slot->divs.v);
+		free(slot->lates.v);
+		free(slot->rx);
+		free(slot->tx);
+		free(slot->sent_at);
+	}
+	stats->elapsed_ns = tm_now_ns() - start;
+	free(slots);
+	qsort(divs.v,divs.len,sizeof(int64_t),replay_cmp_sample);
+	qsort(lates.v,lates.len,sizeof(int64_t),replay_cmp_sample);
+	stats->div_min_ns = replay_percentile(&divs,0);
+	stats->div_p50_ns = replay_percentile(&divs,0.5);
+	stats->div_p90_ns = replay_percentile(&divs,0.9);
+	stats->div_p99_ns = replay_percentile(&divs,0.99);
+	stats->div_max_ns = replay_percentile(&divs,1);
+	stats->late_p50_ns = replay_percentile(&lates,0.5);
+	stats->late_p99_ns = replay_percentile(&lates,0.99);
+	stats->late_max_ns = replay_percentile(&lates,1);
+	free(divs.v);
+	free(lates.v);
+	return 0;
+}
+
+void replay_dump_stats(const Replay_Stats * s, FILE * fp) {
+	fprintf(fp,"replay_sessions %llu\n",(unsigned long long)s->sessions);
+	fprintf(fp,"replay_failed %llu\n",(unsigned long long)s->failed);
+	fprintf(fp,"replay_sent %llu\n",(unsigned long long)s->sent);
+	fprintf(fp,"replay_received %llu\n",(unsigned long long)s->received);
+	fprintf(fp,"replay_missing %llu\n",(unsigned long long)s->missing);
+	fprintf(fp,"replay_unexpected %llu\n",(unsigned long long)s->unexpected);
+	fprintf(fp,"replay_mismatched %llu\n",(unsigned long long)s->mismatched);
+	fprintf(fp,"replay_bytes_sent %llu\n",(unsigned long long)s->bytes_sent);
+	fprintf(fp,"replay_bytes_received %llu\n",(unsigned long long)s->bytes_received);
+	fprintf(fp,"replay_elapsed_ms %llu\n",(unsigned long long)(s->elapsed_ns/TM_NS_PER_MS));
+	fprintf(fp,"replay_recorded_ms %llu\n",(unsigned long long)(s->recorded_ns/TM_NS_PER_MS));
+	fprintf(fp,"replay_divergence_min_us %lld\n",(long long)s->div_min_ns/(long long)TM_NS_PER_US);
+	fprintf(fp,"replay_divergence_p50_us %lld\n",(long long)s->div_p50_ns/(long long)TM_NS_PER_US);
+	fprintf(fp,"replay_divergence_p90_us %lld\n",(long long)s->div_p90_ns/(long long)TM_NS_PER_US);
+	fprintf(fp,"replay_divergence_p99_us %lld\n",(long long)s->div_p99_ns/(long long)TM_NS_PER_US);
+	fprintf(fp,"replay_divergence_max_us %lld\n",(long long)s->div_max_ns/(long long)TM_NS_PER_US);
+	fprintf(fp,"replay_late_p50_us %llu\n",(unsigned long long)(s->late_p50_ns/TM_NS_PER_US));
+	fprintf(fp,"replay_late_p99_us %llu\n",(unsigned long long)(s->late_p99_ns/TM_NS_PER_US));
+	fprintf(fp,"replay_late_max_us %llu\n",(unsigned long long)(s->late_max_ns/TM_NS_PER_US));
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include <fcntl.h>
+#include "codec.h"
+#include "ut.h"
+
+// A websocket server that sends a ping on upgrade, and echoes text and close
+// frames, serving connections one at a time
+static void * test_replay_server(void * arg) {
+	int lfd = (int)(intptr_t)arg;
+	unsigned char buff[1024];
+	for(int i=0; i<2; i++) {
+		int fd = accept(lfd,NULL,NULL);
+		ut_assert(fd>=0);
+		size_t len = 0;
+		ssize_t n;
+		while(!memmem(buff,len,"\r\n\r\n",4)) {
+			ut_assert((n = recv(fd,buff+len,sizeof(buff)-len,0))>0);
+			len += n;
+		}
+		ut_assert(memmem(buff,len,"GET /echo?x=1 HTTP/1.1\r\n",24)==buff);
+		ut_assert((i==0)==(memmem(buff,len,"Sec-WebSocket-Protocol: chat\r\n",30)!=NULL));
+		const char * res = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n\r\n\x89";
+		ut_assert(io_write_all(fd,res,strlen(res)+1)==0);
+		len = 0;
+		while((n = recv(fd,buff+len,sizeof(buff)-len,0))>0) {
+			len += n;
+			// Client frames here are short: 2 bytes, 2 extended length bytes if 126, the mask, the payload
+			while(len>=6) {
+				size_t hdr = (buff[1] & 0x7f)==126 ? 8 : 6;
+				size_t plen = hdr==8 ? (buff[2]<<8 | buff[3]) : (buff[1] & 0x7f);
+				ut_assert(buff[1] & 0x80);
+				if(len<hdr+plen) {
+					break;
+				}
+				unsigned char out[1024];
+				out[0] = buff[0];
+				out[1] = hdr==8 ? 126 : plen;
+				memcpy(out+2,buff+2,hdr-6);
+				for(size_t j=0; j<plen; j++) {
+					out[hdr-4+j] = buff[hdr+j] ^ buff[hdr-4+j%4];
+				}
+				ut_assert(io_write_all(fd,out,hdr-4+plen)==0);
+				memmove(buff,buff+hdr+plen,len-hdr-plen);
+				len -= hdr+plen;
+			}
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+static void test_replay_put(FILE * f, WS_Rec_Kind kind, unsigned char frame, uint64_t conn, uint64_t t_ns,
+		uint64_t len, const void * payload, size_t captured) {
+	unsigned char hdr[2+4*CODEC_VARINT_MAX] = { kind, frame };
+	size_t n = 2;
+	n += codec_varint_put(hdr+n,conn);
+	n += codec_varint_put(hdr+n,t_ns);
+	n += codec_varint_put(hdr+n,len);
+	n += codec_varint_put(hdr+n,captured);
+	ut_assert(fwrite(hdr,n,1,f)==1);
+	ut_assert(captured==0 || fwrite(payload,captured,1,f)==1);
+}
+
+UT_TEST_CASE(replay) {
+	char path[] = "/tmp/replay-test-XXXXXX";
+	int tmp = mkstemp(path);
+	ut_assert(tmp>=0);
+	FILE * f = fdopen(tmp,"w");
+	ut_assert(f);
+	ut_assert(fputs("not a capture",f)>=0 && fflush(f)==0);
+	ut_assert(replay_load(path)==NULL && errno==EINVAL);
+
+	// Two sessions, their records interleaved; the second expects "yy" where the server echoes "x"
+	ut_assert(ftruncate(tmp,0)==0 && fseek(f,0,SEEK_SET)==0);
+	ut_assert(fwrite(WS_REC_MAGIC,WS_REC_MAGIC_LEN,1,f)==1);
+	uint64_t ms = TM_NS_PER_MS;
+	test_replay_put(f,WS_REC_OPEN,0,9,5*ms,9,"/echo?x=1",9);
+	test_replay_put(f,WS_REC_OPEN,0,7,1*ms,14,"/echo?x=1\0chat",14);
+	test_replay_put(f,WS_REC_OUT,0x89,7,1*ms,0,NULL,0);
+	test_replay_put(f,WS_REC_OUT,0x89,9,5*ms,0,NULL,0);
+	test_replay_put(f,WS_REC_IN,0x81,7,2*ms,5,"hello",5);
+	test_replay_put(f,WS_REC_OUT,0x81,7,3*ms,5,"hello",5);
+	test_replay_put(f,WS_REC_IN,0x81,9,6*ms,1,"x",1);
+	test_replay_put(f,WS_REC_IN,0x81,7,4*ms,300,"abcd",4);
+	test_replay_put(f,WS_REC_OUT,0x81,9,7*ms,2,"yy",2);
+	test_replay_put(f,WS_REC_OUT,0x81,7,4*ms,300,"abcd",4);
+	test_replay_put(f,WS_REC_IN,0x88,7,5*ms,2,"\x03\xe8",2);
+	test_replay_put(f,WS_REC_OUT,0x88,7,6*ms,2,"\x03\xe8",2);
+	test_replay_put(f,WS_REC_IN,0x81,11,1*ms,1,"z",1);  // a connection without its upgrade
+	ut_assert(fputc(WS_REC_IN,f)!=EOF);                 // cut short
+	ut_assert(fclose(f)==0);
+	Replay replay = replay_load(path);
+	unlink(path);
+	ut_assert(replay);
+	ut_assert(replay_sessions(replay)==2);
+
+	int lfd = net_listen_tcp(net_atoipv4("127.0.0.1"),0,8);
+	ut_assert(lfd>=0);
+	ut_assert(fcntl(lfd,F_SETFL,fcntl(lfd,F_GETFL) & ~O_NONBLOCK)==0);
+	pthread_t server;
+	ut_assert(pthread_create(&server,NULL,test_replay_server,(void *)(intptr_t)lfd)==0);
+	Replay_Config cfg = { .addr = net_atoipv4("127.0.0.1"), .port = net_local_port(lfd), .speed = 1, .conns = 0, .linger_ms = 100 };
+	Replay_Stats stats;
+	ut_assert(replay_run(replay,&cfg,&stats)<0 && errno==EINVAL);
+	cfg.conns = 2;
+	ut_assert(replay_run(replay,&cfg,&stats)==0);
+	pthread_join(server,NULL);
+	close(lfd);
+	replay_free(replay);
+
+	ut_assert(stats.sessions==2 && stats.failed==0);
+	ut_assert(stats.sent==4 && stats.bytes_sent==5+300+2+1);
+	ut_assert(stats.received==6 && stats.bytes_received==5+300+2+1);
+	ut_assert(stats.missing==0 && stats.unexpected==0 && stats.mismatched==1);
+	ut_assert(stats.recorded_ns==7*ms);
+	// Played at the recorded timing, the sessions took at least as long as recorded
+	ut_assert(stats.elapsed_ns>=5*ms);
+	ut_assert(stats.div_min_ns<=stats.div_p50_ns && stats.div_p50_ns<=stats.div_max_ns);
+	ut_assert(stats.late_p50_ns<=stats.late_max_ns);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
@@ -0,0 +1,68 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Replay: plays the websocket sessions of a capture (see ws_record_start)
+// against a server, to benchmark it with real traffic shapes. Each recorded
+// connection is a session: it is upgraded at its recorded uri (and
+// subprotocol), and sent the frames the client sent, each at its recorded
+// time since the upgrade divided by the speed. Sessions are played cfg.conns
+// at a time, one after another on each connection.
+//
+// The frames the server sends are matched, in order, to those it sent when
+// recorded, and each is timed from the client frame before it (or from the
+// upgrade): how much later (or sooner) than when recorded it comes is its
+// divergence. How far behind schedule the client frames go out is reported
+// too, since a replay that can't keep up says little about the server.
+
+#define REPLAY_MAX_CONNS  1024
+#define REPLAY_LINGER_MS  2000   // how long a session waits for the server, after its last frame is sent
+
+typedef struct {
+	uint32_t addr;           // IPv4 address of the server (network byte order)
+	int port;
+	double speed;            // 1 for the recorded timing, 10 for ten times as fast; 0 to send without waiting
+	unsigned int conns;      // sessions played at once
+	unsigned int linger_ms;  // 0 for REPLAY_LINGER_MS
+} Replay_Config;
+
+typedef struct {
+	uint64_t sessions;       // played
+	uint64_t failed;         // ... of which, failed to connect or upgrade, or were cut short
+	uint64_t sent;           // frames sent
+	uint64_t received;       // frames received
+	uint64_t missing;        // recorded frames the server didn't send
+	uint64_t unexpected;     // frames the server sent beyond those recorded
+	uint64_t mismatched;     // frames received with another opcode or length than the recorded one
+	uint64_t bytes_sent;     // payload bytes
+	uint64_t bytes_received;
+	uint64_t elapsed_ns;
+	uint64_t recorded_ns;    // the sessions' recorded lengths, summed
+	int64_t div_min_ns, div_p50_ns, div_p90_ns, div_p99_ns, div_max_ns;
+	uint64_t late_p50_ns, late_p99_ns, late_max_ns;
+} Replay_Stats;
+
+typedef struct Replay_S * Replay;
+
+/*! \brief Load a capture.
+ *  \return The replay, or NULL (with errno set; EINVAL if the file isn't a
+ *          capture). A capture cut short is played as far as it goes.
+ */
+Replay replay_load(const char * path);
+
+/*! \brief The number of sessions in the capture. */
+size_t replay_sessions(Replay replay);
+
+/*! \brief Play the sessions, returning once they are done.
+ *  \return 0, or -1 (errno EINVAL) if the config isn't valid.
+ */
+int replay_run(Replay replay, const Replay_Config * cfg, Replay_Stats * stats);
+
+void replay_free(Replay replay);
+
+void replay_dump_stats(const Replay_Stats * stats, FILE * fp);
+
+#endif // __REPLAY_H__
@@ -0,0 +1,402 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "log.h"
+#include "sz.h"
+#include "tm.h"
+#include "rl.h"
+
+// Token buckets, keyed by (client address, route, kind)
+typedef struct {
+	uint64_t key;     // 0 if the slot is unused
+	uint64_t last_ns; // last time tokens were added to the bucket
+	double   tokens;
+} Rl_Slot;
+
+#define RL_WAYS 4
+typedef struct {
+	uint32_t lock;
+	uint32_t pad;
+	Rl_Slot ways[RL_WAYS];
+} Rl_Set;
+
+typedef struct {
+	size_t nsets;
+	uint64_t limited[RL_NUM_KINDS];
+	uint64_t evicted;
+	Rl_Set sets[0];
+} Rl_Table;
+
+static Rl_Table * _rl_table = NULL;
+static size_t _rl_table_size = 0;
+static Rl_Route _rl_routes[RL_MAX_ROUTES];
+static int _rl_num_routes = 0;
+
+static const char RSP_429[] =
+	"HTTP/1.1 429 Too Many Requests\r\n"
+	"Retry-After: 1\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char * RL_KIND_NAMES[RL_NUM_KINDS] = { "req", "upg", "msgs", "bytes" };
+
+int rl_init(size_t nslots) {
+	if(nslots==0) {
+		nslots = 16384;
+	}
+	size_t nsets = (nslots + RL_WAYS - 1) / RL_WAYS;
+	size_t size = sizeof(Rl_Table) + nsets * sizeof(Rl_Set);
+	ilogf("Initializing rate limiter: slots=%zu, size=%zu",nsets*RL_WAYS,size);
+	Rl_Table * table = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if(table==MAP_FAILED) {
+		elogf("mmap failed: %s",strerror(errno));
+		return -1;
+	}
+	memset(table,0,size);
+	table->nsets = nsets;
+	if(_rl_table) {
+		munmap(_rl_table,_rl_table_size);
+	}
+	_rl_table = table;
+	_rl_table_size = size;
+	return 0;
+}
+
+int rl_parse_route(const char * spec, Rl_Route * route) {
+	memset(route,0,sizeof(Rl_Route));
+	const char * colon = strchr(spec,':');
+	if(!colon || colon==spec || (colon-spec) > RL_MAX_ROUTE_LEN || *spec!='/') {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(route->route,spec,colon-spec);
+	char limits[strlen(colon)];
+	strcpy(limits,colon+1);
+	char * save = NULL;
+	int count = 0;
+	for(char * tok = strtok_r(limits,",",&save); tok; tok = strtok_r(NULL,",",&save), count++) {
+		char * eq = strchr(tok,'=');
+		if(!eq) {
+			errno = EINVAL;
+			return -1;
+		}
+		*eq = 0;
+		int kind = -1;
+		for(int k=0; k<RL_NUM_KINDS; k++) {
+			if(strcmp(tok,RL_KIND_NAMES[k])==0) {
+				kind = k;
+			}
+		}
+		char * end;
+		long rate = strtol(eq+1,&end,10);
+		long burst = rate;
+		if(*end=='/') {
+			burst = strtol(end+1,&end,10);
+		}
+		if(kind<0 || *end || rate<=0 || burst<=0 || rate>UINT32_MAX || burst>UINT32_MAX) {
+			errno = EINVAL;
+			return -1;
+		}
+		route->rate[kind] = rate;
+		route->burst[kind] = burst;
+	}
+	if(count==0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int rl_add_route(const Rl_Route * route) {
+	if(_rl_num_routes>=RL_MAX_ROUTES) {
+		errno = ENOSPC;
+		return -1;
+	}
+	_rl_routes[_rl_num_routes++] = *route;
+	return 0;
+}
+
+void rl_clear_routes(void) {
+	_rl_num_routes = 0;
+}
+
+int rl_route(const char * uri) {
+	int best = -1;
+	size_t best_len = 0;
+	for(int i=0; i<_rl_num_routes; i++) {
+		size_t len = strlen(_rl_routes[i].route);
+		if(len >= best_len && sz_starts_with(uri,_rl_routes[i].route)) {
+			best = i;
+			best_len = len;
+		}
+	}
+	return best;
+}
+
+static uint64_t rl_key(int route, Rl_Kind kind, const struct sockaddr * addr) {
+	const unsigned char * bytes;
+	size_t len;
+	switch(addr->sa_family) {
+	case AF_INET:
+		bytes = (const unsigned char *)&((const struct sockaddr_in *)addr)->sin_addr;
+		len = sizeof(struct in_addr);
+		break;
+	case AF_INET6: {
+		const struct in6_addr * in6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+		if(IN6_IS_ADDR_V4MAPPED(in6)) {
+			// An IPv4 client of a dual-stack socket
+			bytes = in6->s6_addr + 12;
+			len = sizeof(struct in_addr);
+		} else {
+			// By /64, the smallest network usually assigned to a host, so
+			// that it can't rotate through its addresses for fresh buckets
+			bytes = in6->s6_addr;
+			len = 8;
+		}
+		break; }
+	default:
+		return 0;
+	}
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(size_t i=0; i<len; i++) {
+		h = (h ^ bytes[i]) * 0x100000001b3ULL;
+	}
+	h = (h ^ (uint64_t)route) * 0x100000001b3ULL;
+	h = (h ^ (uint64_t)kind) * 0x100000001b3ULL;
+	return h ? h : 1;
+}
+
+static void rl_lock(Rl_Set * set) {
+	while(__atomic_exchange_n(&set->lock,1,__ATOMIC_ACQUIRE)) {
+		while(__atomic_load_n(&set->lock,__ATOMIC_RELAXED)) {
+			sched_yield();
+		}
+	}
+}
+
+static void rl_unlock(Rl_Set * set) {
+	__atomic_store_n(&set->lock,0,__ATOMIC_RELEASE);
+}
+
+static bool _rl_take_at(int route, Rl_Kind kind, const struct sockaddr * addr, uint64_t tokens, uint64_t now) {
+	if(route<0 || route>=_rl_num_routes || !_rl_table || !addr) {
+		return true;
+	}
+	const Rl_Route * r = &_rl_routes[route];
+	if(r->rate[kind]==0) {
+		return true;
+	}
+	uint64_t key = rl_key(route,kind,addr);
+	if(key==0) {
+		return true;
+	}
+	Rl_Set * set = &_rl_table->sets[(key >> 7) % _rl_table->nsets];
+	rl_lock(set);
+	Rl_Slot * slot = NULL;
+	Rl_Slot * victim = &set->ways[0];
+	for(int i=0; i<RL_WAYS; i++) {
+		Rl_Slot * way = &set->ways[i];
+		if(way->key==key) {
+			slot = way;
+			break;
+		}
+		if(way->last_ns < victim->last_ns) {
+			victim = way;
+		}
+	}
+	if(!slot) {
+		// Evict the least recently refilled bucket. A bucket that has been idle
+		// the longest is the one most likely to be full anyway.
+		if(victim->key) {
+			__atomic_add_fetch(&_rl_table->evicted,1,__ATOMIC_RELAXED);
+		}
+		slot = victim;
+		slot->key = key;
+		slot->tokens = r->burst[kind];
+	} else if(now > slot->last_ns) {
+		slot->tokens += (double)(now - slot->last_ns) * r->rate[kind] / TM_NS_PER_S;
+		if(slot->tokens > r->burst[kind]) {
+			slot->tokens = r->burst[kind];
+		}
+	}
+	slot->last_ns = now;
+	bool ok = slot->tokens >= (double)tokens;
+	if(ok) {
+		slot->tokens -= tokens;
+	}
+	rl_unlock(set);
+	if(!ok) {
+		__atomic_add_fetch(&_rl_table->limited[kind],1,__ATOMIC_RELAXED);
+	}
+	return ok;
+}
+
+bool rl_take(int route, Rl_Kind kind, const struct sockaddr * addr, uint64_t tokens) {
+	return _rl_take_at(route,kind,addr,tokens,tm_now_ns());
+}
+
+int rl_send_429(int fd) {
+	return write(fd,RSP_429,sizeof(RSP_429)-1);
+}
+
+void rl_dump_stats(FILE * fp) {
+	if(!_rl_table) {
+		return;
+	}
+	for(int k=0; k<RL_NUM_KINDS; k++) {
+		fprintf(fp,"rl_limited_%s %llu\n",RL_KIND_NAMES[k],
+			(unsigned long long)__atomic_load_n(&_rl_table->limited[k],__ATOMIC_RELAXED));
+	}
+	fprintf(fp,"rl_evicted %llu\n",(unsigned long long)__atomic_load_n(&_rl_table->evicted,__ATOMIC_RELAXED));
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include <arpa/inet.h>
+#include "ut.h"
+
+static struct sockaddr_in test_addr(uint32_t ip) {
+	struct sockaddr_in a;
+	memset(&a,0,sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_addr.s_addr = htonl(ip);
+	return a;
+}
+
+UT_TEST_CASE(rl_parse_route) {
+	Rl_Route r;
+	ut_assert(rl_parse_route("/ws:msgs=100/200,bytes=65536",&r)==0);
+	ut_assert(strcmp(r.route,"/ws")==0);
+	ut_assert(r.rate[RL_WS_MSGS]==100);
+	ut_assert(r.burst[RL_WS_MSGS]==200);
+	ut_assert(r.rate[RL_WS_BYTES]==65536);
+	ut_assert(r.burst[RL_WS_BYTES]==65536);
+	ut_assert(r.rate[RL_REQ]==0);
+	ut_assert(rl_parse_route("/:req=10,upg=1",&r)==0);
+	ut_assert(r.rate[RL_REQ]==10);
+	ut_assert(r.rate[RL_UPGRADE]==1);
+
+	ut_assert(rl_parse_route("/ws",&r)!=0);
+	ut_assert(rl_parse_route("ws:req=1",&r)!=0);
+	ut_assert(rl_parse_route("/ws:",&r)!=0);
+	ut_assert(rl_parse_route("/ws:bogus=1",&r)!=0);
+	ut_assert(rl_parse_route("/ws:req=0",&r)!=0);
+	ut_assert(rl_parse_route("/ws:req=1x",&r)!=0);
+}
+
+UT_TEST_CASE(rl_routes) {
+	Rl_Route r;
+	rl_clear_routes();
+	ut_assert(rl_route("/")==-1);
+	ut_assert(rl_parse_route("/:req=10",&r)==0);
+	ut_assert(rl_add_route(&r)==0);
+	ut_assert(rl_parse_route("/ws:msgs=10",&r)==0);
+	ut_assert(rl_add_route(&r)==0);
+	ut_assert(rl_route("/index.html")==0);
+	ut_assert(rl_route("/ws")==1);
+	ut_assert(rl_route("/ws/chat")==1);
+	rl_clear_routes();
+}
+
+UT_TEST_CASE(rl_token_bucket) {
+	ut_assert(rl_init(64)==0);
+	Rl_Route r;
+	rl_clear_routes();
+	ut_assert(rl_parse_route("/:req=10/5,bytes=1000",&r)==0);
+	ut_assert(rl_add_route(&r)==0);
+	struct sockaddr_in a1 = test_addr(0x0a000001);
+	struct sockaddr_in a2 = test_addr(0x0a000002);
+	const struct sockaddr * sa1 = (struct sockaddr *)&a1;
+	const struct sockaddr * sa2 = (struct sockaddr *)&a2;
+	uint64_t now = TM_NS_PER_S;
+
+	// burst of 5, then limited
+	for(int i=0; i<5; i++) {
+		ut_assert(_rl_take_at(0,RL_REQ,sa1,1,now));
+	}
+	ut_assert(!_rl_take_at(0,RL_REQ,sa1,1,now));
+	// other clients are not affected
+	ut_assert(_rl_take_at(0,RL_REQ,sa2,1,now));
+	// unlimited kinds, unknown routes and unknown addresses are never limited
+	ut_assert(_rl_take_at(0,RL_WS_MSGS,sa1,1000,now));
+	ut_assert(_rl_take_at(-1,RL_REQ,sa1,1,now));
+	ut_assert(_rl_take_at(0,RL_REQ,NULL,1,now));
+	// refill at 10/s
+	now += TM_NS_PER_S / 10;
+	ut_assert(_rl_take_at(0,RL_REQ,sa1,1,now));
+	ut_assert(!_rl_take_at(0,RL_REQ,sa1,1,now));
+	// refill is capped by the burst size
+	now += 10 * TM_NS_PER_S;
+	for(int i=0; i<5; i++) {
+		ut_assert(_rl_take_at(0,RL_REQ,sa1,1,now));
+	}
+	ut_assert(!_rl_take_at(0,RL_REQ,sa1,1,now));
+	// byte buckets
+	ut_assert(_rl_take_at(0,RL_WS_BYTES,sa1,600,now));
+	ut_assert(!_rl_take_at(0,RL_WS_BYTES,sa1,600,now));
+	ut_assert(_rl_take_at(0,RL_WS_BYTES,sa1,400,now));
+	ut_assert(rl_take(0,RL_WS_BYTES,sa2,1000));
+
+	rl_dump_stats(stdlog);
+	ut_assert(_rl_table->limited[RL_REQ]==3);
+	ut_assert(_rl_table->limited[RL_WS_BYTES]==1);
+	rl_clear_routes();
+}
+
+UT_TEST_CASE(rl_ipv6_prefix) {
+	ut_assert(rl_init(64)==0);
+	Rl_Route r;
+	rl_clear_routes();
+	ut_assert(rl_parse_route("/:req=1/2",&r)==0);
+	ut_assert(rl_add_route(&r)==0);
+	struct sockaddr_in6 a1 = { .sin6_family = AF_INET6 };
+	ut_assert(inet_pton(AF_INET6,"2001:db8:0:1::1",&a1.sin6_addr)==1);
+	struct sockaddr_in6 a2 = a1;   // same /64
+	ut_assert(inet_pton(AF_INET6,"2001:db8:0:1:ffff:1234:5678:9abc",&a2.sin6_addr)==1);
+	struct sockaddr_in6 a3 = a1;   // another /64
+	ut_assert(inet_pton(AF_INET6,"2001:db8:0:2::1",&a3.sin6_addr)==1);
+	struct sockaddr_in6 mapped = a1;
+	ut_assert(inet_pton(AF_INET6,"::ffff:10.0.0.1",&mapped.sin6_addr)==1);
+	struct sockaddr_in v4 = test_addr(0x0a000001);
+	uint64_t now = TM_NS_PER_S;
+
+	// a1 and a2 share a bucket
+	ut_assert(_rl_take_at(0,RL_REQ,(struct sockaddr *)&a1,1,now));
+	ut_assert(_rl_take_at(0,RL_REQ,(struct sockaddr *)&a2,1,now));
+	ut_assert(!_rl_take_at(0,RL_REQ,(struct sockaddr *)&a2,1,now));
+	ut_assert(!_rl_take_at(0,RL_REQ,(struct sockaddr *)&a1,1,now));
+	ut_assert(_rl_take_at(0,RL_REQ,(struct sockaddr *)&a3,1,now));
+	// An IPv4-mapped address is its IPv4 client
+	ut_assert(_rl_take_at(0,RL_REQ,(struct sockaddr *)&v4,2,now));
+	ut_assert(!_rl_take_at(0,RL_REQ,(struct sockaddr *)&mapped,1,now));
+	rl_clear_routes();
+}
+
+UT_TEST_CASE(rl_fixed_memory) {
+	ut_assert(rl_init(256)==0);
+	Rl_Route r;
+	rl_clear_routes();
+	ut_assert(rl_parse_route("/:req=1",&r)==0);
+	ut_assert(rl_add_route(&r)==0);
+	// Many more clients than slots: table doesn't grow, and old buckets are evicted
+	uint64_t now = TM_NS_PER_S;
+	for(uint32_t ip=1; ip<=100000; ip++, now++) {
+		struct sockaddr_in a = test_addr(ip);
+		ut_assert(_rl_take_at(0,RL_REQ,(struct sockaddr *)&a,1,now));
+	}
+	ut_assert(_rl_table->evicted >= 100000-256);
+	// the most recent client is still tracked
+	struct sockaddr_in a = test_addr(100000);
+	ut_assert(!_rl_take_at(0,RL_REQ,(struct sockaddr *)&a,1,now));
+	rl_clear_routes();
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
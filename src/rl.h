@@ -0,0 +1,69 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __RL_H__
+#define __RL_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/*! \brief What a token bucket limits */
+typedef enum {
+	RL_REQ = 0,   // HTTP requests per second
+	RL_UPGRADE,   // websocket upgrades per second
+	RL_WS_MSGS,   // websocket messages per second
+	RL_WS_BYTES,  // websocket message bytes per second
+	RL_NUM_KINDS
+} Rl_Kind;
+
+#define RL_MAX_ROUTES 16
+#define RL_MAX_ROUTE_LEN 127
+
+/*! \brief Rate limits that apply to requests whose URI starts with the route
+ *         prefix. A rate of zero means unlimited.
+ */
+typedef struct {
+	char route[RL_MAX_ROUTE_LEN+1];
+	uint32_t rate[RL_NUM_KINDS];  // tokens per second
+	uint32_t burst[RL_NUM_KINDS]; // bucket capacity; defaults to the rate
+} Rl_Route;
+
+/*! \brief Initialize the rate limiter. Buckets are kept in a fixed-size,
+ *         set-associative table (placed in memory shared with child processes),
+ *         so memory use does not grow with the number of client addresses.
+ *         Must be called before forking any child processes.
+ *
+ * \param nslots Number of buckets in the table; 0 selects a default.
+ */
+int rl_init(size_t nslots);
+
+/*! \brief Parse a route spec of the form `<prefix>:<kind>=<rate>[/<burst>],...`
+ *         where kind is one of `req`, `upg`, `msgs` or `bytes`.
+ *         E.g., `/ws:msgs=100/200,bytes=65536`
+ */
+int rl_parse_route(const char * spec, Rl_Route * route);
+
+/*! \brief Add limits for a route. Routes are matched by longest URI prefix.
+ */
+int rl_add_route(const Rl_Route * route);
+
+/*! \brief Remove all routes. */
+void rl_clear_routes(void);
+
+/*! \brief Find the route for the given URI.
+ *  \return The route index, or -1 if no limits apply.
+ */
+int rl_route(const char * uri);
+
+/*! \brief Take tokens from the bucket associated with the client address.
+ *  \return True if the tokens were available, false if the client is over its limit.
+ */
+bool rl_take(int route, Rl_Kind kind, const struct sockaddr * addr, uint64_t tokens);
+
+/*! \brief Write the prebuilt "429 Too Many Requests" response.
+ */
+int rl_send_429(int fd);
+
+void rl_dump_stats(FILE * fp);
+
+#endif // __RL_H__
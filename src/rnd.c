@@ -1,22 +1,156 @@
 // Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
 #include <errno.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
 
 #include "log.h"
 #include "rnd.h"
 
-unsigned char * _rnd_mem_ext(size_t len, unsigned char * buff, const char * urandom_path);
+// Per-thread xoshiro256** state (https://prng.di.unimi.it/)
+typedef struct {
+    uint64_t s[4];
+    uint64_t gen;  // _rnd_gen when seeded; 0 if not seeded
+} Rnd_State;
 
-unsigned char * rnd_mem(size_t len, unsigned char * buff) {
-    return _rnd_mem_ext(len, buff, "/dev/urandom");
-}
+static __thread Rnd_State _rnd_state;
 
-unsigned char * _rnd_mem_ext(size_t len, unsigned char * buff, const char * urandom_path) {
-    FILE * f_random = fopen(urandom_path, "r");
+static pthread_mutex_t _rnd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _rnd_once = PTHREAD_ONCE_INIT;
+static volatile uint64_t _rnd_gen = 1; // bumped in a forked child
+static uint64_t _rnd_key[4];           // under _rnd_lock
+static uint64_t _rnd_key_gen = 0;      // _rnd_gen the key was read for
+static uint64_t _rnd_threads = 0;      // threads seeded from the key
+
+unsigned char * _rnd_mem_ext(size_t len, unsigned char * buff, const char * urandom_path);
+
+static int rnd_read_file(const char * path, void * buff, size_t len) {
+    FILE * f_random = fopen(path, "r");
     if(!f_random) {
         elogf("Failed to open urandom: %s",strerror(errno));
+        return -1;
+    }
+    if(fread(buff,len,1,f_random)!=1) {
+        elogf("fread failed: %s",strerror(errno));
+        fclose(f_random);
+        return -1;
+    }
+    fclose(f_random);
+    return 0;
+}
+
+static void rnd_atfork_prepare(void) {
+    pthread_mutex_lock(&_rnd_lock);
+}
+
+static void rnd_atfork_parent(void) {
+    pthread_mutex_unlock(&_rnd_lock);
+}
+
+static void rnd_atfork_child(void) {
+    pthread_mutex_unlock(&_rnd_lock);
+    _rnd_gen++;
+}
+
+static void rnd_register_atfork(void) {
+    pthread_atfork(rnd_atfork_prepare,rnd_atfork_parent,rnd_atfork_child);
+}
+
+static inline uint64_t rnd_splitmix64(uint64_t * x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void rnd_seed(Rnd_State * st) {
+    pthread_once(&_rnd_once,rnd_register_atfork);
+    pthread_mutex_lock(&_rnd_lock);
+    uint64_t gen = _rnd_gen;
+    if(_rnd_key_gen != gen) {
+        ssize_t n;
+        while((n = getrandom(_rnd_key,sizeof(_rnd_key),0))<0 && errno==EINTR);
+        if(n!=sizeof(_rnd_key) && rnd_read_file("/dev/urandom",_rnd_key,sizeof(_rnd_key))!=0) {
+            // Still distinct per process and thread, if not unpredictable
+            wlogf("No random seed available; seeding from the clock");
+            _rnd_key[0] ^= (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+        }
+        _rnd_key_gen = gen;
+        _rnd_threads = 0;
+    }
+    uint64_t x = _rnd_key[0] ^ (++_rnd_threads * 0xd1b54a32d192ed03ULL);
+    for(int i=0; i<4; i++) {
+        st->s[i] = _rnd_key[i] ^ rnd_splitmix64(&x);
+    }
+    pthread_mutex_unlock(&_rnd_lock);
+    st->gen = gen;
+}
+
+static inline uint64_t rnd_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t rnd_next(Rnd_State * st) {
+    uint64_t * s = st->s;
+    uint64_t result = rnd_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rnd_rotl(s[3], 45);
+    return result;
+}
+
+static inline Rnd_State * rnd_state(void) {
+    Rnd_State * st = &_rnd_state;
+    if(__builtin_expect(st->gen != _rnd_gen,0)) {
+        rnd_seed(st);
+    }
+    return st;
+}
+
+uint64_t rnd_u64(void) {
+    return rnd_next(rnd_state());
+}
+
+uint32_t rnd_u32(void) {
+    return (uint32_t)(rnd_next(rnd_state()) >> 32);
+}
+
+void rnd_fill(void * buff, size_t len) {
+    Rnd_State * st = rnd_state();
+    unsigned char * p = buff;
+    for(; len>=8; p+=8, len-=8) {
+        uint64_t r = rnd_next(st);
+        memcpy(p,&r,8);
+    }
+    if(len>0) {
+        uint64_t r = rnd_next(st);
+        memcpy(p,&r,len);
+    }
+}
+
+unsigned char * rnd_mem(size_t len, unsigned char * buff) {
+    if(buff==NULL) {
+        buff = malloc(len);
+    } else {
+        buff = realloc(buff,len);
+    }
+    if(!buff) {
+        elogf("(m/re)alloc failed: %s",strerror(errno));
         return NULL;
     }
+    rnd_fill(buff,len);
+    return buff;
+}
+
+unsigned char * _rnd_mem_ext(size_t len, unsigned char * buff, const char * urandom_path) {
     if(buff==NULL) {
         buff = malloc(len);
     } else {
@@ -26,11 +160,10 @@ unsigned char * _rnd_mem_ext(size_t len, unsigned char * buff, const char * uran
         elogf("(m/re)alloc failed: %s",strerror(errno));
         return NULL;
     }
-    if(fread(buff,len,1,f_random)!=1) {
-        elogf("fread failed: %s",strerror(errno));
+    if(rnd_read_file(urandom_path,buff,len)!=0) {
+        free(buff);
         return NULL;
     }
-    fclose(f_random);
     return buff;
 }
 
@@ -46,6 +179,7 @@ char * rnd_sz(size_t len, char * buff) {
 
 #ifndef EXCLUDE_UNIT_TESTS
 
+#include <sys/wait.h>
 #include "ut.h"
 
 #define TEST_DATA_DIR "src/test-data/"
@@ -79,7 +213,106 @@ UT_TEST_CASE(rnd_str) {
 UT_TEST_CASE(rnd_mem_cant_open) {
     unsigned char * sz = _rnd_mem_ext(128,NULL,"/dev/bogus");
     ut_assert(sz==NULL);
+    unsigned char * bytes = _rnd_mem_ext(16,NULL,"/dev/urandom");
+    ut_assert(bytes!=NULL);
+    free(bytes);
 }
 
+UT_TEST_CASE(rnd_fill) {
+    // Odd lengths and offsets
+    unsigned char buff[64];
+    memset(buff,0,sizeof(buff));
+    rnd_fill(buff+1,13);
+    ut_assert(buff[0]==0 && buff[14]==0);
+    int nonzero = 0;
+    for(int i=1; i<14; i++) {
+        nonzero += buff[i]!=0;
+    }
+    ut_assert(nonzero>0);
+
+    // Every bit is set in some of the masks, and clear in some
+    uint32_t ones = 0, zeros = 0;
+    for(int i=0; i<64; i++) {
+        unsigned char mask_key[4];
+        uint32_t m;
+        rnd_mask(mask_key);
+        memcpy(&m,mask_key,4);
+        ones |= m;
+        zeros |= ~m;
+    }
+    ut_assert(ones==0xffffffff && zeros==0xffffffff);
+}
+
+static void * test_rnd_thread(void * arg) {
+    *(uint64_t *)arg = rnd_u64();
+    return NULL;
+}
+
+UT_TEST_CASE(rnd_threads_and_fork) {
+    // Each thread has its own sequence
+    uint64_t r1, r2;
+    pthread_t t1, t2;
+    ut_assert(pthread_create(&t1,NULL,test_rnd_thread,&r1)==0);
+    ut_assert(pthread_create(&t2,NULL,test_rnd_thread,&r2)==0);
+    pthread_join(t1,NULL);
+    pthread_join(t2,NULL);
+    ut_assert(r1!=r2);
+
+    // A forked child doesn't repeat its parent's sequence
+    int fds[2];
+    ut_assert(pipe(fds)==0);
+    pid_t pid = fork();
+    ut_assert(pid>=0);
+    if(pid==0) {
+        uint64_t r = rnd_u64();
+        ssize_t rc = write(fds[1],&r,sizeof(r));
+        fflush(NULL);
+        _exit(rc==sizeof(r) ? 0 : 1);
+    }
+    uint64_t r_child = 0;
+    ut_assert(read(fds[0],&r_child,sizeof(r_child))==sizeof(r_child));
+    int status;
+    waitpid(pid,&status,0);
+    close(fds[0]);
+    close(fds[1]);
+    ut_assert(r_child!=rnd_u64());
+}
 
 #endif // !EXCLUDE_UNIT_TESTS
+
+#ifndef EXCLUDE_BENCHMARKS
+
+#include "bench.h"
+
+BENCH_CASE(rnd_mask_key) {
+    const uint64_t n = bench_iterations(10000000);
+    unsigned char mask_key[4];
+    uint32_t sink = 0;
+    uint64_t start = tm_now_ns();
+    for(uint64_t i=0; i<n; i++) {
+        rnd_mask(mask_key);
+        sink ^= mask_key[i&3];
+    }
+    bench_report("rnd_mask",n,0,tm_now_ns()-start);
+
+    // For comparison: opening /dev/urandom for each key
+    const uint64_t n_file = bench_iterations(20000);
+    start = tm_now_ns();
+    for(uint64_t i=0; i<n_file; i++) {
+        if(rnd_read_file("/dev/urandom",mask_key,4)==0) {
+            sink ^= mask_key[i&3];
+        }
+    }
+    bench_report("fopen(/dev/urandom) per key",n_file,0,tm_now_ns()-start);
+
+    static unsigned char buff[65536];
+    const uint64_t n_fill = bench_iterations(20000);
+    start = tm_now_ns();
+    for(uint64_t i=0; i<n_fill; i++) {
+        rnd_fill(buff,sizeof(buff));
+    }
+    bench_report("rnd_fill (64KB)",n_fill,n_fill*sizeof(buff),tm_now_ns()-start);
+    dlogf("sink=%u",sink);
+}
+
+#endif // !EXCLUDE_BENCHMARKS
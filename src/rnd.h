@@ -3,8 +3,33 @@
 #define __RND_H__
 
 #include <stddef.h>
+#include <stdint.h>
 
+// Fast random numbers, for websocket masking keys, nonces and IDs. Each
+// thread has its own xoshiro256** generator, seeded from a key that is read
+// once per process with getrandom(2) (and read again in a forked child, so
+// that children don't repeat their parent's numbers). Not for secrets: use
+// OpenSSL for those.
+
+/*! \brief Fill buff with len random bytes. */
+extern void rnd_fill(void * buff, size_t len);
+
+extern uint64_t rnd_u64(void);
+extern uint32_t rnd_u32(void);
+
+/*! \brief A websocket masking key. */
+static inline void rnd_mask(unsigned char mask_key[4]) {
+    uint32_t r = rnd_u32();
+    __builtin_memcpy(mask_key,&r,4);
+}
+
+/*! \brief Random bytes, in buff (which is (re)allocated to len bytes if not NULL,
+ *         or allocated if NULL).
+ *  \return The bytes, or NULL if allocation failed.
+ */
 extern unsigned char * rnd_mem(size_t len, unsigned char * buff);
+
+/*! \brief A random string of len-1 printable characters, in buff (as for rnd_mem). */
 extern char * rnd_sz(size_t len, char * buff);
 
 #endif // __RND_H__
@@ -15,6 +15,18 @@
 #include "ht.h"
 #include "http.h"
 #include "ws.h"
+#include "adm.h"
+#include "tm.h"
+#include "rl.h"
+#include "tls.h"
+#include "wrk.h"
+#include "arena.h"
+#include "slab.h"
+#include "relay.h"
+#include "topic.h"
+#include "pool.h"
+#include "prof.h"
+#include "trace.h"
 
 static volatile int shutdown_server = 0;
 
@@ -58,55 +70,190 @@ static void do_server_maintenance() {
 	int pid;
 	while((pid=waitpid(-1,&status,WNOHANG))>0) {
 		ilogf("Child pid=%d terminated with status=0x%x", pid, status);
+		if(!wrk_reaped(pid)) {
+			adm_conn_close();
+		}
+	}
+}
+
+
+typedef struct {
+	bool use_fork;
+	int port;                  // TCP port; 0 if not listening on TCP
+	uint32_t addr;             // IPv4 address to listen on; INVALID_ADDR for any
+	const char * unix_path;    // Unix domain socket path; NULL if not listening on a Unix socket
+	bool unix_abstract;        // unix_path is a name in the abstract namespace
+	const char * static_files_dir;
+	const char * static_bundle;  // serve static files from this bundle instead of static_files_dir
+	int tls_port;              // TLS port; 0 if not listening for TLS connections
+	Tls_Config tls;
+	Adm_Config adm;
+	unsigned int rl_slots;
+	unsigned int frame_pool_cap_mb; // 0 for the default
+	Wrk_Config wrk;            // wrk.workers is 0 if connections are not handed to worker processes
+	Relay_Config relay;        // relay.port is the first worker's relay port; 0 if not relaying
+	int offload_threads;       // websocket message handling threads per process; -1 to handle on the connection's thread
+	const char * ws_record;    // capture websocket sessions to this file; NULL if not capturing
+	unsigned int ws_record_payload; // bytes of each frame's payload captured
+	bool profiler;             // serve CPU profiles at PROF_URI
+} Server_Config;
+
+// Enough of each frame's payload to tell messages apart, while keeping captures small
+#define SERVER_WS_RECORD_PAYLOAD 64
+
+static const Server_Config * _server_cfg = NULL;
+
+#define MAX_LISTENERS 3
+
+static void serve_client(int fd_client, const struct sockaddr * client_addr, bool tls) {
+	if(!tls) {
+		http_client_connect(fd_client,fd_client,client_addr);
+	} else {
+		Tls_Conn * tc = tls_accept(fd_client);
+		if(tc) {
+			http_client_connect(tc->fd_in,tc->fd_out,client_addr);
+			tls_close(tc);
+		}
+	}
+	TRACE2(close,fd_client,adm_sojourn_ns());
+}
+
+// Each worker is a relay node: it links to the workers before it, which
+// accept links on the ports before its own, and to the configured peers
+static void init_worker(int worker) {
+	const Server_Config * cfg = _server_cfg;
+	Relay_Config relay = cfg->relay;
+	relay.port = cfg->relay.port + worker;
+	uint32_t addr = cfg->addr==INVALID_ADDR ? net_atoipv4("127.0.0.1") : cfg->addr;
+	for(int i=0; i<worker && relay.num_peers<RELAY_MAX_PEERS; i++) {
+		relay.peers[relay.num_peers++] = (Relay_Peer){ .addr = addr, .port = cfg->relay.port + i };
+	}
+	if(relay_start(&relay)!=0) {
+		elogf("Worker %d failed to start relaying",worker);
 	}
 }
 
+static void handle_client(const Server_Config * cfg, int fd_client, const struct sockaddr * client_addr, socklen_t client_addr_len,
+		bool tls, uint64_t t_accept_ns, const int * fds_server, int num_servers) {
+	if(wrk_enabled()) {
+		if(wrk_dispatch(fd_client,client_addr,client_addr_len,tls,t_accept_ns)!=0) {
+			wlogf("No worker could take the client connection");
+			if(!tls) {
+				adm_send_503(fd_client);
+			}
+			adm_conn_close();
+		}
+		// The worker has its own copy
+		close(fd_client);
+		return;
+	}
+	if(!cfg->use_fork) {
+		serve_client(fd_client,client_addr,tls);
+		ilogf("Closing client connection");
+		close(fd_client);
+		adm_conn_close();
+		return;
+	}
+	ilogf("Forking child process");
+	int pgrp = getpgrp();
+	int child_pid = fork();
+	if(child_pid!=0) {
+		// parent process
+		ilogf("Forked child pid=%d",child_pid);
+		setpgid(child_pid,pgrp);
+		close(fd_client);
+	} else {
+		// child process
+		setpgid(child_pid,pgrp);
+		signal(SIGINT, sigint_handler_child);
+		signal(SIGTERM, sigint_handler_child);
+		for(int i=0; i<num_servers; i++) {
+			close(fds_server[i]);
+		}
+		_fd_client = fd_client;
+		// handle request
+		serve_client(fd_client,client_addr,tls);
+		ilogf("Closing client connection");
+		close(fd_client);
+		CRYPTO_cleanup_all_ex_data();
+		ilogf("Exiting child process");
+		exit(0);
+	}
+}
 
-static int server(bool use_fork, int port, const char * static_files_dir) {
+static int server(const Server_Config * cfg) {
 	signal(SIGINT, sigint_handler);
 	signal(SIGTERM, sigint_handler);
 	signal(SIGCHLD, sigint_handler);
+	// Writes to a client that has gone away should fail, not kill us
+	signal(SIGPIPE, SIG_IGN);
 
-	if(http_init(static_files_dir)!=0) { // TODO - get this from config
+	if((cfg->static_bundle ? http_init_bundle(cfg->static_bundle) : http_init(cfg->static_files_dir))!=0) {
 		elogf("Failed to initialize http subsystem");
 		return 1;
 	};
+	http_set_offload(cfg->offload_threads);
+	prof_enable(cfg->profiler);
+
+	if(cfg->ws_record && ws_record_start(cfg->ws_record,cfg->ws_record_payload)!=0) {
+		elogf("Failed to start websocket capture: %s",strerror(errno));
+		return 1;
+	}
 
-	ilogf("Starting server on port %d",port);
+	if(adm_init(&cfg->adm)!=0) {
+		elogf("Failed to initialize admission control");
+		return 1;
+	}
 
-	int fd_server;
-	if((fd_server = socket(AF_INET,SOCK_STREAM,0))<0) {
-		elogf("Failed to create server socket: %s",strerror(errno));
+	if(arena_init()!=0) {
+		elogf("Failed to initialize arena stats");
 		return 1;
 	}
 
-	int ov = 1;
-	if(setsockopt(fd_server,SOL_SOCKET,SO_REUSEADDR,&ov,sizeof(ov))<0) {
-		elogf("Failed to set socket options: %s",strerror(errno));
-		close(fd_server);
+	if(slab_init((size_t)cfg->frame_pool_cap_mb*1024*1024)!=0) {
+		elogf("Failed to initialize frame buffer pool");
 		return 1;
 	}
 
-	ov = 1;
-	if(ioctl(fd_server,FIONBIO,&ov)<0) {
-		elogf("Failed to enable non-blocking IO mode: %s",strerror(errno));
-		close(fd_server);
+	if(rl_init(cfg->rl_slots)!=0) {
+		elogf("Failed to initialize rate limiter");
 		return 1;
 	}
 
-	struct sockaddr_in addr;
-	int addr_len = sizeof(addr);
-	memset(&addr,0,addr_len);
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
-	addr.sin_addr.s_addr = INADDR_ANY;
-	if(bind(fd_server,(struct sockaddr *)&addr,addr_len)<0) {
-		elogf("Failed to bind to server socket: %s",strerror(errno));
+	if(cfg->tls_port>0 && tls_init(&cfg->tls)!=0) {
+		elogf("Failed to initialize TLS");
 		return 1;
 	}
 
-	if(listen(fd_server,10)<0) {
-		elogf("Failed to listen to server socket: %s",strerror(errno));
+	int fds_server[MAX_LISTENERS];
+	bool tls_server[MAX_LISTENERS] = { false };
+	int num_servers = 0;
+	if(cfg->port>0) {
+		ilogf("Starting server on port %d",cfg->port);
+		if((fds_server[num_servers] = net_listen_tcp(cfg->addr,cfg->port,10))<0) {
+			return 1;
+		}
+		num_servers++;
+	}
+	if(cfg->tls_port>0) {
+		ilogf("Starting TLS server on port %d",cfg->tls_port);
+		if((fds_server[num_servers] = net_listen_tcp(cfg->addr,cfg->tls_port,10))<0) {
+			return 1;
+		}
+		tls_server[num_servers] = true;
+		num_servers++;
+	}
+	if(cfg->unix_path) {
+		ilogf("Starting server on unix socket %s%s",cfg->unix_abstract?"@":"",cfg->unix_path);
+		if((fds_server[num_servers] = net_listen_unix(cfg->unix_path,cfg->unix_abstract,10))<0) {
+			return 1;
+		}
+		num_servers++;
+	}
+
+	_server_cfg = cfg;
+	if(cfg->wrk.workers>0 && wrk_init(&cfg->wrk,serve_client,fds_server,num_servers)!=0) {
+		elogf("Failed to start worker processes");
 		return 1;
 	}
 
@@ -114,62 +261,82 @@ static int server(bool use_fork, int port, const char * static_files_dir) {
 		do_server_maintenance();
 		fd_set fds;
 		FD_ZERO(&fds);
-		FD_SET(fd_server, &fds);
+		int fd_max = 0;
+		for(int i=0; i<num_servers; i++) {
+			FD_SET(fds_server[i], &fds);
+			fd_max = fds_server[i] > fd_max ? fds_server[i] : fd_max;
+		}
+		fd_max = wrk_fd_set(&fds,fd_max);
 		struct timeval timeout;
 		timeout.tv_sec = 1;
 		timeout.tv_usec = 0;		
-		int s = select(fd_server+1,&fds,NULL,NULL,&timeout);
+		int s = select(fd_max+1,&fds,NULL,NULL,&timeout);
 		if(s>0) {
+			wrk_process(&fds);
+		}
+		for(int i=0; s>0 && i<num_servers && !shutdown_server; i++) {
+			int fd_server = fds_server[i];
+			if(!FD_ISSET(fd_server,&fds)) {
+				continue;
+			}
 			int fd_client;
-			struct sockaddr client_addr = {0};
-			socklen_t client_addr_len = 0;
-			if((fd_client = accept(fd_server,&client_addr,&client_addr_len))<0) {
+			struct sockaddr_storage client_addr_storage;
+			struct sockaddr * client_addr = (struct sockaddr *)&client_addr_storage;
+			socklen_t client_addr_len = sizeof(client_addr_storage);
+			// Zeroed, since an unnamed unix socket's address is only its family
+			memset(&client_addr_storage,0,sizeof(client_addr_storage));
+			uint64_t t_accept_ns;
+			if((fd_client = accept(fd_server,client_addr,&client_addr_len))<0) {
 				elogf("Failed to accept on server socket: %s",strerror(errno));
 				shutdown_server = 1;
+			} else if(adm_conn_open(t_accept_ns = tm_now_ns())!=ADM_ADMIT) {
+				wlogf("Too many connections; shedding client connection");
+				if(!tls_server[i]) {
+					// A TLS client would not understand a plaintext response
+					adm_send_503(fd_client);
+				}
+				close(fd_client);
 			} else {
-				ilogf("Accepted client connection");
-				ov = 0;
+				TRACE2(accept,fd_client,client_addr->sa_family);
+				if(logging(LEVEL_INFO)) {
+					char sz_addr[NET_ADDR_STR_LEN];
+					ilogf("Accepted client connection: %s",net_addr_to_sz(client_addr,client_addr_len,sz_addr,sizeof(sz_addr)));
+					if(client_addr->sa_family==AF_UNIX) {
+						net_log_peer_cred(fd_client);
+					}
+				}
+				int ov = 0;
 				if(ioctl(fd_client,FIONBIO,&ov)<0) {
 					wlogf("Failed to disable non-blocking IO mode: %s",strerror(errno));
 					return 1;
 				}
-				if(!use_fork) {
-					http_client_connect(fd_client,fd_client);
-					ilogf("Closing client connection");
-					close(fd_client);
-				} else {
-					ilogf("Forking child process");
-					int pgrp = getpgrp();
-					int child_pid = fork();
-					if(child_pid!=0) {
-						// parent process
-						ilogf("Forked child pid=%d",child_pid);
-						setpgid(child_pid,pgrp);
-						close(fd_client);
-					} else {
-						// child process
-						setpgid(child_pid,pgrp);
-						signal(SIGINT, sigint_handler_child);
-						signal(SIGTERM, sigint_handler_child);
-						close(fd_server);
-						_fd_client = fd_client;
-						// handle request
-						http_client_connect(fd_client,fd_client);
-						ilogf("Closing client connection");
-						close(fd_client);
-						CRYPTO_cleanup_all_ex_data();
-						ilogf("Exiting child process");
-						exit(0);
-					} 
-				}
+				handle_client(cfg,fd_client,client_addr,client_addr_len,tls_server[i],t_accept_ns,fds_server,num_servers);
 			}
 		}
 	}
 	ilogf("Shutting down");
-	shutdown(fd_server,SHUT_RDWR);
-	close(fd_server);
+	if(logging(LEVEL_INFO)) {
+		adm_dump_stats(stdlog);
+		rl_dump_stats(stdlog);
+		tls_dump_stats(stdlog);
+		wrk_dump_stats(stdlog);
+		arena_dump_stats(stdlog);
+		slab_dump_stats(stdlog);
+		topic_dump_stats(stdlog);
+	}
+	for(int i=0; i<num_servers; i++) {
+		shutdown(fds_server[i],SHUT_RDWR);
+		close(fds_server[i]);
+	}
+	if(cfg->unix_path && !cfg->unix_abstract) {
+		unlink(cfg->unix_path);
+	}
+	wrk_shutdown();
 	// TODO - kill all children
 
+	tls_cleanup();
+	ws_record_stop();
+	http_cleanup();
 	CRYPTO_cleanup_all_ex_data();
 
 	exit(0);
@@ -177,18 +344,77 @@ static int server(bool use_fork, int port, const char * static_files_dir) {
 
 static void usage(FILE * out, const char * prog) {
 	fprintf(out,"Usage: %s [options] port [ip-address]\n",prog);
+	fprintf(out,"       %s [options] --unix <path> [port [ip-address]]\n",prog);
+	fprintf(out,"       %s [options] --tls-port <port> --tls-cert <file> --tls-key <file> [port [ip-address]]\n",prog);
 	fprintf(out,"Options:\n");
 	fprintf(out,"  --debug                Enable debug output\n");
 	fprintf(out,"  --no-fork              Do not fork child processes\n");
+	fprintf(out,"  --workers <n>          Hand connections to n long-lived worker processes, instead of forking\n");
+	fprintf(out,"                         a child process per connection\n");
+	fprintf(out,"  --worker-threads <n>   Connections served at once by each worker (default: %d)\n",WRK_DEFAULT_THREADS);
+	fprintf(out,"  --worker-cpus <lists>  Pin workers to CPUs: a CPU list per worker, separated by ':' (e.g. 0-3:4-7),\n");
+	fprintf(out,"                         or a single list (e.g. 0-7) to pin each worker to one of its CPUs\n");
+	fprintf(out,"  --pin-threads          Pin each worker thread to one of its worker's CPUs\n");
+	fprintf(out,"  --steer-incoming-cpu   Prefer the worker pinned to the CPU that received the connection\n");
 	fprintf(out,"  --static-files <path>  Path to static files directory\n");
+	fprintf(out,"  --static-bundle <file> Serve static files from a bundle made by pack-main, instead of a directory\n");
+	fprintf(out,"  --unix <path>          Listen on a Unix domain socket (in addition to TCP if a port is given)\n");
+	fprintf(out,"  --unix-abstract        The --unix path is a name in the abstract socket namespace (Linux)\n");
+	fprintf(out,"  --tls-port <port>      Listen for TLS (HTTPS/WSS) connections on this port\n");
+	fprintf(out,"  --tls-cert <file>      PEM certificate chain for TLS connections\n");
+	fprintf(out,"  --tls-key <file>       PEM private key for TLS connections\n");
+	fprintf(out,"  --tls-cache-slots <n>  Number of TLS session cache entries (default: 1024)\n");
+	fprintf(out,"  --tls-no-tickets       Resume TLS sessions from the session cache only; don't issue tickets\n");
+	fprintf(out,"  --no-ktls              Do not offload TLS record processing to the kernel\n");
+	fprintf(out,"  --max-conns <n>        Max concurrent client connections (default: unlimited)\n");
+	fprintf(out,"  --max-inflight <n>     Max concurrent in-flight requests (default: unlimited)\n");
+	fprintf(out,"  --codel-target <ms>    Shed load when queue delay stays above this target (default: off)\n");
+	fprintf(out,"  --codel-interval <ms>  Interval used by the queue delay shedder (default: 100)\n");
+	fprintf(out,"  --retry-after <s>      Retry-After value sent with 503 responses (default: 1)\n");
+	fprintf(out,"  --rate-limit <spec>    Per-client rate limits for a route: <uri-prefix>:<kind>=<rate>[/<burst>],...\n");
+	fprintf(out,"                         where kind is req, upg, msgs or bytes (per second). May be repeated.\n");
+	fprintf(out,"  --rate-limit-slots <n> Number of rate limiter buckets (default: 16384)\n");
+	fprintf(out,"  --frame-pool-cap <MiB> Websocket frame buffers pooled per process, at most (default: %d)\n",SLAB_DEFAULT_CAP/(1024*1024));
+	fprintf(out,"  --relay-port <port>    Relay topics between workers, and with peers: worker i accepts links on port+i\n");
+	fprintf(out,"  --relay-peer <ip:port> Relay topics with the peer (a worker of another server) at this address.\n");
+	fprintf(out,"                         May be repeated.\n");
+	fprintf(out,"  --offload-threads <n>  Handle websocket messages on a pool of n threads per process (0 for one\n");
+	fprintf(out,"                         per CPU), rather than on the connection's thread (requires --workers)\n");
+	fprintf(out,"  --ws-record <file>     Capture websocket sessions to the file, for replay-main\n");
+	fprintf(out,"  --ws-record-payload <bytes>\n");
+	fprintf(out,"                         Payload bytes of each frame captured (default: %d)\n",SERVER_WS_RECORD_PAYLOAD);
+	fprintf(out,"  --profiler             Serve CPU profiles (folded stacks) of the process handling the request at\n");
+	fprintf(out,"                         %s?seconds=<s>&hz=<hz> (requires --workers)\n",PROF_URI);
+}
+
+static bool parse_uint_arg(int argc, char ** argv, int * iarg, unsigned int * val) {
+	const char * arg = argv[*iarg];
+	if(++(*iarg)>=argc) {
+		fprintf(stderr,"Argument missing for command line option: %s\n",arg);
+		return false;
+	}
+	char * end;
+	long l = strtol(argv[*iarg],&end,10);
+	if(*end || l<0) {
+		fprintf(stderr,"Invalid argument for command line option: %s %s\n",arg,argv[*iarg]);
+		return false;
+	}
+	*val = (unsigned int)l;
+	return true;
 }
 
 int main(int argc, char ** argv) {
 	log_set_level(LEVEL_INFO);
-	bool use_fork = true;
-	int port = 0;
-	uint32_t addr = INVALID_ADDR;
-	const char * static_files_dir = "./web";
+	Server_Config cfg = {
+		.use_fork = true,
+		.port = 0,
+		.addr = INVALID_ADDR,
+		.unix_path = NULL,
+		.unix_abstract = false,
+		.static_files_dir = "./web",
+		.offload_threads = -1,
+		.ws_record_payload = SERVER_WS_RECORD_PAYLOAD,
+	};
 	// Parse command line arguments
 	for(int iarg=1;iarg<argc; iarg++) {
 		const char * arg = argv[iarg];
@@ -196,30 +422,169 @@ int main(int argc, char ** argv) {
 			if(0==strcmp("--debug",arg)) {
 				log_set_level(LEVEL_DEBUG);
 			} else if(0==strcmp("--no-fork",arg)) {
-				use_fork = false;
+				cfg.use_fork = false;
+			} else if(0==strcmp("--workers",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.wrk.workers)) {
+					return 1;
+				}
+				if(cfg.wrk.workers>WRK_MAX_WORKERS) {
+					fprintf(stderr,"At most %d workers are supported\n",WRK_MAX_WORKERS);
+					return 1;
+				}
+			} else if(0==strcmp("--worker-threads",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.wrk.threads)) {
+					return 1;
+				}
+			} else if(0==strcmp("--worker-cpus",arg)) {
+				if(++iarg>=argc) {
+					fprintf(stderr,"Argument missing for command line option: %s\n",arg);
+					return 1;
+				}
+				cfg.wrk.cpus = argv[iarg];
+			} else if(0==strcmp("--pin-threads",arg)) {
+				cfg.wrk.pin_threads = true;
+			} else if(0==strcmp("--steer-incoming-cpu",arg)) {
+				cfg.wrk.steer = true;
 			} else if(0==strcmp("--static-files",arg)) {
 				if(++iarg>=argc) {
 					fprintf(stderr,"Argument missing for command line option: %s\n",arg);	
 					return 1;
 				}
-				static_files_dir = argv[iarg];
-				if(!io_is_dir(static_files_dir)) {
-					fprintf(stderr,"Must be a directory: %s\n",static_files_dir);
+				cfg.static_files_dir = argv[iarg];
+				if(!io_is_dir(cfg.static_files_dir)) {
+					fprintf(stderr,"Must be a directory: %s\n",cfg.static_files_dir);
+					return 1;
+				}
+			} else if(0==strcmp("--static-bundle",arg)) {
+				if(++iarg>=argc) {
+					fprintf(stderr,"Argument missing for command line option: %s\n",arg);
+					return 1;
+				}
+				cfg.static_bundle = argv[iarg];
+			} else if(0==strcmp("--unix",arg)) {
+				if(++iarg>=argc) {
+					fprintf(stderr,"Argument missing for command line option: %s\n",arg);
+					return 1;
+				}
+				cfg.unix_path = argv[iarg];
+			} else if(0==strcmp("--tls-port",arg)) {
+				unsigned int tls_port;
+				if(!parse_uint_arg(argc,argv,&iarg,&tls_port)) {
+					return 1;
+				}
+				cfg.tls_port = tls_port;
+			} else if(0==strcmp("--tls-cert",arg) || 0==strcmp("--tls-key",arg)) {
+				if(++iarg>=argc) {
+					fprintf(stderr,"Argument missing for command line option: %s\n",arg);
+					return 1;
+				}
+				if(0==strcmp("--tls-cert",arg)) {
+					cfg.tls.cert_file = argv[iarg];
+				} else {
+					cfg.tls.key_file = argv[iarg];
+				}
+			} else if(0==strcmp("--tls-cache-slots",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.tls.cache_slots)) {
+					return 1;
+				}
+			} else if(0==strcmp("--tls-no-tickets",arg)) {
+				cfg.tls.no_tickets = true;
+			} else if(0==strcmp("--no-ktls",arg)) {
+				cfg.tls.no_ktls = true;
+			} else if(0==strcmp("--unix-abstract",arg)) {
+				cfg.unix_abstract = true;
+			} else if(0==strcmp("--max-conns",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.adm.max_conns)) {
+					return 1;
+				}
+			} else if(0==strcmp("--max-inflight",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.adm.max_inflight)) {
+					return 1;
+				}
+			} else if(0==strcmp("--codel-target",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.adm.codel_target_ms)) {
+					return 1;
+				}
+			} else if(0==strcmp("--codel-interval",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.adm.codel_interval_ms)) {
+					return 1;
+				}
+			} else if(0==strcmp("--retry-after",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.adm.retry_after_s)) {
+					return 1;
+				}
+			} else if(0==strcmp("--rate-limit",arg)) {
+				if(++iarg>=argc) {
+					fprintf(stderr,"Argument missing for command line option: %s\n",arg);
+					return 1;
+				}
+				Rl_Route route;
+				if(rl_parse_route(argv[iarg],&route)!=0 || rl_add_route(&route)!=0) {
+					fprintf(stderr,"Invalid rate limit: %s\n",argv[iarg]);
+					return 1;
+				}
+			} else if(0==strcmp("--rate-limit-slots",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.rl_slots)) {
+					return 1;
+				}
+			} else if(0==strcmp("--frame-pool-cap",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.frame_pool_cap_mb)) {
+					return 1;
+				}
+			} else if(0==strcmp("--relay-port",arg)) {
+				unsigned int relay_port;
+				if(!parse_uint_arg(argc,argv,&iarg,&relay_port)) {
+					return 1;
+				}
+				cfg.relay.port = relay_port;
+			} else if(0==strcmp("--relay-peer",arg)) {
+				if(++iarg>=argc) {
+					fprintf(stderr,"Argument missing for command line option: %s\n",arg);
+					return 1;
+				}
+				if(cfg.relay.num_peers==RELAY_MAX_PEERS) {
+					fprintf(stderr,"At most %d relay peers are supported\n",RELAY_MAX_PEERS);
+					return 1;
+				}
+				if(relay_parse_peer(argv[iarg],&cfg.relay.peers[cfg.relay.num_peers++])!=0) {
+					fprintf(stderr,"Invalid relay peer: %s\n",argv[iarg]);
+					return 1;
+				}
+			} else if(0==strcmp("--offload-threads",arg)) {
+				unsigned int offload_threads;
+				if(!parse_uint_arg(argc,argv,&iarg,&offload_threads)) {
+					return 1;
+				}
+				if(offload_threads>POOL_MAX_THREADS) {
+					fprintf(stderr,"At most %d offload threads are supported\n",POOL_MAX_THREADS);
+					return 1;
+				}
+				cfg.offload_threads = offload_threads;
+			} else if(0==strcmp("--ws-record",arg)) {
+				if(++iarg>=argc) {
+					fprintf(stderr,"Argument missing for command line option: %s\n",arg);
+					return 1;
+				}
+				cfg.ws_record = argv[iarg];
+			} else if(0==strcmp("--profiler",arg)) {
+				cfg.profiler = true;
+			} else if(0==strcmp("--ws-record-payload",arg)) {
+				if(!parse_uint_arg(argc,argv,&iarg,&cfg.ws_record_payload)) {
 					return 1;
 				}
 			} else {
 				fprintf(stderr,"Unrecognized command line option: %s\n",arg);
 				return 1;
 			}
-		} else if(port==0) {
-			port = atoi(arg);
-			if(port<=0) {
+		} else if(cfg.port==0) {
+			cfg.port = atoi(arg);
+			if(cfg.port<=0) {
 				fprintf(stderr,"Invalid port number: %s\n",arg);
 				return 1;
 			}
-		} else if(addr==INVALID_ADDR) {
-			addr = net_atoipv4(arg);
-			if(addr==INVALID_ADDR) {
+		} else if(cfg.addr==INVALID_ADDR) {
+			cfg.addr = net_atoipv4(arg);
+			if(cfg.addr==INVALID_ADDR) {
 				fprintf(stderr,"Invalid ip address: %s\n",arg);
 				return 1;
 			}
@@ -228,10 +593,44 @@ int main(int argc, char ** argv) {
 			return 1;
 		}
 	}
-	if(port<=0) {
+	if(cfg.port<=0 && !cfg.unix_path && cfg.tls_port<=0) {
 		usage(stderr,argv[0]);
 		return 1;
 	}
-	server(use_fork, port, static_files_dir);
+	if(cfg.wrk.cpus && cfg.wrk.workers==0) {
+		fprintf(stderr,"--worker-cpus requires --workers\n");
+		return 1;
+	}
+	if((cfg.wrk.pin_threads || cfg.wrk.steer) && !cfg.wrk.cpus) {
+		fprintf(stderr,"--pin-threads and --steer-incoming-cpu require --worker-cpus\n");
+		return 1;
+	}
+	if(cfg.tls_port>0 && (!cfg.tls.cert_file || !cfg.tls.key_file)) {
+		fprintf(stderr,"--tls-port requires --tls-cert and --tls-key\n");
+		return 1;
+	}
+	if(cfg.offload_threads>=0 && cfg.wrk.workers==0) {
+		// Each forked connection would start a pool of its own
+		fprintf(stderr,"--offload-threads requires --workers\n");
+		return 1;
+	}
+	if(cfg.profiler && cfg.wrk.workers==0) {
+		// A forked connection would only profile itself, waiting
+		fprintf(stderr,"--profiler requires --workers\n");
+		return 1;
+	}
+	if(cfg.relay.num_peers>0 && cfg.relay.port==0) {
+		fprintf(stderr,"--relay-peer requires --relay-port\n");
+		return 1;
+	}
+	if(cfg.relay.port>0) {
+		if(cfg.wrk.workers==0) {
+			fprintf(stderr,"--relay-port requires --workers\n");
+			return 1;
+		}
+		cfg.relay.addr = cfg.addr;
+		cfg.wrk.init = init_worker;
+	}
+	server(&cfg);
 
 }
@@ -0,0 +1,142 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <string.h>
+
+#include "endian.h"
+#include "sha1.h"
+
+#define ROL(X,N) (((X) << (N)) | ((X) >> (32 - (N))))
+
+static void sha1_block(uint32_t h[5], const unsigned char * block) {
+	uint32_t w[80];
+	for(int i=0; i<16; i++) {
+		uint32_t v;
+		memcpy(&v,block + 4*i,4);
+		w[i] = be32toh(v);
+	}
+	for(int i=16; i<80; i++) {
+		w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16],1);
+	}
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+#define SHA1_ROUND(F,K,I) do { \
+		uint32_t t = ROL(a,5) + (F) + e + (K) + w[I]; \
+		e = d; \
+		d = c; \
+		c = ROL(b,30); \
+		b = a; \
+		a = t; \
+	} while(0)
+	for(int i=0; i<20; i++) {
+		SHA1_ROUND((b & c) | (~b & d),0x5a827999,i);
+	}
+	for(int i=20; i<40; i++) {
+		SHA1_ROUND(b ^ c ^ d,0x6ed9eba1,i);
+	}
+	for(int i=40; i<60; i++) {
+		SHA1_ROUND((b & c) | (b & d) | (c & d),0x8f1bbcdc,i);
+	}
+	for(int i=60; i<80; i++) {
+		SHA1_ROUND(b ^ c ^ d,0xca62c1d6,i);
+	}
+#undef SHA1_ROUND
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+void sha1_init(Sha1_Ctx * ctx) {
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xefcdab89;
+	ctx->h[2] = 0x98badcfe;
+	ctx->h[3] = 0x10325476;
+	ctx->h[4] = 0xc3d2e1f0;
+	ctx->len = 0;
+}
+
+void sha1_update(Sha1_Ctx * ctx, const void * data, size_t len) {
+	const unsigned char * p = data;
+	size_t used = ctx->len % 64;
+	ctx->len += len;
+	if(used) {
+		size_t n = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->buff + used,p,n);
+		p += n;
+		len -= n;
+		if(used + n < 64) {
+			return;
+		}
+		sha1_block(ctx->h,ctx->buff);
+	}
+	for(; len>=64; p+=64, len-=64) {
+		sha1_block(ctx->h,p);
+	}
+	memcpy(ctx->buff,p,len);
+}
+
+void sha1_final(Sha1_Ctx * ctx, unsigned char digest[SHA1_DIGEST_LEN]) {
+	uint64_t bits = htobe64(ctx->len * 8);
+	size_t used = ctx->len % 64;
+	ctx->buff[used++] = 0x80;
+	if(used > 56) {
+		memset(ctx->buff + used,0,64 - used);
+		sha1_block(ctx->h,ctx->buff);
+		used = 0;
+	}
+	memset(ctx->buff + used,0,56 - used);
+	memcpy(ctx->buff + 56,&bits,8);
+	sha1_block(ctx->h,ctx->buff);
+	for(int i=0; i<5; i++) {
+		uint32_t v = htobe32(ctx->h[i]);
+		memcpy(digest + 4*i,&v,4);
+	}
+}
+
+void sha1(const void * data, size_t len, unsigned char digest[SHA1_DIGEST_LEN]) {
+	Sha1_Ctx ctx;
+	sha1_init(&ctx);
+	sha1_update(&ctx,data,len);
+	sha1_final(&ctx,digest);
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+#include "codec.h"
+
+static bool test_sha1_hex(const char * data, size_t len, const char * hex) {
+	unsigned char digest[SHA1_DIGEST_LEN];
+	char digest_hex[CODEC_HEX_LEN(SHA1_DIGEST_LEN)];
+	sha1(data,len,digest);
+	codec_hex_encode(digest_hex,digest,SHA1_DIGEST_LEN);
+	return memcmp(digest_hex,hex,sizeof(digest_hex))==0;
+}
+
+UT_TEST_CASE(sha1) {
+	// FIPS 180 examples
+	ut_assert(test_sha1_hex("",0,"da39a3ee5e6b4b0d3255bfef95601890afd80709"));
+	ut_assert(test_sha1_hex("abc",3,"a9993e364706816aba3e25717850c26c9cd0d89d"));
+	const char * two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	ut_assert(test_sha1_hex(two_blocks,strlen(two_blocks),"84983e441c3bd26ebaae4aa1f95129e5e54670f1"));
+
+	// A million 'a's, fed in uneven pieces
+	static char a[1000];
+	memset(a,'a',sizeof(a));
+	Sha1_Ctx ctx;
+	sha1_init(&ctx);
+	for(int i=0, n=0; n<1000000; i++) {
+		size_t len = (i%7)*61 + 1;
+		if(len > 1000000 - n) {
+			len = 1000000 - n;
+		}
+		sha1_update(&ctx,a,len);
+		n += len;
+	}
+	unsigned char digest[SHA1_DIGEST_LEN];
+	sha1_final(&ctx,digest);
+	char digest_hex[CODEC_HEX_LEN(SHA1_DIGEST_LEN)];
+	codec_hex_encode(digest_hex,digest,SHA1_DIGEST_LEN);
+	ut_assert(memcmp(digest_hex,"34aa973cd4c4daa4f61eeb2bdbad27316534016f",40)==0);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
@@ -0,0 +1,27 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __SHA1_H__
+#define __SHA1_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// SHA-1 (RFC 3174), for the websocket handshake only: SHA-1 is not collision
+// resistant, and must not be used where that matters. Unlike OpenSSL 3's
+// one-shot SHA1(), it doesn't allocate or fetch an algorithm implementation.
+
+#define SHA1_DIGEST_LEN 20
+
+typedef struct {
+	uint32_t h[5];
+	uint64_t len;           // bytes hashed so far
+	unsigned char buff[64]; // partial block
+} Sha1_Ctx;
+
+void sha1_init(Sha1_Ctx * ctx);
+void sha1_update(Sha1_Ctx * ctx, const void * data, size_t len);
+void sha1_final(Sha1_Ctx * ctx, unsigned char digest[SHA1_DIGEST_LEN]);
+
+/*! \brief Hash len bytes in one call. */
+void sha1(const void * data, size_t len, unsigned char digest[SHA1_DIGEST_LEN]);
+
+#endif // __SHA1_H__
@@ -0,0 +1,348 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "slab.h"
+
+#define SLAB_NO_CLASS 0xff  // malloc'd on its own, and freed with free()
+
+#define SLAB_TCACHE_MAX 16            // buffers cached per class, per thread
+#define SLAB_TCACHE_BYTES (256*1024)  // at most, per class, per thread
+
+typedef struct Slab_Buf_S {
+	struct Slab_Buf_S * next;  // while free
+	size_t size;               // usable bytes
+	uint8_t cls;               // size class, or SLAB_NO_CLASS
+	unsigned char data[] __attribute__((aligned(16)));
+} Slab_Buf;
+
+typedef struct {
+	Slab_Buf * free[SLAB_NUM_CLASSES];
+	unsigned int count[SLAB_NUM_CLASSES];
+} Slab_Cache;
+
+static Slab_Stats _slab_stats_local;
+static Slab_Stats * _slab_stats = &_slab_stats_local;
+
+static size_t _slab_cap = SLAB_DEFAULT_CAP;
+static size_t _slab_bytes = 0; // in slabs, in this process; under _slab_lock
+
+static pthread_mutex_t _slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static Slab_Buf * _slab_free[SLAB_NUM_CLASSES]; // under _slab_lock
+
+static __thread Slab_Cache _slab_cache;
+static __thread bool _slab_cache_registered = false;
+static pthread_key_t _slab_cache_key;
+static pthread_once_t _slab_cache_once = PTHREAD_ONCE_INIT;
+
+#define ATOMIC_INC(V) __atomic_add_fetch(&(V),1,__ATOMIC_RELAXED)
+#define ATOMIC_ADD(V,N) __atomic_add_fetch(&(V),(N),__ATOMIC_RELAXED)
+#define ATOMIC_GET(V) __atomic_load_n(&(V),__ATOMIC_RELAXED)
+
+int slab_init(size_t cap) {
+	Slab_Stats * stats = mmap(NULL,sizeof(Slab_Stats),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if(stats==MAP_FAILED) {
+		elogf("mmap failed: %s",strerror(errno));
+		return -1;
+	}
+	memset(stats,0,sizeof(Slab_Stats));
+	if(_slab_stats != &_slab_stats_local) {
+		munmap(_slab_stats,sizeof(Slab_Stats));
+	}
+	_slab_stats = stats;
+	_slab_cap = cap ? cap : SLAB_DEFAULT_CAP;
+	return 0;
+}
+
+static inline size_t slab_class_size(int cls) {
+	return (size_t)1 << (cls + SLAB_MIN_SHIFT);
+}
+
+static inline int slab_class(size_t len) {
+	int cls = 0;
+	while(cls < SLAB_NUM_CLASSES && slab_class_size(cls) < len) {
+		cls++;
+	}
+	return cls; // SLAB_NUM_CLASSES if too large
+}
+
+static inline unsigned int slab_tcache_max(int cls) {
+	size_t n = SLAB_TCACHE_BYTES / slab_class_size(cls);
+	return n==0 ? 1 : n > SLAB_TCACHE_MAX ? SLAB_TCACHE_MAX : n;
+}
+
+// Hand a thread's cached buffers back to the process when it exits
+static void slab_cache_flush(void * arg) {
+	Slab_Cache * cache = arg;
+	pthread_mutex_lock(&_slab_lock);
+	for(int cls=0; cls<SLAB_NUM_CLASSES; cls++) {
+		while(cache->free[cls]) {
+			Slab_Buf * b = cache->free[cls];
+			cache->free[cls] = b->next;
+			b->next = _slab_free[cls];
+			_slab_free[cls] = b;
+		}
+		cache->count[cls] = 0;
+	}
+	pthread_mutex_unlock(&_slab_lock);
+}
+
+static void slab_cache_key_create(void) {
+	pthread_key_create(&_slab_cache_key,slab_cache_flush);
+}
+
+static Slab_Cache * slab_cache(void) {
+	if(!_slab_cache_registered) {
+		pthread_once(&_slab_cache_once,slab_cache_key_create);
+		pthread_setspecific(_slab_cache_key,&_slab_cache);
+		_slab_cache_registered = true;
+	}
+	return &_slab_cache;
+}
+
+static Slab_Buf * slab_malloc(size_t size, uint8_t cls) {
+	Slab_Buf * b = malloc(sizeof(Slab_Buf) + size);
+	if(!b) {
+		elogf("malloc failed: %s",strerror(errno));
+		return NULL;
+	}
+	b->next = NULL;
+	b->size = size;
+	b->cls = cls;
+	return b;
+}
+
+// Called with _slab_lock held: carve a new slab into buffers of the class,
+// keeping all but the first on the free list
+static Slab_Buf * slab_refill(int cls) {
+	size_t size = slab_class_size(cls);
+	size_t buf_size = sizeof(Slab_Buf) + size;
+	size_t n = SLAB_SIZE / buf_size;
+	if(n==0) {
+		n = 1;
+	}
+	if(_slab_bytes + n*buf_size > _slab_cap) {
+		return NULL;
+	}
+	unsigned char * slab = malloc(n*buf_size);
+	if(!slab) {
+		elogf("malloc failed: %s",strerror(errno));
+		return NULL;
+	}
+	_slab_bytes += n*buf_size;
+	ATOMIC_INC(_slab_stats->slabs);
+	ATOMIC_ADD(_slab_stats->slab_bytes,n*buf_size);
+	for(size_t i=n; i-->0; ) {
+		Slab_Buf * b = (Slab_Buf *)(slab + i*buf_size);
+		b->size = size;
+		b->cls = cls;
+		if(i>0) {
+			b->next = _slab_free[cls];
+			_slab_free[cls] = b;
+		} else {
+			b->next = NULL;
+		}
+	}
+	return (Slab_Buf *)slab;
+}
+
+void * slab_alloc(size_t len) {
+	ATOMIC_INC(_slab_stats->allocs);
+	int cls = slab_class(len);
+	Slab_Buf * b;
+	if(cls==SLAB_NUM_CLASSES) {
+		ATOMIC_INC(_slab_stats->oversize);
+		b = slab_malloc(len,SLAB_NO_CLASS);
+		return b ? b->data : NULL;
+	}
+	Slab_Cache * cache = slab_cache();
+	if((b = cache->free[cls])) {
+		cache->free[cls] = b->next;
+		cache->count[cls]--;
+		ATOMIC_INC(_slab_stats->thread_hits);
+		return b->data;
+	}
+	pthread_mutex_lock(&_slab_lock);
+	if((b = _slab_free[cls])) {
+		_slab_free[cls] = b->next;
+		ATOMIC_INC(_slab_stats->shared_hits);
+	} else {
+		b = slab_refill(cls);
+	}
+	pthread_mutex_unlock(&_slab_lock);
+	if(!b) {
+		ATOMIC_INC(_slab_stats->capped);
+		b = slab_malloc(slab_class_size(cls),SLAB_NO_CLASS);
+	}
+	return b ? b->data : NULL;
+}
+
+static inline Slab_Buf * slab_buf(const void * p) {
+	return (Slab_Buf *)((unsigned char *)p - offsetof(Slab_Buf,data));
+}
+
+void slab_free(void * p) {
+	if(!p) {
+		return;
+	}
+	ATOMIC_INC(_slab_stats->frees);
+	Slab_Buf * b = slab_buf(p);
+	if(b->cls==SLAB_NO_CLASS) {
+		free(b);
+		return;
+	}
+	Slab_Cache * cache = slab_cache();
+	if(cache->count[b->cls] < slab_tcache_max(b->cls)) {
+		b->next = cache->free[b->cls];
+		cache->free[b->cls] = b;
+		cache->count[b->cls]++;
+		return;
+	}
+	pthread_mutex_lock(&_slab_lock);
+	b->next = _slab_free[b->cls];
+	_slab_free[b->cls] = b;
+	pthread_mutex_unlock(&_slab_lock);
+}
+
+size_t slab_size(const void * p) {
+	return slab_buf(p)->size;
+}
+
+void * slab_grow(void * p, size_t len, size_t keep) {
+	if(p && slab_size(p) >= len) {
+		return p;
+	}
+	// Grow geometrically, so that appending is amortized
+	size_t want = p && 2*slab_size(p) > len ? 2*slab_size(p) : len;
+	void * q = slab_alloc(want);
+	if(!q) {
+		return NULL;
+	}
+	if(p) {
+		memcpy(q,p,keep);
+		slab_free(p);
+	}
+	return q;
+}
+
+void slab_get_stats(Slab_Stats * stats) {
+	stats->allocs = ATOMIC_GET(_slab_stats->allocs);
+	stats->frees = ATOMIC_GET(_slab_stats->frees);
+	stats->thread_hits = ATOMIC_GET(_slab_stats->thread_hits);
+	stats->shared_hits = ATOMIC_GET(_slab_stats->shared_hits);
+	stats->slabs = ATOMIC_GET(_slab_stats->slabs);
+	stats->slab_bytes = ATOMIC_GET(_slab_stats->slab_bytes);
+	stats->oversize = ATOMIC_GET(_slab_stats->oversize);
+	stats->capped = ATOMIC_GET(_slab_stats->capped);
+}
+
+void slab_dump_stats(FILE * fp) {
+	Slab_Stats s;
+	slab_get_stats(&s);
+	fprintf(fp,"slab_allocs %llu\n",(unsigned long long)s.allocs);
+	fprintf(fp,"slab_frees %llu\n",(unsigned long long)s.frees);
+	fprintf(fp,"slab_thread_hits %llu\n",(unsigned long long)s.thread_hits);
+	fprintf(fp,"slab_shared_hits %llu\n",(unsigned long long)s.shared_hits);
+	fprintf(fp,"slab_slabs %llu\n",(unsigned long long)s.slabs);
+	fprintf(fp,"slab_bytes %llu\n",(unsigned long long)s.slab_bytes);
+	fprintf(fp,"slab_oversize %llu\n",(unsigned long long)s.oversize);
+	fprintf(fp,"slab_capped %llu\n",(unsigned long long)s.capped);
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+
+UT_TEST_CASE(slab_alloc) {
+	ut_assert(slab_init(0)==0);
+	void * p1 = slab_alloc(10);
+	ut_assert(p1 && ((uintptr_t)p1 % 16)==0);
+	ut_assert(slab_size(p1)==64);
+	void * p2 = slab_alloc(100);
+	ut_assert(slab_size(p2)==128);
+	Slab_Stats stats;
+	slab_get_stats(&stats);
+	ut_assert(stats.allocs==2 && stats.slabs<=2 && stats.slab_bytes<=2*SLAB_SIZE);
+
+	// Freed buffers are reused, from the thread cache
+	uint64_t thread_hits = stats.thread_hits;
+	slab_free(p1);
+	ut_assert(slab_alloc(64)==p1);
+	slab_get_stats(&stats);
+	ut_assert(stats.thread_hits==thread_hits+1 && stats.slabs<=2);
+
+	void * p3 = slab_alloc(33);
+	ut_assert(p3 && p3!=p1);
+	slab_get_stats(&stats);
+	ut_assert(stats.slabs<=2);
+
+	// Too large for a class
+	void * big = slab_alloc(((size_t)1<<SLAB_MAX_SHIFT)+1);
+	ut_assert(big);
+	memset(big,0,((size_t)1<<SLAB_MAX_SHIFT)+1);
+	slab_free(big);
+	slab_get_stats(&stats);
+	ut_assert(stats.oversize==1);
+
+	slab_free(p1);
+	slab_free(p2);
+	slab_free(p3);
+	slab_free(NULL);
+	slab_get_stats(&stats);
+	ut_assert(stats.frees==5);
+}
+
+UT_TEST_CASE(slab_grow) {
+	unsigned char * p = slab_grow(NULL,10,0);
+	ut_assert(p && slab_size(p)==64);
+	memcpy(p,"0123456789",10);
+	ut_assert(slab_grow(p,64,10)==p);
+	p = slab_grow(p,65,10);
+	ut_assert(slab_size(p)==128 && memcmp(p,"0123456789",10)==0);
+	p = slab_grow(p,1000,10);
+	ut_assert(slab_size(p)==1024 && memcmp(p,"0123456789",10)==0);
+	slab_free(p);
+}
+
+static void * test_slab_thread(void * arg) {
+	// Cached on this thread, and handed back when it exits
+	void * p = slab_alloc(4000);
+	slab_free(p);
+	return p;
+}
+
+UT_TEST_CASE(slab_threads_and_cap) {
+	// Room for one more slab
+	ut_assert(slab_init(_slab_bytes + SLAB_SIZE)==0);
+	pthread_t thread;
+	void * p;
+	ut_assert(pthread_create(&thread,NULL,test_slab_thread,NULL)==0);
+	pthread_join(thread,&p);
+	// Not in this thread's cache, but on the shared list
+	ut_assert(slab_alloc(4000)==p);
+	Slab_Stats stats;
+	slab_get_stats(&stats);
+	ut_assert(stats.shared_hits==1);
+
+	// 64 KiB buffers soon don't fit in what's left (once any already free
+	// from earlier tests are taken)
+	void * q[64];
+	int n = 0;
+	do {
+		ut_assert(n<64 && (q[n++] = slab_alloc(40000)));
+		slab_get_stats(&stats);
+	} while(stats.capped==0);
+	ut_assert(stats.capped==1);
+	while(n>0) {
+		slab_free(q[--n]);
+	}
+	slab_free(p);
+	ut_assert(slab_init(0)==0);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
@@ -0,0 +1,62 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Pool of reusable buffers in power-of-two size classes, for websocket frames
+// and messages. Buffers are carved from slabs and never given back to malloc;
+// a freed buffer goes to its thread's cache, or, if that is full, to the
+// process-wide free list of its class, from which any thread can take it.
+// Once the slabs of a process add up to the cap, buffers that don't fit a
+// free one are malloc'd and freed like any other (as are buffers larger than
+// the largest class).
+
+#define SLAB_MIN_SHIFT 6    // smallest class: 64 bytes
+#define SLAB_MAX_SHIFT 20   // largest class: 1 MiB
+#define SLAB_NUM_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_SIZE (64*1024) // small classes are carved from slabs of this size
+#define SLAB_DEFAULT_CAP (64*1024*1024)
+
+typedef struct {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t thread_hits;   // allocations served by the thread's cache
+	uint64_t shared_hits;   // allocations served by the process-wide free lists
+	uint64_t slabs;         // slabs malloc'd
+	uint64_t slab_bytes;    // bytes in slabs
+	uint64_t oversize;      // allocations larger than the largest class
+	uint64_t capped;        // allocations malloc'd because the cap was reached
+} Slab_Stats;
+
+/*! \brief Set the cap, and place the stats in shared memory, so that they are
+ *         shared with forked children.
+ *  \param cap Most bytes held in slabs, per process; 0 selects SLAB_DEFAULT_CAP.
+ *  \return 0 if successful, or -1 if something went wrong.
+ */
+int slab_init(size_t cap);
+
+/*! \brief Allocate a buffer of at least len bytes, aligned to 16 bytes.
+ *  \return The buffer, or NULL if out of memory.
+ */
+void * slab_alloc(size_t len);
+
+/*! \brief Return a buffer to the pool. p may be NULL. */
+void slab_free(void * p);
+
+/*! \brief Usable size of a buffer, which may be more than was asked for. */
+size_t slab_size(const void * p);
+
+/*! \brief Make sure a buffer has room for len bytes, moving it to a larger
+ *         buffer if needed. p may be NULL.
+ *  \param keep Bytes at the start of the buffer to keep if it is moved.
+ *  \return The buffer, or NULL (leaving p as it was) if out of memory.
+ */
+void * slab_grow(void * p, size_t len, size_t keep);
+
+void slab_get_stats(Slab_Stats * stats);
+void slab_dump_stats(FILE * fp);
+
+#endif // __SLAB_H__
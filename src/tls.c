@@ -0,0 +1,567 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "log.h"
+#include "tls.h"
+
+// Sessions are cached in a direct-mapped table, placed in memory that is
+// shared with child processes, so that any child can resume a session that
+// was established by another.
+#define TLS_MAX_SESSION_DER 1024
+
+typedef struct {
+	uint32_t lock;
+	uint32_t id_len;
+	uint32_t der_len;
+	uint32_t pad;
+	uint64_t expires; // seconds since the epoch
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned char der[TLS_MAX_SESSION_DER];
+} Tls_Cache_Slot;
+
+typedef struct {
+	size_t nslots;
+	Tls_Stats stats;
+	Tls_Cache_Slot slots[0];
+} Tls_Cache;
+
+static SSL_CTX * _tls_ctx = NULL;
+static Tls_Cache * _tls_cache = NULL;
+static size_t _tls_cache_size = 0;
+
+// The handshake is done on a blocking socket; don't let a client stall it forever
+#define TLS_HANDSHAKE_TIMEOUT_S 10
+
+static const unsigned char TLS_SESSION_ID_CONTEXT[] = "nuthatch";
+
+#define tls_stat_inc(name) if(_tls_cache) __atomic_add_fetch(&_tls_cache->stats.name,1,__ATOMIC_RELAXED)
+
+static void tls_log_errors(const char * what) {
+	unsigned long err;
+	char sz_err[256];
+	while((err = ERR_get_error())) {
+		ERR_error_string_n(err,sz_err,sizeof(sz_err));
+		wlogf("%s: %s",what,sz_err);
+	}
+}
+
+static Tls_Cache_Slot * tls_cache_slot(const unsigned char * id, unsigned int id_len) {
+	// Session ids are random, so any of their bytes make a good hash
+	uint64_t h = 0;
+	memcpy(&h,id,id_len<sizeof(h)?id_len:sizeof(h));
+	return &_tls_cache->slots[h % _tls_cache->nslots];
+}
+
+static void tls_cache_lock(Tls_Cache_Slot * slot) {
+	while(__atomic_exchange_n(&slot->lock,1,__ATOMIC_ACQUIRE)) {
+		while(__atomic_load_n(&slot->lock,__ATOMIC_RELAXED)) {
+			sched_yield();
+		}
+	}
+}
+
+static void tls_cache_unlock(Tls_Cache_Slot * slot) {
+	__atomic_store_n(&slot->lock,0,__ATOMIC_RELEASE);
+}
+
+static int tls_cache_new_cb(SSL * ssl, SSL_SESSION * sess) {
+	unsigned int id_len;
+	const unsigned char * id = SSL_SESSION_get_id(sess,&id_len);
+	int der_len = i2d_SSL_SESSION(sess,NULL);
+	if(id_len==0 || der_len<=0 || der_len>TLS_MAX_SESSION_DER) {
+		return 0;
+	}
+	Tls_Cache_Slot * slot = tls_cache_slot(id,id_len);
+	tls_cache_lock(slot);
+	unsigned char * p = slot->der;
+	slot->der_len = i2d_SSL_SESSION(sess,&p);
+	memcpy(slot->id,id,id_len);
+	slot->id_len = id_len;
+	slot->expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+	tls_cache_unlock(slot);
+	tls_stat_inc(cache_stores);
+	// We did not keep a reference to the session
+	return 0;
+}
+
+static SSL_SESSION * tls_cache_get_cb(SSL * ssl, const unsigned char * id, int id_len, int * copy) {
+	*copy = 0;
+	unsigned char der[TLS_MAX_SESSION_DER];
+	unsigned int der_len = 0;
+	Tls_Cache_Slot * slot = tls_cache_slot(id,id_len);
+	tls_cache_lock(slot);
+	if(slot->id_len==id_len && memcmp(slot->id,id,id_len)==0 && slot->expires > (uint64_t)time(NULL)) {
+		der_len = slot->der_len;
+		memcpy(der,slot->der,der_len);
+	}
+	tls_cache_unlock(slot);
+	if(der_len==0) {
+		tls_stat_inc(cache_misses);
+		return NULL;
+	}
+	tls_stat_inc(cache_hits);
+	const unsigned char * p = der;
+	return d2i_SSL_SESSION(NULL,&p,der_len);
+}
+
+static void tls_cache_remove_cb(SSL_CTX * ctx, SSL_SESSION * sess) {
+	unsigned int id_len;
+	const unsigned char * id = SSL_SESSION_get_id(sess,&id_len);
+	if(id_len==0) {
+		return;
+	}
+	Tls_Cache_Slot * slot = tls_cache_slot(id,id_len);
+	tls_cache_lock(slot);
+	if(slot->id_len==id_len && memcmp(slot->id,id,id_len)==0) {
+		slot->id_len = 0;
+		slot->der_len = 0;
+	}
+	tls_cache_unlock(slot);
+}
+
+// Prefer HTTP/2; the HTTP layer recognizes its connection preface
+static int tls_alpn_select_cb(SSL * ssl, const unsigned char ** out, unsigned char * out_len,
+		const unsigned char * in, unsigned int in_len, void * arg) {
+	static const unsigned char protos[] = "\x02h2\x08http/1.1";
+	if(SSL_select_next_proto((unsigned char **)out,out_len,protos,sizeof(protos)-1,in,in_len)!=OPENSSL_NPN_NEGOTIATED) {
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(const Tls_Config * cfg) {
+	tls_cleanup();
+	size_t nslots = cfg->cache_slots ? cfg->cache_slots : 1024;
+	size_t size = sizeof(Tls_Cache) + nslots * sizeof(Tls_Cache_Slot);
+	ilogf("Initializing TLS: cert=%s, key=%s, cache slots=%zu, size=%zu",cfg->cert_file,cfg->key_file,nslots,size);
+	Tls_Cache * cache = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if(cache==MAP_FAILED) {
+		elogf("mmap failed: %s",strerror(errno));
+		return -1;
+	}
+	memset(cache,0,size);
+	cache->nslots = nslots;
+
+	SSL_CTX * ctx = SSL_CTX_new(TLS_server_method());
+	if(!ctx) {
+		tls_log_errors("SSL_CTX_new");
+		munmap(cache,size);
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(ctx,TLS1_2_VERSION);
+	if(SSL_CTX_use_certificate_chain_file(ctx,cfg->cert_file)!=1
+			|| SSL_CTX_use_PrivateKey_file(ctx,cfg->key_file,SSL_FILETYPE_PEM)!=1
+			|| SSL_CTX_check_private_key(ctx)!=1) {
+		tls_log_errors("Failed to load certificate/key");
+		SSL_CTX_free(ctx);
+		munmap(cache,size);
+		errno = EINVAL;
+		return -1;
+	}
+	// Children are forked after the context is created, so they all share the
+	// ticket keys that SSL_CTX_new generated; a ticket issued by one child
+	// can be redeemed by any other. Session ids are looked up in the shared
+	// cache (this is also how TLS 1.3 resumption works with --tls-no-tickets).
+	SSL_CTX_set_session_id_context(ctx,TLS_SESSION_ID_CONTEXT,sizeof(TLS_SESSION_ID_CONTEXT)-1);
+	SSL_CTX_set_session_cache_mode(ctx,SSL_SESS_CACHE_SERVER|SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_sess_set_new_cb(ctx,tls_cache_new_cb);
+	SSL_CTX_sess_set_get_cb(ctx,tls_cache_get_cb);
+	SSL_CTX_sess_set_remove_cb(ctx,tls_cache_remove_cb);
+	SSL_CTX_set_alpn_select_cb(ctx,tls_alpn_select_cb,NULL);
+	if(cfg->no_tickets) {
+		SSL_CTX_set_options(ctx,SSL_OP_NO_TICKET);
+	}
+#ifdef SSL_OP_ENABLE_KTLS
+	if(!cfg->no_ktls) {
+		// OpenSSL hands the record layer to the kernel after the handshake if
+		// the kernel (tls ULP) and the negotiated cipher support it.
+		SSL_CTX_set_options(ctx,SSL_OP_ENABLE_KTLS);
+	}
+#endif
+	_tls_ctx = ctx;
+	_tls_cache = cache;
+	_tls_cache_size = size;
+	return 0;
+}
+
+void tls_cleanup(void) {
+	if(_tls_ctx) {
+		SSL_CTX_free(_tls_ctx);
+		_tls_ctx = NULL;
+	}
+	if(_tls_cache) {
+		munmap(_tls_cache,_tls_cache_size);
+		_tls_cache = NULL;
+	}
+}
+
+static bool tls_send_all(int fd, const unsigned char * buff, size_t len) {
+	while(len>0) {
+		ssize_t n = send(fd,buff,len,MSG_NOSIGNAL);
+		if(n<0 && errno==EINTR) {
+			continue;
+		}
+		if(n<=0) {
+			return false;
+		}
+		buff += n;
+		len -= n;
+	}
+	return true;
+}
+
+// Relays between the TLS connection and the plaintext socketpair, in whichever
+// directions the kernel is not already handling. Runs until the HTTP layer
+// closes its end of the socketpair.
+static void * tls_pump(void * arg) {
+	Tls_Conn * tc = arg;
+	unsigned char buff[16384];
+	bool rx_open = !tc->ktls_rx;
+	for(;;) {
+		struct pollfd pfds[2] = {
+			{ .fd = tc->fd_pump, .events = POLLIN },
+			{ .fd = rx_open ? tc->fd : -1, .events = POLLIN },
+		};
+		// Decrypted data may be buffered by OpenSSL, in which case the socket
+		// won't become readable.
+		bool pending = rx_open && SSL_pending(tc->ssl)>0;
+		if(poll(pfds,2,pending?0:-1)<0) {
+			if(errno==EINTR) {
+				continue;
+			}
+			break;
+		}
+		if(pending || pfds[1].revents) {
+			int n = SSL_read(tc->ssl,buff,sizeof(buff));
+			if(n>0) {
+				if(!tls_send_all(tc->fd_pump,buff,n)) {
+					break;
+				}
+			} else {
+				int err = SSL_get_error(tc->ssl,n);
+				if(err!=SSL_ERROR_WANT_READ && err!=SSL_ERROR_WANT_WRITE) {
+					dlogf("TLS connection closed by client: %d",err);
+					// Let the HTTP layer see EOF
+					rx_open = false;
+					shutdown(tc->fd_pump,SHUT_WR);
+				}
+			}
+		}
+		if(pfds[0].revents) {
+			ssize_t n = read(tc->fd_pump,buff,sizeof(buff));
+			if(n<0 && errno==EINTR) {
+				continue;
+			}
+			if(n<=0) {
+				break;
+			}
+			if(tc->ktls_tx) {
+				// Nothing is written through the pump when the kernel handles
+				// the transmit side
+				continue;
+			}
+			if(SSL_write(tc->ssl,buff,n)<=0) {
+				tls_log_errors("SSL_write");
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+Tls_Conn * tls_accept(int fd) {
+	if(!_tls_ctx) {
+		errno = EINVAL;
+		return NULL;
+	}
+	Tls_Conn * tc = calloc(1,sizeof(Tls_Conn));
+	if(!tc || !(tc->ssl = SSL_new(_tls_ctx)) || SSL_set_fd(tc->ssl,fd)!=1) {
+		// Counted as a failed handshake: the client gets none
+		elogf("Failed to set up TLS connection");
+		tls_log_errors("SSL_new");
+		tls_stat_inc(handshake_failures);
+		if(tc) {
+			SSL_free(tc->ssl);
+		}
+		free(tc);
+		errno = ENOMEM;
+		return NULL;
+	}
+	tc->fd = fd;
+	tc->fd_in = tc->fd_out = tc->fd_pump = -1;
+
+	struct timeval tv = { .tv_sec = TLS_HANDSHAKE_TIMEOUT_S };
+	setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+	int ret = SSL_accept(tc->ssl);
+	tv.tv_sec = 0;
+	setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+	if(ret!=1) {
+		wlogf("TLS handshake failed: %d",SSL_get_error(tc->ssl,ret));
+		tls_log_errors("SSL_accept");
+		tls_stat_inc(handshake_failures);
+		SSL_free(tc->ssl);
+		free(tc);
+		return NULL;
+	}
+	tls_stat_inc(handshakes);
+	if(SSL_session_reused(tc->ssl)) {
+		tls_stat_inc(resumed);
+	}
+#ifndef OPENSSL_NO_KTLS
+	tc->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(tc->ssl));
+	tc->ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(tc->ssl));
+#endif
+	if(tc->ktls_tx) {
+		tls_stat_inc(ktls_tx);
+	}
+	if(tc->ktls_rx) {
+		tls_stat_inc(ktls_rx);
+	}
+	ilogf("TLS handshake complete: %s %s, resumed=%d, ktls tx=%d rx=%d",
+		SSL_get_version(tc->ssl),SSL_get_cipher_name(tc->ssl),
+		SSL_session_reused(tc->ssl),tc->ktls_tx,tc->ktls_rx);
+
+	if(tc->ktls_tx && tc->ktls_rx) {
+		// The kernel does it all; the HTTP layer uses the socket directly
+		tc->fd_in = tc->fd_out = fd;
+		return tc;
+	}
+	int sv[2];
+	if(socketpair(AF_UNIX,SOCK_STREAM,0,sv)<0) {
+		elogf("socketpair failed: %s",strerror(errno));
+		SSL_free(tc->ssl);
+		free(tc);
+		return NULL;
+	}
+	tc->fd_in = tc->ktls_rx ? fd : sv[0];
+	tc->fd_out = tc->ktls_tx ? fd : sv[0];
+	tc->fd_pump = sv[1];
+	if(pthread_create(&tc->pump,NULL,tls_pump,tc)!=0) {
+		elogf("Failed to start TLS pump thread");
+		close(sv[0]);
+		close(sv[1]);
+		SSL_free(tc->ssl);
+		free(tc);
+		return NULL;
+	}
+	return tc;
+}
+
+void tls_close(Tls_Conn * tc) {
+	if(!tc) {
+		return;
+	}
+	if(tc->fd_pump>=0) {
+		// Closing our end tells the pump to flush and exit
+		close(tc->fd_in!=tc->fd ? tc->fd_in : tc->fd_out);
+		pthread_join(tc->pump,NULL);
+		close(tc->fd_pump);
+	}
+	SSL_shutdown(tc->ssl);
+	SSL_free(tc->ssl);
+	free(tc);
+}
+
+void tls_get_stats(Tls_Stats * stats) {
+	memset(stats,0,sizeof(Tls_Stats));
+	if(_tls_cache) {
+		__atomic_load(&_tls_cache->stats.handshakes,&stats->handshakes,__ATOMIC_RELAXED);
+		__atomic_load(&_tls_cache->stats.handshake_failures,&stats->handshake_failures,__ATOMIC_RELAXED);
+		__atomic_load(&_tls_cache->stats.resumed,&stats->resumed,__ATOMIC_RELAXED);
+		__atomic_load(&_tls_cache->stats.ktls_tx,&stats->ktls_tx,__ATOMIC_RELAXED);
+		__atomic_load(&_tls_cache->stats.ktls_rx,&stats->ktls_rx,__ATOMIC_RELAXED);
+		__atomic_load(&_tls_cache->stats.cache_hits,&stats->cache_hits,__ATOMIC_RELAXED);
+		__atomic_load(&_tls_cache->stats.cache_misses,&stats->cache_misses,__ATOMIC_RELAXED);
+		__atomic_load(&_tls_cache->stats.cache_stores,&stats->cache_stores,__ATOMIC_RELAXED);
+	}
+}
+
+void tls_dump_stats(FILE * fp) {
+	if(!_tls_cache) {
+		return;
+	}
+	Tls_Stats s;
+	tls_get_stats(&s);
+	fprintf(fp,"tls_handshakes %llu\n",(unsigned long long)s.handshakes);
+	fprintf(fp,"tls_handshake_failures %llu\n",(unsigned long long)s.handshake_failures);
+	fprintf(fp,"tls_resumed %llu\n",(unsigned long long)s.resumed);
+	fprintf(fp,"tls_ktls_tx %llu\n",(unsigned long long)s.ktls_tx);
+	fprintf(fp,"tls_ktls_rx %llu\n",(unsigned long long)s.ktls_rx);
+	fprintf(fp,"tls_cache_hits %llu\n",(unsigned long long)s.cache_hits);
+	fprintf(fp,"tls_cache_misses %llu\n",(unsigned long long)s.cache_misses);
+	fprintf(fp,"tls_cache_stores %llu\n",(unsigned long long)s.cache_stores);
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include "ut.h"
+#include "net.h"
+#include "sz.h"
+#include "http.h"
+
+#define TEST_CERT_FILE "build/tls-test-cert.pem"
+#define TEST_KEY_FILE  "build/tls-test-key.pem"
+
+// Create a self-signed certificate for localhost
+static bool tls_test_make_cert(void) {
+	EVP_PKEY * pkey = EVP_EC_gen("P-256");
+	X509 * x = X509_new();
+	bool ok = false;
+	if(pkey && x) {
+		X509_set_version(x,2);
+		ASN1_INTEGER_set(X509_get_serialNumber(x),1);
+		X509_gmtime_adj(X509_getm_notBefore(x),-60);
+		X509_gmtime_adj(X509_getm_notAfter(x),3600);
+		X509_set_pubkey(x,pkey);
+		X509_NAME * name = X509_get_subject_name(x);
+		X509_NAME_add_entry_by_txt(name,"CN",MBSTRING_ASC,(const unsigned char *)"localhost",-1,-1,0);
+		X509_set_issuer_name(x,name);
+		if(X509_sign(x,pkey,EVP_sha256())>0) {
+			FILE * fp_cert = fopen(TEST_CERT_FILE,"w");
+			FILE * fp_key = fopen(TEST_KEY_FILE,"w");
+			ok = fp_cert && fp_key
+				&& PEM_write_X509(fp_cert,x)
+				&& PEM_write_PrivateKey(fp_key,pkey,NULL,NULL,0,NULL,NULL);
+			if(fp_cert) fclose(fp_cert);
+			if(fp_key) fclose(fp_key);
+		}
+	}
+	X509_free(x);
+	EVP_PKEY_free(pkey);
+	return ok;
+}
+
+typedef struct {
+	int fd_listen;
+	int connections;
+} Test_Tls_Server;
+
+// Accept TLS connections and dispatch them, like the server does with --no-fork
+static void * tls_test_server(void * arg) {
+	Test_Tls_Server * ts = arg;
+	for(int i=0; i<ts->connections; i++) {
+		struct pollfd pfd = { .fd = ts->fd_listen, .events = POLLIN };
+		poll(&pfd,1,5000);
+		int fd = accept(ts->fd_listen,NULL,NULL);
+		if(fd<0) {
+			break;
+		}
+		int ov = 0;
+		ioctl(fd,FIONBIO,&ov);
+		Tls_Conn * tc = tls_accept(fd);
+		if(tc) {
+			http_client_connect(tc->fd_in,tc->fd_out,NULL);
+			tls_close(tc);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+// GET a resource over TLS; returns the number of response bytes
+static ssize_t tls_test_get(SSL_CTX * ctx, int port, SSL_SESSION ** sess, bool * reused, char * rsp, size_t rsp_len) {
+	int fd = net_connect_tcp(net_atoipv4("127.0.0.1"),port);
+	if(fd<0) {
+		return -1;
+	}
+	SSL * ssl = SSL_new(ctx);
+	SSL_set_fd(ssl,fd);
+	if(*sess) {
+		SSL_set_session(ssl,*sess);
+	}
+	ssize_t total = -1;
+	static const char req[] = "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	if(SSL_connect(ssl)==1 && SSL_write(ssl,req,sizeof(req)-1)>0) {
+		total = 0;
+		int n;
+		while((n = SSL_read(ssl,rsp+total,rsp_len-total-1))>0) {
+			total += n;
+		}
+		rsp[total] = 0;
+		*reused = SSL_session_reused(ssl);
+		// The session (ticket) arrives after the handshake, so get it last
+		SSL_SESSION_free(*sess);
+		*sess = SSL_get1_session(ssl);
+	}
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	close(fd);
+	return total;
+}
+
+static void tls_test_resumption(bool no_tickets) {
+	Tls_Config cfg = {
+		.cert_file = TEST_CERT_FILE,
+		.key_file = TEST_KEY_FILE,
+		.no_tickets = no_tickets,
+	};
+	ut_assert(tls_init(&cfg)==0);
+	Test_Tls_Server ts = {
+		.fd_listen = net_listen_tcp(net_atoipv4("127.0.0.1"),0,10),
+		.connections = 2,
+	};
+	ut_assert(ts.fd_listen>=0);
+	pthread_t t;
+	ut_assert(pthread_create(&t,NULL,tls_test_server,&ts)==0);
+
+	SSL_CTX * client_ctx = SSL_CTX_new(TLS_client_method());
+	SSL_CTX_set_verify(client_ctx,SSL_VERIFY_NONE,NULL);
+	SSL_SESSION * sess = NULL;
+	bool reused = true;
+	char rsp[8192];
+	int port = net_local_port(ts.fd_listen);
+	ut_assert(tls_test_get(client_ctx,port,&sess,&reused,rsp,sizeof(rsp))>0);
+	ut_assert(sz_starts_with(rsp,"HTTP/1.1 200 OK"));
+	ut_assert(!reused);
+	ut_assert(sess!=NULL);
+	ut_assert(tls_test_get(client_ctx,port,&sess,&reused,rsp,sizeof(rsp))>0);
+	ut_assert(sz_starts_with(rsp,"HTTP/1.1 200 OK"));
+	ut_assert(reused);
+
+	pthread_join(t,NULL);
+	close(ts.fd_listen);
+	SSL_SESSION_free(sess);
+	SSL_CTX_free(client_ctx);
+
+	Tls_Stats stats;
+	tls_get_stats(&stats);
+	ut_assert(stats.handshakes==2);
+	ut_assert(stats.resumed==1);
+	if(no_tickets) {
+		ut_assert(stats.cache_hits==1);
+	}
+	tls_cleanup();
+}
+
+UT_TEST_CASE(tls_https_loopback) {
+	ut_assert(http_init("./web")==0);
+	ut_assert(tls_test_make_cert());
+	tls_test_resumption(false);
+	tls_test_resumption(true);
+}
+
+UT_TEST_CASE(tls_bad_cert) {
+	Tls_Config cfg = {
+		.cert_file = "src/test-data/does-not-exist.pem",
+		.key_file = "src/test-data/does-not-exist.pem",
+	};
+	ut_assert(tls_init(&cfg)!=0);
+	ut_assert(tls_accept(0)==NULL);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
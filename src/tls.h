@@ -0,0 +1,73 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+
+/*! \brief TLS configuration */
+typedef struct {
+	const char * cert_file;     // PEM certificate (chain)
+	const char * key_file;      // PEM private key
+	unsigned int cache_slots;   // session cache entries; 0 selects a default
+	bool no_tickets;            // resume via the session cache only (no stateless tickets)
+	bool no_ktls;               // do not try to enable kernel TLS offload
+} Tls_Config;
+
+/*! \brief A server-side TLS connection. The HTTP layer reads plaintext from
+ *         fd_in and writes plaintext to fd_out. When the kernel handles the
+ *         record layer (kTLS), these are the socket itself; otherwise they are
+ *         one end of a socketpair that a pump thread relays through OpenSSL.
+ */
+typedef struct {
+	int fd;          // the client socket
+	int fd_in;       // plaintext, read side
+	int fd_out;      // plaintext, write side
+	int fd_pump;     // pump's end of the socketpair, or -1 if no pump
+	bool ktls_tx;    // kernel encrypts writes to fd
+	bool ktls_rx;    // kernel decrypts reads from fd
+	SSL * ssl;
+	pthread_t pump;
+} Tls_Conn;
+
+typedef struct {
+	uint64_t handshakes;
+	uint64_t handshake_failures;
+	uint64_t resumed;
+	uint64_t ktls_tx;
+	uint64_t ktls_rx;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_stores;
+} Tls_Stats;
+
+/*! \brief Initialize the TLS subsystem: loads the certificate and key and
+ *         creates the session cache. Must be called before forking any child
+ *         processes; the session cache and ticket keys are shared with them,
+ *         so a session established by one child may be resumed by another.
+ *
+ * \return Returns 0 if initialized successfully, non-zero if something went wrong.
+ */
+int tls_init(const Tls_Config * cfg);
+
+/*! \brief Release the TLS context. */
+void tls_cleanup(void);
+
+/*! \brief Perform the server side of the TLS handshake on an accepted (blocking)
+ *         socket, and set up the plaintext file descriptors.
+ *  \return The connection, or NULL if the handshake failed.
+ */
+Tls_Conn * tls_accept(int fd);
+
+/*! \brief Flush outstanding data, send close_notify and free the connection.
+ *         Does not close the client socket itself.
+ */
+void tls_close(Tls_Conn * tc);
+
+void tls_get_stats(Tls_Stats * stats);
+void tls_dump_stats(FILE * fp);
+
+#endif // __TLS_H__
@@ -0,0 +1,30 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <time.h>
+
+#include "tm.h"
+
+uint64_t tm_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * TM_NS_PER_S + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t tm_now_us(void) {
+	return tm_now_ns() / TM_NS_PER_US;
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+
+UT_TEST_CASE(tm_now) {
+	uint64_t t1 = tm_now_ns();
+	struct timespec ts = {0, 2*TM_NS_PER_MS};
+	nanosleep(&ts,NULL);
+	uint64_t t2 = tm_now_ns();
+	ut_assert(t2>t1);
+	ut_assert(t2-t1 >= 2*TM_NS_PER_MS);
+	ut_assert(tm_now_us() >= t2/TM_NS_PER_US);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
@@ -0,0 +1,19 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __TM_H__
+#define __TM_H__
+
+#include <stdint.h>
+
+#define TM_NS_PER_US 1000ULL
+#define TM_NS_PER_MS 1000000ULL
+#define TM_NS_PER_S  1000000000ULL
+
+/*! \brief Current value of the monotonic clock, in nanoseconds.
+ */
+uint64_t tm_now_ns(void);
+
+/*! \brief Current value of the monotonic clock, in microseconds.
+ */
+uint64_t tm_now_us(void);
+
+#endif // __TM_H__
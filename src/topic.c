@@ -0,0 +1,588 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "ht.h"
+#include "math.h"
+#include "slab.h"
+#include "tm.h"
+#include "topic.h"
+
+#define TOPIC_MAX_FRAMES (1u<<20)
+#define TOPIC_BATCH      64     // frames referenced per read lock
+
+#define ATOMIC_ADD(V,N) __atomic_add_fetch(&(V),(N),__ATOMIC_RELAXED)
+
+// A published message, encoded as a websocket frame, shared by the history and
+// the subscribers sending it (a pooled buffer, freed with the last reference)
+typedef struct {
+	uint64_t seq;
+	uint32_t refs;
+	size_t len;
+	unsigned char data[];
+} Topic_Frame;
+
+struct Topic_Sub_S {
+	Topic * topic;
+	uint64_t next;          // sequence number of the next frame to send
+	WS_Poll wake;
+	bool signalled;         // woken, and not yet sent what's new
+	Topic_Sub prev_sub, next_sub;
+};
+
+struct Topic_S {
+	char name[TOPIC_MAX_NAME+1];
+	pthread_rwlock_t lock;
+	Topic_Frame ** ring;    // frames first..next-1, at seq & ring_mask
+	uint32_t ring_mask;
+	uint32_t max_frames;
+	size_t max_bytes;
+	uint64_t first, next;
+	Topic_Sub subs;
+	Topic_Stats stats;
+	unsigned opens;         // topic_opens not yet closed (with _topic_lock)
+	uint64_t idle_since;    // when opens last fell to 0 ...
+	Topic * prev_idle, * next_idle; // ... in the list of idle topics, oldest first
+};
+
+static pthread_mutex_t _topic_lock = PTHREAD_MUTEX_INITIALIZER;
+static Hashtable _topics = NULL;
+static unsigned _topic_max_frames = TOPIC_HISTORY_FRAMES;
+static size_t _topic_max_bytes = TOPIC_HISTORY_BYTES;
+static Topic_Publish_Hook _topic_on_publish = NULL;
+static Topic_Interest_Hook _topic_on_interest = NULL;
+static unsigned _topic_max_topics = TOPIC_MAX_TOPICS;
+static uint64_t _topic_idle_ns = TOPIC_IDLE_SECS*TM_NS_PER_S;
+static Topic * _topic_idle_first = NULL, * _topic_idle_last = NULL;
+static struct {
+	uint64_t created;
+	uint64_t freed;
+	uint64_t refused;
+} _topic_counts;
+
+static void topic_frame_release(Topic_Frame * f) {
+	if(__atomic_sub_fetch(&f->refs,1,__ATOMIC_ACQ_REL)==0) {
+		slab_free(f);
+	}
+}
+
+static void topic_free(void * val) {
+	Topic * topic = val;
+	for(uint64_t seq=topic->first; seq<topic->next; seq++) {
+		topic_frame_release(topic->ring[seq & topic->ring_mask]);
+	}
+	if(topic->subs) {
+		wlogf("Topic freed with subscribers: %s",topic->name);
+	}
+	pthread_rwlock_destroy(&topic->lock);
+	free(topic->ring);
+	free(topic);
+}
+
+int topic_set_history(unsigned max_frames, size_t max_bytes) {
+	if(max_frames>TOPIC_MAX_FRAMES) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&_topic_lock);
+	_topic_max_frames = max_frames ? max_frames : TOPIC_HISTORY_FRAMES;
+	_topic_max_bytes = max_bytes ? max_bytes : TOPIC_HISTORY_BYTES;
+	pthread_mutex_unlock(&_topic_lock);
+	return 0;
+}
+
+void topic_set_limits(unsigned max_topics, unsigned idle_secs) {
+	pthread_mutex_lock(&_topic_lock);
+	_topic_max_topics = max_topics ? max_topics : TOPIC_MAX_TOPICS;
+	_topic_idle_ns = (idle_secs ? idle_secs : TOPIC_IDLE_SECS)*TM_NS_PER_S;
+	pthread_mutex_unlock(&_topic_lock);
+}
+
+// (With _topic_lock held, as for the idle list functions below)
+static void topic_idle_remove(Topic * topic) {
+	if(topic->prev_idle) {
+		topic->prev_idle->next_idle = topic->next_idle;
+	} else {
+		_topic_idle_first = topic->next_idle;
+	}
+	if(topic->next_idle) {
+		topic->next_idle->prev_idle = topic->prev_idle;
+	} else {
+		_topic_idle_last = topic->prev_idle;
+	}
+	topic->prev_idle = topic->next_idle = NULL;
+}
+
+static void topic_idle_append(Topic * topic, uint64_t now) {
+	topic->idle_since = now;
+	topic->prev_idle = _topic_idle_last;
+	topic->next_idle = NULL;
+	if(_topic_idle_last) {
+		_topic_idle_last->next_idle = topic;
+	} else {
+		_topic_idle_first = topic;
+	}
+	_topic_idle_last = topic;
+}
+
+// Free the topics that have been idle for long enough
+static void topic_reap(uint64_t now) {
+	while(_topic_idle_first && now - _topic_idle_first->idle_since >= _topic_idle_ns) {
+		Topic * topic = _topic_idle_first;
+		topic_idle_remove(topic);
+		dlogf("Topic freed: %s",topic->name);
+		ht_remove(_topics,topic->name);
+		_topic_counts.freed++;
+	}
+}
+
+static Topic * topic_create(const char * name) {
+	uint32_t ring_len = 1;
+	while(ring_len<_topic_max_frames) {
+		ring_len <<= 1;
+	}
+	Topic * topic = calloc(1,sizeof(Topic));
+	Topic_Frame ** ring = malloc(ring_len*sizeof(Topic_Frame *));
+	if(!topic || !ring) {
+		free(topic);
+		free(ring);
+		errno = ENOMEM;
+		return NULL;
+	}
+	strcpy(topic->name,name);
+	pthread_rwlock_init(&topic->lock,NULL);
+	topic->ring = ring;
+	topic->ring_mask = ring_len - 1;
+	topic->max_frames = _topic_max_frames;
+	topic->max_bytes = _topic_max_bytes;
+	topic->first = topic->next = 1;
+	return topic;
+}
+
+static Topic * topic_open_at(const char * name, uint64_t now) {
+	if(strlen(name)>TOPIC_MAX_NAME) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	pthread_mutex_lock(&_topic_lock);
+	if(!_topics) {
+		_topics = ht_create(0,NULL,free,topic_free);
+	}
+	Topic * topic = NULL;
+	if(_topics) {
+		topic_reap(now);
+		topic = ht_get(_topics,name);
+	}
+	if(topic) {
+		if(topic->opens++==0) {
+			topic_idle_remove(topic);
+		}
+	} else if(_topics && ht_size(_topics)>=_topic_max_topics) {
+		_topic_counts.refused++;
+		errno = EAGAIN;
+	} else if(_topics && (topic = topic_create(name))) {
+		char * key = strdup(name);
+		if(!key) {
+			topic_free(topic);
+			topic = NULL;
+			errno = ENOMEM;
+		} else {
+			topic->opens = 1;
+			ht_put(_topics,key,topic);
+			_topic_counts.created++;
+			dlogf("Topic created: %s",name);
+		}
+	}
+	pthread_mutex_unlock(&_topic_lock);
+	return topic;
+}
+
+Topic * topic_open(const char * name) {
+	return topic_open_at(name,tm_now_ns());
+}
+
+static void topic_close_at(Topic * topic, uint64_t now) {
+	pthread_mutex_lock(&_topic_lock);
+	if(--topic->opens==0) {
+		topic_idle_append(topic,now);
+	}
+	topic_reap(now);
+	pthread_mutex_unlock(&_topic_lock);
+}
+
+void topic_close(Topic * topic) {
+	topic_close_at(topic,tm_now_ns());
+}
+
+void topic_cleanup(void) {
+	pthread_mutex_lock(&_topic_lock);
+	ht_free(_topics);
+	_topics = NULL;
+	_topic_idle_first = _topic_idle_last = NULL;
+	pthread_mutex_unlock(&_topic_lock);
+}
+
+const char * topic_name(const Topic * topic) {
+	return topic->name;
+}
+
+// Drop the oldest frame (with the write lock held)
+static void topic_evict(Topic * topic) {
+	Topic_Frame * f = topic->ring[topic->first & topic->ring_mask];
+	topic->first++;
+	topic->stats.bytes -= f->len;
+	topic->stats.frames--;
+	topic->stats.evicted++;
+	topic_frame_release(f);
+}
+
+void topic_set_hooks(Topic_Publish_Hook on_publish, Topic_Interest_Hook on_interest) {
+	pthread_mutex_lock(&_topic_lock);
+	_topic_on_publish = on_publish;
+	_topic_on_interest = on_interest;
+	pthread_mutex_unlock(&_topic_lock);
+}
+
+static uint64_t topic_append(Topic * topic, WS_Msg_Type type, const unsigned char * msg, size_t msg_len, bool hook) {
+	// Encoded outside the lock, once for all subscribers
+	Topic_Frame * f = slab_alloc(sizeof(Topic_Frame) + WS_MAX_HEADER_LEN + msg_len);
+	if(!f) {
+		errno = ENOMEM;
+		return 0;
+	}
+	f->refs = 1;
+	f->len = ws_encode_frame(f->data,type,msg,msg_len);
+
+	pthread_rwlock_wrlock(&topic->lock);
+	if(topic->next - topic->first==topic->max_frames) {
+		topic_evict(topic);
+	}
+	uint64_t seq = f->seq = topic->next++;
+	topic->ring[seq & topic->ring_mask] = f;
+	topic->stats.bytes += f->len;
+	topic->stats.frames++;
+	topic->stats.published++;
+	if(hook && _topic_on_publish) {
+		_topic_on_publish(topic,type,msg,msg_len);
+	}
+	// The newest message is kept, however big
+	while(topic->stats.bytes>topic->max_bytes && topic->first<seq) {
+		topic_evict(topic);
+	}
+	// Wake each subscriber once, until it has sent what's new
+	for(Topic_Sub sub=topic->subs; sub; sub=sub->next_sub) {
+		if(!__atomic_exchange_n(&sub->signalled,true,__ATOMIC_ACQ_REL)) {
+			ws_poll_wake(sub->wake);
+		}
+	}
+	pthread_rwlock_unlock(&topic->lock);
+	return seq;
+}
+
+uint64_t topic_publish(Topic * topic, WS_Msg_Type type, const unsigned char * msg, size_t msg_len) {
+	return topic_append(topic,type,msg,msg_len,true);
+}
+
+uint64_t topic_deliver(Topic * topic, WS_Msg_Type type, const unsigned char * msg, size_t msg_len) {
+	return topic_append(topic,type,msg,msg_len,false);
+}
+
+Topic_Sub topic_subscribe(Topic * topic, uint64_t since, WS_Poll wake) {
+	Topic_Sub sub = malloc(sizeof(struct Topic_Sub_S));
+	if(!sub) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_rwlock_wrlock(&topic->lock);
+	*sub = (struct Topic_Sub_S) {
+		.topic = topic,
+		.next = since==0 || since>topic->next ? topic->next : since,
+		.wake = wake,
+		.next_sub = topic->subs,
+	};
+	if(topic->subs) {
+		topic->subs->prev_sub = sub;
+	}
+	topic->subs = sub;
+	if(topic->stats.subs++==0 && _topic_on_interest) {
+		_topic_on_interest(topic,true);
+	}
+	pthread_rwlock_unlock(&topic->lock);
+	return sub;
+}
+
+void topic_unsubscribe(Topic_Sub sub) {
+	Topic * topic = sub->topic;
+	pthread_rwlock_wrlock(&topic->lock);
+	if(sub->prev_sub) {
+		sub->prev_sub->next_sub = sub->next_sub;
+	} else {
+		topic->subs = sub->next_sub;
+	}
+	if(sub->next_sub) {
+		sub->next_sub->prev_sub = sub->prev_sub;
+	}
+	if(--topic->stats.subs==0 && _topic_on_interest) {
+		_topic_on_interest(topic,false);
+	}
+	pthread_rwlock_unlock(&topic->lock);
+	free(sub);
+}
+
+uint64_t topic_position(Topic_Sub sub) {
+	Topic * topic = sub->topic;
+	pthread_rwlock_rdlock(&topic->lock);
+	uint64_t next = max(sub->next,topic->first);
+	pthread_rwlock_unlock(&topic->lock);
+	return next;
+}
+
+int topic_send(Topic_Sub sub, Websocket ws) {
+	Topic * topic = sub->topic;
+	// A message published from here on wakes us again
+	__atomic_store_n(&sub->signalled,false,__ATOMIC_RELEASE);
+	int sent = 0;
+	bool ok = true;
+	ws_cork(ws);
+	while(ok) {
+		// Reference a batch of frames under the read lock, and send them after
+		Topic_Frame * batch[TOPIC_BATCH];
+		int n = 0;
+		pthread_rwlock_rdlock(&topic->lock);
+		if(sub->next<topic->first) {
+			ATOMIC_ADD(topic->stats.missed,topic->first - sub->next);
+			sub->next = topic->first;
+		}
+		for(; n<TOPIC_BATCH && sub->next<topic->next; n++, sub->next++) {
+			batch[n] = topic->ring[sub->next & topic->ring_mask];
+			ATOMIC_ADD(batch[n]->refs,1);
+		}
+		pthread_rwlock_unlock(&topic->lock);
+		if(n==0) {
+			break;
+		}
+		for(int i=0; i<n; i++) {
+			ok = ok && ws_send_frame(ws,batch[i]->data,batch[i]->len);
+			topic_frame_release(batch[i]);
+		}
+		if(ok) {
+			sent += n;
+		}
+	}
+	ok = ws_uncork(ws) && ok;
+	ATOMIC_ADD(topic->stats.replayed,sent);
+	return ok ? sent : -1;
+}
+
+void topic_get_stats(Topic * topic, Topic_Stats * stats) {
+	pthread_rwlock_rdlock(&topic->lock);
+	*stats = topic->stats;
+	stats->replayed = __atomic_load_n(&topic->stats.replayed,__ATOMIC_RELAXED);
+	stats->missed = __atomic_load_n(&topic->stats.missed,__ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&topic->lock);
+}
+
+void topic_dump_stats(FILE * fp) {
+	pthread_mutex_lock(&_topic_lock);
+	fprintf(fp,"topics %zu\n",_topics ? ht_size(_topics) : 0);
+	fprintf(fp,"topics_created %llu\n",(unsigned long long)_topic_counts.created);
+	fprintf(fp,"topics_freed %llu\n",(unsigned long long)_topic_counts.freed);
+	fprintf(fp,"topics_refused %llu\n",(unsigned long long)_topic_counts.refused);
+	pthread_mutex_unlock(&_topic_lock);
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include "ut.h"
+
+// A websocket on one end of a socketpair, its 101 response and ping skipped;
+// the client end is returned in fd_client
+static Websocket test_topic_ws(int * fd_client) {
+	int sv[2];
+	ut_assert(socketpair(AF_UNIX,SOCK_STREAM,0,sv)==0);
+	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
+	ht_put(headers,(char*)"connection",(char*)"Upgrade");
+	ht_put(headers,(char*)"upgrade",(char*)"websocket");
+	ht_put(headers,(char*)"sec-websocket-version",(char*)"13");
+	ht_put(headers,(char*)"sec-websocket-key",(char*)"dGhlIHNhbXBsZSBub25jZQ==");
+	Websocket ws = ws_upgrade(fdopen(sv[0],"r"),fdopen(dup(sv[0]),"w"),headers,"/topics/t",true,NULL);
+	ht_free(headers);
+	ut_assert(ws!=NULL);
+	char buff[256];
+	ssize_t n = recv(sv[1],buff,sizeof(buff),0);
+	ut_assert(n>4 && memcmp(buff+n-2,"\x89\x00",2)==0);
+	*fd_client = sv[1];
+	return ws;
+}
+
+// Read n unmasked text frames, checking their payloads are "<first>".."<first+n-1>"
+static void test_topic_recv(int fd, int first, int n) {
+	for(int i=first; i<first+n; i++) {
+		unsigned char hdr[2];
+		char payload[126], expected[16];
+		ut_assert(recv(fd,hdr,2,MSG_WAITALL)==2);
+		ut_assert(hdr[0]==0x81 && hdr[1]<126);
+		ut_assert(recv(fd,payload,hdr[1],MSG_WAITALL)==hdr[1]);
+		snprintf(expected,sizeof(expected),"%d",i);
+		ut_assert(hdr[1]==strlen(expected) && memcmp(payload,expected,hdr[1])==0);
+	}
+	char c;
+	ut_assert(recv(fd,&c,1,MSG_DONTWAIT)<0 && errno==EAGAIN);
+}
+
+static void test_topic_publish(Topic * topic, int first, int n) {
+	for(int i=first; i<first+n; i++) {
+		char msg[16];
+		snprintf(msg,sizeof(msg),"%d",i);
+		ut_assert(topic_publish(topic,WS_MSG_TXT,(unsigned char *)msg,strlen(msg))==(uint64_t)i);
+	}
+}
+
+UT_TEST_CASE(topic_history) {
+	ut_assert(topic_set_history(8,0)==0);
+	char name[TOPIC_MAX_NAME+2];
+	memset(name,'x',sizeof(name)-1);
+	name[sizeof(name)-1] = 0;
+	ut_assert(topic_open(name)==NULL && errno==ENAMETOOLONG);
+	Topic * topic = topic_open("history");
+	ut_assert(topic && topic_open("history")==topic);
+	WS_Poll poll = ws_poll_create();
+	int fd;
+	Websocket ws = test_topic_ws(&fd);
+
+	// A live subscriber is woken, and sent what's new
+	Topic_Sub live = topic_subscribe(topic,0,poll);
+	ut_assert(topic_position(live)==1);
+	test_topic_publish(topic,1,5);
+	WS_Event ev[1];
+	uint64_t start = tm_now_ns();
+	ut_assert(ws_poll_wait(poll,ev,1,1000)==0);
+	ut_assert(tm_now_ns() - start < 500*TM_NS_PER_MS);
+	ut_assert(topic_send(live,ws)==5);
+	test_topic_recv(fd,1,5);
+	ut_assert(topic_send(live,ws)==0);
+
+	// The history keeps the last 8; a late joiner replays from where it asks
+	test_topic_publish(topic,6,7);
+	ut_assert(topic_send(live,ws)==7);
+	test_topic_recv(fd,6,7);
+	Topic_Sub late = topic_subscribe(topic,10,poll);
+	ut_assert(topic_position(late)==10);
+	ut_assert(topic_send(late,ws)==3);
+	test_topic_recv(fd,10,3);
+	topic_unsubscribe(late);
+
+	// ... or from the oldest kept
+	late = topic_subscribe(topic,2,poll);
+	ut_assert(topic_position(late)==5);
+	ut_assert(topic_send(late,ws)==8);
+	test_topic_recv(fd,5,8);
+	Topic_Stats stats;
+	topic_get_stats(topic,&stats);
+	ut_assert(stats.published==12 && stats.frames==8 && stats.evicted==4);
+	ut_assert(stats.subs==2 && stats.missed==3 && stats.replayed==23);
+	topic_unsubscribe(late);
+	topic_unsubscribe(live);
+
+	// The history is bounded by bytes too (but keeps the newest)
+	ut_assert(topic_set_history(0,100)==0);
+	Topic * small = topic_open("history-small");
+	unsigned char big[200];
+	memset(big,'b',sizeof(big));
+	ut_assert(topic_publish(small,WS_MSG_BIN,big,50)==1);
+	ut_assert(topic_publish(small,WS_MSG_BIN,big,40)==2);
+	topic_get_stats(small,&stats);
+	ut_assert(stats.frames==2 && stats.bytes==52+42);
+	ut_assert(topic_publish(small,WS_MSG_BIN,big,sizeof(big))==3);
+	topic_get_stats(small,&stats);
+	ut_assert(stats.frames==1 && stats.bytes==4+sizeof(big) && stats.evicted==2);
+	ut_assert(topic_set_history(0,0)==0);
+
+	ws_free(ws);
+	close(fd);
+	ws_poll_free(poll);
+	topic_cleanup();
+}
+
+UT_TEST_CASE(topic_limits) {
+	topic_set_limits(2,10);
+	const uint64_t s = TM_NS_PER_S;
+	Topic * a = topic_open_at("limit-a",1*s);
+	Topic * b = topic_open_at("limit-b",1*s);
+	ut_assert(a && b);
+	ut_assert(topic_publish(b,WS_MSG_TXT,(unsigned char *)"b1",2)==1);
+
+	// No more topics than the limit
+	ut_assert(topic_open_at("limit-c",2*s)==NULL && errno==EAGAIN);
+	ut_assert(topic_open_at("limit-a",2*s)==a);
+	topic_close_at(a,2*s);
+
+	// A topic nobody has open is kept, with its history, while it is idle ...
+	topic_close_at(b,3*s);
+	ut_assert(topic_open_at("limit-c",12*s)==NULL && errno==EAGAIN);
+	ut_assert(topic_open_at("limit-b",12*s)==b);
+	Topic_Stats stats;
+	topic_get_stats(b,&stats);
+	ut_assert(stats.published==1);
+	topic_close_at(b,12*s);
+
+	// ... and freed once it has been idle for long enough
+	Topic * c = topic_open_at("limit-c",22*s);
+	ut_assert(c!=NULL);
+	b = topic_open_at("limit-b",22*s);
+	ut_assert(b==NULL && errno==EAGAIN);
+	topic_close_at(a,23*s);
+	ut_assert((b = topic_open_at("limit-b",33*s))!=NULL);
+	topic_get_stats(b,&stats);
+	ut_assert(stats.published==0);
+
+	topic_dump_stats(stdlog);
+	topic_close_at(b,33*s);
+	topic_close_at(c,33*s);
+	topic_set_limits(0,0);
+	topic_cleanup();
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
+
+#ifndef EXCLUDE_BENCHMARKS
+
+#include <stdio.h>
+#include "bench.h"
+
+// Replaying a full history to many (re)connecting subscribers
+BENCH_CASE(topic_replay) {
+	Topic * topic = topic_open("bench-replay");
+	unsigned char msg[100];
+	memset(msg,'m',sizeof(msg));
+	for(int i=0; i<TOPIC_HISTORY_FRAMES; i++) {
+		topic_publish(topic,WS_MSG_BIN,msg,sizeof(msg));
+	}
+	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
+	ht_put(headers,(char*)"connection",(char*)"Upgrade");
+	ht_put(headers,(char*)"upgrade",(char*)"websocket");
+	ht_put(headers,(char*)"sec-websocket-version",(char*)"13");
+	ht_put(headers,(char*)"sec-websocket-key",(char*)"dGhlIHNhbXBsZSBub25jZQ==");
+	Websocket ws = ws_upgrade(fopen("/dev/null","r"),fopen("/dev/null","w"),headers,"/topics/t",true,NULL);
+	WS_Poll poll = ws_poll_create();
+	const uint64_t n = bench_iterations(2000);
+	uint64_t frames = 0;
+	uint64_t start = tm_now_ns();
+	for(uint64_t i=0; i<n; i++) {
+		Topic_Sub sub = topic_subscribe(topic,1,poll);
+		frames += topic_send(sub,ws);
+		topic_unsubscribe(sub);
+	}
+	bench_report("replay 1024 x 100 B",n,frames*(sizeof(msg)+2),tm_now_ns()-start);
+	ws_poll_free(poll);
+	ws_free(ws);
+	ht_free(headers);
+	topic_cleanup();
+}
+
+#endif // !EXCLUDE_BENCHMARKS
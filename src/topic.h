@@ -0,0 +1,121 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __TOPIC_H__
+#define __TOPIC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "ws.h"
+
+// Topics: named streams of websocket messages, in-process. A message published
+// to a topic is encoded once, as a websocket frame, and kept in the topic's
+// history (a ring bounded by count and bytes), numbered by sequence from 1.
+// Subscribers read from the history, from a sequence number of their choosing:
+// a late joiner's replay and live delivery are the same path, sending the
+// shared frames (referenced, not copied) with ws_send_frame.
+//
+// Topics are held open by those using them. The number of topics is limited,
+// and a topic nobody has open is freed, with its history, once it has been
+// idle for a while: names are chosen by clients, and would otherwise
+// accumulate.
+
+#define TOPIC_MAX_NAME         64
+#define TOPIC_HISTORY_FRAMES   1024          // default history, in messages
+#define TOPIC_HISTORY_BYTES    (1024*1024)   // ... and in bytes (frames)
+#define TOPIC_MAX_TOPICS       1024          // default limit on topics kept
+#define TOPIC_IDLE_SECS        60            // default time a topic nobody has open is kept
+
+typedef struct Topic_S Topic;
+typedef struct Topic_Sub_S * Topic_Sub;
+
+typedef struct {
+	uint64_t published;  // messages published
+	uint64_t evicted;    // messages dropped from the history
+	uint64_t replayed;   // messages sent to subscribers
+	uint64_t missed;     // messages subscribers asked for that were no longer kept
+	uint32_t frames;     // messages in the history
+	uint32_t subs;       // subscribers
+	size_t bytes;        // bytes in the history
+} Topic_Stats;
+
+/*! \brief Set the history limits of topics opened from now on (0 for the default).
+ *  \return 0, or -1 (errno EINVAL) if max_frames is over 2^20.
+ */
+int topic_set_history(unsigned max_frames, size_t max_bytes);
+
+/*! \brief Set the limit on topics kept, and how long a topic nobody has open
+ *         is kept (0 for the defaults).
+ */
+void topic_set_limits(unsigned max_topics, unsigned idle_secs);
+
+/*! \brief Open the topic of the given name, created on first use. Each open is
+ *         ended with topic_close; a topic nobody has open is freed once it has
+ *         been idle for the time set with topic_set_limits.
+ *  \return The topic, or NULL (errno ENAMETOOLONG, EAGAIN if it is new and as
+ *          many topics as the limit are kept, or ENOMEM).
+ */
+Topic * topic_open(const char * name);
+
+/*! \brief End a topic_open. Subscriptions made under it must have been ended.
+ */
+void topic_close(Topic * topic);
+
+/*! \brief Free all topics. Their subscriptions must have been ended.
+ */
+void topic_cleanup(void);
+
+const char * topic_name(const Topic * topic);
+
+/*! \brief Publish a message, waking the subscribers' pollers.
+ *  \return The message's sequence number, or 0 (errno ENOMEM).
+ */
+uint64_t topic_publish(Topic * topic, WS_Msg_Type type, const unsigned char * msg, size_t msg_len);
+
+/*! \brief Subscribe, from sequence number since (0 for new messages only).
+ *         Messages older than the history are skipped (and counted as missed).
+ *  \param wake A poller to wake (ws_poll_wake) when there is something to send.
+ *  \return The subscription, or NULL (errno ENOMEM).
+ */
+Topic_Sub topic_subscribe(Topic * topic, uint64_t since, WS_Poll wake);
+
+void topic_unsubscribe(Topic_Sub sub);
+
+/*! \brief The sequence number of the next message the subscriber will be sent.
+ */
+uint64_t topic_position(Topic_Sub sub);
+
+/*! \brief Send the subscriber what has been published since it was last sent
+ *         anything, without re-encoding.
+ *  \return The number of messages sent, or -1 if sending failed.
+ */
+int topic_send(Topic_Sub sub, Websocket ws);
+
+void topic_get_stats(Topic * topic, Topic_Stats * stats);
+
+/*! \brief Print the number of topics, and those created, freed and refused.
+ */
+void topic_dump_stats(FILE * fp);
+
+/*! \brief Called as a message is published with topic_publish (in order, with
+ *         the topic locked: it must not call topic functions).
+ */
+typedef void (*Topic_Publish_Hook)(Topic * topic, WS_Msg_Type type, const unsigned char * msg, size_t msg_len);
+
+/*! \brief Called as a topic gets its first subscriber (subscribed is true), or
+ *         loses its last (with the topic locked, as for Topic_Publish_Hook).
+ */
+typedef void (*Topic_Interest_Hook)(Topic * topic, bool subscribed);
+
+/*! \brief Set the hooks (NULL for none), to pass what's published on to other
+ *         processes (see relay.h).
+ */
+void topic_set_hooks(Topic_Publish_Hook on_publish, Topic_Interest_Hook on_interest);
+
+/*! \brief Publish a message that came from elsewhere: as topic_publish, but the
+ *         publish hook is not called.
+ */
+uint64_t topic_deliver(Topic * topic, WS_Msg_Type type, const unsigned char * msg, size_t msg_len);
+
+#endif // __TOPIC_H__
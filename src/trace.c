@@ -0,0 +1,25 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#include "trace.h"
+
+#ifdef TRACE_ENABLED
+// The probes' semaphores, which tracers find by the probes' ELF notes
+#define TRACE_DEFINE_SEMAPHORE(probe) \
+	unsigned short TRACE_SEMAPHORE(probe) __attribute__((section(".probes")));
+TRACE_PROBES(TRACE_DEFINE_SEMAPHORE)
+#endif
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+
+UT_TEST_CASE(trace) {
+	// Nothing is attached to the probes while testing
+	unsigned long evaluated = 0;
+	TRACE2(accept,evaluated++,0);
+	TRACE4(dispatch_end,"GET","/",200,evaluated++);
+	TRACE3(frame_read,0x1,evaluated++,true);
+	ut_assert(evaluated==0);
+	ut_assert(!TRACING(close));
+}
+
+#endif
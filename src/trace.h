@@ -0,0 +1,73 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// Static tracepoints (USDT) of the "nuthatch" provider, for bpftrace, perf and
+// other tracers to attach to in a running server. Where <sys/sdt.h> is
+// available (systemtap-sdt-dev), each probe is a nop in the code plus an ELF
+// note, and is guarded by a semaphore the tracer raises while it is attached,
+// so the probe's arguments are only computed (and clocks only read) while it
+// is traced. Without <sys/sdt.h>, or built with -DNO_TRACE, probes compile to
+// nothing.
+//
+//   accept(fd, family)                       a client connection was accepted
+//   request_line(method, uri, v_maj, v_min)  the request line was parsed
+//   headers(count, elapsed_ns)               the headers were parsed, elapsed_ns after accept
+//   dispatch_start(method, uri)              an HTTP/1.1 request is handled ...
+//   dispatch_end(method, uri, status, duration_ns)
+//   response(status, bytes)                  ... and its response was sent (bytes written)
+//   upgrade(uri, protocol)                   the connection was upgraded to a websocket
+//   frame_read(opcode, len, fin)             a websocket frame was received
+//   frame_write(opcode, len, fin)            a websocket frame was sent (or buffered)
+//   close(fd, duration_ns)                   a connection was served, duration_ns after accept
+//
+// Strings (method, uri, protocol) are passed as pointers, for str() in
+// bpftrace; method is the method's name.
+
+#define TRACE_PROBES(X) \
+	X(accept) X(request_line) X(headers) X(dispatch_start) X(dispatch_end) \
+	X(response) X(upgrade) X(frame_read) X(frame_write) X(close)
+
+#if !defined(NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define TRACE_ENABLED 1
+#endif
+#endif
+
+#ifdef TRACE_ENABLED
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(probe) nuthatch_##probe##_semaphore
+#define TRACE_DECLARE_SEMAPHORE(probe) extern unsigned short TRACE_SEMAPHORE(probe);
+TRACE_PROBES(TRACE_DECLARE_SEMAPHORE)
+
+/*! \brief Is a tracer attached to the probe? For work done only for a probe,
+ *  such as taking a start time.
+ */
+#define TRACING(probe) __builtin_expect(__atomic_load_n(&TRACE_SEMAPHORE(probe),__ATOMIC_RELAXED)!=0,0)
+
+#define TRACE1(probe,a1) do { \
+	if(TRACING(probe)) DTRACE_PROBE1(nuthatch,probe,a1); } while(0)
+#define TRACE2(probe,a1,a2) do { \
+	if(TRACING(probe)) DTRACE_PROBE2(nuthatch,probe,a1,a2); } while(0)
+#define TRACE3(probe,a1,a2,a3) do { \
+	if(TRACING(probe)) DTRACE_PROBE3(nuthatch,probe,a1,a2,a3); } while(0)
+#define TRACE4(probe,a1,a2,a3,a4) do { \
+	if(TRACING(probe)) DTRACE_PROBE4(nuthatch,probe,a1,a2,a3,a4); } while(0)
+
+#else
+
+#define TRACING(probe) 0
+
+// The arguments are referenced, not evaluated, so that values computed only
+// for a probe don't go unused
+#define TRACE1(probe,a1) do { if(0) { (void)(a1); } } while(0)
+#define TRACE2(probe,a1,a2) do { if(0) { (void)(a1); (void)(a2); } } while(0)
+#define TRACE3(probe,a1,a2,a3) do { if(0) { (void)(a1); (void)(a2); (void)(a3); } } while(0)
+#define TRACE4(probe,a1,a2,a3,a4) do { if(0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } } while(0)
+
+#endif // TRACE_ENABLED
+
+#endif // __TRACE_H__
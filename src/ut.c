@@ -1,4 +1,6 @@
 // Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef EXCLUDE_UNIT_TESTS
+
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -270,3 +272,5 @@ int ut_test_driver(int argc, char ** argv) {
 
 	return c_failed>0 ? 1 : 0;
 }
+
+#endif // !EXCLUDE_UNIT_TESTS
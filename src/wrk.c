@@ -0,0 +1,711 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#define _GNU_SOURCE // for cpu_set_t
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "net.h"
+#include "adm.h"
+#include "tm.h"
+#include "cpu.h"
+#include "wrk.h"
+
+#define WRK_STOP_TIMEOUT_MS 5000
+
+// Server -> worker, with the connection's file descriptor
+typedef struct {
+	uint64_t t_accept_ns;
+	uint32_t client_addr_len;
+	uint32_t tls;
+	struct sockaddr_storage client_addr;
+} Wrk_Handoff;
+
+// Worker -> server
+typedef struct {
+	uint64_t received;
+	uint32_t conns;
+	uint32_t queued;
+} Wrk_Load;
+
+typedef struct Wrk_Conn_S {
+	int fd;
+	Wrk_Handoff h;
+	struct Wrk_Conn_S * next;
+} Wrk_Conn;
+
+// State of a worker process
+typedef struct {
+	int fd_chan;
+	Wrk_Stats * stats;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	Wrk_Conn * head;      // connections waiting for a thread
+	Wrk_Conn * tail;
+	bool stopping;
+	uint64_t received;
+	uint32_t conns;
+	uint32_t queued;
+	unsigned int num_threads;
+	pthread_t * threads;
+	int * fds;            // the connection served by each thread, or -1
+} Wrk_Pool;
+
+typedef struct {
+	Wrk_Pool * pool;
+	unsigned int ix;
+	const cpu_set_t * cpus;  // the worker's CPUs, if the thread is to be pinned
+} Wrk_Thread_Arg;
+
+static Wrk_Config _wrk_cfg;
+static Wrk_Serve_Fn _wrk_serve = NULL;
+static int * _wrk_fds_close = NULL;
+static int _wrk_num_fds_close = 0;
+static Wrk_Stats * _wrk_stats = NULL;        // shared with the workers
+static int _wrk_chan[WRK_MAX_WORKERS];       // the server's end of each channel
+static unsigned int _wrk_next = 0;           // breaks ties between equally loaded workers
+static bool _wrk_stopping = false;
+static bool _wrk_pinned = false;
+static cpu_set_t _wrk_cpus[WRK_MAX_WORKERS];     // the CPUs each worker is pinned to
+static int8_t _wrk_cpu_worker[CPU_SETSIZE];      // the worker pinned to each CPU, or -1
+
+#define ATOMIC_INC(V) __atomic_add_fetch(&(V),1,__ATOMIC_RELAXED)
+#define ATOMIC_GET(V) __atomic_load_n(&(V),__ATOMIC_RELAXED)
+
+/////////////////////////////////////////////////////////////////////////////
+// Worker process
+
+// Tell the server about our load. Called with the pool locked.
+static void wrk_report(Wrk_Pool * p) {
+	Wrk_Load load = { .received = p->received, .conns = p->conns, .queued = p->queued };
+	// Don't block if the server is busy; a later report will do
+	if(send(p->fd_chan,&load,sizeof(load),MSG_DONTWAIT|MSG_NOSIGNAL)<0 && errno!=EAGAIN) {
+		dlogf("Failed to send load report: %s",strerror(errno));
+	}
+}
+
+static void wrk_conn_done(Wrk_Pool * p, int fd) {
+	close(fd);
+	adm_conn_close();
+	ATOMIC_INC(p->stats->finished);
+}
+
+static void * wrk_thread(void * arg) {
+	Wrk_Thread_Arg * ta = arg;
+	Wrk_Pool * p = ta->pool;
+	if(ta->cpus) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu_nth(ta->cpus,ta->ix),&set);
+		if(cpu_pin_thread(pthread_self(),&set)!=0) {
+			wlogf("Failed to pin worker thread: %s",strerror(errno));
+		}
+	}
+	for(;;) {
+		pthread_mutex_lock(&p->lock);
+		while(!p->stopping && !p->head) {
+			pthread_cond_wait(&p->cond,&p->lock);
+		}
+		if(p->stopping) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		Wrk_Conn * c = p->head;
+		p->head = c->next;
+		if(!p->head) {
+			p->tail = NULL;
+		}
+		p->queued--;
+		p->conns++;
+		p->fds[ta->ix] = c->fd;
+		wrk_report(p);
+		pthread_mutex_unlock(&p->lock);
+
+		adm_conn_set_accept_ns(c->h.t_accept_ns);
+		_wrk_serve(c->fd,c->h.client_addr_len ? (struct sockaddr *)&c->h.client_addr : NULL,c->h.tls);
+
+		pthread_mutex_lock(&p->lock);
+		// Closed with the lock held, so that wrk_main can't shut down a
+		// recycled file descriptor
+		p->fds[ta->ix] = -1;
+		wrk_conn_done(p,c->fd);
+		p->conns--;
+		wrk_report(p);
+		pthread_mutex_unlock(&p->lock);
+		free(c);
+	}
+	return NULL;
+}
+
+// Run on the worker's CPUs, and allocate memory (including thread stacks) on
+// their NUMA node
+static void wrk_place(int worker) {
+	if(cpu_pin_thread(pthread_self(),&_wrk_cpus[worker])!=0) {
+		wlogf("Failed to pin worker %d: %s",worker,strerror(errno));
+		return;
+	}
+	int node = cpu_node(cpu_nth(&_wrk_cpus[worker],0));
+	if(node>=0 && cpu_prefer_node(node)!=0) {
+		wlogf("Failed to set memory policy of worker %d: %s",worker,strerror(errno));
+	}
+	ilogf("Worker %d pinned to %d CPUs starting at %d, NUMA node %d",worker,CPU_COUNT(&_wrk_cpus[worker]),
+		cpu_nth(&_wrk_cpus[worker],0),node);
+}
+
+static void wrk_main(int worker, int fd_chan) {
+	if(_wrk_pinned) {
+		wrk_place(worker);
+	}
+	if(_wrk_cfg.init) {
+		_wrk_cfg.init(worker);
+	}
+	Wrk_Pool pool = {
+		.fd_chan = fd_chan,
+		.stats = &_wrk_stats[worker],
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.num_threads = _wrk_cfg.threads,
+	};
+	Wrk_Pool * p = &pool;
+	p->threads = calloc(p->num_threads,sizeof(pthread_t));
+	p->fds = malloc(p->num_threads*sizeof(int));
+	Wrk_Thread_Arg * args = calloc(p->num_threads,sizeof(Wrk_Thread_Arg));
+	unsigned int started = 0;
+	for(unsigned int i=0; i<p->num_threads; i++) {
+		p->fds[i] = -1;
+		args[i] = (Wrk_Thread_Arg){ .pool = p, .ix = i, .cpus = _wrk_pinned && _wrk_cfg.pin_threads ? &_wrk_cpus[worker] : NULL };
+		if(pthread_create(&p->threads[i],NULL,wrk_thread,&args[i])!=0) {
+			elogf("Failed to start worker thread: %s",strerror(errno));
+			break;
+		}
+		started++;
+	}
+	ilogf("Worker %d started: pid=%d threads=%u",worker,getpid(),started);
+
+	// Receive connections until the server closes the channel
+	while(started>0) {
+		Wrk_Conn * c = calloc(1,sizeof(Wrk_Conn));
+		ssize_t n = net_recv_fd(fd_chan,&c->fd,&c->h,sizeof(c->h));
+		if(n<=0) {
+			if(n<0) {
+				elogf("Failed to receive connection: %s",strerror(errno));
+			}
+			free(c);
+			break;
+		}
+		if(c->fd<0 || n!=sizeof(c->h)) {
+			wlogf("Invalid connection handoff");
+			if(c->fd>=0) {
+				close(c->fd);
+			}
+			free(c);
+			continue;
+		}
+		pthread_mutex_lock(&p->lock);
+		p->received++;
+		p->queued++;
+		if(p->tail) {
+			p->tail->next = c;
+		} else {
+			p->head = c;
+		}
+		p->tail = c;
+		pthread_cond_signal(&p->cond);
+		wrk_report(p);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	ilogf("Worker %d stopping: conns=%u queued=%u",worker,p->conns,p->queued);
+	pthread_mutex_lock(&p->lock);
+	p->stopping = true;
+	pthread_cond_broadcast(&p->cond);
+	for(unsigned int i=0; i<started; i++) {
+		if(p->fds[i]>=0) {
+			// Wake up the thread serving the connection
+			shutdown(p->fds[i],SHUT_RDWR);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	for(unsigned int i=0; i<started; i++) {
+		pthread_join(p->threads[i],NULL);
+	}
+	while(p->head) {
+		Wrk_Conn * c = p->head;
+		p->head = c->next;
+		wrk_conn_done(p,c->fd);
+		free(c);
+	}
+	close(fd_chan);
+	free(p->threads);
+	free(p->fds);
+	free(args);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Server process
+
+static int wrk_start(int worker) {
+	int sv[2];
+	if(socketpair(AF_UNIX,SOCK_SEQPACKET,0,sv)<0) {
+		elogf("socketpair failed: %s",strerror(errno));
+		return -1;
+	}
+	Wrk_Stats * s = &_wrk_stats[worker];
+	Wrk_Stats prev = *s;
+	memset(s,0,sizeof(Wrk_Stats));
+	s->restarts = prev.restarts;
+	s->steered = prev.steered;
+	fflush(NULL);
+	pid_t pid = fork();
+	if(pid<0) {
+		elogf("fork failed: %s",strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if(pid==0) {
+		// Worker process; the server shuts us down by closing the channel
+		signal(SIGINT,SIG_IGN);
+		signal(SIGTERM,SIG_DFL);
+		signal(SIGCHLD,SIG_DFL);
+		close(sv[0]);
+		for(int i=0; i<_wrk_cfg.workers; i++) {
+			if(_wrk_chan[i]>=0) {
+				close(_wrk_chan[i]);
+			}
+		}
+		for(int i=0; i<_wrk_num_fds_close; i++) {
+			close(_wrk_fds_close[i]);
+		}
+		wrk_main(worker,sv[1]);
+		// Not exit(), which runs the server's exit handlers
+		fflush(NULL);
+		_exit(0);
+	}
+	close(sv[1]);
+	// Never block the acceptor on a worker
+	fcntl(sv[0],F_SETFL,fcntl(sv[0],F_GETFL)|O_NONBLOCK);
+	_wrk_chan[worker] = sv[0];
+	s->pid = pid;
+	ilogf("Started worker %d: pid=%d",worker,pid);
+	return 0;
+}
+
+static int wrk_init_cpus(void) {
+	memset(_wrk_cpu_worker,-1,sizeof(_wrk_cpu_worker));
+	_wrk_pinned = _wrk_cfg.cpus!=NULL;
+	if(!_wrk_pinned) {
+		return 0;
+	}
+	unsigned int num;
+	cpu_set_t * sets = cpu_parse_sets(_wrk_cfg.cpus,&num);
+	if(!sets) {
+		errno = EINVAL;
+		return -1;
+	}
+	for(int i=0; i<_wrk_cfg.workers; i++) {
+		if(num==1) {
+			// One CPU each
+			CPU_ZERO(&_wrk_cpus[i]);
+			CPU_SET(cpu_nth(&sets[0],i),&_wrk_cpus[i]);
+		} else {
+			_wrk_cpus[i] = sets[i % num];
+		}
+		for(int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+			if(CPU_ISSET(cpu,&_wrk_cpus[i]) && _wrk_cpu_worker[cpu]<0) {
+				_wrk_cpu_worker[cpu] = i;
+			}
+		}
+	}
+	free(sets);
+	return 0;
+}
+
+int wrk_init(const Wrk_Config * cfg, Wrk_Serve_Fn serve, const int * fds_close, int num_fds_close) {
+	if(cfg->workers==0 || cfg->workers>WRK_MAX_WORKERS) {
+		elogf("Number of workers must be between 1 and %d",WRK_MAX_WORKERS);
+		errno = EINVAL;
+		return -1;
+	}
+	_wrk_cfg = *cfg;
+	if(_wrk_cfg.threads==0) {
+		_wrk_cfg.threads = WRK_DEFAULT_THREADS;
+	}
+	_wrk_serve = serve;
+	_wrk_stopping = false;
+	free(_wrk_fds_close);
+	_wrk_fds_close = malloc((num_fds_close+1)*sizeof(int));
+	memcpy(_wrk_fds_close,fds_close,num_fds_close*sizeof(int));
+	_wrk_num_fds_close = num_fds_close;
+	if(!_wrk_stats) {
+		// Placed in shared memory, so that workers can report their stats
+		void * shared = mmap(NULL,WRK_MAX_WORKERS*sizeof(Wrk_Stats),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+		if(shared==MAP_FAILED) {
+			elogf("mmap failed: %s",strerror(errno));
+			return -1;
+		}
+		_wrk_stats = shared;
+	}
+	memset(_wrk_stats,0,WRK_MAX_WORKERS*sizeof(Wrk_Stats));
+	for(int i=0; i<WRK_MAX_WORKERS; i++) {
+		_wrk_chan[i] = -1;
+	}
+	if(wrk_init_cpus()!=0) {
+		elogf("Invalid worker CPU lists: %s",_wrk_cfg.cpus);
+		return -1;
+	}
+	ilogf("Starting %u workers with %u threads each",_wrk_cfg.workers,_wrk_cfg.threads);
+	for(int i=0; i<_wrk_cfg.workers; i++) {
+		if(wrk_start(i)<0) {
+			wrk_shutdown();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+bool wrk_enabled(void) {
+	return _wrk_serve!=NULL;
+}
+
+// Connections a worker has yet to finish, as far as we know
+static uint64_t wrk_load(const Wrk_Stats * s) {
+	uint64_t in_transit = s->handed - s->received;
+	return s->conns + s->queued + in_transit;
+}
+
+int wrk_dispatch(int fd, const struct sockaddr * client_addr, socklen_t client_addr_len, bool tls, uint64_t t_accept_ns) {
+	Wrk_Handoff h = { .t_accept_ns = t_accept_ns, .tls = tls };
+	if(client_addr && client_addr_len<=sizeof(h.client_addr)) {
+		memcpy(&h.client_addr,client_addr,client_addr_len);
+		h.client_addr_len = client_addr_len;
+	}
+	unsigned int n = _wrk_cfg.workers;
+	bool tried[WRK_MAX_WORKERS] = { false };
+	// The worker pinned to the CPU that received the connection keeps its
+	// data in that CPU's caches, as long as the worker has a thread to spare
+	int steer = -1;
+	if(_wrk_cfg.steer) {
+		int cpu = net_incoming_cpu(fd);
+		if(cpu>=0 && cpu<CPU_SETSIZE && (steer = _wrk_cpu_worker[cpu])>=0
+			&& (_wrk_chan[steer]<0 || wrk_load(&_wrk_stats[steer])>=_wrk_cfg.threads)) {
+			steer = -1;
+		}
+	}
+	for(unsigned int attempt=0; attempt<n; attempt++) {
+		// Least loaded first; fewest waiting for a thread breaks ties, and
+		// then round-robin
+		int best = attempt==0 ? steer : -1;
+		for(unsigned int k=0; k<n && !(attempt==0 && steer>=0); k++) {
+			int i = (_wrk_next + k) % n;
+			const Wrk_Stats * s = &_wrk_stats[i];
+			if(tried[i] || _wrk_chan[i]<0) {
+				continue;
+			}
+			if(best<0 || wrk_load(s)<wrk_load(&_wrk_stats[best])
+				|| (wrk_load(s)==wrk_load(&_wrk_stats[best]) && s->queued<_wrk_stats[best].queued)) {
+				best = i;
+			}
+		}
+		if(best<0) {
+			break;
+		}
+		tried[best] = true;
+		if(net_send_fd(_wrk_chan[best],fd,&h,sizeof(h))==0) {
+			_wrk_stats[best].handed++;
+			if(best==steer) {
+				_wrk_stats[best].steered++;
+			}
+			_wrk_next = (best + 1) % n;
+			dlogf("Handed connection to worker %d: load=%llu",best,(unsigned long long)wrk_load(&_wrk_stats[best]));
+			return 0;
+		}
+		wlogf("Failed to hand connection to worker %d: %s",best,strerror(errno));
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+int wrk_fd_set(fd_set * fds, int fd_max) {
+	for(int i=0; i<_wrk_cfg.workers; i++) {
+		if(_wrk_chan[i]>=0) {
+			FD_SET(_wrk_chan[i],fds);
+			fd_max = _wrk_chan[i]>fd_max ? _wrk_chan[i] : fd_max;
+		}
+	}
+	return fd_max;
+}
+
+void wrk_process(const fd_set * fds) {
+	for(int i=0; i<_wrk_cfg.workers; i++) {
+		if(_wrk_chan[i]<0 || !FD_ISSET(_wrk_chan[i],fds)) {
+			continue;
+		}
+		Wrk_Load load;
+		ssize_t n;
+		while((n = recv(_wrk_chan[i],&load,sizeof(load),MSG_DONTWAIT))==sizeof(load)) {
+			Wrk_Stats * s = &_wrk_stats[i];
+			s->received = load.received;
+			s->conns = load.conns;
+			s->queued = load.queued;
+		}
+		if(n==0 || (n<0 && errno!=EAGAIN && errno!=EINTR)) {
+			// The worker has gone away; it's restarted once it is reaped
+			wlogf("Lost worker %d",i);
+			close(_wrk_chan[i]);
+			_wrk_chan[i] = -1;
+		}
+	}
+}
+
+bool wrk_reaped(pid_t pid) {
+	if(!_wrk_stats || pid<=0) {
+		return false;
+	}
+	for(int i=0; i<_wrk_cfg.workers; i++) {
+		Wrk_Stats * s = &_wrk_stats[i];
+		if(s->pid!=pid) {
+			continue;
+		}
+		// The worker's connections are gone with it
+		uint64_t unfinished = s->handed - ATOMIC_GET(s->finished);
+		wlogf("Worker %d (pid=%d) terminated with %llu connections",i,pid,(unsigned long long)unfinished);
+		for(uint64_t k=0; k<unfinished; k++) {
+			adm_conn_close();
+		}
+		if(_wrk_chan[i]>=0) {
+			close(_wrk_chan[i]);
+			_wrk_chan[i] = -1;
+		}
+		s->pid = 0;
+		if(!_wrk_stopping) {
+			s->restarts++;
+			wrk_start(i);
+		}
+		return true;
+	}
+	return false;
+}
+
+void wrk_shutdown(void) {
+	if(!_wrk_stats) {
+		return;
+	}
+	_wrk_stopping = true;
+	for(int i=0; i<_wrk_cfg.workers; i++) {
+		if(_wrk_chan[i]>=0) {
+			close(_wrk_chan[i]);
+			_wrk_chan[i] = -1;
+		}
+	}
+	uint64_t deadline = tm_now_ns() + WRK_STOP_TIMEOUT_MS*1000000ULL;
+	for(int i=0; i<_wrk_cfg.workers; i++) {
+		pid_t pid = _wrk_stats[i].pid;
+		if(pid<=0) {
+			continue;
+		}
+		int status;
+		pid_t rc;
+		while((rc = waitpid(pid,&status,WNOHANG))==0 && tm_now_ns()<deadline) {
+			usleep(10000);
+		}
+		if(rc==0) {
+			wlogf("Worker %d (pid=%d) did not stop; killing it",i,pid);
+			kill(pid,SIGKILL);
+			waitpid(pid,&status,0);
+		}
+		ilogf("Worker %d (pid=%d) stopped",i,pid);
+		_wrk_stats[i].pid = 0;
+	}
+	_wrk_serve = NULL;
+}
+
+void wrk_get_stats(int worker, Wrk_Stats * stats) {
+	memset(stats,0,sizeof(Wrk_Stats));
+	if(_wrk_stats && worker>=0 && worker<WRK_MAX_WORKERS) {
+		*stats = _wrk_stats[worker];
+		stats->finished = ATOMIC_GET(_wrk_stats[worker].finished);
+	}
+}
+
+void wrk_dump_stats(FILE * fp) {
+	if(!_wrk_stats) {
+		return;
+	}
+	for(int i=0; i<_wrk_cfg.workers; i++) {
+		Wrk_Stats s;
+		wrk_get_stats(i,&s);
+		fprintf(fp,"worker_%d_pid %d\n",i,(int)s.pid);
+		fprintf(fp,"worker_%d_conns %u\n",i,s.conns);
+		fprintf(fp,"worker_%d_queued %u\n",i,s.queued);
+		fprintf(fp,"worker_%d_handed %llu\n",i,(unsigned long long)s.handed);
+		fprintf(fp,"worker_%d_restarts %llu\n",i,(unsigned long long)s.restarts);
+		fprintf(fp,"worker_%d_steered %llu\n",i,(unsigned long long)s.steered);
+	}
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include "ut.h"
+
+// Wait for a byte from the client, then answer
+static void test_wrk_serve(int fd, const struct sockaddr * client_addr, bool tls) {
+	char ch;
+	if(read(fd,&ch,1)==1) {
+		ssize_t n = write(fd,"ok",2);
+		(void)n;
+	}
+}
+
+// Process load reports until the workers report the given number of connections
+static bool test_wrk_wait_conns(uint32_t conns) {
+	uint64_t deadline = tm_now_ns() + 2000000000ULL;
+	while(tm_now_ns()<deadline) {
+		uint32_t total = 0;
+		for(int i=0; i<_wrk_cfg.workers; i++) {
+			total += _wrk_stats[i].conns;
+		}
+		if(total==conns) {
+			return true;
+		}
+		fd_set fds;
+		FD_ZERO(&fds);
+		int fd_max = wrk_fd_set(&fds,0);
+		struct timeval timeout = { .tv_sec = 0, .tv_usec = 10000 };
+		if(select(fd_max+1,&fds,NULL,NULL,&timeout)>0) {
+			wrk_process(&fds);
+		}
+	}
+	return false;
+}
+
+UT_TEST_CASE(wrk_dispatch) {
+	Wrk_Config cfg = { .workers = 2, .threads = 1 };
+	ut_assert(wrk_init(&cfg,test_wrk_serve,NULL,0)==0);
+	ut_assert(wrk_enabled());
+
+	int c1[2];
+	int c2[2];
+	ut_assert(socketpair(AF_UNIX,SOCK_STREAM,0,c1)==0);
+	ut_assert(socketpair(AF_UNIX,SOCK_STREAM,0,c2)==0);
+	ut_assert(wrk_dispatch(c1[1],NULL,0,false,tm_now_ns())==0);
+	close(c1[1]);
+	ut_assert(test_wrk_wait_conns(1));
+	// The other worker is less loaded
+	ut_assert(wrk_dispatch(c2[1],NULL,0,false,tm_now_ns())==0);
+	close(c2[1]);
+	ut_assert(test_wrk_wait_conns(2));
+	Wrk_Stats s0, s1;
+	wrk_get_stats(0,&s0);
+	wrk_get_stats(1,&s1);
+	ut_assert(s0.handed==1 && s1.handed==1);
+	ut_assert(s0.conns==1 && s1.conns==1);
+
+	char buff[2];
+	ut_assert(write(c1[0],"x",1)==1);
+	ut_assert(read(c1[0],buff,2)==2 && memcmp(buff,"ok",2)==0);
+	ut_assert(write(c2[0],"x",1)==1);
+	ut_assert(read(c2[0],buff,2)==2 && memcmp(buff,"ok",2)==0);
+	ut_assert(test_wrk_wait_conns(0));
+	close(c1[0]);
+	close(c2[0]);
+
+	// A worker that dies is restarted
+	wrk_get_stats(0,&s0);
+	ut_assert(s0.finished==1);
+	ut_assert(kill(s0.pid,SIGKILL)==0);
+	int status;
+	ut_assert(waitpid(s0.pid,&status,0)==s0.pid);
+	ut_assert(wrk_reaped(s0.pid));
+	ut_assert(!wrk_reaped(1));
+	wrk_get_stats(0,&s0);
+	ut_assert(s0.pid>0 && s0.restarts==1 && s0.handed==0);
+
+	wrk_shutdown();
+	ut_assert(!wrk_enabled());
+	wrk_get_stats(0,&s0);
+	ut_assert(s0.pid==0);
+}
+
+UT_TEST_CASE(wrk_shutdown_active) {
+	// Workers close the connections they serve when they are stopped
+	Wrk_Config cfg = { .workers = 1, .threads = 2 };
+	ut_assert(wrk_init(&cfg,test_wrk_serve,NULL,0)==0);
+	int c[2];
+	ut_assert(socketpair(AF_UNIX,SOCK_STREAM,0,c)==0);
+	ut_assert(wrk_dispatch(c[1],NULL,0,false,tm_now_ns())==0);
+	close(c[1]);
+	ut_assert(test_wrk_wait_conns(1));
+	wrk_shutdown();
+	char ch;
+	ut_assert(read(c[0],&ch,1)==0);
+	close(c[0]);
+	ut_assert(wrk_dispatch(0,NULL,0,false,0)<0);
+}
+
+static int test_wrk_accept_tcp(int fd_listen, int * fd_client) {
+	*fd_client = net_connect_tcp(net_atoipv4("127.0.0.1"),net_local_port(fd_listen));
+	int fd;
+	while((fd = accept(fd_listen,NULL,NULL))<0 && errno==EAGAIN) {
+		usleep(1000);
+	}
+	return fd;
+}
+
+UT_TEST_CASE(wrk_steer) {
+	// Both workers on the first CPU we may run on (a cpuset may leave out
+	// CPU 0), which has worker 0's connections steered to it
+	cpu_set_t cpus_test, cpu_one;
+	ut_assert(pthread_getaffinity_np(pthread_self(),sizeof(cpus_test),&cpus_test)==0);
+	int cpu = cpu_nth(&cpus_test,0);
+	char cpus[16];
+	snprintf(cpus,sizeof(cpus),"%d",cpu);
+	Wrk_Config cfg = { .workers = 2, .threads = 1, .cpus = cpus, .pin_threads = true, .steer = true };
+	ut_assert(wrk_init(&cfg,test_wrk_serve,NULL,0)==0);
+	int fd_listen = net_listen_tcp(net_atoipv4("127.0.0.1"),0,2);
+	ut_assert(fd_listen>=0);
+	// A loopback connection is received on the CPU that connects
+	CPU_ZERO(&cpu_one);
+	CPU_SET(cpu,&cpu_one);
+	ut_assert(cpu_pin_thread(pthread_self(),&cpu_one)==0);
+	int c1, c2;
+	int s1 = test_wrk_accept_tcp(fd_listen,&c1);
+	ut_assert(s1>=0 && c1>=0);
+	ut_assert(wrk_dispatch(s1,NULL,0,false,tm_now_ns())==0);
+	close(s1);
+	Wrk_Stats s0;
+	wrk_get_stats(0,&s0);
+	ut_assert(s0.handed==1 && s0.steered==1);
+	ut_assert(test_wrk_wait_conns(1));
+
+	// Worker 0 has no thread to spare
+	int s2 = test_wrk_accept_tcp(fd_listen,&c2);
+	ut_assert(s2>=0 && c2>=0);
+	ut_assert(wrk_dispatch(s2,NULL,0,false,tm_now_ns())==0);
+	close(s2);
+	wrk_get_stats(0,&s0);
+	ut_assert(s0.handed==1 && s0.steered==1);
+	Wrk_Stats s1_stats;
+	wrk_get_stats(1,&s1_stats);
+	ut_assert(s1_stats.handed==1 && s1_stats.steered==0);
+
+	char buff[2];
+	ut_assert(write(c1,"x",1)==1);
+	ut_assert(read(c1,buff,2)==2 && memcmp(buff,"ok",2)==0);
+	close(c1);
+	close(c2);
+	close(fd_listen);
+	wrk_shutdown();
+	ut_assert(cpu_pin_thread(pthread_self(),&cpus_test)==0);
+
+	cfg.cpus = "0:x";
+	ut_assert(wrk_init(&cfg,test_wrk_serve,NULL,0)<0);
+}
+
+#endif // !EXCLUDE_UNIT_TESTS
@@ -0,0 +1,91 @@
+// Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
+#ifndef __WRK_H__
+#define __WRK_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+
+// Long-lived worker processes. The server process accepts connections and
+// hands them to the least loaded worker over a Unix socketpair (SCM_RIGHTS).
+// Each worker serves its connections with a pool of threads, and reports its
+// load (connections being served and connections waiting for a thread) back
+// over the same socketpair. Workers can be pinned to CPUs, in which case they
+// allocate memory on their local NUMA node, and connections can be steered to
+// the worker pinned to the CPU that received them.
+
+#define WRK_MAX_WORKERS 64
+#define WRK_DEFAULT_THREADS 64
+
+/*! \brief Called in each worker process as it starts (and restarts), before
+ *         it is handed any connections.
+ */
+typedef void (*Wrk_Init_Fn)(int worker);
+
+typedef struct {
+	unsigned int workers;  // number of worker processes
+	unsigned int threads;  // threads per worker, i.e. max connections served at once; 0 selects a default
+	const char * cpus;     // CPU lists separated by ':', one per worker (e.g. "0-3:4-7"), or a single
+	                       // list to pin each worker to one of its CPUs; NULL if workers are not pinned
+	bool pin_threads;      // pin each worker thread to one of its worker's CPUs
+	bool steer;            // prefer the worker pinned to the CPU that received the connection
+	Wrk_Init_Fn init;      // NULL if the workers need no set up of their own
+} Wrk_Config;
+
+/*! \brief Serves a connection, in a worker thread. The worker closes the
+ *         connection once this returns.
+ */
+typedef void (*Wrk_Serve_Fn)(int fd, const struct sockaddr * client_addr, bool tls);
+
+typedef struct {
+	pid_t pid;          // 0 if the worker is not running
+	uint64_t handed;    // connections handed to this worker
+	uint64_t received;  // connections received by the worker (as last reported)
+	uint32_t conns;     // connections being served (as last reported)
+	uint32_t queued;    // connections waiting for a thread (as last reported)
+	uint64_t finished;  // connections the worker is done with (maintained by the worker itself)
+	uint64_t restarts;
+	uint64_t steered;   // connections handed to this worker because it is pinned to their incoming CPU
+} Wrk_Stats;
+
+/*! \brief Start the worker processes. Must be called after the other
+ *         subsystems have been initialized, since the workers inherit them.
+ *
+ * \param fds_close File descriptors (listening sockets) that the workers must close.
+ * \return Returns 0 if initialized successfully, non-zero if something went wrong.
+ */
+int wrk_init(const Wrk_Config * cfg, Wrk_Serve_Fn serve, const int * fds_close, int num_fds_close);
+
+/*! \brief Are workers in use? */
+bool wrk_enabled(void);
+
+/*! \brief Hand an accepted (and admitted) connection to the least loaded
+ *         worker. The caller still owns (and must close) its copy of fd.
+ *  \return 0 if successful, or -1 if no worker could take the connection.
+ */
+int wrk_dispatch(int fd, const struct sockaddr * client_addr, socklen_t client_addr_len, bool tls, uint64_t t_accept_ns);
+
+/*! \brief Add the worker channels to a select(2) set.
+ *  \return The highest file descriptor in the set.
+ */
+int wrk_fd_set(fd_set * fds, int fd_max);
+
+/*! \brief Process load reports from workers whose channels are ready. */
+void wrk_process(const fd_set * fds);
+
+/*! \brief Called when a child process has terminated. If it was a worker, the
+ *         connections it held are accounted for, and the worker is restarted.
+ *  \return true if the child was a worker.
+ */
+bool wrk_reaped(pid_t pid);
+
+/*! \brief Stop the workers, closing the connections they serve. */
+void wrk_shutdown(void);
+
+void wrk_get_stats(int worker, Wrk_Stats * stats);
+void wrk_dump_stats(FILE * fp);
+
+#endif // __WRK_H__
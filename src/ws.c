@@ -1,7 +1,14 @@
 // Copyright (c) 2024 Thomas Mikalsen. Subject to the MIT License 
-#include <openssl/sha.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "endian.h"
 
@@ -13,17 +20,25 @@
 #include "io.h"
 #include "math.h"
 #include "mem.h"
+#include "arena.h"
+#include "slab.h"
+#include "codec.h"
+#include "sha1.h"
+#include "tm.h"
+#include "trace.h"
 
 // https://tools.ietf.org/html/rfc6455
 
 // Header names
-static const char * H_SEC_WEBSOCKET_KEY    = "sec-websocket-key";
-static const char * H_SEC_WEBSOCKET_EXT    = "sec-websocket-extensions";
-static const char * H_SEC_WEBSOCKET_ACCEPT = "sec-websocket-accept";
+static const char * H_SEC_WEBSOCKET_KEY     = "sec-websocket-key";
+static const char * H_SEC_WEBSOCKET_EXT     = "sec-websocket-extensions";
+static const char * H_SEC_WEBSOCKET_PROTOCOL = "sec-websocket-protocol";
+static const char * H_SEC_WEBSOCKET_VERSION = "sec-websocket-version";
 
 // Other constants
 static const char * WS_UPGRADE = "websocket";
 static const char * WS_MAGIC   = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char * WS_VERSION = "13";
 
 typedef enum {
 	OC_CONT  = 0x0,
@@ -56,15 +71,16 @@ struct Data_Frame_Header_S {
 	unsigned char mask:1;
 };
 
-// Allocate (or re-allocate) a Data Frame
+// Allocate (or re-allocate) a Data Frame, from the pooled buffers. The payload
+// of a re-allocated frame is not kept.
 static Data_Frame alloc_dataframe(char opcode, bool fin, uint64_t len, Data_Frame df) {
 	uint64_t size = sizeof(struct Data_Frame_S) + len;
-	if(df==NULL) {
-		df = malloc(size);
-		df->size = size;
-	} else if(df->size < size) {
-		df = realloc(df, size);
-		df->size = size;
+	if(df==NULL || df->size < size) {
+		slab_free(df);
+		if(!(df = slab_alloc(size))) {
+			return NULL;
+		}
+		df->size = slab_size(df);
 	}
 	df->opcode = opcode;
 	df->fin = fin;
@@ -73,7 +89,7 @@ static Data_Frame alloc_dataframe(char opcode, bool fin, uint64_t len, Data_Fram
 }
 
 static void free_dataframe(Data_Frame df) {
-	free(df);
+	slab_free(df);
 }
 /*! \brief Read a Websocket data frame
  *
@@ -158,7 +174,10 @@ static Data_Frame read_dataframe(FILE * f, bool require_masked, Data_Frame df) {
 			fprintf(stdlog,"\n");
 		}
 	}
-	df = alloc_dataframe(dfh.opcode,dfh.fin,len64,df);
+	if(!(df = alloc_dataframe(dfh.opcode,dfh.fin,len64,df))) {
+		wlogf("Failed to allocate data frame: len=%llu",len64);
+		return NULL;
+	}
 	// (4) Read payload
 	if(len64>0) {
 		if(fread(df->payload,len64,1,f)!=1) {
@@ -186,13 +205,49 @@ static Data_Frame read_dataframe(FILE * f, bool require_masked, Data_Frame df) {
 	return df;
 
 on_error:
-	if(df) {
-		free(df);
-	}
+	free_dataframe(df);
 	return NULL;
 
 }
 
+/*! \brief Parse a data frame header from the len bytes at p.
+ *  \param payload_len Set to the payload length.
+ *  \return The header length (including the masking key), 0 if p doesn't hold
+ *          the whole header yet, or -1 if the header is invalid.
+ */
+static int parse_dataframe_header(const unsigned char * p, size_t len, bool require_masked, uint64_t * payload_len) {
+	struct Data_Frame_Header_S dfh;
+	if(len < sizeof(dfh)) {
+		return 0;
+	}
+	memcpy(&dfh,p,sizeof(dfh));
+	if(!dfh.mask && require_masked) {
+		wlogf("Unexpected mask bit in data frame header");
+		return -1;
+	}
+	size_t hdr_len = sizeof(dfh) + (dfh.len==127 ? 8 : dfh.len==126 ? 2 : 0) + (dfh.mask ? 4 : 0);
+	if(len < hdr_len) {
+		return 0;
+	}
+	if(dfh.len==127) {
+		uint64_t len64;
+		memcpy(&len64,p+sizeof(dfh),sizeof(len64));
+		len64 = be64toh(len64);
+		if(len64 & ((uint64_t)1<<63)) {
+			wlogf("Expected 64-bit payload length most significant bit to be zero");
+			return -1;
+		}
+		*payload_len = len64;
+	} else if(dfh.len==126) {
+		uint16_t len16;
+		memcpy(&len16,p+sizeof(dfh),sizeof(len16));
+		*payload_len = be16toh(len16);
+	} else {
+		*payload_len = dfh.len;
+	}
+	return hdr_len;
+}
+
 static bool write_dataframe(FILE * f, const Data_Frame df, unsigned char * mask_key) {
 	ilogf("Sending dataframe: opcode=0x%x, len=%llu", df->opcode, df->len);
 
@@ -280,6 +335,25 @@ static bool write_dataframe(FILE * f, const Data_Frame df, unsigned char * mask_
 	return true;
 }
 
+// Encode an unmasked frame header (as the server sends), returning its length
+static size_t encode_dataframe_header(unsigned char hdr[WS_MAX_HEADER_LEN], char opcode, bool fin, uint64_t len) {
+	hdr[0] = (fin ? 0x80 : 0) | opcode;
+	if(len<=125) {
+		hdr[1] = len;
+		return 2;
+	}
+	if(len<=0xffff) {
+		uint16_t len16 = htobe16((uint16_t)len);
+		hdr[1] = 126;
+		memcpy(hdr+2,&len16,sizeof(len16));
+		return 4;
+	}
+	uint64_t len64 = htobe64(len);
+	hdr[1] = 127;
+	memcpy(hdr+2,&len64,sizeof(len64));
+	return 10;
+}
+
 /*! \brief Read a data frame from the given file. 
  *
  *  \param f The file from which to read the data frame
@@ -291,189 +365,716 @@ static bool write_dataframe(FILE * f, const Data_Frame df, unsigned char * mask_
  *   \return Returns point to the data frame, or NULL if something bad happened.
  */
 
-bool _ws_handshake(
-		FILE * f_out, 
-		const Http_Headers headers) {
-	ilogf("performing websocket handshake");
+// The 101 response up to the accept key, and what follows it
+#define WS_101_PREFIX \
+	"HTTP/1.1 101 Switching Protocols\r\n" \
+	"connection: upgrade\r\n" \
+	"upgrade: websocket\r\n" \
+	"sec-websocket-accept: "
+#define WS_101_SUFFIX "\r\n\r\n"
+#define WS_101_PROTOCOL "\r\nsec-websocket-protocol: "
+#define WS_KEY_LEN    16 // bytes, before base64 encoding
+#define WS_ACCEPT_LEN CODEC_B64_LEN(SHA1_DIGEST_LEN)
+
+static const char WS_400[] =
+	"HTTP/1.1 400 Bad Request\r\n"
+	"content-length: 0\r\n"
+	"connection: close\r\n\r\n";
+static const char WS_426[] =
+	"HTTP/1.1 426 Upgrade Required\r\n"
+	"sec-websocket-version: 13\r\n"
+	"content-length: 0\r\n"
+	"connection: close\r\n\r\n";
+
+// Subprotocols we accept, in order of preference (see ws_set_protocols)
+static const char * const * _ws_protocols;
+
+/*! \brief Whether the comma-separated list sz contains token (ignoring case and whitespace). */
+static bool _ws_has_token(const char * sz, const char * token) {
+	size_t token_len = strlen(token);
+	while(sz && *sz) {
+		while(*sz==' ' || *sz=='\t' || *sz==',') {
+			sz++;
+		}
+		const char * end = strchr(sz,',');
+		size_t len = end ? (size_t)(end - sz) : strlen(sz);
+		while(len>0 && (sz[len-1]==' ' || sz[len-1]=='\t')) {
+			len--;
+		}
+		if(len==token_len && strncasecmp(sz,token,len)==0) {
+			return true;
+		}
+		sz = end;
+	}
+	return false;
+}
+
+/*! \brief Validate an upgrade request.
+ *  \return 0 if the handshake can go ahead, or the HTTP status to reject it with.
+ */
+static int _ws_check_handshake(const Http_Headers headers) {
 	if(!sz_equal_ignore_case(WS_UPGRADE,ht_get(headers,H_UPGRADE))) {
 		wlogf("not a websocket request");
-		return false;
+		return 400;
+	}
+	if(!_ws_has_token(ht_get(headers,H_CONNECTION),H_UPGRADE)) {
+		wlogf("no upgrade token in connection header");
+		return 400;
+	}
+	const char * ws_version = ht_get(headers,H_SEC_WEBSOCKET_VERSION);
+	if(!sz_equal(ws_version,WS_VERSION)) {
+		wlogf("unsupported websocket version: %s",ws_version?ws_version:"<NULL>");
+		return 426;
 	}
 	const char * ws_key = ht_get(headers,H_SEC_WEBSOCKET_KEY);
-	const char * ws_ext = ht_get(headers,H_SEC_WEBSOCKET_EXT);
-	if(!ws_key) {
-		wlogf("websocket security key not found in headers");
-		return false;
+	unsigned char key[CODEC_B64_DECODED_MAX(CODEC_B64_LEN(WS_KEY_LEN))];
+	if(!ws_key || strlen(ws_key)!=CODEC_B64_LEN(WS_KEY_LEN) ||
+			codec_b64_decode(key,ws_key,CODEC_B64_LEN(WS_KEY_LEN))!=WS_KEY_LEN) {
+		wlogf("invalid websocket key: %s",ws_key?ws_key:"<NULL>");
+		return 400;
 	}
-	dlogf("ws_ext: %s", ws_ext?ws_ext:"<NULL>");
-	ilogf("switching protocols");
-	fprintf(f_out,"HTTP/1.1 101 Switching Protocols\r\n");
-	fprintf(f_out,"%s: %s\r\n",H_CONNECTION,H_UPGRADE);
-	fprintf(f_out,"%s: %s\r\n",H_UPGRADE,WS_UPGRADE);
-	fprintf(f_out,"%s: ",H_SEC_WEBSOCKET_ACCEPT);
-	char * ws_accept = sz_cat(ws_key,WS_MAGIC);
-	dlogf("ws_accept: %s",ws_accept);
-	unsigned char hash[SHA_DIGEST_LENGTH];
-	SHA1((unsigned char *)ws_accept, strlen(ws_accept), hash);
-	free(ws_accept);
+	return 0;
+}
+
+/*! \brief The accept key for ws_key: base64(SHA-1(ws_key + WS_MAGIC)). */
+static void _ws_accept_key(char accept[WS_ACCEPT_LEN], const char * ws_key) {
+	Sha1_Ctx ctx;
+	unsigned char hash[SHA1_DIGEST_LEN];
+	sha1_init(&ctx);
+	sha1_update(&ctx,ws_key,strlen(ws_key));
+	sha1_update(&ctx,WS_MAGIC,strlen(WS_MAGIC));
+	sha1_final(&ctx,hash);
+	codec_b64_encode(accept,hash,SHA1_DIGEST_LEN);
 	if(logging(LEVEL_DEBUG)) {
-		dlogf("hash: ");
-		io_encode_hex(stdlog,hash,SHA_DIGEST_LENGTH);
-		fprintf(stdlog,"\n");
+		char hash_hex[CODEC_HEX_LEN(SHA1_DIGEST_LEN)+1];
+		hash_hex[codec_hex_encode(hash_hex,hash,SHA1_DIGEST_LEN)] = '\0';
+		dlogf("hash: %s",hash_hex);
+		dlogf("base64: %.*s",(int)WS_ACCEPT_LEN,accept);
 	}
-	io_encode_b64(f_out,hash,SHA_DIGEST_LENGTH);
-	if(logging(LEVEL_DEBUG)) {
-		dlogf("base64:");
-		io_encode_b64(stdlog, hash, SHA_DIGEST_LENGTH);
-		fprintf(stdlog,"\n");
+}
+
+/*! \brief Validate the upgrade request and send the 101 response, or reject the
+ *         request with a 400 (or a 426 if the websocket version isn't 13).
+ *         The response is built on the stack and sent with a single write.
+ *  \param protocol Set to the subprotocol chosen from those the client
+ *         offered, or NULL.
+ */
+bool _ws_handshake(
+		FILE * f_out, 
+		const Http_Headers headers,
+		const char ** protocol) {
+	*protocol = NULL;
+	dlogf("performing websocket handshake");
+	int status = _ws_check_handshake(headers);
+	if(status!=0) {
+		if(status==426) {
+			fwrite(WS_426,1,sizeof(WS_426)-1,f_out);
+		} else {
+			fwrite(WS_400,1,sizeof(WS_400)-1,f_out);
+		}
+		fflush(f_out);
+		return false;
 	}
-	fprintf(f_out,"\r\n\r\n");
-	fflush(f_out);
-	return true;
+	dlogf("ws_ext: %s", ht_get(headers,H_SEC_WEBSOCKET_EXT)?:"<NULL>");
+	dlogf("switching protocols");
+	const char * offered = ht_get(headers,H_SEC_WEBSOCKET_PROTOCOL);
+	for(const char * const * pp=_ws_protocols; offered && pp && *pp; pp++) {
+		if(_ws_has_token(offered,*pp)) {
+			*protocol = *pp;
+			break;
+		}
+	}
+	char response[sizeof(WS_101_PREFIX)-1 + WS_ACCEPT_LEN +
+		sizeof(WS_101_PROTOCOL)-1 + WS_MAX_PROTOCOL_LEN + sizeof(WS_101_SUFFIX)-1];
+	char * p = response;
+	memcpy(p,WS_101_PREFIX,sizeof(WS_101_PREFIX)-1);
+	p += sizeof(WS_101_PREFIX)-1;
+	_ws_accept_key(p,ht_get(headers,H_SEC_WEBSOCKET_KEY));
+	p += WS_ACCEPT_LEN;
+	if(*protocol) {
+		dlogf("subprotocol: %s",*protocol);
+		memcpy(p,WS_101_PROTOCOL,sizeof(WS_101_PROTOCOL)-1);
+		p += sizeof(WS_101_PROTOCOL)-1;
+		size_t len = strlen(*protocol);
+		memcpy(p,*protocol,len);
+		p += len;
+	}
+	memcpy(p,WS_101_SUFFIX,sizeof(WS_101_SUFFIX)-1);
+	p += sizeof(WS_101_SUFFIX)-1;
+	size_t len = p - response;
+	return fwrite(response,1,len,f_out)==len && fflush(f_out)==0;
 }
 
+// A message in an outbound queue
+typedef struct WS_Out_Msg_S {
+	struct WS_Out_Msg_S * next;
+	char opcode;
+	size_t len;
+	size_t framed;           // payload bytes handed to fragments so far
+	unsigned char data[];
+} WS_Out_Msg;
+
+typedef struct {
+	WS_Out_Msg * head, * tail;
+	uint64_t pass;           // virtual time at which the class is next due
+} WS_Out_Class;
+
+// A frame being written from a queue, perhaps a few bytes at a time
+typedef struct {
+	unsigned char hdr[WS_MAX_HEADER_LEN];
+	size_t hdr_len;
+	const unsigned char * payload;
+	size_t len;              // header and payload
+	size_t off;              // bytes written
+	WS_Out_Msg * done;       // freed once the frame is written
+} WS_Fragment;
+
 struct Websocket_S {
-	int fd_client;
+	Arena * arena;   // if set, the websocket is allocated from this arena
+	int fd_client;   // the socket, while registered with a poller
 	FILE * f_in;
 	FILE * f_out;
 	bool is_masked_client;
+	const char * protocol; // the subprotocol, or NULL
 	Data_Frame df;
-	unsigned char * buff;
+	unsigned char * buff;  // message reassembly, a pooled buffer
 	size_t buff_len;
+	char msg_opcode;       // opcode of the message being reassembled, or -1
 	uint16_t status_code; // reason for closure: see https://tools.ietf.org/html/rfc6455#section-7.4.1
 	uint16_t ping_recv_count;
 	uint16_t ping_sent_count;
 	uint16_t pong_recv_count;
+	// ws_poll state
+	WS_Poll poll;          // the poller this websocket is registered with, or NULL
+	void * poll_data;
+	uint32_t poll_events;  // epoll events registered, 0 once closed or failed
+	unsigned poll_batch;   // the last ws_poll_wait batch that reported this websocket
+	bool poll_eof;
+	bool poll_pending;     // queued, with a whole frame buffered
+	Websocket poll_next;   // in the pending queue
+	Websocket poll_prev_member, poll_next_member;
+	unsigned char * in;    // received but unparsed bytes are in[in_off..in_len), a pooled buffer
+	size_t in_off, in_len;
+	size_t in_need;        // size of the frame being received, once its header is in
+	bool poll_flushing;    // on the poller's list of websockets with a flush deadline
+	Websocket poll_flush_next;
+	// Coalescing (ws_set_coalesce, ws_cork)
+	unsigned char * out;   // frames not yet written, a pooled buffer
+	size_t out_len;
+	size_t coalesce_bytes; // flush once this much is buffered; 0 if not coalescing
+	uint64_t coalesce_ns;  // ... or this long after the first frame was buffered
+	uint64_t out_deadline;
+	bool corked;
+	// Outbound queues (ws_queue_msg): control frames, then WS_Priority classes
+	WS_Out_Class out_class[1 + WS_PRIO_COUNT];
+	WS_Out_Msg * sending;  // the data message being sent in fragments
+	uint64_t out_vtime;    // the pass of the class last started
+	size_t queued;         // payload bytes queued and not yet written
+	WS_Fragment frag;      // the frame being written, if frag.len>0
+	bool poll_writable;    // the application wants WS_EV_WRITABLE
+	// Recording (ws_record_start)
+	uint64_t rec_conn;     // the connection's number in the capture; 0 if not recorded
+	unsigned char * rec;   // records not yet written, a pooled buffer
+	size_t rec_len;
 };
 
+static void _ws_poll_flush_later(Websocket ws);
+static void _ws_poll_update_events(Websocket ws);
+
 static Websocket _ws_create(
 		FILE * f_in, FILE * f_out, 
-		bool masked_client) {
+		bool masked_client, const char * protocol, Arena * arena) {
 
 	// Allocate inital data frame, and send a PING
 	Data_Frame df = alloc_dataframe(OC_PING,true,0,NULL);
-	if(!write_dataframe(f_out,df,NULL)) {
+	if(!df || !write_dataframe(f_out,df,NULL)) {
 		free_dataframe(df);
 		return NULL;
 	}
 
-	Websocket ws = malloc(sizeof(struct Websocket_S));
-	ws->f_in = f_in;
-	ws->f_out = f_out;
-	ws->df = df;
-	ws->status_code = 0;
-	ws->buff = NULL;
-	ws->buff_len = 0;
-	ws->is_masked_client = masked_client;
-	// zero-out stats
-	ws->ping_recv_count = ws->pong_recv_count = 0;
+	Websocket ws = arena ? arena_alloc(arena,sizeof(struct Websocket_S)) : malloc(sizeof(struct Websocket_S));
+	*ws = (struct Websocket_S) {
+		.arena = arena,
+		.fd_client = -1,
+		.f_in = f_in,
+		.f_out = f_out,
+		.is_masked_client = masked_client,
+		.protocol = protocol,
+		.df = df,
+		.msg_opcode = -1,
+	};
 	return ws;
 }
 
+// Recording (see ws.h)
+static int _ws_rec_fd = -1;
+static size_t _ws_rec_max_payload;
+static uint64_t _ws_rec_t0;
+static uint32_t _ws_rec_count = 0;   // connections recorded by this process
+
+#define WS_REC_MAX_HEADER (2 + 4*CODEC_VARINT_MAX)
+
+// Append the websocket's records to the capture
+static void _ws_rec_flush(Websocket ws) {
+	int fd = __atomic_load_n(&_ws_rec_fd,__ATOMIC_ACQUIRE);
+	if(fd>=0 && ws->rec_len>0 && io_write_all(fd,ws->rec,ws->rec_len)!=0) {
+		wlogf("Failed to write capture; no longer recording the websocket: %s",strerror(errno));
+		ws->rec_conn = 0;
+	}
+	ws->rec_len = 0;
+}
+
+static void _ws_rec(Websocket ws, WS_Rec_Kind kind, unsigned char frame, const unsigned char * payload, size_t len) {
+	size_t captured = kind==WS_REC_OPEN ? len : min(len,_ws_rec_max_payload);
+	unsigned char * rec = slab_grow(ws->rec,ws->rec_len + WS_REC_MAX_HEADER + captured,ws->rec_len);
+	if(!rec) {
+		wlogf("Failed to allocate capture record: len=%zu",captured);
+		return;
+	}
+	ws->rec = rec;
+	unsigned char * p = rec + ws->rec_len;
+	*p++ = kind;
+	*p++ = frame;
+	p += codec_varint_put(p,ws->rec_conn);
+	p += codec_varint_put(p,tm_now_ns() - _ws_rec_t0);
+	p += codec_varint_put(p,len);
+	p += codec_varint_put(p,captured);
+	if(captured>0) {
+		memcpy(p,payload,captured);
+	}
+	ws->rec_len = p + captured - rec;
+	if(ws->rec_len>=WS_REC_FLUSH) {
+		_ws_rec_flush(ws);
+	}
+}
+
+// Start recording a websocket just upgraded (and sent its first ping)
+static void _ws_rec_open(Websocket ws, const char * uri) {
+	ws->rec_conn = (uint64_t)getpid()<<32 | __atomic_add_fetch(&_ws_rec_count,1,__ATOMIC_RELAXED);
+	size_t uri_len = strlen(uri);
+	size_t protocol_len = ws->protocol ? strlen(ws->protocol) : 0;
+	unsigned char * open = slab_alloc(uri_len + 1 + protocol_len);
+	if(!open) {
+		ws->rec_conn = 0;
+		return;
+	}
+	memcpy(open,uri,uri_len);
+	open[uri_len] = 0;
+	if(protocol_len>0) {
+		memcpy(open + uri_len + 1,ws->protocol,protocol_len);
+	}
+	_ws_rec(ws,WS_REC_OPEN,0,open,uri_len + 1 + protocol_len);
+	slab_free(open);
+	_ws_rec(ws,WS_REC_OUT,0x80 | OC_PING,NULL,0);
+}
+
+/* Write the buffered frames, and then the given frame (if any), in one writev
+ * where f_out is a file descriptor. */
+static bool _ws_write_out(Websocket ws, const unsigned char * hdr, size_t hdr_len, const unsigned char * payload, size_t len) {
+	int fd = fileno(ws->f_out);
+	bool ok;
+	if(fd<0) {
+		// A memory stream, in tests
+		ok = (ws->out_len==0 || fwrite(ws->out,ws->out_len,1,ws->f_out)==1)
+			&& (hdr_len==0 || fwrite(hdr,hdr_len,1,ws->f_out)==1)
+			&& (len==0 || fwrite(payload,len,1,ws->f_out)==1)
+			&& fflush(ws->f_out)==0;
+	} else {
+		struct iovec iov[3];
+		int iovcnt = 0;
+		if(ws->out_len>0) {
+			iov[iovcnt++] = (struct iovec) { .iov_base = ws->out, .iov_len = ws->out_len };
+		}
+		if(hdr_len>0) {
+			iov[iovcnt++] = (struct iovec) { .iov_base = (void *)hdr, .iov_len = hdr_len };
+		}
+		if(len>0) {
+			iov[iovcnt++] = (struct iovec) { .iov_base = (void *)payload, .iov_len = len };
+		}
+		ok = true;
+		for(int i=0; i<iovcnt && ok;) {
+			ssize_t n = writev(fd,iov+i,iovcnt-i);
+			if(n<0 && errno==EINTR) {
+				continue;
+			}
+			if(n<0) {
+				ok = false;
+				break;
+			}
+			// Skip what was written, which may end part way into an iovec
+			for(; i<iovcnt && (size_t)n>=iov[i].iov_len; i++) {
+				n -= iov[i].iov_len;
+			}
+			if(i<iovcnt) {
+				iov[i].iov_base = (unsigned char *)iov[i].iov_base + n;
+				iov[i].iov_len -= n;
+			}
+		}
+	}
+	if(!ok) {
+		wlogf("Failed to write data frames: %s",strerror(errno));
+	}
+	slab_free(ws->out);
+	ws->out = NULL;
+	ws->out_len = 0;
+	return ok;
+}
+
+// Outbound queues. Messages queued with ws_queue_msg are sent in fragments of
+// up to WS_FRAGMENT_LEN. Control frames go first, at the next fragment
+// boundary. The data classes share the connection by weight, with the class of
+// least virtual time ("pass") going next, and its pass advancing by the
+// message length over its weight; RFC 6455 doesn't allow the fragments of two
+// data messages to interleave, so classes take turns at message boundaries.
+
+static const unsigned _ws_prio_weight[WS_PRIO_COUNT] = {
+	[WS_PRIO_HIGH]   = 8,
+	[WS_PRIO_NORMAL] = 4,
+	[WS_PRIO_BULK]   = 1,
+};
+
+#define WS_OUT_CONTROL 0 // out_class index of the control queue
+
+static bool _ws_queue_active(Websocket ws) {
+	return ws->queued>0 || ws->frag.len>0 || ws->sending;
+}
+
+static bool _ws_enqueue(Websocket ws, int cls, char opcode, const unsigned char * msg, size_t len) {
+	WS_Out_Msg * m = slab_alloc(sizeof(WS_Out_Msg) + len);
+	if(!m) {
+		errno = ENOMEM;
+		return false;
+	}
+	*m = (WS_Out_Msg) { .opcode = opcode, .len = len };
+	memcpy(m->data,msg,len);
+	WS_Out_Class * c = &ws->out_class[cls];
+	if(c->tail) {
+		c->tail->next = m;
+	} else {
+		c->head = m;
+		// An idle class gets no credit for the time it was idle
+		c->pass = max(c->pass,ws->out_vtime);
+	}
+	c->tail = m;
+	ws->queued += len;
+	return true;
+}
+
+static WS_Out_Msg * _ws_dequeue(WS_Out_Class * c) {
+	WS_Out_Msg * m = c->head;
+	if(m) {
+		c->head = m->next;
+		if(!c->head) {
+			c->tail = NULL;
+		}
+	}
+	return m;
+}
+
+// Set up the next frame to write, returning false if nothing is queued
+static bool _ws_next_fragment(Websocket ws) {
+	WS_Fragment * f = &ws->frag;
+	WS_Out_Msg * m = _ws_dequeue(&ws->out_class[WS_OUT_CONTROL]);
+	if(m) {
+		// A control frame, whole
+		f->hdr_len = encode_dataframe_header(f->hdr,m->opcode,true,m->len);
+		f->payload = m->data;
+		f->len = f->hdr_len + m->len;
+		f->off = 0;
+		f->done = m;
+		ws->queued -= m->len;
+		TRACE3(frame_write,m->opcode,m->len,true);
+		if(ws->rec_conn) {
+			_ws_rec(ws,WS_REC_OUT,f->hdr[0],f->payload,m->len);
+		}
+		return true;
+	}
+	if(!ws->sending) {
+		WS_Out_Class * next = NULL;
+		for(int i=1; i<=WS_PRIO_COUNT; i++) {
+			WS_Out_Class * c = &ws->out_class[i];
+			if(c->head && (!next || c->pass<next->pass)) {
+				next = c;
+			}
+		}
+		if(!next) {
+			return false;
+		}
+		ws->sending = _ws_dequeue(next);
+		ws->out_vtime = next->pass;
+		next->pass += ws->sending->len/_ws_prio_weight[next - ws->out_class - 1] + 1;
+	}
+	m = ws->sending;
+	size_t n = min(m->len - m->framed,(size_t)WS_FRAGMENT_LEN);
+	bool fin = m->framed + n == m->len;
+	f->hdr_len = encode_dataframe_header(f->hdr,m->framed==0 ? m->opcode : OC_CONT,fin,n);
+	f->payload = m->data + m->framed;
+	f->len = f->hdr_len + n;
+	f->off = 0;
+	f->done = fin ? m : NULL;
+	m->framed += n;
+	ws->queued -= n;
+	TRACE3(frame_write,f->hdr[0] & 0xf,n,fin);
+	if(fin) {
+		ws->sending = NULL;
+	}
+	if(ws->rec_conn) {
+		_ws_rec(ws,WS_REC_OUT,f->hdr[0],f->payload,n);
+	}
+	return true;
+}
+
+/* Write queued frames until the queues are empty (1), or, unless block, the
+ * socket is full (0); -1 on error. */
+static int _ws_pump(Websocket ws, bool block) {
+	if(ws->out_len>0 && !ws_flush(ws)) {
+		return -1;
+	}
+	int fd = fileno(ws->f_out);
+	int rc = 1;
+	while(ws->frag.len>0 || _ws_next_fragment(ws)) {
+		WS_Fragment * f = &ws->frag;
+		size_t payload_len = f->len - f->hdr_len;
+		if(fd<0) {
+			// A memory stream, in tests
+			if(fwrite(f->hdr,f->hdr_len,1,ws->f_out)!=1
+					|| (payload_len>0 && fwrite(f->payload,payload_len,1,ws->f_out)!=1)
+					|| fflush(ws->f_out)!=0) {
+				rc = -1;
+				break;
+			}
+			f->off = f->len;
+		} else {
+			struct iovec iov[2];
+			int iovcnt = 0;
+			if(f->off<f->hdr_len) {
+				iov[iovcnt++] = (struct iovec) { .iov_base = f->hdr + f->off, .iov_len = f->hdr_len - f->off };
+			}
+			if(payload_len>0) {
+				size_t skip = f->off>f->hdr_len ? f->off - f->hdr_len : 0;
+				iov[iovcnt++] = (struct iovec) { .iov_base = (void *)(f->payload + skip), .iov_len = payload_len - skip };
+			}
+			ssize_t n;
+			if(block) {
+				n = writev(fd,iov,iovcnt);
+			} else {
+				struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+				n = sendmsg(fd,&msg,MSG_DONTWAIT);
+				if(n<0 && errno==ENOTSOCK) {
+					// A pipe (to the TLS proxy, say) is written blocking
+					n = writev(fd,iov,iovcnt);
+				}
+			}
+			if(n<0) {
+				if(errno==EINTR) {
+					continue;
+				}
+				if(errno==EAGAIN || errno==EWOULDBLOCK) {
+					rc = 0;
+				} else {
+					wlogf("Failed to write queued frames: %s",strerror(errno));
+					rc = -1;
+				}
+				break;
+			}
+			f->off += n;
+		}
+		if(f->off==f->len) {
+			slab_free(f->done);
+			*f = (WS_Fragment) { 0 };
+		}
+	}
+	if(ws->poll) {
+		_ws_poll_update_events(ws);
+	}
+	return rc;
+}
+
+// Drop whatever is still queued
+static void _ws_queue_free(Websocket ws) {
+	for(int i=0; i<=WS_PRIO_COUNT; i++) {
+		WS_Out_Msg * m;
+		while((m = _ws_dequeue(&ws->out_class[i]))) {
+			slab_free(m);
+		}
+	}
+	slab_free(ws->frag.done);
+	slab_free(ws->sending);
+	ws->sending = NULL;
+	ws->frag = (WS_Fragment) { 0 };
+	ws->queued = 0;
+}
+
+/* Send a frame, or buffer it while coalescing or corked. With flush (control
+ * frames), or once the threshold or deadline is reached, the buffered frames
+ * are written along with it. */
+static bool _ws_write_encoded(Websocket ws, char opcode, const unsigned char * hdr, size_t hdr_len,
+		const unsigned char * payload, size_t len, bool flush) {
+	if(!ws->f_out) {
+		errno = EPIPE;
+		return false;
+	}
+	dlogf("Sending dataframe: opcode=0x%x, len=%zu",opcode,len);
+	if(_ws_queue_active(ws)) {
+		// Behind what's queued; control frames (flush) at the next fragment boundary
+		if(!_ws_enqueue(ws,flush ? WS_OUT_CONTROL : 1 + WS_PRIO_NORMAL,opcode,payload,len)) {
+			return false;
+		}
+		return _ws_pump(ws,false)>=0;
+	}
+	TRACE3(frame_write,opcode,len,(hdr[0] & 0x80)!=0);
+	if(ws->rec_conn) {
+		_ws_rec(ws,WS_REC_OUT,hdr[0],payload,len);
+	}
+	size_t limit = ws->corked ? WS_COALESCE_MAX : ws->coalesce_bytes;
+	if(!flush && ws->out_len + hdr_len + len < limit
+			&& (ws->corked || ws->out_len==0 || tm_now_ns() < ws->out_deadline)) {
+		unsigned char * out = slab_grow(ws->out,ws->out_len + hdr_len + len,ws->out_len);
+		if(!out) {
+			errno = ENOMEM;
+			return false;
+		}
+		if(ws->out_len==0) {
+			ws->out_deadline = tm_now_ns() + ws->coalesce_ns;
+			_ws_poll_flush_later(ws);
+		}
+		memcpy(out + ws->out_len,hdr,hdr_len);
+		memcpy(out + ws->out_len + hdr_len,payload,len);
+		ws->out = out;
+		ws->out_len += hdr_len + len;
+		return true;
+	}
+	return _ws_write_out(ws,hdr,hdr_len,payload,len);
+}
+
+static bool _ws_write_frame(Websocket ws, char opcode, const unsigned char * payload, size_t len, bool flush) {
+	unsigned char hdr[WS_MAX_HEADER_LEN];
+	size_t hdr_len = encode_dataframe_header(hdr,opcode,true,len);
+	return _ws_write_encoded(ws,opcode,hdr,hdr_len,payload,len,flush);
+}
+
+/* Handle a received frame: answer a ping, or add a message fragment to the
+ * message buffer. Returns the opcode of a whole message, OC_CLOSE, OC_CONT if
+ * the message isn't complete yet, or -1 on error. */
+static char _ws_handle_frame(Websocket ws, Data_Frame df) {
+	TRACE3(frame_read,df->opcode,df->len,df->fin);
+	if(ws->rec_conn) {
+		_ws_rec(ws,WS_REC_IN,(df->fin ? 0x80 : 0) | df->opcode,df->payload,df->len);
+	}
+	char opcode = df->opcode;
+	switch(opcode) {
+	default:
+		wlogf("Unexpected opcode: 0x%x",opcode);
+		return -1;
+	// Control Frames (which may come between the fragments of a message)
+	case OC_PING:
+		ilogf("Received OC_PING; sending OC_PONG");
+		ws->ping_recv_count++;
+		if(!_ws_write_frame(ws,OC_PONG,df->payload,df->len,true)) {
+			return -1;
+		}
+		return OC_CONT;
+	case OC_PONG:
+		ilogf("Received OC_PONG");
+		ws->pong_recv_count++;
+		return OC_CONT;
+	case OC_CLOSE: {
+		// Close status codes: https://tools.ietf.org/html/rfc6455#section-7.4.1			
+		uint16_t status_code = 0;
+		if(df->len >= 2) {
+			memcpy(&status_code,df->payload,sizeof(status_code));
+		}
+		status_code = be16toh(status_code);
+		ilogf("Received OC_CLOSE: status_code=%u",status_code);
+		ws->status_code = status_code;
+		return OC_CLOSE;
+		}
+	// Message frames
+	case OC_CONT:
+		if(ws->msg_opcode<0) {
+			wlogf("Unexpected continuation frame");
+			return -1;
+		}
+		opcode = ws->msg_opcode;
+		break;
+	case OC_TEXT:
+	case OC_BIN:
+		ws->buff_len = 0;
+		break;
+	}
+	if(df->len>0) {
+		unsigned char * buff = slab_grow(ws->buff,ws->buff_len+df->len,ws->buff_len);
+		if(!buff) {
+			return -1;
+		}
+		memcpy(buff+ws->buff_len,df->payload,df->len);
+		ws->buff = buff;
+		ws->buff_len += df->len;
+	}
+	ws->msg_opcode = df->fin ? -1 : opcode;
+	return df->fin ? opcode : OC_CONT;
+}
+
 /* Read a message from the remote endpoint */ 
 static char _ws_read(Websocket ws) {	
-	char opcode_prev = -1;
 	for/*ever*/(;;) {
 		Data_Frame df = ws->df = read_dataframe(ws->f_in,ws->is_masked_client,ws->df);
 		if(df==NULL) {
 			ilogf("Failed to read data frame");
 			return WS_ERROR;
 		}
-		char opcode = df->opcode;
-		if(opcode==OC_CONT) {
-			opcode = opcode_prev;
-		} else {
-			ws->buff_len = 0;
-		}
-		switch(opcode) {
-		default:
-		// shouldn't get here
-			wlogf("Unexpected opcode: 0x%x",opcode);
-			return -1;
-		// Control Frames
-		case OC_PING:
-			ilogf("Received OC_PING; sending OC_PONG");
-			ws->ping_recv_count++;
-			df->opcode = OC_PONG;
-			write_dataframe(ws->f_out,df,NULL);
-			break;
-		case OC_PONG:
-			ilogf("Received OC_PONG");
-			ws->pong_recv_count++;
-			break;
-		case OC_CLOSE: {
-			// Close status codes: https://tools.ietf.org/html/rfc6455#section-7.4.1			
-			uint16_t status_code = 0;
-			if(df->len >= 2) {
-				memcpy(&status_code,df->payload,sizeof(status_code));
-			}
-			status_code = be16toh(status_code);
-			ilogf("Received OC_CLOSE: status_code=%u",status_code);
-			ws->status_code = status_code;
-			return OC_CLOSE;
-			} 
-			break;
-		// Message frames
-		case OC_TEXT:
-		case OC_BIN:
-			ws->buff = mem_append(ws->buff,ws->buff_len,ws->df->payload,ws->df->len,&ws->buff_len);
-			if(df->fin) {
-				return opcode;
-			}
-			break;
+		char opcode = _ws_handle_frame(ws,df);
+		if(opcode!=OC_CONT) {
+			return opcode;
 		}
-		opcode_prev = df->fin ? -1 : opcode;
 	}
 }
 
 bool _ws_send_close(Websocket ws, uint16_t status_code) {
-	Data_Frame df = alloc_dataframe(OC_CLOSE,true,2,NULL);
-	if(!df) {
-		return false;
-	}
 	status_code = htobe16(status_code);
-	memcpy(df->payload,&status_code,sizeof(status_code));
-	bool ok = write_dataframe(ws->f_out,df,NULL);
-	free_dataframe(df);
-	return ok;
+	return _ws_write_frame(ws,OC_CLOSE,(unsigned char *)&status_code,sizeof(status_code),true);
 }
 
 bool _ws_send_msg(Websocket ws, WS_Msg_Type type, const unsigned char * msg, size_t msg_len) {
-	Data_Frame df = alloc_dataframe(type==WS_MSG_TXT?OC_TEXT:OC_BIN,true,msg_len,NULL);
-	if(!df) {
-		return false;
-	}
-	memcpy(df->payload,msg,msg_len);
-	bool ok = write_dataframe(ws->f_out,df,NULL);
-	free_dataframe(df);
-	return ok;
+	return _ws_write_frame(ws,type==WS_MSG_TXT?OC_TEXT:OC_BIN,msg,msg_len,false);
 }
 
 // PUBLIC interface
 
 bool ws_is_upgradable(const Http_Headers headers) {
-	char * valT;
-	// REVIEW:
-	// We should be looking for a `connection` header with value 'Upgrade'.
-	// However, this will not work (currently) if there are multiple values associated
-	// with the `connection` header. E.g., Firefox sends "connection:keep-alive, Upgrade"
-	// To resolve this, we need to parse comma-separated values into multiple values
-	// as per HTTP spec. 
-	// The quick fix (as done here) is to simply remove the check for "Upgrade" in
-	// the `connection` header value, and just look for an `upgrade:websocket` header.
-    return 
-	    // (valT=ht_get(headers,H_CONNECTION)) &&
-        // sz_equal_ignore_case(valT,H_UPGRADE) &&
-        (valT=ht_get(headers,H_UPGRADE)) &&
-        sz_equal_ignore_case(valT,WS_UPGRADE);
-}
-
-Websocket ws_upgrade(FILE * f_in, FILE * f_out, const Http_Headers headers, const char * uri, bool masked_client) {
-	if(!_ws_handshake(f_out,headers)) {
+	// Only the upgrade header routes a request to the websocket handler; the
+	// handshake checks the rest (connection tokens, e.g. Firefox's
+	// "keep-alive, Upgrade", version and key) and answers a bad request itself.
+	const char * valT = ht_get(headers,H_UPGRADE);
+	return valT && sz_equal_ignore_case(valT,WS_UPGRADE);
+}
+
+Websocket ws_upgrade(FILE * f_in, FILE * f_out, const Http_Headers headers, const char * uri, bool masked_client, Arena * arena) {
+	const char * protocol;
+	if(!_ws_handshake(f_out,headers,&protocol)) {
 		wlogf("not a websocket connection");
 		return NULL;
 	}
-	return _ws_create(f_in,f_out, masked_client);
+	Websocket ws = _ws_create(f_in,f_out, masked_client, protocol, arena);
+	if(ws && __atomic_load_n(&_ws_rec_fd,__ATOMIC_ACQUIRE)>=0) {
+		_ws_rec_open(ws,uri ? uri : "");
+	}
+	return ws;
+}
+
+int ws_set_protocols(const char * const * protocols) {
+	for(const char * const * pp=protocols; pp && *pp; pp++) {
+		if(strlen(*pp)>WS_MAX_PROTOCOL_LEN) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+	}
+	_ws_protocols = protocols;
+	return 0;
+}
+
+const char * ws_protocol(Websocket ws) {
+	return ws->protocol;
 }
 
 bool ws_is_open(Websocket ws) {
@@ -481,10 +1082,18 @@ bool ws_is_open(Websocket ws) {
 }
 
 void ws_close(Websocket ws, WS_Status_Code code) {
+	if(ws->poll) {
+		// Before the socket is closed, while epoll still knows it
+		ws_poll_remove(ws->poll,ws);
+	}
 	if(!ws->f_out) {
 		wlogf("websocket already closed");
 		return;
 	}
+	// Queued messages go first (the close frame must be the last)
+	if(_ws_queue_active(ws) && _ws_pump(ws,true)<0) {
+		_ws_queue_free(ws);
+	}
 	_ws_send_close(ws,code);
 
 	// It's possible for f_in and f_out to be the same object,
@@ -504,59 +1113,656 @@ bool ws_send_msg(Websocket ws, WS_Msg_Type type, const unsigned char * msg, size
 	return _ws_send_msg(ws, type, msg, msg_len);
 }
 
-void ws_free(Websocket ws) {
-	ws_close(ws,WS_STATUS_GOING_AWAY);
-	if(ws->df) {
-		free_dataframe(ws->df);
-		ws->df = NULL;
-	}
-	if(ws->buff) {
-		free(ws->buff);
-		ws->buff_len = 0;
+bool ws_set_coalesce(Websocket ws, size_t max_bytes, unsigned max_delay_us) {
+	if(max_bytes>WS_COALESCE_MAX) {
+		errno = EINVAL;
+		return false;
 	}
-	free(ws);
+	ws->coalesce_bytes = max_bytes;
+	ws->coalesce_ns = max_delay_us*TM_NS_PER_US;
+	return max_bytes>0 || ws_flush(ws);
 }
 
-WS_Msg_Type ws_wait(Websocket ws) {
-	char oc = _ws_read(ws);
-	switch(oc) {
-	default:
-		return WS_ERROR;
-	case OC_CLOSE:
-		return WS_CLOSE;
-	case OC_BIN:
-		return WS_MSG_BIN;
-	case OC_TEXT:
-		return WS_MSG_TXT;
+bool ws_flush(Websocket ws) {
+	if(ws->out_len==0) {
+		return true;
+	}
+	if(!ws->f_out) {
+		errno = EPIPE;
+		return false;
 	}
+	return _ws_write_out(ws,NULL,0,NULL,0);
 }
 
-const unsigned char * ws_get_msg(Websocket ws, size_t * msg_len) {
-	if(msg_len!=NULL) {
-		*msg_len = ws->buff_len;
+bool ws_queue_msg(Websocket ws, WS_Priority prio, WS_Msg_Type type, const unsigned char * msg, size_t msg_len) {
+	if(prio<0 || prio>=WS_PRIO_COUNT || (type!=WS_MSG_TXT && type!=WS_MSG_BIN)) {
+		errno = EINVAL;
+		return false;
 	}
-	return ws->buff;
+	if(!ws->f_out) {
+		errno = EPIPE;
+		return false;
+	}
+	if(!_ws_enqueue(ws,1 + prio,type==WS_MSG_TXT ? OC_TEXT : OC_BIN,msg,msg_len)) {
+		return false;
+	}
+	return _ws_pump(ws,false)>=0;
 }
 
-WS_Status_Code ws_status(Websocket ws) {
-	return ws->status_code;
+int ws_send_queued(Websocket ws) {
+	if(!ws->f_out) {
+		errno = EPIPE;
+		return -1;
+	}
+	return _ws_pump(ws,false);
 }
 
-#ifndef EXCLUDE_UNIT_TESTS
+size_t ws_queued(Websocket ws) {
+	return ws->queued + (ws->frag.len - ws->frag.off);
+}
 
-#include "ut.h"
-#include "rnd.h"
+size_t ws_encode_frame(unsigned char * frame, WS_Msg_Type type, const unsigned char * msg, size_t msg_len) {
+	size_t hdr_len = encode_dataframe_header(frame,type==WS_MSG_TXT ? OC_TEXT : OC_BIN,true,msg_len);
+	memcpy(frame + hdr_len,msg,msg_len);
+	return hdr_len + msg_len;
+}
 
-UT_TEST_CASE(ws_is_upgradable) {
-	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
-	
-	ht_put(headers,(char*)H_CONNECTION,(char*)H_UPGRADE);
-	ut_assert(!ws_is_upgradable(headers));
+bool ws_send_frame(Websocket ws, const unsigned char * frame, size_t frame_len) {
+	uint64_t payload_len;
+	int hdr_len = parse_dataframe_header(frame,frame_len,false,&payload_len);
+	if(hdr_len<=0 || hdr_len + payload_len!=frame_len) {
+		errno = EINVAL;
+		return false;
+	}
+	return _ws_write_encoded(ws,frame[0] & 0xf,frame,hdr_len,frame + hdr_len,payload_len,false);
+}
 
-	ht_put(headers,(char*)H_UPGRADE,(char*)WS_UPGRADE);
-	ut_assert(ws_is_upgradable(headers));
+void ws_cork(Websocket ws) {
+	ws->corked = true;
+}
 
-	ht_free(headers);
+bool ws_uncork(Websocket ws) {
+	ws->corked = false;
+	return ws_flush(ws);
+}
+
+void ws_free(Websocket ws) {
+	ws_close(ws,WS_STATUS_GOING_AWAY);
+	if(ws->rec_conn) {
+		_ws_rec_flush(ws);
+	}
+	slab_free(ws->rec);
+	ws->rec = NULL;
+	if(ws->df) {
+		free_dataframe(ws->df);
+		ws->df = NULL;
+	}
+	if(ws->buff) {
+		slab_free(ws->buff);
+		ws->buff = NULL;
+		ws->buff_len = 0;
+	}
+	slab_free(ws->in);
+	ws->in = NULL;
+	slab_free(ws->out);
+	ws->out = NULL;
+	ws->out_len = 0;
+	_ws_queue_free(ws);
+	if(!ws->arena) {
+		free(ws);
+	}
+}
+
+int ws_record_start(const char * path, size_t max_payload) {
+	if(__atomic_load_n(&_ws_rec_fd,__ATOMIC_ACQUIRE)>=0) {
+		errno = EALREADY;
+		return -1;
+	}
+	int fd = open(path,O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,0644);
+	if(fd<0) {
+		elogf("Failed to create capture: %s: %s",path,strerror(errno));
+		return -1;
+	}
+	if(io_write_all(fd,WS_REC_MAGIC,WS_REC_MAGIC_LEN)!=0) {
+		elogf("Failed to write capture: %s: %s",path,strerror(errno));
+		close(fd);
+		return -1;
+	}
+	_ws_rec_max_payload = max_payload;
+	_ws_rec_t0 = tm_now_ns();
+	__atomic_store_n(&_ws_rec_fd,fd,__ATOMIC_RELEASE);
+	ilogf("Recording websockets: capture=%s",path);
+	return 0;
+}
+
+void ws_record_stop(void) {
+	int fd = __atomic_exchange_n(&_ws_rec_fd,-1,__ATOMIC_ACQ_REL);
+	if(fd>=0) {
+		close(fd);
+	}
+}
+
+ssize_t ws_record_parse(const unsigned char * p, size_t len, WS_Record * rec) {
+	if(len<2) {
+		return 0;
+	}
+	if(p[0]<WS_REC_OPEN || p[0]>WS_REC_OUT) {
+		errno = EINVAL;
+		return -1;
+	}
+	rec->kind = p[0];
+	rec->frame = p[1];
+	uint64_t captured;
+	uint64_t * fields[] = { &rec->conn, &rec->t_ns, &rec->len, &captured };
+	size_t n = 2;
+	for(int i=0; i<sizeof(fields)/sizeof(fields[0]); i++) {
+		int v = codec_varint_get(p+n,len-n,fields[i]);
+		if(v<=0) {
+			errno = EINVAL;
+			return v;
+		}
+		n += v;
+	}
+	if(captured>rec->len) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(len-n<captured) {
+		return 0;
+	}
+	rec->captured = captured;
+	rec->payload = p+n;
+	return n + captured;
+}
+
+WS_Msg_Type ws_wait(Websocket ws) {
+	if(ws->poll) {
+		wlogf("websocket is registered with a poller");
+		return WS_ERROR;
+	}
+	// Nothing would meet the flush deadline, or send the queues, while we block
+	if(ws->out_len>0 && !ws_flush(ws)) {
+		return WS_ERROR;
+	}
+	if(_ws_queue_active(ws) && _ws_pump(ws,true)<0) {
+		return WS_ERROR;
+	}
+	char oc = _ws_read(ws);
+	switch(oc) {
+	default:
+		return WS_ERROR;
+	case OC_CLOSE:
+		return WS_CLOSE;
+	case OC_BIN:
+		return WS_MSG_BIN;
+	case OC_TEXT:
+		return WS_MSG_TXT;
+	}
+}
+
+const unsigned char * ws_get_msg(Websocket ws, size_t * msg_len) {
+	if(msg_len!=NULL) {
+		*msg_len = ws->buff_len;
+	}
+	return ws->buff;
+}
+
+WS_Status_Code ws_status(Websocket ws) {
+	return ws->status_code;
+}
+
+// POLLING
+//
+// A registered websocket is read with non-blocking recv()s into its input
+// buffer, and frames are parsed from there once they are whole, so a slow
+// sender holds nothing up but its own messages. Each websocket reports at most
+// one message per batch (its message buffer is reused for the next); one with
+// more whole frames buffered is queued, and served first in the next batch.
+// Sends are unchanged (blocking), but coalesced frames are flushed here once
+// their deadline passes.
+
+#define WS_POLL_READ    4096 // least room for a recv()
+#define WS_POLL_MAX_EVENTS 64   // epoll events fetched per ws_poll_wait
+
+struct WS_Poll_S {
+	int fd_epoll;
+	int fd_wake;             // eventfd, for ws_poll_wake
+	Websocket members;       // registered websockets
+	Websocket pending;       // queue of websockets with a whole frame buffered
+	Websocket pending_tail;
+	unsigned pending_count;
+	unsigned batch;
+	Websocket flushing;      // websockets with coalesced frames, and a deadline
+};
+
+WS_Poll ws_poll_create(void) {
+	int fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if(fd_epoll<0) {
+		elogf("epoll_create1 failed: %s",strerror(errno));
+		return NULL;
+	}
+	WS_Poll poll = malloc(sizeof(struct WS_Poll_S));
+	int fd_wake = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+	// The wake event has no websocket
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	if(!poll || fd_wake<0 || epoll_ctl(fd_epoll,EPOLL_CTL_ADD,fd_wake,&ev)<0) {
+		elogf("Failed to create poller: %s",strerror(errno));
+		free(poll);
+		if(fd_wake>=0) {
+			close(fd_wake);
+		}
+		close(fd_epoll);
+		return NULL;
+	}
+	*poll = (struct WS_Poll_S) { .fd_epoll = fd_epoll, .fd_wake = fd_wake };
+	return poll;
+}
+
+void ws_poll_free(WS_Poll poll) {
+	while(poll->members) {
+		ws_poll_remove(poll,poll->members);
+	}
+	close(poll->fd_wake);
+	close(poll->fd_epoll);
+	free(poll);
+}
+
+void ws_poll_wake(WS_Poll poll) {
+	uint64_t one = 1;
+	// Fails only if the counter is full, when a wake is due anyway
+	if(write(poll->fd_wake,&one,sizeof(one))<0 && errno!=EAGAIN) {
+		wlogf("Failed to wake poller: %s",strerror(errno));
+	}
+}
+
+int ws_poll_add(WS_Poll poll, Websocket ws, void * data) {
+	if(ws->poll || !ws_is_open(ws)) {
+		errno = EINVAL;
+		return -1;
+	}
+	// Only a plain socket can be read around the stream (not TLS, say)
+	int fd = fileno(ws->f_in);
+	if(fd<0) {
+		errno = ENOTSOCK;
+		return -1;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ws };
+	if(epoll_ctl(poll->fd_epoll,EPOLL_CTL_ADD,fd,&ev)<0) {
+		wlogf("epoll_ctl(ADD) failed: %s",strerror(errno));
+		return -1;
+	}
+	ws->poll = poll;
+	ws->poll_data = data;
+	ws->poll_events = ev.events;
+	ws->poll_batch = poll->batch;
+	ws->poll_eof = false;
+	ws->fd_client = fd;
+	ws->poll_prev_member = NULL;
+	ws->poll_next_member = poll->members;
+	if(poll->members) {
+		poll->members->poll_prev_member = ws;
+	}
+	poll->members = ws;
+	if(ws->out_len>0) {
+		_ws_poll_flush_later(ws);
+	}
+	_ws_poll_update_events(ws);
+	return 0;
+}
+
+// Have ws_poll_wait flush the websocket's coalesced frames at their deadline
+static void _ws_poll_flush_later(Websocket ws) {
+	if(ws->poll && !ws->poll_flushing && !ws->corked) {
+		ws->poll_flushing = true;
+		ws->poll_flush_next = ws->poll->flushing;
+		ws->poll->flushing = ws;
+	}
+}
+
+// Flush the websockets whose deadline has passed, returning the timeout
+// shortened to the next deadline
+static int _ws_poll_flush_due(WS_Poll poll, int timeout_ms) {
+	uint64_t now = tm_now_ns();
+	Websocket * pp = &poll->flushing;
+	while(*pp) {
+		Websocket ws = *pp;
+		if(ws->out_len>0 && !ws->corked) {
+			if(now<ws->out_deadline) {
+				// Rounded up: epoll_wait waits whole milliseconds
+				uint64_t ms = (ws->out_deadline - now + TM_NS_PER_MS - 1)/TM_NS_PER_MS;
+				if(timeout_ms<0 || ms<timeout_ms) {
+					timeout_ms = ms;
+				}
+				pp = &ws->poll_flush_next;
+				continue;
+			}
+			// A failed write is reported by the next send (or read)
+			ws_flush(ws);
+		}
+		*pp = ws->poll_flush_next;
+		ws->poll_flushing = false;
+		ws->poll_flush_next = NULL;
+	}
+	return timeout_ms;
+}
+
+// Stop watching the socket (the websocket stays registered)
+static void _ws_poll_detach(Websocket ws) {
+	if(ws->poll_events) {
+		epoll_ctl(ws->poll->fd_epoll,EPOLL_CTL_DEL,ws->fd_client,NULL);
+		ws->poll_events = 0;
+	}
+}
+
+int ws_poll_remove(WS_Poll poll, Websocket ws) {
+	if(ws->poll!=poll) {
+		errno = ENOENT;
+		return -1;
+	}
+	_ws_poll_detach(ws);
+	if(ws->poll_pending) {
+		Websocket prev = NULL;
+		for(Websocket p=poll->pending; p!=ws; p=p->poll_next) {
+			prev = p;
+		}
+		if(prev) {
+			prev->poll_next = ws->poll_next;
+		} else {
+			poll->pending = ws->poll_next;
+		}
+		if(poll->pending_tail==ws) {
+			poll->pending_tail = prev;
+		}
+		poll->pending_count--;
+		ws->poll_pending = false;
+		ws->poll_next = NULL;
+	}
+	if(ws->poll_flushing) {
+		Websocket * pp = &poll->flushing;
+		while(*pp!=ws) {
+			pp = &(*pp)->poll_flush_next;
+		}
+		*pp = ws->poll_flush_next;
+		ws->poll_flushing = false;
+		ws->poll_flush_next = NULL;
+	}
+	if(ws->poll_prev_member) {
+		ws->poll_prev_member->poll_next_member = ws->poll_next_member;
+	} else {
+		poll->members = ws->poll_next_member;
+	}
+	if(ws->poll_next_member) {
+		ws->poll_next_member->poll_prev_member = ws->poll_prev_member;
+	}
+	ws->poll = NULL;
+	ws->poll_writable = false;
+	ws->fd_client = -1;
+	return 0;
+}
+
+int ws_poll_want_writable(WS_Poll poll, Websocket ws, bool writable) {
+	if(ws->poll!=poll || !ws->poll_events) {
+		errno = ws->poll!=poll ? ENOENT : EPIPE;
+		return -1;
+	}
+	ws->poll_writable = writable;
+	_ws_poll_update_events(ws);
+	return 0;
+}
+
+// Watch for room to send while the application wants it, or frames are queued
+static void _ws_poll_update_events(Websocket ws) {
+	if(!ws->poll_events) {
+		return;
+	}
+	uint32_t events = ws->poll_writable || _ws_queue_active(ws) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	if(events==ws->poll_events) {
+		return;
+	}
+	struct epoll_event ev = { .events = events, .data.ptr = ws };
+	if(epoll_ctl(ws->poll->fd_epoll,EPOLL_CTL_MOD,ws->fd_client,&ev)<0) {
+		wlogf("epoll_ctl(MOD) failed: %s",strerror(errno));
+		return;
+	}
+	ws->poll_events = events;
+}
+
+// Receive what the socket has, making room for at least the frame being
+// received. Returns the bytes received (0 on end of file), or -1 on error,
+// with errno EAGAIN if there was nothing to receive.
+static ssize_t _ws_poll_recv(Websocket ws) {
+	size_t unparsed = ws->in_len - ws->in_off;
+	size_t need = max(ws->in_need,unparsed + WS_POLL_READ);
+	if(ws->in_off>0 && (!ws->in || slab_size(ws->in) - ws->in_len < need - unparsed)) {
+		memmove(ws->in,ws->in + ws->in_off,unparsed);
+		ws->in_off = 0;
+		ws->in_len = unparsed;
+	}
+	if(!ws->in || slab_size(ws->in) < need) {
+		unsigned char * in = slab_grow(ws->in,need,ws->in_len);
+		if(!in) {
+			wlogf("Failed to allocate input buffer: len=%zu",need);
+			errno = ENOMEM;
+			return -1;
+		}
+		ws->in = in;
+	}
+	ssize_t n = recv(ws->fd_client,ws->in + ws->in_len,slab_size(ws->in) - ws->in_len,MSG_DONTWAIT);
+	if(n>0) {
+		ws->in_len += n;
+	}
+	return n;
+}
+
+// Parse and handle whole frames from the input buffer, up to a message
+// (returns its opcode), a close (OC_CLOSE) or an error (-1). Returns OC_CONT
+// once the buffer holds no more whole frames.
+static char _ws_poll_parse(Websocket ws) {
+	for(;;) {
+		const unsigned char * p = ws->in + ws->in_off;
+		size_t avail = ws->in_len - ws->in_off;
+		uint64_t payload_len;
+		int hdr_len = parse_dataframe_header(p,avail,ws->is_masked_client,&payload_len);
+		if(hdr_len<0) {
+			return -1;
+		}
+		if(hdr_len==0 || avail - hdr_len < payload_len) {
+			ws->in_need = hdr_len ? hdr_len + payload_len : 0;
+			if(avail==0) {
+				// Idle: give the buffer back to the pool
+				slab_free(ws->in);
+				ws->in = NULL;
+				ws->in_off = ws->in_len = 0;
+			}
+			return OC_CONT;
+		}
+		struct Data_Frame_Header_S dfh;
+		memcpy(&dfh,p,sizeof(dfh));
+		Data_Frame df = ws->df = alloc_dataframe(dfh.opcode,dfh.fin,payload_len,ws->df);
+		if(!df) {
+			wlogf("Failed to allocate data frame: len=%llu",payload_len);
+			return -1;
+		}
+		memcpy(df->payload,p + hdr_len,payload_len);
+		if(dfh.mask) {
+			const unsigned char * mask_key = p + hdr_len - 4;
+			for(uint64_t i=0;i<payload_len;i++) {
+				df->payload[i] ^= mask_key[i%4];
+			}
+		}
+		ws->in_off += hdr_len + payload_len;
+		ws->in_need = 0;
+		ilogf("Received dataframe: opcode=0x%x, len=%llu", df->opcode, df->len);
+		char opcode = _ws_handle_frame(ws,df);
+		if(opcode!=OC_CONT) {
+			return opcode;
+		}
+	}
+}
+
+static bool _ws_poll_has_frame(Websocket ws) {
+	uint64_t payload_len;
+	size_t avail = ws->in_len - ws->in_off;
+	int hdr_len = ws->in ? parse_dataframe_header(ws->in + ws->in_off,avail,ws->is_masked_client,&payload_len) : 0;
+	// (an invalid header is reported from the queue too)
+	return hdr_len<0 || (hdr_len>0 && avail - hdr_len >= payload_len);
+}
+
+static void _ws_poll_enqueue(WS_Poll poll, Websocket ws) {
+	ws->poll_pending = true;
+	ws->poll_next = NULL;
+	if(poll->pending_tail) {
+		poll->pending_tail->poll_next = ws;
+	} else {
+		poll->pending = ws;
+	}
+	poll->pending_tail = ws;
+	poll->pending_count++;
+}
+
+// Fill in the event for ws, reading from its socket first if readable.
+// Returns true if there is anything to report.
+static bool _ws_poll_event(WS_Poll poll, Websocket ws, bool readable, unsigned events, WS_Event * event) {
+	ws->poll_batch = poll->batch;
+	*event = (WS_Event) { .ws = ws, .data = ws->poll_data, .events = events, .msg_type = WS_ERROR };
+	if(readable && !ws->poll_eof) {
+		ssize_t n = _ws_poll_recv(ws);
+		if(n==0) {
+			ws->poll_eof = true;
+		} else if(n<0 && errno!=EAGAIN && errno!=EWOULDBLOCK) {
+			wlogf("recv failed: %s",strerror(errno));
+			event->events |= WS_EV_ERROR;
+		}
+	}
+	if(!(event->events & WS_EV_ERROR)) {
+		switch(_ws_poll_parse(ws)) {
+		case OC_TEXT:
+			event->events |= WS_EV_MSG;
+			event->msg_type = WS_MSG_TXT;
+			break;
+		case OC_BIN:
+			event->events |= WS_EV_MSG;
+			event->msg_type = WS_MSG_BIN;
+			break;
+		case OC_CLOSE:
+			event->events |= WS_EV_CLOSE;
+			event->msg_type = WS_CLOSE;
+			break;
+		case OC_CONT:
+			if(ws->poll_eof) {
+				ilogf("connection closed without a close frame");
+				event->events |= WS_EV_ERROR;
+			}
+			break;
+		default:
+			event->events |= WS_EV_ERROR;
+			break;
+		}
+	}
+	if(event->events & (WS_EV_CLOSE | WS_EV_ERROR)) {
+		_ws_poll_detach(ws);
+		event->events &= ~WS_EV_WRITABLE;
+	} else if(_ws_poll_has_frame(ws)) {
+		_ws_poll_enqueue(poll,ws);
+	}
+	return event->events!=0;
+}
+
+int ws_poll_wait(WS_Poll poll, WS_Event * events, int max_events, int timeout_ms) {
+	if(max_events<=0) {
+		errno = EINVAL;
+		return -1;
+	}
+	int n = 0;
+	poll->batch++;
+	timeout_ms = _ws_poll_flush_due(poll,timeout_ms);
+	// (1) Websockets with whole frames already buffered
+	for(unsigned i=poll->pending_count; i>0 && n<max_events; i--) {
+		Websocket ws = poll->pending;
+		poll->pending = ws->poll_next;
+		if(!poll->pending) {
+			poll->pending_tail = NULL;
+		}
+		poll->pending_count--;
+		ws->poll_pending = false;
+		ws->poll_next = NULL;
+		if(_ws_poll_event(poll,ws,false,0,&events[n])) {
+			n++;
+		}
+	}
+	if(n==max_events) {
+		return n;
+	}
+	// (2) Sockets, without blocking if there's something to report already
+	struct epoll_event epoll_events[WS_POLL_MAX_EVENTS];
+	int nev = epoll_wait(poll->fd_epoll,epoll_events,min(max_events - n,WS_POLL_MAX_EVENTS),
+		n>0 || poll->pending ? 0 : timeout_ms);
+	if(nev<0) {
+		if(errno!=EINTR) {
+			elogf("epoll_wait failed: %s",strerror(errno));
+		}
+		return n>0 ? n : -1;
+	}
+	if(poll->flushing) {
+		// Perhaps woken for a deadline
+		_ws_poll_flush_due(poll,0);
+	}
+	for(int i=0; i<nev; i++) {
+		Websocket ws = epoll_events[i].data.ptr;
+		if(!ws) {
+			// ws_poll_wake
+			uint64_t count;
+			if(read(poll->fd_wake,&count,sizeof(count))<0 && errno!=EAGAIN) {
+				wlogf("Failed to read wake event: %s",strerror(errno));
+			}
+			continue;
+		}
+		if(ws->poll_batch==poll->batch || ws->poll_pending) {
+			// Reported already, or queued (and read from next time)
+			continue;
+		}
+		uint32_t ev = epoll_events[i].events;
+		unsigned writable = 0;
+		if(ev & EPOLLOUT) {
+			// Send what's queued; a failure shows up as the socket's error
+			if(_ws_queue_active(ws)) {
+				_ws_pump(ws,false);
+			}
+			writable = ws->poll_writable ? WS_EV_WRITABLE : 0;
+		}
+		if(_ws_poll_event(poll,ws,ev & (EPOLLIN|EPOLLHUP|EPOLLERR),writable,&events[n])) {
+			n++;
+		}
+	}
+	return n;
+}
+
+#ifndef EXCLUDE_UNIT_TESTS
+
+#include <sys/ioctl.h>
+#include "ut.h"
+#include "rnd.h"
+
+// A valid upgrade request (the example from RFC 6455)
+static Http_Headers test_upgrade_headers(void) {
+	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
+	ht_put(headers,(char*)H_CONNECTION,(char*)"keep-alive, Upgrade");
+	ht_put(headers,(char*)H_UPGRADE,(char*)WS_UPGRADE);
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_VERSION,(char*)WS_VERSION);
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_KEY,(char*)"dGhlIHNhbXBsZSBub25jZQ==");
+	return headers;
+}
+
+UT_TEST_CASE(ws_is_upgradable) {
+	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
+	
+	ht_put(headers,(char*)H_CONNECTION,(char*)H_UPGRADE);
+	ut_assert(!ws_is_upgradable(headers));
+
+	ht_put(headers,(char*)H_UPGRADE,(char*)WS_UPGRADE);
+	ut_assert(ws_is_upgradable(headers));
+
+	ht_free(headers);
 }
 
 UT_TEST_CASE(ws_dataframe_io_round_trip) {
@@ -682,10 +1888,8 @@ UT_TEST_CASE(ws_dataframe_io_round_trip) {
 	out = fopen("/dev/null","w");
 
 	// Create websocket request
-	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
-	ht_put(headers,(char*)H_UPGRADE,(char*)WS_UPGRADE);
-	ht_put(headers,(char*)H_SEC_WEBSOCKET_KEY,(char*)"ThisIsTheKey");
-	Websocket ws = ws_upgrade(in,out,headers,"/ws",false);
+	Http_Headers headers = test_upgrade_headers();
+	Websocket ws = ws_upgrade(in,out,headers,"/ws",false,NULL);
 	ut_assert(ws);
 	ut_assert(ws_is_open(ws));
 	ut_assert(ws_wait(ws)==WS_MSG_BIN);
@@ -733,18 +1937,75 @@ UT_TEST_CASE(ws_dataframe_mask_required) {
 
 UT_TEST_CASE(ws_not_upgradable) {
 	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
-	Websocket ws = ws_upgrade(stdin,stdout,headers,"/ws",false);
+	FILE * out = fopen("/dev/null","w");
+	Websocket ws = ws_upgrade(stdin,out,headers,"/ws",false,NULL);
 	ut_assert(ws==NULL);
+	fclose(out);
 	ht_free(headers);
 }
 
-UT_TEST_CASE(ws_already_closed) {
-	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
-	ht_put(headers,(char*)H_UPGRADE,(char*)WS_UPGRADE);
+static bool test_handshake(const Http_Headers headers, const char * expected) {
+	char * buff = NULL;
+	size_t buff_len = 0;
+	FILE * out = open_memstream(&buff,&buff_len);
+	const char * protocol;
+	bool ok = _ws_handshake(out,headers,&protocol);
+	fclose(out);
+	bool match = buff_len==strlen(expected) && memcmp(buff,expected,buff_len)==0;
+	free(buff);
+	return ok==sz_starts_with(expected,"HTTP/1.1 101") && match;
+}
+
+UT_TEST_CASE(ws_handshake) {
+	Http_Headers headers = test_upgrade_headers();
+	ut_assert(test_handshake(headers,WS_101_PREFIX "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=" WS_101_SUFFIX));
+
+	// Connection tokens, in any case, with or without other tokens
+	ht_put(headers,(char*)H_CONNECTION,(char*)"UPGRADE");
+	ut_assert(test_handshake(headers,WS_101_PREFIX "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=" WS_101_SUFFIX));
+	ht_put(headers,(char*)H_CONNECTION,(char*)"keep-alive");
+	ut_assert(test_handshake(headers,WS_400));
+	ht_put(headers,(char*)H_CONNECTION,(char*)"keep-alive,upgraded");
+	ut_assert(test_handshake(headers,WS_400));
+	ht_put(headers,(char*)H_CONNECTION,(char*)" upgrade ,keep-alive");
+	ut_assert(test_handshake(headers,WS_101_PREFIX "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=" WS_101_SUFFIX));
+
+	// Key must be 16 bytes, base64-encoded
 	ht_put(headers,(char*)H_SEC_WEBSOCKET_KEY,(char*)"ThisIsTheKey");
+	ut_assert(test_handshake(headers,WS_400));
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_KEY,(char*)"dGhlIHNhbXBsZSBub25jZQ!=");
+	ut_assert(test_handshake(headers,WS_400));
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_KEY,(char*)"x3JJHMbDL1EzLkh9GBhXDw==");
+	ut_assert(test_handshake(headers,WS_101_PREFIX "HSmrc0sMlYUkAGmm5OPpG2HaGWk=" WS_101_SUFFIX));
+
+	// Version must be 13
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_VERSION,(char*)"8");
+	ut_assert(test_handshake(headers,WS_426));
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_VERSION,NULL);
+	ut_assert(test_handshake(headers,WS_426));
+	ht_free(headers);
+
+	// Subprotocols: ours, in our order of preference, if the client offers one
+	headers = test_upgrade_headers();
+	static const char * protocols[] = { "b.example", "a.example", NULL };
+	ut_assert(ws_set_protocols(protocols)==0);
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_PROTOCOL,(char*)"x.example");
+	ut_assert(test_handshake(headers,WS_101_PREFIX "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=" WS_101_SUFFIX));
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_PROTOCOL,(char*)"a.example, b.example");
+	ut_assert(test_handshake(headers,WS_101_PREFIX "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=" WS_101_PROTOCOL "b.example" WS_101_SUFFIX));
+	Websocket ws = ws_upgrade(stdin,fopen("/dev/null","w"),headers,"/ws",false,NULL);
+	ut_assert(ws && sz_equal(ws_protocol(ws),"b.example"));
+	ws->f_in = NULL; // not ours to close
+	ws_free(ws);
+	ut_assert(ws_set_protocols(NULL)==0);
+	ht_free(headers);
+}
+
+UT_TEST_CASE(ws_already_closed) {
+	Http_Headers headers = test_upgrade_headers();
 	FILE * in = fopen("/dev/random", "r");
 	FILE * out = fopen("/dev/null", "w");
-	Websocket ws = ws_upgrade(in,out,headers,"/ws",false);
+	Websocket ws = ws_upgrade(in,out,headers,"/ws",false,NULL);
 	ut_assert(ws!=NULL);
 	ws_close(ws,WS_STATUS_NORMAL);
 	ws_close(ws,WS_STATUS_NORMAL);
@@ -752,4 +2013,684 @@ UT_TEST_CASE(ws_already_closed) {
 	ht_free(headers);
 }
 
+UT_TEST_CASE(ws_arena) {
+	Http_Headers headers = test_upgrade_headers();
+	char * buff = NULL;
+	size_t buff_len = 0;
+	FILE * out = open_memstream(&buff,&buff_len);
+	FILE * in = fopen("/dev/null", "r");
+	Arena * arena = arena_create(ARENA_CONN,1024);
+	Websocket ws = ws_upgrade(in,out,headers,"/ws",false,arena);
+	ut_assert(ws!=NULL);
+	size_t used = arena_used(arena);
+	ut_assert(used>0);
+	// Outgoing frames are written from the message, or coalesced in a pooled
+	// buffer, returned once sent
+	unsigned char msg[4000];
+	memset(msg,'x',sizeof(msg));
+	Slab_Stats before, after;
+	slab_get_stats(&before);
+	ut_assert(ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg)));
+	ut_assert(ws_set_coalesce(ws,16384,1000000));
+	ut_assert(ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg)));
+	ut_assert(ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg)));
+	ut_assert(ws_flush(ws));
+	slab_get_stats(&after);
+	ut_assert(after.allocs>before.allocs && after.allocs-before.allocs==after.frees-before.frees);
+	ut_assert(arena_used(arena)==used);
+	ws_close(ws,WS_STATUS_NORMAL);
+	ut_assert(arena_used(arena)==used);
+	ws_free(ws);
+	ut_assert(buff_len>sizeof(msg));
+	free(buff);
+	arena_free(arena);
+	ht_free(headers);
+}
+
+// A websocket (with masked client frames) on one end of a socketpair; the
+// client end is returned in fd_client
+static Websocket test_poll_ws(int * fd_client) {
+	int sv[2];
+	ut_assert(socketpair(AF_UNIX,SOCK_STREAM,0,sv)==0);
+	Http_Headers headers = test_upgrade_headers();
+	Websocket ws = ws_upgrade(fdopen(sv[0],"r"),fdopen(dup(sv[0]),"w"),headers,"/ws",true,NULL);
+	ht_free(headers);
+	ut_assert(ws!=NULL);
+	// Skip the 101 response and the ping
+	char buff[256];
+	size_t len = sizeof(WS_101_PREFIX)-1 + WS_ACCEPT_LEN + sizeof(WS_101_SUFFIX)-1 + 2;
+	for(size_t n=0; n<len; ) {
+		ssize_t r = recv(sv[1],buff,len-n,0);
+		ut_assert(r>0);
+		n += r;
+	}
+	*fd_client = sv[1];
+	return ws;
+}
+
+// Append a masked client frame to f
+static void test_client_frame(FILE * f, char opcode, bool fin, const void * payload, size_t len) {
+	Data_Frame df = alloc_dataframe(opcode,fin,len,NULL);
+	memcpy(df->payload,payload,len);
+	unsigned char mask_key[4];
+	rnd_mask(mask_key);
+	ut_assert(write_dataframe(f,df,mask_key));
+	free_dataframe(df);
+}
+
+static bool test_poll_msg(const WS_Event * ev, Websocket ws, WS_Msg_Type type, const void * msg, size_t len) {
+	size_t msg_len;
+	const unsigned char * received = ws_get_msg(ws,&msg_len);
+	return ev->ws==ws && ev->events==WS_EV_MSG && ev->msg_type==type &&
+		msg_len==len && memcmp(received,msg,len)==0;
+}
+
+UT_TEST_CASE(ws_poll) {
+	WS_Poll poll = ws_poll_create();
+	ut_assert(poll!=NULL);
+	int fd_a, fd_b, fd_c;
+	Websocket a = test_poll_ws(&fd_a), b = test_poll_ws(&fd_b), c = test_poll_ws(&fd_c);
+	ut_assert(ws_poll_add(poll,a,"a")==0);
+	ut_assert(ws_poll_add(poll,b,"b")==0);
+	ut_assert(ws_poll_add(poll,c,"c")==0);
+	ut_assert(ws_poll_add(poll,c,"c")<0 && errno==EINVAL);
+	ut_assert(ws_wait(c)==WS_ERROR);
+	WS_Event ev[8];
+	ut_assert(ws_poll_wait(poll,ev,8,0)==0);
+
+	// a sends half a message, and b a whole one: a doesn't hold up b
+	static unsigned char big[70000];
+	rnd_fill(big,sizeof(big));
+	char * frames = NULL;
+	size_t frames_len = 0;
+	FILE * f = open_memstream(&frames,&frames_len);
+	test_client_frame(f,OC_BIN,true,big,sizeof(big));
+	fclose(f);
+	char * big_frame = frames;
+	size_t big_frame_len = frames_len;
+	ut_assert(send(fd_a,big_frame,big_frame_len/2,0)==(ssize_t)big_frame_len/2);
+	f = open_memstream(&frames,&frames_len);
+	test_client_frame(f,OC_TEXT,true,"hello",5);
+	fclose(f);
+	ut_assert(send(fd_b,frames,frames_len,0)==(ssize_t)frames_len);
+	ut_assert(ws_poll_wait(poll,ev,8,1000)==1);
+	ut_assert(test_poll_msg(&ev[0],b,WS_MSG_TXT,"hello",5));
+	ut_assert(strcmp(ev[0].data,"b")==0);
+	ut_assert(ws_poll_wait(poll,ev,8,0)==0);
+	free(frames);
+
+	// ... until the rest comes
+	size_t rest = big_frame_len - big_frame_len/2;
+	ut_assert(send(fd_a,big_frame + big_frame_len/2,rest,0)==(ssize_t)rest);
+	int n = 0;
+	for(int i=0; i<10 && n==0; i++) {
+		n = ws_poll_wait(poll,ev,8,1000);
+	}
+	ut_assert(n==1);
+	ut_assert(test_poll_msg(&ev[0],a,WS_MSG_BIN,big,sizeof(big)));
+	free(big_frame);
+
+	// c sends two messages at once, with a ping between the fragments of the
+	// second; they are reported one per wait
+	f = open_memstream(&frames,&frames_len);
+	test_client_frame(f,OC_TEXT,true,"one",3);
+	test_client_frame(f,OC_TEXT,false,"tw",2);
+	test_client_frame(f,OC_PING,true,"",0);
+	test_client_frame(f,OC_CONT,true,"o",1);
+	fclose(f);
+	ut_assert(send(fd_c,frames,frames_len,0)==(ssize_t)frames_len);
+	free(frames);
+	ut_assert(ws_poll_wait(poll,ev,8,1000)==1);
+	ut_assert(test_poll_msg(&ev[0],c,WS_MSG_TXT,"one",3));
+	ut_assert(ws_poll_wait(poll,ev,8,-1)==1);
+	ut_assert(test_poll_msg(&ev[0],c,WS_MSG_TXT,"two",3));
+	unsigned char pong[2];
+	ut_assert(recv(fd_c,pong,2,0)==2 && (pong[0]&0x0f)==OC_PONG);
+
+	// Writable, on request
+	ut_assert(ws_poll_want_writable(poll,a,true)==0);
+	ut_assert(ws_poll_wait(poll,ev,8,1000)==1);
+	ut_assert(ev[0].ws==a && ev[0].events==WS_EV_WRITABLE);
+	ut_assert(ws_poll_want_writable(poll,a,false)==0);
+	ut_assert(ws_poll_wait(poll,ev,8,0)==0);
+
+	// c closes, and b drops its connection
+	f = open_memstream(&frames,&frames_len);
+	uint16_t status_code = htobe16(WS_STATUS_NORMAL);
+	test_client_frame(f,OC_CLOSE,true,&status_code,2);
+	fclose(f);
+	ut_assert(send(fd_c,frames,frames_len,0)==(ssize_t)frames_len);
+	free(frames);
+	shutdown(fd_b,SHUT_WR);
+	unsigned seen = 0;
+	for(int i=0; i<10 && seen!=3; i++) {
+		n = ws_poll_wait(poll,ev,8,1000);
+		for(int j=0; j<n; j++) {
+			if(ev[j].ws==c) {
+				ut_assert(ev[j].events==WS_EV_CLOSE && ws_status(c)==WS_STATUS_NORMAL);
+				seen |= 1;
+			} else {
+				ut_assert(ev[j].ws==b && ev[j].events==WS_EV_ERROR);
+				seen |= 2;
+			}
+		}
+	}
+	ut_assert(seen==3);
+	ut_assert(ws_poll_wait(poll,ev,8,0)==0);
+
+	ut_assert(ws_poll_remove(poll,c)==0);
+	ut_assert(ws_poll_remove(poll,c)<0 && errno==ENOENT);
+	ws_free(b);
+	ws_free(c);
+	ws_poll_free(poll);
+	// a was removed with the poller, and can be waited on again
+	ut_assert(ws_is_open(a));
+	ws_free(a);
+	close(fd_a);
+	close(fd_b);
+	close(fd_c);
+}
+
+UT_TEST_CASE(ws_poll_byte_at_a_time) {
+	WS_Poll poll = ws_poll_create();
+	int fd;
+	Websocket ws = test_poll_ws(&fd);
+	ut_assert(ws_poll_add(poll,ws,NULL)==0);
+	unsigned char msg[300];
+	rnd_fill(msg,sizeof(msg));
+	char * frames = NULL;
+	size_t frames_len = 0;
+	FILE * f = open_memstream(&frames,&frames_len);
+	test_client_frame(f,OC_BIN,false,msg,100);
+	test_client_frame(f,OC_PONG,true,"",0);
+	test_client_frame(f,OC_CONT,true,msg+100,200);
+	fclose(f);
+	WS_Event ev[1];
+	int n = 0;
+	for(size_t i=0; i<frames_len; i++) {
+		ut_assert(n==0);
+		ut_assert(send(fd,frames+i,1,0)==1);
+		n = ws_poll_wait(poll,ev,1,1000);
+	}
+	ut_assert(n==1);
+	ut_assert(test_poll_msg(&ev[0],ws,WS_MSG_BIN,msg,sizeof(msg)));
+	ut_assert(ws->pong_recv_count==1);
+	free(frames);
+
+	// Not on a socket
+	FILE * in = fmemopen(msg,sizeof(msg),"r");
+	Websocket ws_file = _ws_create(in,fopen("/dev/null","w"),true,NULL,NULL);
+	ut_assert(ws_poll_add(poll,ws_file,NULL)<0 && errno==ENOTSOCK);
+	ws_free(ws_file);
+
+	ws_free(ws);
+	ws_poll_free(poll);
+	close(fd);
+}
+
+// Bytes waiting on the client end of a test websocket
+static size_t test_pending(int fd) {
+	int n = 0;
+	ut_assert(ioctl(fd,FIONREAD,&n)==0);
+	return n;
+}
+
+UT_TEST_CASE(ws_coalesce) {
+	int fd;
+	Websocket ws = test_poll_ws(&fd);
+	unsigned char msg[50];
+	memset(msg,'m',sizeof(msg));
+	size_t frame_len = 2 + sizeof(msg);
+	ut_assert(!ws_set_coalesce(ws,WS_COALESCE_MAX+1,0) && errno==EINVAL);
+
+	// Buffered until the threshold, then written together
+	ut_assert(ws_set_coalesce(ws,10*frame_len,TM_NS_PER_S/TM_NS_PER_US));
+	for(int i=0; i<9; i++) {
+		ut_assert(ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg)));
+	}
+	ut_assert(test_pending(fd)==0);
+	ut_assert(ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg)));
+	ut_assert(test_pending(fd)==10*frame_len);
+
+	// ... or on an explicit flush
+	ut_assert(ws_send_msg(ws,WS_MSG_TXT,msg,sizeof(msg)));
+	ut_assert(test_pending(fd)==10*frame_len);
+	ut_assert(ws_flush(ws));
+	ut_assert(test_pending(fd)==11*frame_len);
+
+	// A message too big to buffer takes the buffered ones with it
+	unsigned char big[4000];
+	memset(big,'b',sizeof(big));
+	ut_assert(ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg)));
+	ut_assert(ws_send_msg(ws,WS_MSG_BIN,big,sizeof(big)));
+	ut_assert(test_pending(fd)==12*frame_len + 4 + sizeof(big));
+
+	// Corked, nothing goes out (bar control frames) until uncorked
+	ws_cork(ws);
+	for(int i=0; i<20; i++) {
+		ut_assert(ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg)));
+	}
+	ut_assert(test_pending(fd)==12*frame_len + 4 + sizeof(big));
+	ut_assert(ws_uncork(ws));
+	ut_assert(test_pending(fd)==32*frame_len + 4 + sizeof(big));
+
+	// The frames arrive intact, in order
+	size_t total = 32*frame_len + 4 + sizeof(big);
+	unsigned char * received = malloc(total);
+	for(size_t n=0; n<total; ) {
+		ssize_t r = recv(fd,received+n,total-n,0);
+		ut_assert(r>0);
+		n += r;
+	}
+	ut_assert(received[0]==0x82 && received[1]==sizeof(msg) && received[2]=='m');
+	ut_assert(received[10*frame_len]==0x81);
+	ut_assert(received[12*frame_len]==0x82 && received[12*frame_len+1]==126 && received[12*frame_len+4]=='b');
+	ut_assert(received[total-frame_len]==0x82 && received[total-1]=='m');
+	free(received);
+
+	// A polled websocket is flushed at the deadline
+	WS_Poll poll = ws_poll_create();
+	ut_assert(ws_poll_add(poll,ws,NULL)==0);
+	ut_assert(ws_set_coalesce(ws,4096,2000));
+	ut_assert(ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg)));
+	ut_assert(test_pending(fd)==0);
+	WS_Event ev[1];
+	uint64_t start = tm_now_ns();
+	ut_assert(ws_poll_wait(poll,ev,1,1000)==0);
+	ut_assert(tm_now_ns() - start < 500*TM_NS_PER_MS);
+	ut_assert(test_pending(fd)==frame_len);
+
+	// Turning coalescing off flushes
+	ut_assert(ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg)));
+	ut_assert(ws_set_coalesce(ws,0,0));
+	ut_assert(test_pending(fd)==2*frame_len);
+	ws_poll_free(poll);
+	ws_free(ws);
+	close(fd);
+}
+
+UT_TEST_CASE(ws_queue) {
+	int fd;
+	Websocket ws = test_poll_ws(&fd);
+	int sndbuf = 4096;
+	ut_assert(setsockopt(fileno(ws->f_out),SOL_SOCKET,SO_SNDBUF,&sndbuf,sizeof(sndbuf))==0);
+	ut_assert(!ws_queue_msg(ws,WS_PRIO_COUNT,WS_MSG_BIN,(unsigned char *)"x",1) && errno==EINVAL);
+
+	// A normal message fills the socket, then urgent and bulk ones are queued
+	static unsigned char normal[50000];
+	memset(normal,'n',sizeof(normal));
+	ut_assert(ws_queue_msg(ws,WS_PRIO_NORMAL,WS_MSG_BIN,normal,sizeof(normal)));
+	ut_assert(ws_queued(ws)>0 && ws_send_queued(ws)==0);
+	unsigned char msg[1000];
+	for(int i=0; i<6; i++) {
+		memset(msg,'h',sizeof(msg));
+		ut_assert(ws_queue_msg(ws,WS_PRIO_HIGH,WS_MSG_BIN,msg,sizeof(msg)));
+		memset(msg,'b',sizeof(msg));
+		ut_assert(ws_queue_msg(ws,WS_PRIO_BULK,WS_MSG_BIN,msg,sizeof(msg)));
+	}
+	// ... and a plain send queues behind them
+	ut_assert(ws_send_msg(ws,WS_MSG_TXT,(unsigned char *)"t",1));
+
+	// A ping is answered before the rest of the normal message
+	WS_Poll poll = ws_poll_create();
+	ut_assert(ws_poll_add(poll,ws,NULL)==0);
+	char * ping = NULL;
+	size_t ping_len = 0;
+	FILE * f = open_memstream(&ping,&ping_len);
+	test_client_frame(f,OC_PING,true,"p",1);
+	fclose(f);
+	ut_assert(send(fd,ping,ping_len,0)==(ssize_t)ping_len);
+	free(ping);
+	WS_Event ev[1];
+	ut_assert(ws_poll_wait(poll,ev,1,1000)==0);
+
+	// Read everything, the poller sending as the socket has room
+	size_t total = 0, size = 200000;
+	unsigned char * received = malloc(size);
+	for(;;) {
+		ssize_t r = recv(fd,received + total,size - total,MSG_DONTWAIT);
+		if(r>0) {
+			total += r;
+		} else if(ws_queued(ws)>0) {
+			ut_assert(ws_poll_wait(poll,ev,1,1000)==0);
+		} else {
+			break;
+		}
+	}
+
+	// Frames, by the first payload byte: the normal message's fragments with the
+	// pong among them, then the urgent and bulk messages, 8:1 by weight
+	char order[64];
+	int frames = 0, n_frags = 0;
+	for(size_t off=0; off<total; frames++) {
+		ut_assert(frames<(int)sizeof(order)-1);
+		unsigned char opcode = received[off] & 0xf;
+		size_t len = received[off+1] & 0x7f, hdr_len = 2;
+		if(len==126) {
+			len = (received[off+2]<<8) | received[off+3];
+			hdr_len = 4;
+		}
+		order[frames] = opcode==OC_PONG ? 'P' : received[off+hdr_len];
+		n_frags += order[frames]=='n';
+		ut_assert(opcode==(order[frames]=='n' && n_frags>1 ? OC_CONT : order[frames]=='P' ? OC_PONG : order[frames]=='t' ? OC_TEXT : OC_BIN));
+		ut_assert(len<=WS_FRAGMENT_LEN);
+		off += hdr_len + len;
+	}
+	order[frames] = 0;
+	ut_assert(n_frags==(sizeof(normal)+WS_FRAGMENT_LEN-1)/WS_FRAGMENT_LEN);
+	const char * pong = strchr(order,'P');
+	ut_assert(pong && strrchr(order,'n')>pong);
+	const char * data = strrchr(order,'n') + 1;
+	ut_assert(strcmp(data,"hbhhhhhbbbbbt")==0);
+	free(received);
+	ws_poll_free(poll);
+	ws_free(ws);
+	close(fd);
+}
+
+UT_TEST_CASE(ws_record) {
+	char path[64];
+	snprintf(path,sizeof(path),"/tmp/ws_record_%d.cap",getpid());
+	ut_assert(ws_record_start(path,1000)==0);
+	ut_assert(ws_record_start(path,1000)<0 && errno==EALREADY);
+	int fd;
+	Websocket ws = test_poll_ws(&fd);
+
+	// A message each way, a queued one (in fragments), and the close
+	char * frames = NULL;
+	size_t frames_len = 0;
+	FILE * f = open_memstream(&frames,&frames_len);
+	test_client_frame(f,OC_TEXT,true,"hello",5);
+	fclose(f);
+	ut_assert(send(fd,frames,frames_len,0)==(ssize_t)frames_len);
+	free(frames);
+	ut_assert(ws_wait(ws)==WS_MSG_TXT);
+	ut_assert(ws_send_msg(ws,WS_MSG_TXT,(unsigned char *)"hello",5));
+	static unsigned char big[40000];
+	memset(big,'b',sizeof(big));
+	ut_assert(ws_queue_msg(ws,WS_PRIO_NORMAL,WS_MSG_BIN,big,sizeof(big)));
+	ut_assert(ws_send_queued(ws)==1);
+	ws_free(ws);
+	ws_record_stop();
+	close(fd);
+
+	FILE * cap = fopen(path,"r");
+	ut_assert(cap!=NULL);
+	static unsigned char buff[8192];
+	size_t len = fread(buff,1,sizeof(buff),cap);
+	fclose(cap);
+	unlink(path);
+	ut_assert(len>WS_REC_MAGIC_LEN && memcmp(buff,WS_REC_MAGIC,WS_REC_MAGIC_LEN)==0);
+	const struct {
+		WS_Rec_Kind kind;
+		unsigned char frame;
+		uint64_t len;
+		size_t captured;
+	} expected[] = {
+		{ WS_REC_OPEN, 0, 4, 4 },
+		{ WS_REC_OUT, 0x80 | OC_PING, 0, 0 },
+		{ WS_REC_IN, 0x80 | OC_TEXT, 5, 5 },
+		{ WS_REC_OUT, 0x80 | OC_TEXT, 5, 5 },
+		{ WS_REC_OUT, OC_BIN, WS_FRAGMENT_LEN, 1000 },
+		{ WS_REC_OUT, OC_CONT, WS_FRAGMENT_LEN, 1000 },
+		{ WS_REC_OUT, 0x80 | OC_CONT, sizeof(big) - 2*WS_FRAGMENT_LEN, 1000 },
+		{ WS_REC_OUT, 0x80 | OC_CLOSE, 2, 2 },
+	};
+	size_t off = WS_REC_MAGIC_LEN;
+	uint64_t t_ns = 0;
+	WS_Record rec;
+	for(int i=0; i<sizeof(expected)/sizeof(expected[0]); i++) {
+		ssize_t n = ws_record_parse(buff + off,len - off,&rec);
+		ut_assert(n>0);
+		ut_assert(rec.kind==expected[i].kind && rec.frame==expected[i].frame);
+		ut_assert(rec.len==expected[i].len && rec.captured==expected[i].captured);
+		ut_assert(rec.conn>>32==getpid() && rec.t_ns>=t_ns);
+		t_ns = rec.t_ns;
+		off += n;
+	}
+	ut_assert(off==len);
+	ut_assert(ws_record_parse(buff + WS_REC_MAGIC_LEN,len - WS_REC_MAGIC_LEN,&rec)>0 && memcmp(rec.payload,"/ws",4)==0);
+	ut_assert(ws_record_parse(buff + WS_REC_MAGIC_LEN,3,&rec)==0);
+	ut_assert(ws_record_parse((unsigned char *)"\x09\x00",2,&rec)<0 && errno==EINVAL);
+}
+
 #endif // !EXCLUDE_UNIT_TESTS
+
+#ifndef EXCLUDE_BENCHMARKS
+
+#include <pthread.h>
+#include <openssl/sha.h>
+#include "rnd.h"
+#include "bench.h"
+
+BENCH_CASE(ws_handshake) {
+	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
+	ht_put(headers,(char*)H_CONNECTION,(char*)"keep-alive, Upgrade");
+	ht_put(headers,(char*)H_UPGRADE,(char*)WS_UPGRADE);
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_VERSION,(char*)WS_VERSION);
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_KEY,(char*)"dGhlIHNhbXBsZSBub25jZQ==");
+	FILE * out = fopen("/dev/null","w");
+	const uint64_t n = bench_iterations(200000);
+	uint64_t start = tm_now_ns();
+	for(uint64_t i=0; i<n; i++) {
+		const char * protocol;
+		_ws_handshake(out,headers,&protocol);
+	}
+	bench_report("handshake (validate + 101)",n,0,tm_now_ns()-start);
+
+	char accept[WS_ACCEPT_LEN];
+	unsigned sink = 0;
+	start = tm_now_ns();
+	for(uint64_t i=0; i<n; i++) {
+		_ws_accept_key(accept,"dGhlIHNhbXBsZSBub25jZQ==");
+		sink ^= accept[i%WS_ACCEPT_LEN];
+	}
+	bench_report("accept key",n,0,tm_now_ns()-start);
+
+	// For comparison: the accept key with sz_cat and OpenSSL's SHA1()
+	start = tm_now_ns();
+	for(uint64_t i=0; i<n; i++) {
+		char * sz = sz_cat("dGhlIHNhbXBsZSBub25jZQ==",WS_MAGIC);
+		unsigned char hash[SHA_DIGEST_LENGTH];
+		SHA1((unsigned char *)sz,strlen(sz),hash);
+		free(sz);
+		codec_b64_encode(accept,hash,SHA_DIGEST_LENGTH);
+		sink ^= accept[i%WS_ACCEPT_LEN];
+	}
+	bench_report("accept key (sz_cat + OpenSSL SHA1)",n,0,tm_now_ns()-start);
+	dlogf("sink=%u",sink);
+	fclose(out);
+	ht_free(headers);
+}
+
+static void * bench_drain(void * arg) {
+	int fd = (int)(intptr_t)arg;
+	char buff[65536];
+	while(read(fd,buff,sizeof(buff))>0);
+	return NULL;
+}
+
+// 50-byte messages over a socketpair, one write each and coalesced
+BENCH_CASE(ws_send_small) {
+	int sv[2];
+	if(socketpair(AF_UNIX,SOCK_STREAM,0,sv)!=0) {
+		return;
+	}
+	pthread_t drain;
+	pthread_create(&drain,NULL,bench_drain,(void *)(intptr_t)sv[1]);
+	Http_Headers headers = ht_create(0,NULL,NULL,NULL);
+	ht_put(headers,(char*)H_CONNECTION,(char*)"Upgrade");
+	ht_put(headers,(char*)H_UPGRADE,(char*)WS_UPGRADE);
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_VERSION,(char*)WS_VERSION);
+	ht_put(headers,(char*)H_SEC_WEBSOCKET_KEY,(char*)"dGhlIHNhbXBsZSBub25jZQ==");
+	Websocket ws = ws_upgrade(fopen("/dev/null","r"),fdopen(sv[0],"w"),headers,"/ws",true,NULL);
+	unsigned char msg[50];
+	memset(msg,'m',sizeof(msg));
+	const uint64_t n = bench_iterations(500000);
+	uint64_t start = tm_now_ns();
+	for(uint64_t i=0; i<n; i++) {
+		ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg));
+	}
+	bench_report("send 50 B",n,n*sizeof(msg),tm_now_ns()-start);
+	ws_set_coalesce(ws,4096,1000);
+	start = tm_now_ns();
+	for(uint64_t i=0; i<n; i++) {
+		ws_send_msg(ws,WS_MSG_BIN,msg,sizeof(msg));
+	}
+	ws_flush(ws);
+	bench_report("send 50 B (coalesced, 4 KiB)",n,n*sizeof(msg),tm_now_ns()-start);
+	ws_free(ws);
+	pthread_join(drain,NULL);
+	close(sv[1]);
+	ht_free(headers);
+}
+
+// Frame codec throughput: read_dataframe and write_dataframe over memory
+// buffers and a socketpair, masked (as clients send) and not (as servers do),
+// across the 7-, 16- and 64-bit length forms, for whole and fragmented messages
+
+#define BENCH_FRAME_BYTES (64*1024*1024)  // payload bytes per measurement, unscaled
+#define BENCH_FRAME_MAX_MSGS 200000
+
+typedef struct {
+	FILE * f;
+	Data_Frame df;          // allocated for the largest frame
+	uint64_t len;           // message length
+	uint64_t frag_len;      // fragment length; 0 for whole messages
+	bool masked;
+	uint64_t msgs;
+	bool rewind;            // rewind f for each message (a memory buffer holding one)
+	uint64_t frames;        // frames written or read
+} Bench_Frames;
+
+static Data_Frame bench_alloc_frame(uint64_t len) {
+	Data_Frame df = alloc_dataframe(OC_BIN,true,len,NULL);
+	if(df) {
+		memset(df->payload,'f',len);
+	}
+	return df;
+}
+
+static void * bench_write_frames(void * arg) {
+	Bench_Frames * bf = arg;
+	unsigned char mask_key[4];
+	rnd_mask(mask_key);
+	uint64_t frag_len = bf->frag_len ? bf->frag_len : bf->len;
+	for(uint64_t i=0; i<bf->msgs; i++) {
+		if(bf->rewind) {
+			rewind(bf->f);
+		}
+		uint64_t off = 0;
+		do {
+			uint64_t len = min(frag_len,bf->len - off);
+			bf->df->opcode = off==0 ? OC_BIN : OC_CONT;
+			bf->df->fin = off + len==bf->len;
+			bf->df->len = len;
+			if(!write_dataframe(bf->f,bf->df,bf->masked ? mask_key : NULL)) {
+				return NULL;
+			}
+			off += len;
+			bf->frames++;
+		} while(off<bf->len);
+	}
+	return NULL;
+}
+
+static void * bench_read_frames(void * arg) {
+	Bench_Frames * bf = arg;
+	for(uint64_t i=0; i<bf->msgs; i++) {
+		if(bf->rewind) {
+			rewind(bf->f);
+		}
+		do {
+			if(!(bf->df = read_dataframe(bf->f,bf->masked,bf->df))) {
+				return NULL;
+			}
+			bf->frames++;
+		} while(!bf->df->fin);
+	}
+	return NULL;
+}
+
+static void bench_frames(const char * size_label, uint64_t len, uint64_t frag_len, bool masked) {
+	char label[64];
+	char suffix[32];
+	snprintf(suffix,sizeof(suffix),"%s%s",masked ? ", masked" : "",frag_len ? ", 64 KiB frags" : "");
+	uint64_t frame_len = frag_len ? frag_len : len;
+	uint64_t frames_per_msg = frag_len ? (len + frag_len - 1)/frag_len : 1;
+	uint64_t msgs = bench_iterations(min((uint64_t)BENCH_FRAME_MAX_MSGS,BENCH_FRAME_BYTES/(len + 64))) + 1;
+	// A message, encoded, in memory
+	size_t buff_len = len + frames_per_msg*(WS_MAX_HEADER_LEN + 4) + 1;
+	char * buff = malloc(buff_len);
+	Bench_Frames w = { .df = bench_alloc_frame(frame_len), .len = len, .frag_len = frag_len, .masked = masked, .msgs = msgs, .rewind = true };
+	Bench_Frames r = { .df = NULL, .len = len, .frag_len = frag_len, .masked = masked, .msgs = msgs, .rewind = true };
+	if(!buff || !w.df || !(w.f = fmemopen(buff,buff_len,"w"))) {
+		goto done;
+	}
+	uint64_t start = tm_now_ns();
+	bench_write_frames(&w);
+	uint64_t elapsed = tm_now_ns() - start;
+	snprintf(label,sizeof(label),"encode %s%s",size_label,suffix);
+	bench_report(label,w.frames,msgs*len,elapsed);
+	size_t encoded_len = ftell(w.f);
+	fclose(w.f);
+
+	if(!(r.f = fmemopen(buff,encoded_len,"r"))) {
+		goto done;
+	}
+	start = tm_now_ns();
+	bench_read_frames(&r);
+	elapsed = tm_now_ns() - start;
+	fclose(r.f);
+	snprintf(label,sizeof(label),"decode %s%s",size_label,suffix);
+	bench_report(label,r.frames,msgs*len,elapsed);
+
+	// Written on one thread, read on another
+	int sv[2];
+	if(socketpair(AF_UNIX,SOCK_STREAM,0,sv)!=0) {
+		goto done;
+	}
+	w.f = fdopen(sv[0],"w");
+	r.f = fdopen(sv[1],"r");
+	w.rewind = r.rewind = false;
+	w.frames = r.frames = 0;
+	pthread_t writer;
+	start = tm_now_ns();
+	pthread_create(&writer,NULL,bench_write_frames,&w);
+	bench_read_frames(&r);
+	pthread_join(writer,NULL);
+	elapsed = tm_now_ns() - start;
+	fclose(w.f);
+	fclose(r.f);
+	snprintf(label,sizeof(label),"socketpair %s%s",size_label,suffix);
+	bench_report(label,r.frames,msgs*len,elapsed);
+done:
+	free(buff);
+	free_dataframe(w.df);
+	free_dataframe(r.df);
+}
+
+BENCH_CASE(ws_frame_codec) {
+	static const struct {
+		const char * label;
+		uint64_t len;
+	} sizes[] = {
+		{ "0 B", 0 },
+		{ "125 B", 125 },             // the longest 7-bit length
+		{ "126 B", 126 },             // the shortest 16-bit length
+		{ "4 KiB", 4096 },
+		{ "64 KiB-1", 65535 },        // the longest 16-bit length
+		{ "64 KiB", 65536 },          // the shortest 64-bit length
+		{ "1 MiB", 1024*1024 },
+		{ "16 MiB", 16*1024*1024 },
+	};
+	for(int masked=0; masked<=1; masked++) {
+		for(int i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+			bench_frames(sizes[i].label,sizes[i].len,0,masked);
+		}
+		bench_frames("1 MiB",1024*1024,65536,masked);
+		bench_frames("16 MiB",16*1024*1024,65536,masked);
+	}
+}
+
+#endif // !EXCLUDE_BENCHMARKS
@@ -17,7 +17,9 @@ typedef enum {
 	WS_STATUS_NORMAL=1000,
 	WS_STATUS_GOING_AWAY=1001,
 	WS_STATUS_PROTOCOL_ERROR=1002,
-    WS_STATUS_CANT_ACCEPT=1003
+    WS_STATUS_CANT_ACCEPT=1003,
+	WS_STATUS_POLICY_VIOLATION=1008,
+	WS_STATUS_TRY_AGAIN=1013
 } WS_Status_Code;
 
 typedef struct Websocket_S * Websocket;
@@ -30,7 +32,20 @@ bool ws_is_upgradable(const Http_Headers headers);
 /*! \brief Determine if the given HTTP headers indicates a request
 *          to upgrade an HTTP connection to the Websocket protcol.
  */
-Websocket ws_upgrade(FILE * f_in, FILE * f_out, const Http_Headers headers, const char * uri, bool masked_client);
+Websocket ws_upgrade(FILE * f_in, FILE * f_out, const Http_Headers headers, const char * uri, bool masked_client, Arena * arena);
+
+#define WS_MAX_PROTOCOL_LEN 64
+
+/*! \brief Set the subprotocols that ws_upgrade accepts (Sec-WebSocket-Protocol),
+ *         in order of preference, as a NULL-terminated array, which must
+ *         outlive the websockets. None by default.
+ *  \return 0, or -1 (errno ENAMETOOLONG) if a name is over WS_MAX_PROTOCOL_LEN.
+ */
+int ws_set_protocols(const char * const * protocols);
+
+/*! \brief The subprotocol agreed in the handshake, or NULL.
+ */
+const char * ws_protocol(Websocket ws);
 
 /*! \brief Determine if the websocket is open
  */
@@ -56,6 +71,137 @@ const unsigned char * ws_get_msg(Websocket ws, size_t * msg_len);
 
 bool ws_send_msg(Websocket ws, WS_Msg_Type type, const unsigned char * msg, size_t msg_len);
 
+// Coalescing: each message sent is otherwise its own write. With coalescing
+// on, frames are buffered and written together, with one writev, once
+// max_bytes are buffered or max_delay_us after the first, whichever comes
+// first. The deadline is kept by the next send, or by ws_poll_wait (to the
+// millisecond) for a polled websocket; ws_wait flushes before it blocks.
+// Control frames (pong, close) flush at once. Corking buffers everything
+// (up to WS_COALESCE_MAX) until ws_uncork.
+
+#define WS_COALESCE_MAX (64*1024)
+
+/*! \brief Coalesce sends (see above); max_bytes 0 turns coalescing off again,
+ *         flushing what's buffered.
+ *  \return false (errno EINVAL) if max_bytes is over WS_COALESCE_MAX, or if a
+ *          flush fails.
+ */
+bool ws_set_coalesce(Websocket ws, size_t max_bytes, unsigned max_delay_us);
+
+/*! \brief Write the buffered frames now, e.g. after a latency-critical message.
+ */
+bool ws_flush(Websocket ws);
+
+/*! \brief Buffer sends until ws_uncork, e.g. to write a batch of messages together.
+ */
+void ws_cork(Websocket ws);
+
+/*! \brief Stop buffering, and flush.
+ */
+bool ws_uncork(Websocket ws);
+
+// Outbound queues: a message sent with ws_send_msg goes out whole, in call
+// order, blocking until written. Queued messages are sent without blocking,
+// in fragments of up to WS_FRAGMENT_LEN, as the socket has room. Control frames
+// (pong, close) go first, at the next fragment boundary, and the priority
+// classes share the connection 8:4:1 (by bytes, at message boundaries: the
+// protocol doesn't allow the fragments of two messages to interleave), so bulk
+// still progresses. While anything is queued, ws_send_msg queues too (at
+// WS_PRIO_NORMAL). A polled websocket sends its queues as the socket has room;
+// otherwise call ws_send_queued (ws_wait and ws_close send them first).
+
+#define WS_FRAGMENT_LEN 16384
+
+typedef enum {
+	WS_PRIO_HIGH = 0,  // urgent messages
+	WS_PRIO_NORMAL,
+	WS_PRIO_BULK,      // large transfers
+	WS_PRIO_COUNT
+} WS_Priority;
+
+/*! \brief Queue a message, and send what the socket has room for.
+ *  \return false (with errno set) if the message can't be queued, or on a write error.
+ */
+bool ws_queue_msg(Websocket ws, WS_Priority prio, WS_Msg_Type type, const unsigned char * msg, size_t msg_len);
+
+/*! \brief Send queued messages, without blocking.
+ *  \return 1 if the queues are empty, 0 if the socket is full, or -1 on error.
+ */
+int ws_send_queued(Websocket ws);
+
+/*! \brief Bytes queued, not yet written.
+ */
+size_t ws_queued(Websocket ws);
+
+// Pre-encoded frames: a message sent to many websockets can be encoded once.
+
+#define WS_MAX_HEADER_LEN 10 // as sent by the server (unmasked)
+
+/*! \brief Encode a message as a frame, into frame (at least msg_len +
+ *         WS_MAX_HEADER_LEN bytes).
+ *  \return The frame length.
+ */
+size_t ws_encode_frame(unsigned char * frame, WS_Msg_Type type, const unsigned char * msg, size_t msg_len);
+
+/*! \brief Send a frame from ws_encode_frame, as ws_send_msg would send the message.
+ */
+bool ws_send_frame(Websocket ws, const unsigned char * frame, size_t frame_len);
+
+// Recording: the frames of websockets upgraded while a capture is on are
+// written, both ways and unmasked, with timestamps, to a capture file (for
+// replay.h to play back). A capture is WS_REC_MAGIC, then records:
+//
+//    kind | frame byte | connection (varint) | time (varint) | length (varint) | captured (varint) | payload
+//
+// The frame byte is FIN (0x80) and the opcode; the time is in nanoseconds
+// since the capture started; the payload is the first captured bytes (up to
+// the capture's limit) of length. A connection's first record is WS_REC_OPEN,
+// whose payload (never cut) is the uri, a NUL, and the subprotocol, if any. A
+// connection's records are buffered and appended, with one write, when
+// WS_REC_FLUSH bytes are buffered and when the websocket is freed, so records
+// of different connections interleave in chunks. Processes forked from the
+// one that started the capture write to it too (connections are numbered by
+// process id and count).
+
+#define WS_REC_MAGIC "NHWSCAP1"
+#define WS_REC_MAGIC_LEN 8
+#define WS_REC_FLUSH (64*1024)
+
+typedef enum {
+	WS_REC_OPEN = 1,  // a websocket was upgraded
+	WS_REC_IN,        // a frame was received
+	WS_REC_OUT,       // a frame was sent (or buffered to be)
+} WS_Rec_Kind;
+
+typedef struct {
+	WS_Rec_Kind kind;
+	unsigned char frame;           // FIN and opcode
+	uint64_t conn;
+	uint64_t t_ns;
+	uint64_t len;                  // payload length
+	size_t captured;               // ... of which this much was captured
+	const unsigned char * payload;
+} WS_Record;
+
+/*! \brief Start a capture, recording up to max_payload bytes of each frame's
+ *         payload (SIZE_MAX for all).
+ *  \return 0, or -1 (with errno set) if the file can't be created, or
+ *          EALREADY if a capture is on.
+ */
+int ws_record_start(const char * path, size_t max_payload);
+
+/*! \brief Stop the capture. Websockets still open are no longer recorded,
+ *         and what they have buffered is dropped; stop it while no recorded
+ *         websocket is in use by another thread.
+ */
+void ws_record_stop(void);
+
+/*! \brief Parse a record from the len bytes at p (after WS_REC_MAGIC).
+ *  \return The record length, 0 if p doesn't hold the whole record, or -1
+ *          (errno EINVAL) if it is invalid.
+ */
+ssize_t ws_record_parse(const unsigned char * p, size_t len, WS_Record * rec);
+
 /*! \brief The status code sent from the remote 
  *         endpoint when the connection was closed.
  *         This is only meaningful after receiving
@@ -63,4 +209,63 @@ bool ws_send_msg(Websocket ws, WS_Msg_Type type, const unsigned char * msg, size
  */
 WS_Status_Code ws_status(Websocket ws);
 
+// Polling: wait on many websockets at once, with epoll underneath. A
+// websocket must be on a plain socket (not TLS), and once registered is read
+// only by the poller (ws_wait fails). Closing or freeing a websocket removes it
+// from its poller.
+
+typedef struct WS_Poll_S * WS_Poll;
+
+typedef enum {
+	WS_EV_MSG      = 0x1, // a message was received: see msg_type and ws_get_msg
+	WS_EV_CLOSE    = 0x2, // the remote endpoint closed the connection: see ws_status
+	WS_EV_WRITABLE = 0x4, // the socket has room to send (see ws_poll_want_writable)
+	WS_EV_ERROR    = 0x8, // a read or protocol error, or the connection was dropped
+} WS_Event_Type;
+
+typedef struct {
+	Websocket ws;
+	void * data;          // as given to ws_poll_add
+	unsigned events;      // WS_Event_Type flags
+	WS_Msg_Type msg_type; // WS_MSG_TXT or WS_MSG_BIN, with WS_EV_MSG
+} WS_Event;
+
+/*! \brief Create a poller.
+ *  \return The poller, or NULL (with errno set) on failure.
+ */
+WS_Poll ws_poll_create(void);
+
+/*! \brief Free the poller, removing any websockets still registered (which
+ *         are not closed).
+ */
+void ws_poll_free(WS_Poll poll);
+
+/*! \brief Register a websocket, to be reported with data.
+ *  \return 0, or -1 (with errno set) if the websocket is closed, registered
+ *          already, or not on a socket.
+ */
+int ws_poll_add(WS_Poll poll, Websocket ws, void * data);
+
+/*! \brief Unregister a websocket.
+ *  \return 0, or -1 (with errno ENOENT) if it isn't registered with poll.
+ */
+int ws_poll_remove(WS_Poll poll, Websocket ws);
+
+/*! \brief Whether to report WS_EV_WRITABLE for the websocket (off by default).
+ */
+int ws_poll_want_writable(WS_Poll poll, Websocket ws, bool writable);
+
+/*! \brief Make a ws_poll_wait (in another thread, say) return at once,
+ *         or the next one if none is waiting. Safe to call from any thread.
+ */
+void ws_poll_wake(WS_Poll poll);
+
+/*! \brief Wait up to timeout_ms (-1 for ever) for events, and return up to
+ *         max_events of them, one per websocket. A message is valid until the
+ *         websocket's next event. After WS_EV_CLOSE or WS_EV_ERROR, the
+ *         websocket isn't reported again, and should be closed or freed.
+ *  \return The number of events (0 on timeout), or -1 (with errno set).
+ */
+int ws_poll_wait(WS_Poll poll, WS_Event * events, int max_events, int timeout_ms);
+
 #endif // __WS_H__